@@ -30,7 +30,12 @@ protected:
 
     virtual void _OnRequestDone()
     {
-        printf("_OnRequestDone(): %s\n", GetCurrentRequest().resource.c_str());
+        const minihttp::RequestTimings& t = GetTimings();
+        printf("_OnRequestDone(): %s (total %u ms, first byte after %u ms, %s connection)\n",
+            GetCurrentRequest().resource.c_str(),
+            unsigned((t.done - t.start) / 1000),
+            unsigned(t.firstByte ? (t.firstByte - t.start) / 1000 : 0),
+            t.reused ? "reused" : "new");
         // Do *NOT* call close() in here!
     }
 
@@ -56,7 +61,11 @@ int main(int argc, char *argv[])
     minihttp::InitNetwork();
     atexit(minihttp::StopNetwork);
 
+    // Remembers 301/308 redirects, so that repeated downloads skip the extra round trip.
+    minihttp::RedirectCache redirects;
+
     HttpDumpSocket *ht = new HttpDumpSocket;
+    ht->SetRedirectCache(&redirects);
     ht->SetKeepAlive(3);
     ht->SetBufsizeIn(64 * 1024);
     ht->SetUserAgent("minihttp"); // Let the server know who we are. This is optional but it seems that some servers check that this is set.
@@ -0,0 +1,63 @@
+// Example 3: C++20 coroutines, many downloads on one thread without subclassing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+#include "minihttp_coro.h"
+
+#ifdef MINIHTTP_CORO_H_AVAILABLE
+
+using namespace minihttp::coro;
+
+// Each call is an independent workflow; they all make progress while the SocketSet is updated.
+static Task<> fetch(Client& client, const char *url)
+{
+    Response r = co_await client.get(url);
+    printf("%s: status %u, %u bytes, type %s\n", url, r.status, unsigned(r.body.size()),
+        r.header("content-type") ? r.header("content-type") : "?");
+
+    // Streaming variant: the body arrives piece by piece, without collecting it first
+    Stream s = client.open(url);
+    Response h = co_await s.headers();
+    size_t total = 0;
+    for(;;)
+    {
+        std::string_view chunk = co_await s.read();
+        if(chunk.empty())
+            break;
+        total += chunk.size();
+    }
+    printf("%s: streamed %u bytes (status %u)%s\n", url, unsigned(total), h.status, s.failed() ? ", FAILED" : "");
+}
+
+int main(int argc, char *argv[])
+{
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    minihttp::InitNetwork();
+    atexit(minihttp::StopNetwork);
+
+    minihttp::SocketSet ss;
+    Client client(ss);
+    client.SetUserAgent("minihttp");
+
+    Spawn(fetch(client, "example.com"));
+    Spawn(fetch(client, "http://www.ietf.org/rfc/rfc2616.txt"));
+
+    while(ss.size())
+        ss.update();
+
+    return 0;
+}
+
+#else
+
+int main()
+{
+    puts("This example needs a compiler with C++20 coroutine support");
+    return 0;
+}
+
+#endif
@@ -10,6 +10,10 @@
 #  endif
 #endif
 
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#  define _FILE_OFFSET_BITS 64 // for fseeko() on 32 bit systems
+#endif
+
 #ifdef _WIN32
 #  ifndef _WIN32_WINNT
 #    define _WIN32_WINNT 0x0501
@@ -29,13 +33,27 @@
 #    define ENOTCONN WSAENOTCONN
 #  endif
 #  include <io.h>
+#  include <sys/stat.h>
 #else
 #  include <sys/types.h>
 #  include <unistd.h>
 #  include <fcntl.h>
 #  include <sys/socket.h>
 #  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <netdb.h>
+#  include <pthread.h>
+#  include <poll.h>
+#  include <sys/stat.h>
+#  ifdef __linux__
+#    include <sys/epoll.h>
+#    include <sys/sendfile.h>
+#  endif
+#  ifdef MINIHTTP_USE_IO_URING
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <linux/io_uring.h>
+#  endif
 #  define SOCKET_ERROR (-1)
 #  define INVALID_SOCKET (SOCKET)(~0)
    typedef intptr_t SOCKET;
@@ -44,10 +62,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sstream>
 #include <cctype>
 #include <cerrno>
 #include <algorithm>
+#include <deque>
 #include <assert.h>
 
 #ifdef MINIHTTP_USE_MBEDTLS
@@ -110,7 +130,7 @@ struct SSLCtx
         mbedtls_ctr_drbg_free(&ctr_drbg);
         mbedtls_ssl_config_free(&conf);
     }
-    bool init()
+    bool init(const char **alpn)
     {
         const char *pers = "minihttp";
         const size_t perslen = strlen(pers);
@@ -140,6 +160,21 @@ struct SSLCtx
         mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
         mbedtls_ssl_conf_dbg(&conf, traceprint_ssl, NULL);
 
+        if(alpn)
+        {
+#ifdef MBEDTLS_SSL_ALPN
+            err = mbedtls_ssl_conf_alpn_protocols(&conf, alpn);
+            if(err)
+            {
+                traceprint("SSLCtx::init(): mbedtls_ssl_conf_alpn_protocols() returned %d\n", err);
+                return false;
+            }
+#else
+            traceprint("SSLCtx::init(): mbedtls was built without ALPN support\n");
+            return false;
+#endif
+        }
+
         err = mbedtls_ssl_setup(&ssl, &conf);
         if(err)
         {
@@ -169,6 +204,10 @@ bool HasSSL() { return false; }
 
 #define DEFAULT_BUFSIZE 4096
 
+// Smallest piece to read or send under a rate limit. Sockets that share a limit take turns this way,
+// instead of the first one in line getting a steady trickle of single bytes and the others nothing.
+#define RATE_QUANTUM 4096
+
 inline int _GetError()
 {
 #ifdef _WIN32
@@ -195,6 +234,480 @@ inline std::string _GetErrorStr(int e)
     return ret;
 }
 
+// Monotonic clock, in microseconds
+static u64 _GetTimeUS()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq = { 0 };
+    if(!freq.QuadPart)
+        ::QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+    return u64(now.QuadPart / freq.QuadPart) * 1000000 + u64(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000 + u64(ts.tv_nsec) / 1000;
+#endif
+}
+
+void RequestTimings::clear()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+// ------------------------ METRICS -------------------------
+
+// Metrics have a single writer, but may be read by other threads at any time,
+// so each value must be loaded and stored in one piece.
+static inline u64 _AtomicLoad(const u64 *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    return (u64)_InterlockedCompareExchange64((volatile __int64*)p, 0, 0);
+#else
+    return *(volatile const u64*)p;
+#endif
+}
+
+static inline void _AtomicStore(u64 *p, u64 v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    _InterlockedExchange64((volatile __int64*)p, (__int64)v);
+#else
+    *(volatile u64*)p = v;
+#endif
+}
+
+// Reads before an acquire fence complete before any access after it; writes before a release fence
+// become visible before any write after it. Only the trace ring needs this, it publishes records
+// through a counter. Metrics values are independent of each other, relaxed is enough there.
+static inline void _AtomicFenceAcquire()
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+    MemoryBarrier();
+#elif defined(_MSC_VER)
+    _ReadWriteBarrier();
+#endif
+}
+
+static inline void _AtomicFenceRelease()
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+    MemoryBarrier();
+#elif defined(_MSC_VER)
+    _ReadWriteBarrier();
+#endif
+}
+
+static inline void *_AtomicLoadPtr(void *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n((void**)p, __ATOMIC_ACQUIRE);
+#else
+    return *(void * volatile *)p;
+#endif
+}
+
+// Reference counts have many writers and need a real RMW; returns the new value
+static inline long _AtomicInc(long *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_add_fetch(p, 1, __ATOMIC_ACQ_REL);
+#elif defined(_MSC_VER)
+    return _InterlockedIncrement((volatile long*)p);
+#else
+    return ++*p;
+#endif
+}
+
+static inline long _AtomicDec(long *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL);
+#elif defined(_MSC_VER)
+    return _InterlockedDecrement((volatile long*)p);
+#else
+    return --*p;
+#endif
+}
+
+static inline void _AtomicAdd(u64 *p, u64 n)
+{
+    _AtomicStore(p, _AtomicLoad(p) + n); // no RMW necessary, there is only one writer
+}
+
+static inline void _Count(Metrics *m, u64 Metrics::*field, u64 n = 1)
+{
+    if(m)
+        _AtomicAdd(&(m->*field), n);
+}
+
+static inline void _CountError(Metrics *m, MetricsError e)
+{
+    if(m)
+        _AtomicAdd(&m->errors[e], 1);
+}
+
+static inline void _Record(Metrics *m, Histogram Metrics::*h, u64 from, u64 to)
+{
+    if(m && from && to >= from)
+        (m->*h).add(to - from);
+}
+
+void Histogram::clear()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+unsigned Histogram::bucketOf(u64 v)
+{
+    if(v < SUB)
+        return (unsigned)v;
+    unsigned msb = 0;
+    for(u64 t = v; t >>= 1; )
+        ++msb;
+    const unsigned sub = unsigned(v >> (msb - SUB_BITS)) & (SUB - 1);
+    const unsigned i = (msb - SUB_BITS + 1) * SUB + sub;
+    return i < BUCKETS ? i : BUCKETS - 1;
+}
+
+u64 Histogram::bucketUpper(unsigned i)
+{
+    if(i < SUB)
+        return i + 1;
+    const unsigned shift = i / SUB - 1;
+    return (u64(SUB + i % SUB) << shift) + (u64(1) << shift);
+}
+
+void Histogram::add(u64 v)
+{
+    _AtomicAdd(&buckets[bucketOf(v)], 1);
+    _AtomicAdd(&sum, v);
+    _AtomicAdd(&count, 1);
+}
+
+u64 Histogram::percentile(double p) const
+{
+    const u64 n = _AtomicLoad(&count);
+    if(!n)
+        return 0;
+    u64 target = u64(n * (p / 100.0) + 0.5);
+    if(!target)
+        target = 1;
+    u64 acc = 0;
+    for(unsigned i = 0; i < BUCKETS; ++i)
+    {
+        acc += _AtomicLoad(&buckets[i]);
+        if(acc >= target)
+            return bucketUpper(i);
+    }
+    return bucketUpper(BUCKETS - 1);
+}
+
+void Metrics::clear()
+{
+    openSockets = activeRequests = queuedRequests = 0;
+    bytesIn = bytesOut = bufferShifts = requests = redirects = coalesced = 0;
+    memset(errors, 0, sizeof(errors));
+    connectTime.clear();
+    handshakeTime.clear();
+    firstByteTime.clear();
+    requestTime.clear();
+}
+
+static const char * const s_errorNames[MERR_MAX] =
+{
+    "resolve",
+    "connect",
+    "ssl",
+    "send",
+    "recv",
+    "http",
+    "truncated",
+    "protocol"
+};
+
+const char *MetricsErrorName(unsigned e)
+{
+    return e < MERR_MAX ? s_errorNames[e] : "?";
+}
+
+static void _PromValue(std::ostringstream& os, const char *prefix, const char *name, const char *type, const u64 *v)
+{
+    os << "# TYPE " << prefix << '_' << name << ' ' << type << '\n';
+    os << prefix << '_' << name << ' ' << _AtomicLoad(v) << '\n';
+}
+
+// Exact, unlike a double with the stream's default precision
+static const char *_PromSeconds(char *buf, u64 us)
+{
+    sprintf(buf, "%llu.%06u", us / 1000000, unsigned(us % 1000000));
+    return buf;
+}
+
+static void _PromHistogram(std::ostringstream& os, const char *prefix, const char *name, const Histogram& h)
+{
+    os << "# TYPE " << prefix << '_' << name << " histogram\n";
+    // Every bucket, so that the set of series doesn't change over time. Values are whole microseconds,
+    // so a bucket's largest value is its exclusive upper bound - 1. The last one is open-ended and is +Inf.
+    u64 acc = 0;
+    char num[32];
+    for(unsigned i = 0; i + 1 < Histogram::BUCKETS; ++i)
+    {
+        acc += _AtomicLoad(&h.buckets[i]);
+        os << prefix << '_' << name << "_bucket{le=\"" << _PromSeconds(num, Histogram::bucketUpper(i) - 1) << "\"} " << acc << '\n';
+    }
+    acc += _AtomicLoad(&h.buckets[Histogram::BUCKETS - 1]);
+    os << prefix << '_' << name << "_bucket{le=\"+Inf\"} " << acc << '\n';
+    os << prefix << '_' << name << "_sum " << _PromSeconds(num, _AtomicLoad(&h.sum)) << '\n';
+    os << prefix << '_' << name << "_count " << acc << '\n';
+}
+
+void Metrics::toPrometheus(std::string& out, const char *prefix) const
+{
+    std::ostringstream os;
+    _PromValue(os, prefix, "open_sockets", "gauge", &openSockets);
+    _PromValue(os, prefix, "active_requests", "gauge", &activeRequests);
+    _PromValue(os, prefix, "queued_requests", "gauge", &queuedRequests);
+    _PromValue(os, prefix, "received_bytes_total", "counter", &bytesIn);
+    _PromValue(os, prefix, "sent_bytes_total", "counter", &bytesOut);
+    _PromValue(os, prefix, "buffer_shifts_total", "counter", &bufferShifts);
+    _PromValue(os, prefix, "requests_total", "counter", &requests);
+    _PromValue(os, prefix, "redirects_total", "counter", &redirects);
+    _PromValue(os, prefix, "coalesced_requests_total", "counter", &coalesced);
+    os << "# TYPE " << prefix << "_errors_total counter\n";
+    for(unsigned i = 0; i < MERR_MAX; ++i)
+        os << prefix << "_errors_total{kind=\"" << s_errorNames[i] << "\"} " << _AtomicLoad(&errors[i]) << '\n';
+    _PromHistogram(os, prefix, "connect_seconds", connectTime);
+    _PromHistogram(os, prefix, "handshake_seconds", handshakeTime);
+    _PromHistogram(os, prefix, "first_byte_seconds", firstByteTime);
+    _PromHistogram(os, prefix, "request_seconds", requestTime);
+    out += os.str();
+}
+
+static void _JSONHistogram(std::ostringstream& os, const char *name, const Histogram& h)
+{
+    os << ",\"" << name << "\":{\"count\":" << _AtomicLoad(&h.count)
+       << ",\"sum\":" << _AtomicLoad(&h.sum)
+       << ",\"p50\":" << h.percentile(50)
+       << ",\"p90\":" << h.percentile(90)
+       << ",\"p99\":" << h.percentile(99)
+       << ",\"p999\":" << h.percentile(99.9)
+       << '}';
+}
+
+void Metrics::toJSON(std::string& out) const
+{
+    std::ostringstream os;
+    os << "{\"open_sockets\":" << _AtomicLoad(&openSockets)
+       << ",\"active_requests\":" << _AtomicLoad(&activeRequests)
+       << ",\"queued_requests\":" << _AtomicLoad(&queuedRequests)
+       << ",\"bytes_in\":" << _AtomicLoad(&bytesIn)
+       << ",\"bytes_out\":" << _AtomicLoad(&bytesOut)
+       << ",\"buffer_shifts\":" << _AtomicLoad(&bufferShifts)
+       << ",\"requests\":" << _AtomicLoad(&requests)
+       << ",\"redirects\":" << _AtomicLoad(&redirects)
+       << ",\"coalesced\":" << _AtomicLoad(&coalesced)
+       << ",\"errors\":{";
+    for(unsigned i = 0; i < MERR_MAX; ++i)
+        os << (i ? "," : "") << '"' << s_errorNames[i] << "\":" << _AtomicLoad(&errors[i]);
+    os << '}';
+    // Histogram values are in microseconds
+    _JSONHistogram(os, "connect_us", connectTime);
+    _JSONHistogram(os, "handshake_us", handshakeTime);
+    _JSONHistogram(os, "first_byte_us", firstByteTime);
+    _JSONHistogram(os, "request_us", requestTime);
+    os << '}';
+    out += os.str();
+}
+
+// ------------------------ TRACE RING -------------------------
+
+#define TRACE_RING_SIZE 4096 // records per thread, must be a power of 2
+
+static const char * const s_traceNames[TRACE_MAX] =
+{
+    "none",
+    "socket_open",
+    "socket_close",
+    "request_start",
+    "request_done",
+    "request_queued",
+    "status",
+    "header_field",
+    "chunk",
+    "redirect",
+    "error"
+};
+
+const char *TraceEventName(unsigned e)
+{
+    return e < TRACE_MAX ? s_traceNames[e] : "?";
+}
+
+#if MINIHTTP_TRACE_LEVEL > 0
+
+struct TraceRing
+{
+    TraceRing *next;
+    u64 head; // number of records ever written. Published after the record is complete.
+    TraceRecord rec[TRACE_RING_SIZE];
+};
+
+// Rings are created on first use in each thread and never freed,
+// so that TraceSave() can always walk the list without locking.
+static TraceRing *s_traceRings = NULL;
+static unsigned s_traceRingCount = 0;
+
+#if defined(_MSC_VER)
+static __declspec(thread) TraceRing *t_traceRing = NULL;
+static __declspec(thread) unsigned short t_traceId = 0;
+#else
+static __thread TraceRing *t_traceRing = NULL;
+static __thread unsigned short t_traceId = 0;
+#endif
+
+static TraceRing *_NewTraceRing()
+{
+    TraceRing *r = (TraceRing*)calloc(1, sizeof(TraceRing));
+    if(!r)
+        return NULL;
+#if defined(__GNUC__) || defined(__clang__)
+    t_traceId = (unsigned short)__atomic_fetch_add(&s_traceRingCount, 1, __ATOMIC_RELAXED);
+    do
+        r->next = __atomic_load_n(&s_traceRings, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&s_traceRings, &r->next, r, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#elif defined(_MSC_VER)
+    t_traceId = (unsigned short)(_InterlockedIncrement((volatile long*)&s_traceRingCount) - 1);
+    do
+        r->next = s_traceRings;
+    while(InterlockedCompareExchangePointer((void * volatile *)&s_traceRings, r, r->next) != r->next);
+#else
+    t_traceId = (unsigned short)s_traceRingCount++;
+    r->next = s_traceRings;
+    s_traceRings = r;
+#endif
+    return r;
+}
+
+static void _Trace(TraceEvent ev, const void *obj, unsigned a, u64 b)
+{
+    TraceRing *r = t_traceRing;
+    if(!r && !(r = t_traceRing = _NewTraceRing()))
+        return;
+    const u64 h = r->head;
+    _AtomicFenceRelease(); // the previous head goes out before this slot gets overwritten
+    TraceRecord& t = r->rec[h & (TRACE_RING_SIZE - 1)];
+    t.time = _GetTimeUS();
+    t.obj = (u64)(size_t)obj;
+    t.b = b;
+    t.a = a;
+    t.event = (unsigned short)ev;
+    t.thread = t_traceId;
+    _AtomicFenceRelease(); // and the record before the new head
+    _AtomicStore(&r->head, h + 1);
+}
+
+// Pack the first 8 chars of a string into a record field
+static u64 _TraceStr(const char *s, size_t len)
+{
+    u64 v = 0;
+    memcpy(&v, s, len < sizeof(v) ? len : sizeof(v));
+    return v;
+}
+
+#  define tracerec(lvl, ev, obj, a, b) { if((lvl) <= MINIHTTP_TRACE_LEVEL) _Trace(ev, obj, a, b); }
+
+bool TraceSave(const char *filename, unsigned lastSeconds /* = 0 */)
+{
+    FILE *f = fopen(filename, "wb");
+    if(!f)
+        return false;
+    const unsigned hdr[3] = { TRACE_FILE_MAGIC, TRACE_FILE_VERSION, sizeof(TraceRecord) };
+    bool ok = fwrite(&hdr[0], sizeof(hdr), 1, f) == 1;
+
+    const u64 now = _GetTimeUS();
+    const u64 since = lastSeconds && now > u64(lastSeconds) * 1000000 ? now - u64(lastSeconds) * 1000000 : 0;
+    TraceRecord *tmp = (TraceRecord*)malloc(sizeof(TraceRecord) * TRACE_RING_SIZE);
+    if(!tmp)
+        ok = false;
+
+    for(TraceRing *r = (TraceRing*)_AtomicLoadPtr(&s_traceRings); r && ok; r = r->next)
+    {
+        // The owning thread may keep writing while we copy.
+        // Copy first, then drop everything that may have been overwritten in the meantime.
+        const u64 h1 = _AtomicLoad(&r->head);
+        _AtomicFenceAcquire();
+        const u64 n = h1 < TRACE_RING_SIZE ? h1 : TRACE_RING_SIZE;
+        for(u64 i = h1 - n; i < h1; ++i)
+            tmp[i - (h1 - n)] = r->rec[i & (TRACE_RING_SIZE - 1)];
+        _AtomicFenceAcquire();
+        const u64 h2 = _AtomicLoad(&r->head);
+        u64 first = h1 - n;
+        if(h2 >= TRACE_RING_SIZE && h2 - TRACE_RING_SIZE + 1 > first)
+            first = h2 - TRACE_RING_SIZE + 1;
+        for(u64 i = first; i < h1 && ok; ++i)
+        {
+            const TraceRecord& t = tmp[i - (h1 - n)];
+            if(t.time >= since)
+                ok = fwrite(&t, sizeof(t), 1, f) == 1;
+        }
+    }
+
+    free(tmp);
+    return !fclose(f) && ok;
+}
+
+#else // MINIHTTP_TRACE_LEVEL > 0
+
+#  define tracerec(lvl, ev, obj, a, b) {}
+
+bool TraceSave(const char *filename, unsigned lastSeconds /* = 0 */)
+{
+    (void)filename;
+    (void)lastSeconds;
+    return false;
+}
+
+#endif
+
+class Mutex
+{
+public:
+#ifdef _WIN32
+    Mutex() { ::InitializeCriticalSection(&_cs); }
+    ~Mutex() { ::DeleteCriticalSection(&_cs); }
+    void lock() { ::EnterCriticalSection(&_cs); }
+    void unlock() { ::LeaveCriticalSection(&_cs); }
+private:
+    CRITICAL_SECTION _cs;
+#else
+    Mutex() { pthread_mutex_init(&_m, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&_m); }
+    void lock() { pthread_mutex_lock(&_m); }
+    void unlock() { pthread_mutex_unlock(&_m); }
+private:
+    pthread_mutex_t _m;
+#endif
+};
+
+class MutexLock
+{
+public:
+    MutexLock(void *m) : _m((Mutex*)m) { _m->lock(); }
+    ~MutexLock() { _m->unlock(); }
+private:
+    Mutex *_m;
+};
+
 static bool _networkInitDone = false;
 
 bool InitNetwork()
@@ -359,8 +872,17 @@ TcpSocket::TcpSocket()
 	, _inbufSize(0)
 	, _recvSize(0)
 	, _lastport(0)
+	, _nonblocking(true)
 	, _s(INVALID_SOCKET)
+	, _metrics(NULL)
+	, _alpn(NULL)
+	, _limitIn(NULL)
+	, _limitOut(NULL)
+	, _throttled(false)
+	, _options(NULL)
 	, _sslctx(NULL)
+	, _owner(NULL)
+	, _slot(0)
 {
 #ifdef MINIHTTP_USE_MBEDTLS
     mbedtls_net_init((mbedtls_net_context*)&_s);
@@ -370,26 +892,47 @@ TcpSocket::TcpSocket()
 TcpSocket::~TcpSocket()
 {
     close();
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+    if(_owner)
+        _owner->remove(this);
+#endif
     if(_inbuf)
         free(_inbuf);
 }
 
-bool TcpSocket::isOpen(void)
+bool TcpSocket::isOpen(void) const
 {
     return SOCKETVALID(_s);
 }
 
+bool TcpSocket::IsIdle() const
+{
+#ifdef MINIHTTP_USE_MBEDTLS
+    if(_sslctx && mbedtls_ssl_get_bytes_avail(&((SSLCtx*)_sslctx)->ssl))
+        return false; // already decrypted, the socket itself won't signal this
+#endif
+    return isOpen() && !_throttled;
+}
+
+void TcpSocket::_Wake()
+{
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+    if(_owner)
+        _owner->_Wake(_slot);
+#endif
+}
+
 void TcpSocket::close(void)
 {
     if(!SOCKETVALID(_s))
         return;
 
-    traceprint("TcpSocket::close\n");
-
     _OnCloseInternal();
 
     if(!SOCKETVALID(_s))
-        return;
+        return; // closed from a callback, and recorded there
+
+    tracerec(2, TRACE_SOCKET_CLOSE, this, 0, _timings.wireBytes);
 
 #ifdef MINIHTTP_USE_MBEDTLS
     if(_sslctx)
@@ -406,6 +949,11 @@ void TcpSocket::close(void)
 
     _s = INVALID_SOCKET;
     _recvSize = 0;
+    _Count(_metrics, &Metrics::openSockets, u64(-1));
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+    if(_owner)
+        _owner->_Closed(_slot); // before the descriptor can be reused
+#endif
 }
 
 void TcpSocket::_OnCloseInternal()
@@ -413,6 +961,16 @@ void TcpSocket::_OnCloseInternal()
     _OnClose();
 }
 
+void TcpSocket::SetMetrics(Metrics *m)
+{
+    if(isOpen())
+    {
+        _Count(_metrics, &Metrics::openSockets, u64(-1));
+        _Count(m, &Metrics::openSockets);
+    }
+    _metrics = m;
+}
+
 bool TcpSocket::SetNonBlocking(bool nonblock)
 {
     _nonblocking = nonblock;
@@ -430,7 +988,57 @@ void TcpSocket::SetBufsizeIn(unsigned int s)
     _readptr = _writeptr = _inbuf;
 }
 
-static bool _openSocket(SOCKET *ps, const char *host, unsigned port)
+#if defined(__linux__) && !defined(TCP_FASTOPEN_CONNECT)
+#  define TCP_FASTOPEN_CONNECT 30 // linux 4.11+, older libc headers don't know it
+#endif
+
+static void _SetOpt(SOCKET s, int level, int name, int val)
+{
+    if(setsockopt(s, level, name, (const char*)&val, sizeof(val)))
+        traceprint("setsockopt(%d, %d) failed: %s\n", level, name, _GetErrorStr(_GetError()).c_str());
+}
+
+// Before connect(): these affect the handshake
+static void _PreConnectOptions(SOCKET s, const SocketOptions& o)
+{
+    if(o.rcvBuf)
+        _SetOpt(s, SOL_SOCKET, SO_RCVBUF, (int)o.rcvBuf);
+    if(o.sndBuf)
+        _SetOpt(s, SOL_SOCKET, SO_SNDBUF, (int)o.sndBuf);
+#ifdef TCP_FASTOPEN_CONNECT
+    if(o.fastOpen)
+        _SetOpt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#endif
+}
+
+static void _PostConnectOptions(SOCKET s, const SocketOptions& o)
+{
+    if(o.noDelay)
+        _SetOpt(s, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef TCP_QUICKACK
+    if(o.quickAck)
+        _SetOpt(s, IPPROTO_TCP, TCP_QUICKACK, 1);
+#endif
+    if(o.keepIdle)
+    {
+        _SetOpt(s, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+        _SetOpt(s, IPPROTO_TCP, TCP_KEEPIDLE, (int)o.keepIdle);
+#elif defined(TCP_KEEPALIVE) // apple
+        _SetOpt(s, IPPROTO_TCP, TCP_KEEPALIVE, (int)o.keepIdle);
+#endif
+#ifdef TCP_KEEPINTVL
+        if(o.keepInterval)
+            _SetOpt(s, IPPROTO_TCP, TCP_KEEPINTVL, (int)o.keepInterval);
+#endif
+#ifdef TCP_KEEPCNT
+        if(o.keepCount)
+            _SetOpt(s, IPPROTO_TCP, TCP_KEEPCNT, (int)o.keepCount);
+#endif
+    }
+}
+
+static bool _openSocket(SOCKET *ps, const char *host, unsigned port, RequestTimings *t, const SocketOptions *o)
 {
 #ifdef MINIHTTP_USE_MBEDTLS
     int s;
@@ -440,8 +1048,16 @@ static bool _openSocket(SOCKET *ps, const char *host, unsigned port)
     if(err)
     {
         traceprint("open_ssl: net_connect(%s, %u) returned %d\n", host, port, err);
+        if(err != MBEDTLS_ERR_NET_UNKNOWN_HOST)
+            t->resolved = _GetTimeUS();
         return false;
     }
+    t->resolved = t->connected = _GetTimeUS();
+    if(o)
+    {
+        _PreConnectOptions(s, *o); // too late for fast open
+        _PostConnectOptions(s, *o);
+    }
 #else
     sockaddr_in addr;
     if(!_Resolve(host, port, &addr))
@@ -449,6 +1065,7 @@ static bool _openSocket(SOCKET *ps, const char *host, unsigned port)
         traceprint("RESOLV ERROR: %s\n", _GetErrorStr(_GetError()).c_str());
         return false;
     }
+    t->resolved = _GetTimeUS();
 
     SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -458,6 +1075,9 @@ static bool _openSocket(SOCKET *ps, const char *host, unsigned port)
         return false;
     }
 
+    if(o)
+        _PreConnectOptions(s, *o);
+
     if (::connect(s, (sockaddr*)&addr, sizeof(sockaddr)))
     {
         traceprint("CONNECT ERROR: %s\n", _GetErrorStr(_GetError()).c_str());
@@ -468,6 +1088,9 @@ static bool _openSocket(SOCKET *ps, const char *host, unsigned port)
 #  endif
         return false;
     }
+    t->connected = _GetTimeUS();
+    if(o)
+        _PostConnectOptions(s, *o);
 #endif
 
     *ps = s;
@@ -524,12 +1147,27 @@ bool TcpSocket::open(const char *host /* = NULL */, unsigned int port /* = 0 */)
     assert(!SOCKETVALID(_s));
 
     _recvSize = 0;
+    _timings.connecting = _GetTimeUS();
+    _timings.resolved = _timings.connected = _timings.handshaked = 0;
+    _timings.reused = false;
 
     {
+        const SocketOptions *o = _options;
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+        if(!o && _owner)
+            o = _owner->_options;
+#endif
         SOCKET s;
-        if(!_openSocket(&s, host, port))
+        if(!_openSocket(&s, host, port, &_timings, o))
+        {
+            const MetricsError e = _timings.resolved ? MERR_CONNECT : MERR_RESOLVE;
+            tracerec(1, TRACE_ERROR, this, e, _GetError());
+            _CountError(_metrics, e);
             return false;
+        }
         _s = s;
+        _Count(_metrics, &Metrics::openSockets);
+        _Record(_metrics, &Metrics::connectTime, _timings.connecting, _timings.connected);
 
 #ifdef SO_NOSIGPIPE
         // Don't fire SIGPIPE when trying to write to a closed socket
@@ -549,13 +1187,20 @@ bool TcpSocket::open(const char *host /* = NULL */, unsigned int port /* = 0 */)
         traceprint("TcpSocket::open(): SSL requested...\n");
         if(!_openSSL(&_s, (SSLCtx*)_sslctx))
         {
+            tracerec(1, TRACE_ERROR, this, MERR_SSL, 0);
+            _CountError(_metrics, MERR_SSL);
             close();
             return false;
         }
+        _timings.handshaked = _GetTimeUS();
+        _Record(_metrics, &Metrics::handshakeTime, _timings.connected, _timings.handshaked);
     }
 #endif
 
+    tracerec(2, TRACE_SOCKET_OPEN, this, port, 0);
+
     _OnOpen();
+    _Wake(); // new descriptor
 
     return true;
 }
@@ -576,7 +1221,7 @@ bool TcpSocket::initSSL(const char *certs)
     {
         ctx = new SSLCtx();
         _sslctx = ctx;
-        if(!ctx->init())
+        if(!ctx->init(_alpn))
         {
             shutdownSSL();
             return false;
@@ -597,6 +1242,15 @@ bool TcpSocket::initSSL(const char *certs)
     return true;
 }
 
+const char *TcpSocket::GetALPN() const
+{
+#ifdef MBEDTLS_SSL_ALPN
+    if(_sslctx)
+        return mbedtls_ssl_get_alpn_protocol(&((SSLCtx*)_sslctx)->ssl);
+#endif
+    return NULL;
+}
+
 SSLResult TcpSocket::verifySSL(char *buf, unsigned bufsize)
 {
     if(!_sslctx)
@@ -646,6 +1300,7 @@ bool TcpSocket::initSSL(const char *certs)
     return false;
 }
 SSLResult TcpSocket::verifySSL(char *buf, unsigned buflen) { return SSLR_NO_SSL; }
+const char *TcpSocket::GetALPN() const { return NULL; }
 #endif
 
 bool TcpSocket::SendBytes(const void *str, unsigned int len)
@@ -671,6 +1326,8 @@ bool TcpSocket::SendBytes(const void *str, unsigned int len)
         {
             int err = ret == -1 ? _GetError() : ret;
             traceprint("SendBytes: error %d: %s\n", err, _GetErrorStr(err).c_str());
+            tracerec(1, TRACE_ERROR, this, MERR_SEND, err);
+            _CountError(_metrics, MERR_SEND);
             close();
             return false;
         }
@@ -678,6 +1335,8 @@ bool TcpSocket::SendBytes(const void *str, unsigned int len)
     }
 
     assert(written == len);
+    _Count(_metrics, &Metrics::bytesOut, len);
+    _Consume(true, len); // not held back, but counts
     return true;
 }
 
@@ -712,11 +1371,11 @@ int TcpSocket::_writeBytes(const unsigned char *buf, size_t len)
 
 void TcpSocket::_ShiftBuffer(void)
 {
-    size_t by = _readptr - _inbuf;
-    memmove(_inbuf, _readptr, by);
+    _Count(_metrics, &Metrics::bufferShifts);
+    memmove(_inbuf, _readptr, _recvSize);
     _readptr = _inbuf;
-    _writeptr = _inbuf + by;
-    _writeSize = _inbufSize - by - 1;
+    _writeptr = _inbuf + _recvSize;
+    _writeSize = _inbufSize - _recvSize - 1;
 }
 
 void TcpSocket::_OnData()
@@ -724,8 +1383,48 @@ void TcpSocket::_OnData()
     _OnRecv(_readptr, _recvSize);
 }
 
+int TcpSocket::_SendSome(const void *buf, unsigned len)
+{
+    const u64 allow = _Allowance(true);
+    if(allow < std::min(len, unsigned(RATE_QUANTUM)))
+        return 0;
+    if(allow < len)
+        len = unsigned(allow);
+    const int ret = _writeBytes((const unsigned char*)buf, len);
+    if(ret > 0)
+    {
+        _Count(_metrics, &Metrics::bytesOut, ret);
+        _Consume(true, ret);
+        return ret;
+    }
+    const int err = ret == -1 ? _GetError() : ret;
+    switch(err)
+    {
+        case 0:
+        case EWOULDBLOCK:
+#if defined(EAGAIN) && (EWOULDBLOCK != EAGAIN)
+        case EAGAIN:
+#endif
+#ifdef MINIHTTP_USE_MBEDTLS
+        case MBEDTLS_ERR_SSL_WANT_WRITE:
+        case MBEDTLS_ERR_SSL_WANT_READ:
+#endif
+            return 0;
+    }
+    traceprint("_SendSome: error %d: %s\n", err, _GetErrorStr(err).c_str());
+    tracerec(1, TRACE_ERROR, this, MERR_SEND, err);
+    _CountError(_metrics, MERR_SEND);
+    close();
+    return -1;
+}
+
 int TcpSocket::_readBytes(unsigned char *buf, size_t maxlen)
 {
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+    int fed;
+    if(_owner && _owner->_Recv(this, buf, maxlen, &fed)) // already received by the set's backend
+        return fed;
+#endif
 #ifdef MINIHTTP_USE_MBEDTLS
     if(_sslctx)
         return mbedtls_ssl_read(&((SSLCtx*)_sslctx)->ssl, buf, maxlen);
@@ -747,12 +1446,23 @@ bool TcpSocket::update(void)
     if(!_inbuf)
         SetBufsizeIn(DEFAULT_BUFSIZE);
 
-    int bytes = _readBytes((unsigned char*)_writeptr, _writeSize);
+    unsigned maxlen = _writeSize;
+    const u64 allow = _Allowance(false);
+    _throttled = allow < std::min(maxlen, unsigned(RATE_QUANTUM));
+    if(_throttled)
+        return false; // leave it in the socket for now
+    if(allow < maxlen)
+        maxlen = unsigned(allow);
+
+    int bytes = _readBytes((unsigned char*)_writeptr, maxlen);
     //traceprint("TcpSocket::update: _readBytes() result %d\n", bytes);
     if(bytes > 0) // we received something
     {
-        _inbuf[bytes] = 0;
-        _recvSize = bytes;
+        _timings.wireBytes += bytes;
+        _Count(_metrics, &Metrics::bytesIn, bytes);
+        _Consume(false, bytes);
+        _recvSize = unsigned(_writeptr - _inbuf) + bytes; // include what _ShiftBuffer() kept
+        _inbuf[_recvSize] = 0;
 
         // reset pointers for next read
         _writeSize = _inbufSize - 1;
@@ -791,6 +1501,8 @@ bool TcpSocket::update(void)
         case WSAECONNABORTED:
         case WSAESHUTDOWN:
 #endif
+            tracerec(1, TRACE_ERROR, this, MERR_RECV, err);
+            _CountError(_metrics, MERR_RECV);
             close();
             break;
         }
@@ -798,16 +1510,106 @@ bool TcpSocket::update(void)
     return true;
 }
 
-
-// ==========================
-// ===== HTTP SPECIFIC ======
-// ==========================
-#ifdef MINIHTTP_SUPPORT_HTTP
-
-static void strToLower(std::string& s)
+u64 TcpSocket::_Allowance(bool out)
 {
-    std::transform(s.begin(), s.end(), s.begin(), tolower);
-}
+    u64 n = u64(-1);
+    if(RateLimit *r = out ? _limitOut : _limitIn)
+        n = r->Available();
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+    if(_owner && n)
+        n = std::min(n, _owner->_Allowance(_host, out));
+#endif
+    return n;
+}
+
+void TcpSocket::_Consume(bool out, u64 n)
+{
+    if(RateLimit *r = out ? _limitOut : _limitIn)
+        r->Consume(n);
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+    if(_owner)
+        _owner->_Consume(_host, out, n);
+#endif
+}
+
+// ------------------------ RATE LIMITS -------------------------
+
+RateLimit::RateLimit(u64 bytesPerSec /* = 0 */, u64 burst /* = 0 */)
+{
+    Set(bytesPerSec, burst);
+}
+
+void RateLimit::Set(u64 bytesPerSec, u64 burst /* = 0 */)
+{
+    _rate = bytesPerSec;
+    _burst = burst ? burst : std::max(bytesPerSec / 10, u64(16 * 1024));
+    if(_burst < RATE_QUANTUM) // sockets wait until a whole quantum is available, which would never happen
+        _burst = RATE_QUANTUM;
+    _last = _GetTimeUS();
+    _frac = 0;
+    _tokens = (long long)_burst;
+}
+
+u64 RateLimit::Available()
+{
+    if(!_rate)
+        return u64(-1);
+    const u64 now = _GetTimeUS();
+    if(now > _last)
+    {
+        _frac += std::min(now - _last, u64(60000000)) * _rate; // capped to keep it in range
+        _last = now;
+        _tokens += (long long)(_frac / 1000000);
+        _frac %= 1000000;
+        if(_tokens >= (long long)_burst)
+        {
+            _tokens = (long long)_burst;
+            _frac = 0;
+        }
+    }
+    return _tokens > 0 ? u64(_tokens) : 0;
+}
+
+void RateLimit::Consume(u64 n)
+{
+    if(_rate)
+        _tokens -= (long long)n;
+}
+
+
+// ==========================
+// ===== HTTP SPECIFIC ======
+// ==========================
+#ifdef MINIHTTP_SUPPORT_HTTP
+
+// strtoull() is not available everywhere
+static u64 _ParseU64(const char *s, unsigned base)
+{
+    u64 v = 0;
+    if(!s)
+        return 0;
+    while(*s == ' ' || *s == '\t')
+        ++s;
+    for( ; ; ++s)
+    {
+        unsigned d;
+        if(*s >= '0' && *s <= '9')
+            d = *s - '0';
+        else if(base == 16 && *s >= 'a' && *s <= 'f')
+            d = *s - 'a' + 10;
+        else if(base == 16 && *s >= 'A' && *s <= 'F')
+            d = *s - 'A' + 10;
+        else
+            break;
+        v = v * base + d;
+    }
+    return v;
+}
+
+static void strToLower(std::string& s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), tolower);
+}
 
 POST& POST::add(const char *key, const char *value)
 {
@@ -819,542 +1621,5507 @@ POST& POST::add(const char *key, const char *value)
     return *this;
 }
 
+int MemoryBody::read(void *buf, unsigned maxlen)
+{
+    const size_t n = std::min(size_t(maxlen), _len - _pos);
+    memcpy(buf, _data + _pos, n);
+    _pos += n;
+    return (int)n;
+}
 
-HttpSocket::HttpSocket()
-	: TcpSocket()
-	, _keep_alive(0)
-	, _remaining(0)
-	, _status(0)
-	, _inProgress(false)
-	, _chunkedTransfer(false)
-	, _mustClose(true)
-	, _followRedir(true)
-	, _alwaysHandle(false)
+FileBody::FileBody(int fd, u64 offset /* = 0 */, u64 len /* = u64(-1) */)
+    : _fd(fd), _start(offset), _end(u64(-1)), _pos(offset)
 {
+    if(len != u64(-1))
+        _end = offset + len;
+    else
+    {
+#ifdef _WIN32
+        struct _stati64 st;
+        if(!_fstati64(fd, &st))
+#else
+        struct stat st;
+        if(!fstat(fd, &st) && S_ISREG(st.st_mode))
+#endif
+            _end = std::max(u64(st.st_size), offset);
+    }
 }
 
-HttpSocket::~HttpSocket()
+int FileBody::read(void *buf, unsigned maxlen)
+{
+    u64 n = maxlen;
+    if(_end != u64(-1) && _end - _pos < n)
+        n = _end - _pos;
+    if(!n)
+        return 0;
+#ifdef _WIN32
+    if(_lseeki64(_fd, (__int64)_pos, SEEK_SET) < 0)
+        return -1;
+    const int r = _read(_fd, buf, (unsigned)n);
+#else
+    const int r = (int)pread(_fd, buf, (size_t)n, (off_t)_pos);
+#endif
+    if(r > 0)
+        _pos += r;
+    return r;
+}
+
+static void _AppendFormName(std::string& out, const char *s)
 {
+    for( ; *s; ++s)
+        switch(*s)
+        {
+            case '"': out += "%22"; break;
+            case '\r': out += "%0D"; break;
+            case '\n': out += "%0A"; break;
+            default: out += *s;
+        }
 }
 
-void HttpSocket::_OnOpen()
+MultipartBody::MultipartBody()
+    : _cur(0), _off(0), _inBody(false)
 {
-    TcpSocket::_OnOpen();
-    _chunkedTransfer = false;
-    _mustClose = true;
+    char b[64];
+    sprintf(b, "minihttp-%08x%08x", (unsigned)_GetTimeUS(), (unsigned)(size_t)this ^ (unsigned)rand());
+    _boundary = b;
+    _contentType = "multipart/form-data; boundary=" + _boundary;
+    _tail = "--" + _boundary + "--\r\n";
 }
 
-void HttpSocket::_OnCloseInternal()
+void MultipartBody::_AddHead(const char *name, const char *filename, const char *contentType, std::string& head) const
 {
-    if(!IsRedirecting() || _alwaysHandle)
-        _OnClose();
+    if(_parts.size())
+        head += "\r\n"; // ends the previous part
+    head += "--";
+    head += _boundary;
+    head += "\r\nContent-Disposition: form-data; name=\"";
+    _AppendFormName(head, name);
+    head += '"';
+    if(filename)
+    {
+        head += "; filename=\"";
+        _AppendFormName(head, filename);
+        head += '"';
+    }
+    head += "\r\n";
+    if(contentType)
+    {
+        head += "Content-Type: ";
+        head += contentType;
+        head += "\r\n";
+    }
+    head += "\r\n";
 }
 
-bool HttpSocket::_OnUpdate()
+MultipartBody& MultipartBody::add(const char *name, const char *value)
 {
-    if(!TcpSocket::_OnUpdate())
-        return false;
+    Part p;
+    _AddHead(name, NULL, NULL, p.head);
+    p.head += value;
+    p.body = NULL;
+    _parts.push_back(p);
+    _tail = "\r\n--" + _boundary + "--\r\n";
+    return *this;
+}
 
-    if(_inProgress && !_chunkedTransfer && !_remaining && _status)
-        _FinishRequest();
+MultipartBody& MultipartBody::add(const char *name, const char *filename, const char *contentType, RequestBody *body)
+{
+    Part p;
+    _AddHead(name, filename ? filename : "", contentType ? contentType : "application/octet-stream", p.head);
+    p.body = body;
+    _parts.push_back(p);
+    _tail = "\r\n--" + _boundary + "--\r\n";
+    return *this;
+}
 
-    //traceprint("HttpSocket::_OnUpdate, Q = %d\n", (unsigned)_requestQ.size());
+u64 MultipartBody::size() const
+{
+    u64 total = _tail.length();
+    for(size_t i = 0; i < _parts.size(); ++i)
+    {
+        total += _parts[i].head.length();
+        if(_parts[i].body)
+        {
+            const u64 sz = _parts[i].body->size();
+            if(sz == u64(-1))
+                return sz;
+            total += sz;
+        }
+    }
+    return total;
+}
 
-    // initiate transfer if queue is not empty, but the socket somehow forgot to proceed
-    if(_requestQ.size() && !_remaining && !_chunkedTransfer && !_inProgress)
-        _DequeueMore();
+int MultipartBody::read(void *buf, unsigned maxlen)
+{
+    while(_cur <= _parts.size())
+    {
+        if(_inBody)
+        {
+            const int n = _parts[_cur].body->read(buf, maxlen);
+            if(n)
+                return n; // data or error
+            _inBody = false;
+            ++_cur;
+            continue;
+        }
+        const std::string& text = _cur < _parts.size() ? _parts[_cur].head : _tail;
+        if(_off < text.length())
+        {
+            const size_t n = std::min(size_t(maxlen), text.length() - _off);
+            memcpy(buf, text.data() + _off, n);
+            _off += n;
+            return (int)n;
+        }
+        _off = 0;
+        if(_cur < _parts.size() && _parts[_cur].body)
+            _inBody = true;
+        else
+            ++_cur;
+    }
+    return 0;
+}
 
+bool MultipartBody::rewind()
+{
+    for(size_t i = 0; i < _parts.size(); ++i)
+        if(_parts[i].body && !_parts[i].body->rewind())
+            return false;
+    _cur = _off = 0;
+    _inBody = false;
     return true;
 }
 
-bool HttpSocket::Download(const std::string& url, const char *extraRequest /*= NULL*/, void *user /* = NULL */, const POST *post /*= NULL*/)
+void Request::swap(Request& o)
 {
-    Request req;
-    req.user = user;
-    if(post)
-        req.post = *post;
-    SplitURI(url, req.protocol, req.host, req.resource, req.port, req.useSSL);
-    if(IsRedirecting() && req.host.empty()) // if we're following a redirection to the same host, the server is likely to omit its hostname
-        req.host = _curRequest.host;
-    if(req.port < 0)
-        req.port = 80;
-    if(extraRequest)
-        req.extraGetHeaders = extraRequest;
-    return SendRequest(req, false);
+    protocol.swap(o.protocol);
+    host.swap(o.host);
+    header.swap(o.header);
+    resource.swap(o.resource);
+    extraGetHeaders.swap(o.extraGetHeaders);
+    std::swap(port, o.port);
+    std::swap(user, o.user);
+    std::swap(useSSL, o.useSSL);
+    std::swap(cacheState, o.cacheState);
+    std::swap(onRecv, o.onRecv);
+    std::swap(onDone, o.onDone);
+    post.swap(o.post);
+    std::swap(body, o.body);
+    std::swap(priority, o.priority);
+    std::swap(queuedAt, o.queuedAt);
+    std::swap(expectContinue, o.expectContinue);
 }
 
-
-bool HttpSocket::_Redirect(const std::string& loc, bool forceGET)
+bool RequestQueue::_Later(const Entry& a, const Entry& b)
 {
-    traceprint("Following HTTP redirect to: %s\n", loc.c_str());
-    if(loc.empty())
-        return false;
+    return a.key != b.key ? a.key > b.key : a.seq > b.seq;
+}
 
-    Request req;
-    req.user = _curRequest.user;
-    req.useSSL = _curRequest.useSSL;
-    if(!forceGET)
-        req.post = _curRequest.post;
-    SplitURI(loc, req.protocol, req.host, req.resource, req.port, req.useSSL);
-    if(req.protocol.empty()) // assume local resource
+void RequestQueue::push(Request& r)
+{
+    if(!r.queuedAt)
+        r.queuedAt = _GetTimeUS(); // kept if the request comes back, so it doesn't lose its place
+    Entry e;
+    e.key = (long long)r.queuedAt - (long long)r.priority * (long long)_aging;
+    e.seq = _seq++;
+    if(_free.empty())
     {
-        req.host = _curRequest.host;
-        req.resource = loc;
+        const size_t n = _slots.size();
+        std::vector<Request> grown(n ? n * 2 : 4);
+        for(size_t i = 0; i < n; ++i)
+            grown[i].swap(_slots[i]);
+        _slots.swap(grown);
+        for(size_t i = _slots.size(); i > n; --i)
+            _free.push_back(i - 1);
     }
-    if(req.host.empty())
-        req.host = _curRequest.host;
-    if(req.port < 0)
-        req.port = _curRequest.port;
-    req.extraGetHeaders = _curRequest.extraGetHeaders;
-    return SendRequest(req, false);
+    e.slot = _free.back();
+    _free.pop_back();
+    _slots[e.slot].swap(r);
+    _heap.push_back(e);
+    std::push_heap(_heap.begin(), _heap.end(), _Later);
 }
 
-bool HttpSocket::SendRequest(const std::string& what, const char *extraRequest /*= NULL*/, void *user /* = NULL */)
+void RequestQueue::pop(Request& r)
 {
-    Request req(what, _host, _lastport, user);
-    if(extraRequest)
-        req.extraGetHeaders = extraRequest;
-    return SendRequest(req, false);
+    std::pop_heap(_heap.begin(), _heap.end(), _Later);
+    const size_t slot = _heap.back().slot;
+    _heap.pop_back();
+    r.swap(_slots[slot]); // slot keeps r's old contents, usually empty
+    _free.push_back(slot);
 }
 
-bool HttpSocket::QueueRequest(const std::string& what, const char *extraRequest /*= NULL*/, void *user /* = NULL */)
+
+// ---------------------------------------------------
+// Response caches
+
+std::string HttpCache::MakeKey(const Request& req, const std::string& acceptEncoding /* = std::string() */)
 {
-    Request req(what, _host, _lastport, user);
-    if(extraRequest)
-        req.extraGetHeaders = extraRequest;
-    return SendRequest(req, true);
+    std::ostringstream os;
+    os << (req.useSSL ? "https://" : "http://") << req.host << ':' << req.port << req.resource;
+    if(acceptEncoding.length()) // a URL has no spaces, so this can't collide with another one
+        os << " accept-encoding=" << acceptEncoding;
+    return os.str();
 }
 
-bool HttpSocket::SendRequest(Request& req, bool enqueue)
+struct DiskCacheStore
 {
-    if(req.host.empty() || !req.port)
-        return false;
-
-    const bool post = !req.post.empty();
+    FILE *f;
+    std::string url;
+    HttpCache::Info info;
+    u64 written;
+    long sizeAt; // where the body file has room for the size
+};
 
-    std::stringstream r;
-    const char *crlf = "\r\n";
-    r << (post ? "POST " : "GET ") << req.resource << " HTTP/1.1" << crlf;
-    r << "Host: " << req.host << crlf;
-    if(_keep_alive)
+// FNV-1a
+static u64 _Hash64(const std::string& s)
+{
+    u64 h = 14695981039346656037ULL;
+    for(size_t i = 0; i < s.length(); ++i)
     {
-        r << "Connection: Keep-Alive" << crlf;
-        r << "Keep-Alive: " << _keep_alive << crlf;
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
     }
-    else
-        r << "Connection: close" << crlf;
-
-    if(_user_agent.length())
-        r << "User-Agent: " << _user_agent << crlf;
+    return h;
+}
 
-    if(_accept_encoding.length())
-        r << "Accept-Encoding: " << _accept_encoding << crlf;
+static bool _ReadLine(FILE *f, std::string& line)
+{
+    line.clear();
+    int c;
+    while((c = fgetc(f)) != EOF && c != '\n')
+        line += (char)c;
+    return c != EOF;
+}
 
-    if(post)
-    {
-        r << "Content-Length: " << req.post.length() << crlf;
-        r << "Content-Type: application/x-www-form-urlencoded" << crlf;
-    }
+static u64 _FileSize(FILE *f)
+{
+#ifdef _WIN32
+    struct _stati64 st;
+    return _fstati64(_fileno(f), &st) ? u64(-1) : u64(st.st_size);
+#else
+    struct stat st;
+    return fstat(fileno(f), &st) ? u64(-1) : u64(st.st_size);
+#endif
+}
 
-    if(req.extraGetHeaders.length())
-    {
-        r << req.extraGetHeaders;
-        if(req.extraGetHeaders.compare(req.extraGetHeaders.length() - 2, std::string::npos, crlf))
-            r << crlf;
-    }
+static bool _ReplaceFile(const char *from, const char *to)
+{
+#ifdef _WIN32
+    remove(to); // rename() does not overwrite on windows
+#endif
+    return !rename(from, to);
+}
 
-    r << crlf; // header terminator
+#define DISKCACHE_MAGIC "minihttp-cache 2"
+#define DISKCACHE_SIZE_DIGITS 20 // fixed width, filled in when the body is complete
 
-    // FIXME: appending this to the 'header' field is probably not a good idea
-    if(post)
-        r << req.post.str();
+DiskCache::DiskCache(const std::string& dir)
+    : _dir(dir)
+{
+    if(_dir.length() && _dir[_dir.length() - 1] != '/' && _dir[_dir.length() - 1] != '\\')
+        _dir += '/';
+}
 
-    req.header = r.str();
+DiskCache::~DiskCache()
+{
+}
 
-    return _EnqueueOrSend(req, enqueue);
+std::string DiskCache::_Path(const std::string& url, const char *ext) const
+{
+    const u64 h = _Hash64(url);
+    char buf[17];
+    for(unsigned i = 0; i < 16; ++i)
+        buf[i] = "0123456789abcdef"[(h >> (60 - i * 4)) & 0xf];
+    buf[16] = 0;
+    return _dir + buf + ext;
 }
 
-bool HttpSocket::_EnqueueOrSend(const Request& req, bool forceQueue /* = false */)
+bool DiskCache::_WriteInfo(const std::string& url, const Info& info, const char *ext)
 {
-    traceprint("HttpSocket::_EnqueueOrSend, forceQueue = %d\n", forceQueue);
-    if(_inProgress || forceQueue) // do not send while receiving other data
-    {
-        traceprint("HTTP: Transfer pending; putting into queue. Now %u waiting.\n", (unsigned int)_requestQ.size());
-        _requestQ.push(req);
-        return true;
-    }
-    // ok, we can send directly
-    traceprint("HTTP: Open request for immediate send.\n");
-    if(!_OpenRequest(req))
+    const std::string tmp = _Path(url, ".htmp");
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(!f)
         return false;
-    bool sent = SendBytes(req.header.c_str(), req.header.length());
-    _inProgress = sent;
-    return sent;
+    std::ostringstream os;
+    os << DISKCACHE_MAGIC << '\n' << url << '\n' << info.etag << '\n' << info.lastModified << '\n'
+       << info.contentType << '\n' << info.expires << '\n' << info.size << '\n';
+    const std::string s = os.str();
+    bool ok = fwrite(s.c_str(), 1, s.length(), f) == s.length();
+    ok = !fclose(f) && ok;
+    return ok && _ReplaceFile(tmp.c_str(), _Path(url, ext).c_str());
 }
 
-// called whenever a request is finished completely and the socket checks for more things to send
-void HttpSocket::_DequeueMore(void)
+bool DiskCache::Lookup(const std::string& url, Info& info)
 {
-    traceprint("HttpSocket::_DequeueMore, Q = %u\n", (unsigned)_requestQ.size());
-    _FinishRequest(); // In case this was not done yet.
-
-    // _inProgress is known to be false here
-    if(_requestQ.size()) // still have other requests queued?
-        if(_EnqueueOrSend(_requestQ.front(), false)) // could we send?
-            _requestQ.pop(); // if so, we are done with this request
+    FILE *f = fopen(_Path(url, ".hdr").c_str(), "rb");
+    if(!f)
+        return false;
+    std::string magic, u, exp, sz;
+    bool ok = _ReadLine(f, magic) && magic == DISKCACHE_MAGIC
+        && _ReadLine(f, u) && u == url // different URL with the same hash is a miss
+        && _ReadLine(f, info.etag)
+        && _ReadLine(f, info.lastModified)
+        && _ReadLine(f, info.contentType)
+        && _ReadLine(f, exp)
+        && _ReadLine(f, sz);
+    fclose(f);
+    if(!ok)
+        return false;
+    info.expires = _ParseU64(exp.c_str(), 10);
+    info.size = _ParseU64(sz.c_str(), 10);
+    return true;
+}
 
-    // otherwise, we are done for now. socket is kept alive for future sends. Nothing to do.
+// The body file starts with the URL and the size, like the header file. Another URL's body (same hash),
+// or one that doesn't go with the header file (a store that died between renaming the two) is a miss.
+bool DiskCache::Replay(const std::string& url, ReplayFunc func, void *ctx)
+{
+    FILE *f = fopen(_Path(url, ".body").c_str(), "rb");
+    if(!f)
+        return false;
+    Info info;
+    std::string magic, u, sz;
+    bool ok = _ReadLine(f, magic) && magic == DISKCACHE_MAGIC
+        && _ReadLine(f, u) && u == url
+        && _ReadLine(f, sz) && Lookup(url, info) && _ParseU64(sz.c_str(), 10) == info.size
+        && _FileSize(f) == u64(ftell(f)) + info.size;
+    if(ok)
+    {
+        char buf[16 * 1024];
+        size_t rd;
+        while((rd = fread(buf, 1, sizeof(buf), f)))
+            func(ctx, buf, (unsigned)rd);
+        ok = !ferror(f);
+    }
+    fclose(f);
+    return ok;
 }
 
-bool HttpSocket::_OpenRequest(const Request& req)
+void *DiskCache::BeginStore(const std::string& url, const Info& info)
 {
-    if(_inProgress)
+    FILE *f = fopen(_Path(url, ".tmp").c_str(), "wb");
+    if(!f)
+        return NULL;
+    std::ostringstream os;
+    os << DISKCACHE_MAGIC << '\n' << url << '\n';
+    const std::string head = os.str() + std::string(DISKCACHE_SIZE_DIGITS, '0') + '\n';
+    if(fwrite(head.c_str(), 1, head.length(), f) != head.length())
     {
-        traceprint("HttpSocket::_OpenRequest(): _inProgress == true, should not be called.");
-        return false;
+        fclose(f);
+        remove(_Path(url, ".tmp").c_str());
+        return NULL;
     }
-    _status = 0;
-    if(req.useSSL && !hasSSL())
+    DiskCacheStore *st = new DiskCacheStore;
+    st->f = f;
+    st->url = url;
+    st->info = info;
+    st->written = 0;
+    st->sizeAt = long(head.length() - DISKCACHE_SIZE_DIGITS - 1);
+    return st;
+}
+
+void DiskCache::Append(void *handle, const void *buf, unsigned size)
+{
+    DiskCacheStore *st = (DiskCacheStore*)handle;
+    if(st->f && fwrite(buf, 1, size, st->f) != size)
     {
-        traceprint("HttpSocket::_OpenRequest(): Is an SSL connection, but SSL was not inited, doing that now\n");
-        if(!initSSL(NULL)) // FIXME: supply cert list?
-        {
-            traceprint("FAILED to init SSL\n");
-            return false;
-        }
+        fclose(st->f); // disk full or so. Remember the failure and discard at the end.
+        st->f = NULL;
     }
-    if(!open(req.host.c_str(), req.port))
-        return false;
-    _inProgress = true;
-    _curRequest = req;
-    return true;
+    st->written += size;
 }
 
-void HttpSocket::_FinishRequest(void)
+void DiskCache::EndStore(void *handle, bool commit)
 {
-    traceprint("HttpSocket::_FinishRequest\n");
-    if(_inProgress)
+    DiskCacheStore *st = (DiskCacheStore*)handle;
+    const std::string tmp = _Path(st->url, ".tmp");
+    // Without Content-Length, the size is whatever arrived until the end of the response
+    commit = commit && st->f && (!st->info.size || st->info.size == st->written);
+    if(commit)
     {
-        traceprint("... in progress. redirecting = %d\n", IsRedirecting());
-        if(!IsRedirecting() || _alwaysHandle)
-            _OnRequestDone(); // notify about finished request
-        _inProgress = false;
-        _hdrs.clear();
-        if(_mustClose)
-            close();
+        st->info.size = st->written;
+        commit = !fseek(st->f, st->sizeAt, SEEK_SET) && fprintf(st->f, "%020llu", st->written) == DISKCACHE_SIZE_DIGITS;
+    }
+    if(st->f)
+        commit = !fclose(st->f) && commit;
+    if(commit)
+        commit = _ReplaceFile(tmp.c_str(), _Path(st->url, ".body").c_str()) && _WriteInfo(st->url, st->info, ".hdr");
+    if(!commit)
+    {
+        remove(tmp.c_str());
+        Remove(st->url);
     }
+    delete st;
 }
 
-void HttpSocket::_ProcessChunk(void)
+void DiskCache::Refresh(const std::string& url, const Info& info)
 {
-    if(!_chunkedTransfer)
-        return;
+    _WriteInfo(url, info, ".hdr");
+}
+
+void DiskCache::Remove(const std::string& url)
+{
+    remove(_Path(url, ".hdr").c_str());
+    remove(_Path(url, ".body").c_str());
+}
 
-    unsigned int chunksize = -1;
+// ---------------------------------------------------
+// In-memory cache
 
-    while(true)
+SharedBody::SharedBody()
+    : _data(NULL), _size(0), _cap(0), _refs(1)
+{
+}
+
+SharedBody::~SharedBody()
+{
+    free(_data);
+}
+
+SharedBody *SharedBody::Create(size_t reserve)
+{
+    SharedBody *b = new SharedBody;
+    b->_cap = reserve + 1;
+    b->_data = (char*)malloc(b->_cap);
+    if(!b->_data)
     {
-        // less data required until chunk end than received, means the new chunk starts somewhere in the middle
-        // of the received data block. finish this chunk first.
-        if(_remaining)
-        {
-            if(_remaining <= _recvSize) // it contains the rest of the chunk, including CRLF
+        delete b;
+        return NULL;
+    }
+    b->_data[0] = 0;
+    return b;
+}
+
+SharedBody *SharedBody::Adopt(char *buf, size_t size)
+{
+    SharedBody *b = new SharedBody;
+    b->_data = buf;
+    b->_size = b->_cap = size;
+    return b;
+}
+
+bool SharedBody::append(const void *buf, size_t size)
+{
+    if(_size + size + 1 > _cap)
+    {
+        const size_t newcap = _cap + (_cap / 2) + size + 1;
+        char *p = (char*)realloc(_data, newcap);
+        if(!p)
+            return false;
+        _data = p;
+        _cap = newcap;
+    }
+    memcpy(_data + _size, buf, size);
+    _size += size;
+    _data[_size] = 0;
+    return true;
+}
+
+void SharedBody::AddRef() const
+{
+    _AtomicInc(&_refs);
+}
+
+void SharedBody::Release() const
+{
+    if(!_AtomicDec(&_refs))
+        delete this;
+}
+
+struct MemCacheStore
+{
+    std::string url;
+    HttpCache::Info info;
+    SharedBody *body;
+    size_t budget; // as it was in BeginStore(), so that Append() doesn't need the lock
+};
+
+MemCache::MemCache(size_t budget /* = 16 * 1024 * 1024 */)
+    : _head(NULL)
+    , _tail(NULL)
+    , _bytes(0)
+    , _budget(budget)
+    , _mutex(new Mutex)
+{
+}
+
+MemCache::~MemCache()
+{
+    Clear();
+    delete (Mutex*)_mutex;
+}
+
+MemCache& MemCache::Global()
+{
+    static MemCache inst;
+    return inst;
+}
+
+void MemCache::_Unlink(Entry *e)
+{
+    (e->prev ? e->prev->next : _head) = e->next;
+    (e->next ? e->next->prev : _tail) = e->prev;
+    e->prev = e->next = NULL;
+}
+
+MemCache::Entry *MemCache::_Find(const std::string& url)
+{
+    Store::iterator it = _store.find(url);
+    if(it == _store.end())
+        return NULL;
+    Entry *e = &it->second;
+    if(e != _head)
+    {
+        _Unlink(e);
+        e->next = _head;
+        _head->prev = e;
+        _head = e;
+    }
+    return e;
+}
+
+void MemCache::_Erase(Store::iterator it)
+{
+    Entry *e = &it->second;
+    _Unlink(e);
+    _bytes -= e->body->size();
+    e->body->Release(); // Whoever still holds a reference keeps it alive
+    _store.erase(it);
+}
+
+void MemCache::_Evict()
+{
+    while(_bytes > _budget && _tail)
+        _Erase(_store.find(*_tail->key));
+}
+
+bool MemCache::Lookup(const std::string& url, Info& info)
+{
+    MutexLock lock(_mutex);
+    Entry *e = _Find(url);
+    if(e)
+        info = e->info;
+    return !!e;
+}
+
+bool MemCache::Replay(const std::string& url, ReplayFunc f, void *ctx)
+{
+    SharedBody *b = NULL;
+    {
+        MutexLock lock(_mutex);
+        if(Entry *e = _Find(url))
+        {
+            b = e->body;
+            b->AddRef();
+        }
+    }
+    if(!b)
+        return false;
+    // Delivered in place. Not under the lock, since the callback may call back into the cache.
+    const char *p = b->data();
+    size_t remain = b->size();
+    do
+    {
+        const unsigned n = remain > 0x40000000 ? 0x40000000 : (unsigned)remain;
+        f(ctx, p, n);
+        p += n;
+        remain -= n;
+    }
+    while(remain);
+    b->Release();
+    return true;
+}
+
+SharedBody *MemCache::GetShared(const std::string& url)
+{
+    MutexLock lock(_mutex);
+    Entry *e = _Find(url);
+    if(!e || e->info.expires <= (u64)time(NULL))
+        return NULL;
+    e->body->AddRef();
+    return e->body;
+}
+
+void *MemCache::BeginStore(const std::string& url, const Info& info)
+{
+    size_t budget;
+    {
+        MutexLock lock(_mutex);
+        budget = _budget;
+    }
+    if(info.size > budget)
+        return NULL;
+    SharedBody *b = SharedBody::Create((size_t)info.size);
+    if(!b)
+        return NULL;
+    MemCacheStore *st = new MemCacheStore;
+    st->url = url;
+    st->info = info;
+    st->body = b;
+    st->budget = budget;
+    return st;
+}
+
+void MemCache::Append(void *handle, const void *buf, unsigned size)
+{
+    MemCacheStore *st = (MemCacheStore*)handle;
+    if(st->body && (st->body->size() + size > st->budget || !st->body->append(buf, size)))
+    {
+        st->body->Release(); // too large after all, or out of memory
+        st->body = NULL;
+    }
+}
+
+void MemCache::EndStore(void *handle, bool commit)
+{
+    MemCacheStore *st = (MemCacheStore*)handle;
+    if(st->body && commit && (!st->info.size || st->info.size == st->body->size()))
+    {
+        st->info.size = st->body->size();
+        MutexLock lock(_mutex);
+        Store::iterator it = _store.find(st->url);
+        if(it != _store.end())
+            _Erase(it);
+        Entry& e = _store[st->url];
+        e.info = st->info;
+        e.body = st->body;
+        e.key = &_store.find(st->url)->first;
+        e.prev = NULL;
+        e.next = _head;
+        (_head ? _head->prev : _tail) = &e;
+        _head = &e;
+        _bytes += e.body->size();
+        _Evict();
+    }
+    else if(st->body)
+        st->body->Release();
+    delete st;
+}
+
+void MemCache::Refresh(const std::string& url, const Info& info)
+{
+    MutexLock lock(_mutex);
+    if(Entry *e = _Find(url))
+    {
+        const u64 size = e->info.size;
+        e->info = info;
+        e->info.size = size;
+    }
+}
+
+void MemCache::Remove(const std::string& url)
+{
+    MutexLock lock(_mutex);
+    Store::iterator it = _store.find(url);
+    if(it != _store.end())
+        _Erase(it);
+}
+
+void MemCache::SetBudget(size_t bytes)
+{
+    MutexLock lock(_mutex);
+    _budget = bytes;
+    _Evict();
+}
+
+size_t MemCache::GetBytes() const
+{
+    MutexLock lock(_mutex);
+    return _bytes;
+}
+
+void MemCache::Clear()
+{
+    MutexLock lock(_mutex);
+    while(_head)
+        _Erase(_store.find(*_head->key));
+}
+
+// ---------------------------------------------------
+// Request coalescing
+
+Coalescer::~Coalescer()
+{
+    for(Store::iterator it = _flights.begin(); it != _flights.end(); ++it)
+    {
+        Flight& f = it->second;
+        f.leader->_leading = false;
+        for(size_t i = 0; i < f.waiters.size(); ++i)
+            if(f.waiters[i])
+                f.waiters[i]->_CoalescedDone(false);
+    }
+}
+
+std::string Coalescer::_MakeKey(const HttpSocket *s, const Request& req)
+{
+    std::string key = "GET " + HttpCache::MakeKey(req);
+    key += '\n';
+    key += s->_accept_encoding;
+    key += '\n';
+    key += req.extraGetHeaders;
+    return key;
+}
+
+Coalescer::Flight *Coalescer::_Find(HttpSocket *leader)
+{
+    for(Store::iterator it = _flights.begin(); it != _flights.end(); ++it)
+        if(it->second.leader == leader)
+            return &it->second;
+    return NULL;
+}
+
+bool Coalescer::_Join(const std::string& key, HttpSocket *s)
+{
+    Store::iterator it = _flights.find(key);
+    if(it == _flights.end() || it->second.delivering)
+        return false;
+    it->second.waiters.push_back(s);
+    return true;
+}
+
+void Coalescer::_Lead(const std::string& key, HttpSocket *s)
+{
+    Flight& f = _flights[key];
+    if(f.leader)
+        return; // Joined too late, this one goes alone
+    f.leader = s;
+    s->_leading = true;
+}
+
+void Coalescer::_Leave(HttpSocket *s)
+{
+    for(Store::iterator it = _flights.begin(); it != _flights.end(); ++it)
+    {
+        std::vector<HttpSocket*>& w = it->second.waiters;
+        for(size_t i = 0; i < w.size(); ++i)
+            if(w[i] == s)
+            {
+                if(it->second.delivering)
+                    w[i] = NULL; // might be iterating over this right now
+                else
+                    w.erase(w.begin() + i);
+                return;
+            }
+    }
+}
+
+void Coalescer::_Headers(HttpSocket *leader)
+{
+    Flight *f = _Find(leader);
+    if(!f || f->delivering)
+        return;
+    f->delivering = true;
+    for(size_t i = 0; i < f->waiters.size(); ++i)
+        if(HttpSocket *w = f->waiters[i])
+            w->_CoalescedHeaders(leader);
+}
+
+void Coalescer::_Body(HttpSocket *leader, const void *buf, unsigned size)
+{
+    _Headers(leader);
+    if(Flight *f = _Find(leader))
+        for(size_t i = 0; i < f->waiters.size(); ++i)
+            if(HttpSocket *w = f->waiters[i])
+                w->_CoalescedBody(buf, size);
+}
+
+void Coalescer::_Land(HttpSocket *leader, bool complete)
+{
+    if(complete)
+        _Headers(leader); // in case there was no body
+    std::vector<HttpSocket*> w;
+    for(Store::iterator it = _flights.begin(); it != _flights.end(); ++it)
+        if(it->second.leader == leader)
+        {
+            // Gone before the waiters get to see it, so that follow-up requests start a new flight
+            w.swap(it->second.waiters);
+            _flights.erase(it);
+            break;
+        }
+    leader->_leading = false;
+    for(size_t i = 0; i < w.size(); ++i)
+        if(w[i])
+            w[i]->_CoalescedDone(complete);
+}
+
+// ---------------------------------------------------
+// Permanent redirects
+
+#define MAX_CACHED_REDIRECT_HOPS 8
+
+RedirectCache::RedirectCache(size_t maxEntries /* = 256 */)
+    : _gen(0)
+    , _maxEntries(maxEntries)
+    , _mutex(new Mutex)
+{
+}
+
+RedirectCache::~RedirectCache()
+{
+    delete (Mutex*)_mutex;
+}
+
+bool RedirectCache::Resolve(Request& req) const
+{
+    MutexLock lock(_mutex);
+    bool changed = false;
+    // Bounded, in case the server ever redirected in a circle
+    for(unsigned i = 0; i < MAX_CACHED_REDIRECT_HOPS; ++i)
+    {
+        Store::const_iterator it = _store.find(HttpCache::MakeKey(req));
+        if(it == _store.end())
+            break;
+        SplitURI(it->second.location, req.protocol, req.host, req.resource, req.port, req.useSSL);
+        changed = true;
+    }
+    return changed;
+}
+
+void RedirectCache::Add(const Request& from, const Request& to)
+{
+    const std::string key = HttpCache::MakeKey(from);
+    MutexLock lock(_mutex);
+    Entry& e = _store[key];
+    e.location = HttpCache::MakeKey(to); // which is a full URL
+    e.gen = ++_gen;
+    _order.push(std::make_pair(key, e.gen));
+    while(_store.size() > _maxEntries && _order.size())
+    {
+        // Skip over keys that were replaced or invalidated in the meantime
+        Store::iterator it = _store.find(_order.front().first);
+        if(it != _store.end() && it->second.gen == _order.front().second)
+            _store.erase(it);
+        _order.pop();
+    }
+    if(_order.size() > 2 * _maxEntries + 16) // too much garbage from replaced entries; rebuild
+    {
+        std::queue<std::pair<std::string, unsigned long> > q;
+        for( ; _order.size(); _order.pop())
+        {
+            Store::iterator it = _store.find(_order.front().first);
+            if(it != _store.end() && it->second.gen == _order.front().second)
+                q.push(_order.front());
+        }
+        std::swap(q, _order);
+    }
+}
+
+void RedirectCache::Invalidate(const std::string& url)
+{
+    Request req;
+    if(!SplitURI(url, req.protocol, req.host, req.resource, req.port, req.useSSL))
+        return;
+    if(req.port < 0)
+        req.port = 80;
+    MutexLock lock(_mutex);
+    _store.erase(HttpCache::MakeKey(req));
+}
+
+void RedirectCache::Clear()
+{
+    MutexLock lock(_mutex);
+    _store.clear();
+    _order = std::queue<std::pair<std::string, unsigned long> >();
+}
+
+size_t RedirectCache::size() const
+{
+    MutexLock lock(_mutex);
+    return _store.size();
+}
+
+HttpSocket::HttpSocket()
+	: TcpSocket()
+	, _keep_alive(0)
+	, _remaining(0)
+	, _status(0)
+	, _inProgress(false)
+	, _chunkedTransfer(false)
+	, _mustClose(true)
+	, _followRedir(true)
+	, _alwaysHandle(false)
+	, _redirected(false)
+	, _cache(NULL)
+	, _cacheStore(NULL)
+	, _coalescer(NULL)
+	, _leading(false)
+	, _waiting(false)
+	, _redirects(NULL)
+	, _idleSince(0)
+	, _serverIdleTimeout(0)
+	, _requestsLeft(unsigned(-1))
+	, _retryPending(false)
+	, _upBody(NULL)
+	, _postBody(NULL, 0)
+	, _expectMin(0)
+	, _expectWaitMs(0)
+	, _expectUntil(0)
+	, _uploading(false)
+	, _upChunked(false)
+	, _upLast(false)
+	, _upLeft(0)
+	, _upOff(0)
+	, _upLen(0)
+{
+}
+
+HttpSocket::~HttpSocket()
+{
+    _EndCacheStore(false); // TcpSocket's destructor can't reach our _OnClose() anymore
+    if(_leading)
+        _coalescer->_Land(this, false);
+    if(_waiting)
+        _coalescer->_Leave(this);
+    // TcpSocket's destructor leaves the SocketSet, but by then it can only release its own gauges
+    _SetInProgress(false);
+    _Count(_metrics, &Metrics::queuedRequests, u64(0) - _requestQ.size());
+}
+
+void HttpSocket::_OnOpen()
+{
+    TcpSocket::_OnOpen();
+    _chunkedTransfer = false;
+    _mustClose = true;
+    _idleSince = 0;
+    _serverIdleTimeout = 0;
+    _requestsLeft = unsigned(-1);
+}
+
+void HttpSocket::_OnCloseInternal()
+{
+    if(!IsRedirecting() || _alwaysHandle)
+        _OnClose();
+}
+
+bool HttpSocket::_OnUpdate()
+{
+    if(!TcpSocket::_OnUpdate())
+        return false;
+
+    if(_uploading && !_PumpUpload())
+        return true;
+
+    if(_inProgress && !_waiting && !_chunkedTransfer && !_remaining && _status)
+        _FinishRequest();
+
+    if(_retryPending && !_inProgress)
+    {
+        _retryPending = false;
+        Request req;
+        req.swap(_curRequest);
+        if(!_EnqueueOrSend(req))
+            _DropRequest(req);
+    }
+
+    if(_idleSince && !_inProgress && _IdleExpired())
+    {
+        traceprint("HttpSocket: closing idle connection before the server drops it\n");
+        close();
+    }
+
+    //traceprint("HttpSocket::_OnUpdate, Q = %d\n", (unsigned)_requestQ.size());
+
+    // initiate transfer if queue is not empty, but the socket somehow forgot to proceed
+    if(_requestQ.size() && !_remaining && !_chunkedTransfer && !_inProgress)
+        _DequeueMore();
+
+    return true;
+}
+
+void HttpSocket::_MakeRequest(Request& req, const std::string& url, const POST *post) const
+{
+    if(post)
+        req.post = *post;
+    SplitURI(url, req.protocol, req.host, req.resource, req.port, req.useSSL);
+    if(IsRedirecting() && req.host.empty()) // if we're following a redirection to the same host, the server is likely to omit its hostname
+        req.host = _curRequest.host;
+    if(req.port < 0)
+        req.port = 80;
+}
+
+bool HttpSocket::Download(const std::string& url, const char *extraRequest /*= NULL*/, void *user /* = NULL */, const POST *post /*= NULL*/)
+{
+    Request req;
+    req.user = user;
+    _MakeRequest(req, url, post);
+    if(extraRequest)
+        req.extraGetHeaders = extraRequest;
+    return SendRequestSwap(req, false);
+}
+
+bool HttpSocket::Upload(const std::string& url, RequestBody *body, const char *extraRequest /* = NULL */, void *user /* = NULL */)
+{
+    Request req;
+    req.user = user;
+    req.body = body;
+    _MakeRequest(req, url, NULL);
+    if(extraRequest)
+        req.extraGetHeaders = extraRequest;
+    return SendRequestSwap(req, false);
+}
+
+bool HttpSocket::Fetch(const std::string& url, Request::RecvFunc recv, Request::DoneFunc done, void *user /* = NULL */, const POST *post /* = NULL */)
+{
+    Request req;
+    req.user = user;
+    req.onRecv = recv;
+    req.onDone = done;
+    _MakeRequest(req, url, post);
+    return SendRequestSwap(req, false);
+}
+
+
+bool HttpSocket::_Redirect(const std::string& loc, bool forceGET)
+{
+    traceprint("Following HTTP redirect to: %s\n", loc.c_str());
+    if(loc.empty())
+        return false;
+    tracerec(2, TRACE_REDIRECT, this, _status, 0);
+    _Count(_metrics, &Metrics::redirects);
+
+    Request req;
+    req.user = _curRequest.user;
+    req.onRecv = _curRequest.onRecv;
+    req.onDone = _curRequest.onDone;
+    req.priority = _curRequest.priority;
+    req.queuedAt = _curRequest.queuedAt; // same request, keeps its place
+    req.useSSL = _curRequest.useSSL;
+    SplitURI(loc, req.protocol, req.host, req.resource, req.port, req.useSSL);
+    if(req.protocol.empty()) // assume local resource
+    {
+        req.host = _curRequest.host;
+        req.resource = loc;
+        req.useSSL = _curRequest.useSSL;
+    }
+    if(req.host.empty())
+        req.host = _curRequest.host;
+    if(req.port < 0)
+        req.port = _curRequest.port;
+    req.extraGetHeaders = _curRequest.extraGetHeaders;
+    if(_redirects && (_status == 301 || _status == 308))
+        _redirects->Add(_curRequest, req);
+    if(!forceGET) // the old request is done with its body
+    {
+        req.post.swap(_curRequest.post);
+        if((req.body = _curRequest.body) && !req.body->rewind())
+        {
+            traceprint("Can't send the request body again, not following the redirect\n");
+            return false;
+        }
+    }
+    return SendRequestSwap(req, false);
+}
+
+bool HttpSocket::SendRequest(const std::string& what, const char *extraRequest /*= NULL*/, void *user /* = NULL */)
+{
+    Request req(_host, what, _lastport, user);
+    if(extraRequest)
+        req.extraGetHeaders = extraRequest;
+    return SendRequestSwap(req, false);
+}
+
+bool HttpSocket::QueueRequest(const std::string& what, const char *extraRequest /*= NULL*/, void *user /* = NULL */)
+{
+    Request req(_host, what, _lastport, user);
+    if(extraRequest)
+        req.extraGetHeaders = extraRequest;
+    return SendRequestSwap(req, true);
+}
+
+// Whether a block of "Name: value\r\n" lines has the given field. name in lower case.
+static bool _HasField(const std::string& fields, const char *name)
+{
+    const size_t n = strlen(name);
+    for(size_t pos = 0; pos < fields.length(); )
+    {
+        if(!STRNICMP(fields.c_str() + pos, name, n) && fields.c_str()[pos + n] == ':')
+            return true;
+        pos = fields.find('\n', pos);
+        if(pos == std::string::npos)
+            break;
+        ++pos;
+    }
+    return false;
+}
+
+bool HttpSocket::SendRequest(const Request& what, bool enqueue)
+{
+    Request req(what);
+    return SendRequestSwap(req, enqueue);
+}
+
+bool HttpSocket::SendRequestSwap(Request& req, bool enqueue)
+{
+    if(req.host.empty() || !req.port)
+        return false;
+
+    if(_redirects && _redirects->Resolve(req))
+        traceprint("Known permanent redirect, going to %s directly\n", req.resource.c_str());
+
+    const bool post = !req.post.empty() || req.body;
+    const u64 bodySize = req.body ? req.body->size() : u64(req.post.length());
+    req.expectContinue = post && _expectMin && bodySize >= _expectMin;
+
+    HttpCache::Info ci;
+    req.cacheState = CACHE_BYPASS;
+    if(_cache && !post && req.extraGetHeaders.empty())
+    {
+        req.cacheState = CACHE_MISS;
+        if(_cache->Lookup(HttpCache::MakeKey(req, _accept_encoding), ci))
+        {
+            if(ci.expires > (u64)time(NULL))
+                req.cacheState = CACHE_HIT;
+            else if(ci.etag.length() || ci.lastModified.length())
+                req.cacheState = CACHE_REVALIDATE;
+        }
+    }
+
+    // Built in place, in one allocation that the request keeps until it is sent
+    std::string& r = req.header;
+    const char *crlf = "\r\n";
+    char num[32];
+    r.clear();
+    r.reserve(256 + req.resource.length() + req.host.length() + _user_agent.length()
+        + _accept_encoding.length() + req.extraGetHeaders.length() + ci.etag.length()
+        + ci.lastModified.length() + req.post.length());
+    r += post ? "POST " : "GET ";
+    r += req.resource;
+    r += " HTTP/1.1";
+    r += crlf;
+    r += "Host: ";
+    r += req.host;
+    r += crlf;
+    if(_HasField(req.extraGetHeaders, "connection")) // the caller knows better, e.g. "Upgrade"
+        ;
+    else if(_keep_alive)
+    {
+        sprintf(num, "%u", _keep_alive);
+        r += "Connection: Keep-Alive";
+        r += crlf;
+        r += "Keep-Alive: ";
+        r += num;
+        r += crlf;
+    }
+    else
+    {
+        r += "Connection: close";
+        r += crlf;
+    }
+
+    if(_user_agent.length())
+    {
+        r += "User-Agent: ";
+        r += _user_agent;
+        r += crlf;
+    }
+
+    if(_accept_encoding.length())
+    {
+        r += "Accept-Encoding: ";
+        r += _accept_encoding;
+        r += crlf;
+    }
+
+    if(post)
+    {
+        if(bodySize == u64(-1))
+            r += "Transfer-Encoding: chunked";
+        else
+        {
+            sprintf(num, "%llu", bodySize);
+            r += "Content-Length: ";
+            r += num;
+        }
+        r += crlf;
+        r += "Content-Type: ";
+        r += req.body ? req.body->GetContentType().c_str() : "application/x-www-form-urlencoded";
+        r += crlf;
+        if(req.expectContinue)
+        {
+            r += "Expect: 100-continue";
+            r += crlf;
+        }
+    }
+
+    if(req.extraGetHeaders.length())
+    {
+        r += req.extraGetHeaders;
+        if(req.extraGetHeaders.compare(req.extraGetHeaders.length() - 2, std::string::npos, crlf))
+            r += crlf;
+    }
+
+    if(req.cacheState == CACHE_REVALIDATE)
+    {
+        if(ci.etag.length())
+        {
+            r += "If-None-Match: ";
+            r += ci.etag;
+            r += crlf;
+        }
+        if(ci.lastModified.length())
+        {
+            r += "If-Modified-Since: ";
+            r += ci.lastModified;
+            r += crlf;
+        }
+    }
+
+    r += crlf; // header terminator
+
+    // FIXME: appending this to the 'header' field is probably not a good idea
+    if(post && !req.body && !req.expectContinue)
+        r += req.post.str();
+
+    return _EnqueueOrSend(req, enqueue);
+}
+
+bool HttpSocket::_EnqueueOrSend(Request& req, bool forceQueue /* = false */)
+{
+    _Wake();
+    if(_inProgress || forceQueue) // do not send while receiving other data
+    {
+        _requestQ.push(req);
+        tracerec(3, TRACE_REQUEST_QUEUED, this, (unsigned)_requestQ.size(), 0);
+        _Count(_metrics, &Metrics::queuedRequests);
+        return true;
+    }
+    if(req.cacheState == CACHE_HIT && _ServeFromCache(req))
+        return true;
+    std::string flight;
+    if(_coalescer && req.post.empty() && !req.body && !_leading) // a retrying leader keeps its waiters
+    {
+        flight = Coalescer::_MakeKey(this, req);
+        if(_coalescer->_Join(flight, this)) // someone else is already asking; park until the response is there
+        {
+            _timings.clear();
+            _timings.start = _GetTimeUS();
+            _timings.coalesced = true;
+            _status = 0;
+            _curRequest.swap(req);
+            _waiting = true;
+            _SetInProgress(true);
+            tracerec(2, TRACE_REQUEST_START, this, (unsigned)_requestQ.size(), 0);
+            return true;
+        }
+    }
+    // ok, we can send directly
+    if(!_OpenRequest(req)) // req is still ours, and onDone wasn't called. Callers rely on that.
+    {
+        if(_leading)
+            _coalescer->_Land(this, false);
+        return false;
+    }
+    // From here on it's _curRequest. If sending fails, the socket gets closed,
+    // and closing either retries or finishes the request. Either way it was accepted: return true,
+    // onDone may already have run and freed its user data.
+    if(SendBytes(_curRequest.header.c_str(), _curRequest.header.length()))
+    {
+        RequestBody *body = _curRequest.body;
+        if(!body && _curRequest.expectContinue) // held back; goes out from the request like a streamed body
+        {
+            _postBody = MemoryBody(_curRequest.post.c_str(), _curRequest.post.length());
+            body = &_postBody;
+        }
+        if(body)
+        {
+            _upBody = body;
+            _uploading = true;
+            _upLeft = body->size();
+            _upChunked = _upLeft == u64(-1);
+            _upLast = false;
+            _upOff = _upLen = 0;
+            if(_curRequest.expectContinue)
+                _expectUntil = _GetTimeUS() + u64(_expectWaitMs) * 1000;
+            else if(!_PumpUpload())
+                return true; // closing took care of the request
+        }
+        else
+            _timings.sent = _GetTimeUS(); // with a body, _PumpUpload() sets it once the last byte is out
+        if(flight.length())
+            _coalescer->_Lead(flight, this);
+    }
+    else if(_inProgress) // didn't even get to close
+        _FinishRequest();
+    return true;
+}
+
+// called whenever a request is finished completely and the socket checks for more things to send
+void HttpSocket::_DequeueMore(void)
+{
+    _FinishRequest(); // In case this was not done yet.
+
+    // _inProgress is known to be false here
+    if(_requestQ.size()) // still have other requests queued?
+    {
+        // Either it's on its way now, or it never will be. Retrying forever won't help an unreachable host.
+        Request req;
+        _requestQ.pop(req);
+        _Count(_metrics, &Metrics::queuedRequests, u64(-1));
+        if(!_EnqueueOrSend(req, false))
+            _DropRequest(req);
+    }
+
+    // otherwise, we are done for now. socket is kept alive for future sends. Nothing to do.
+}
+
+bool HttpSocket::_OpenRequest(Request& req)
+{
+    if(_inProgress)
+    {
+        traceprint("HttpSocket::_OpenRequest(): _inProgress == true, should not be called.");
+        return false;
+    }
+    _status = 0;
+    _redirected = false;
+    _uploading = false;
+    _expectUntil = 0;
+    if(req.useSSL && !hasSSL())
+    {
+        traceprint("HttpSocket::_OpenRequest(): Is an SSL connection, but SSL was not inited, doing that now\n");
+        if(!initSSL(NULL)) // FIXME: supply cert list?
+        {
+            traceprint("FAILED to init SSL\n");
+            return false;
+        }
+    }
+    _timings.clear();
+    _timings.start = _GetTimeUS();
+    _timings.reused = true; // open() resets this if it has to connect
+    if(_idleSince && _IdleExpired()) // don't bet on a connection the server is about to drop
+        close();
+    _idleSince = 0;
+    if(!open(req.host.c_str(), req.port))
+        return false;
+    _SetInProgress(true);
+    _curRequest.swap(req);
+    tracerec(2, TRACE_REQUEST_START, this, (unsigned)_requestQ.size(), 0);
+    return true;
+}
+
+void HttpSocket::_SetInProgress(bool p)
+{
+    if(p != _inProgress)
+        _Count(_metrics, &Metrics::activeRequests, p ? 1 : u64(-1));
+    _inProgress = p;
+}
+
+#define UPLOAD_BUFSIZE (16 * 1024)
+#define UPLOAD_CHUNK_HDR 16 // room in front of the data for the chunk size line
+#define UPLOAD_PER_UPDATE (256 * 1024) // then it's the other sockets' turn. Non-blocking sockets only.
+
+bool HttpSocket::_PumpUpload()
+{
+    if(_expectUntil)
+    {
+        if(_GetTimeUS() < _expectUntil)
+            return true;
+        traceprint("HttpSocket: no 100 Continue, sending the body anyway\n");
+        _expectUntil = 0;
+    }
+    RequestBody *body = _upBody;
+    unsigned budget = UPLOAD_PER_UPDATE;
+    // A blocking socket would wait in recv() for a response to a body that isn't complete yet,
+    // so it doesn't spend its budget and sends all of it now
+    while(_uploading && budget)
+    {
+        if(_upOff == _upLen) // everything staged went out
+        {
+            if(_upLast || (!_upChunked && !_upLeft))
+            {
+                _uploading = false;
+                _timings.sent = _GetTimeUS();
+                break;
+            }
+#ifdef __linux__
+            if(!_upChunked && !hasSSL() && body->fd() >= 0)
+            {
+                const u64 allow = _Allowance(true);
+                if(allow < std::min(_upLeft, u64(RATE_QUANTUM)))
+                    break;
+                off_t pos = (off_t)body->tell();
+                const ssize_t n = sendfile((int)_s, body->fd(), &pos, (size_t)std::min(std::min(_upLeft, u64(budget)), allow));
+                if(n > 0)
+                {
+                    body->skip(n);
+                    _upLeft -= n;
+                    if(_nonblocking)
+                        budget -= std::min(budget, (unsigned)n);
+                    _Count(_metrics, &Metrics::bytesOut, n);
+                    _Consume(true, n);
+                    continue;
+                }
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if(!n || (errno != EINVAL && errno != ENOSYS)) // file ended early, or the connection broke
+                    goto fail;
+                // else sendfile() can't handle this descriptor, read() it
+            }
+#endif
+            if(_upBuf.size() < UPLOAD_BUFSIZE)
+                _upBuf.resize(UPLOAD_BUFSIZE);
+            unsigned want = UPLOAD_BUFSIZE - UPLOAD_CHUNK_HDR - 2;
+            if(!_upChunked && _upLeft < want)
+                want = (unsigned)_upLeft;
+            const int n = body->read(&_upBuf[UPLOAD_CHUNK_HDR], want);
+            if(n < 0 || (!n && !_upChunked) || n > (int)want)
+                goto fail;
+            _upOff = UPLOAD_CHUNK_HDR;
+            _upLen = UPLOAD_CHUNK_HDR + n;
+            if(!_upChunked)
+                _upLeft -= n;
+            else if(n)
+            {
+                char hdr[UPLOAD_CHUNK_HDR];
+                const unsigned h = (unsigned)sprintf(hdr, "%x\r\n", n);
+                _upOff -= h;
+                memcpy(&_upBuf[_upOff], hdr, h);
+                _upBuf[_upLen++] = '\r';
+                _upBuf[_upLen++] = '\n';
+            }
+            else
+            {
+                memcpy(&_upBuf[0], "0\r\n\r\n", 5);
+                _upOff = 0;
+                _upLen = 5;
+                _upLast = true;
+            }
+        }
+        const int sent = _SendSome(&_upBuf[_upOff], _upLen - _upOff);
+        if(sent < 0)
+            return false; // closed
+        if(!sent)
+            break;
+        _upOff += sent;
+        if(_nonblocking)
+            budget -= std::min(budget, (unsigned)sent);
+    }
+    return true;
+
+fail:
+    traceprint("HttpSocket: request body failed\n");
+    tracerec(1, TRACE_ERROR, this, MERR_SEND, 0);
+    _CountError(_metrics, MERR_SEND);
+    _uploading = false;
+    close();
+    return false;
+}
+
+bool HttpSocket::IsIdle() const
+{
+    // An idle keep-alive connection is not watched for expiry here; _OpenRequest() checks before reusing it.
+    if(!TcpSocket::IsIdle() || _uploading || _retryPending || (_requestQ.size() && !_inProgress))
+        return false;
+    return !(_inProgress && !_waiting && !_chunkedTransfer && !_remaining && _status); // about to finish
+}
+
+bool HttpSocket::_QueuedWork(long long& key) const
+{
+    if(_inProgress || !_requestQ.size())
+        return false;
+    key = _requestQ.frontKey();
+    return true;
+}
+
+bool HttpSocket::_IdleExpired() const
+{
+    if(!isOpen())
+        return false;
+    // Leave a safety margin for the request to reach the server
+    const u64 limit = _serverIdleTimeout ? _serverIdleTimeout : u64(_keep_alive) * 1000000;
+    const u64 deadline = limit > 2000000 ? limit - 1000000 : limit / 2;
+    return _GetTimeUS() - _idleSince >= deadline;
+}
+
+void HttpSocket::SetMetrics(Metrics *m)
+{
+    if(_inProgress)
+    {
+        _Count(_metrics, &Metrics::activeRequests, u64(-1));
+        _Count(m, &Metrics::activeRequests);
+    }
+    const u64 q = _requestQ.size();
+    _Count(_metrics, &Metrics::queuedRequests, u64(0) - q);
+    _Count(m, &Metrics::queuedRequests, q);
+    TcpSocket::SetMetrics(m);
+}
+
+void HttpSocket::_FinishRequest(void)
+{
+    if(_inProgress)
+    {
+        _timings.done = _GetTimeUS();
+        tracerec(2, TRACE_REQUEST_DONE, this, _status, _timings.bodyBytes);
+        _Count(_metrics, &Metrics::requests);
+        if(_status && !IsSuccess() && !IsRedirecting() && _status != 101) // 101: WebSocket upgrade
+            _CountError(_metrics, MERR_HTTP);
+        _Record(_metrics, &Metrics::firstByteTime, _timings.start, _timings.firstByte);
+        _Record(_metrics, &Metrics::requestTime, _timings.start, _timings.done);
+        _EndCacheStore(true);
+        if(_leading)
+            _coalescer->_Land(this, true);
+        // A redirect that is followed is no response of its own. One that isn't, is.
+        const bool redirected = _redirected;
+        _redirected = false;
+        if(!redirected || _alwaysHandle)
+        {
+            if(_curRequest.onDone)
+                _curRequest.onDone(this, _curRequest.user, _status != 0);
+            else
+                _OnRequestDone(); // notify about finished request
+        }
+        _SetInProgress(false);
+        _hdrs.clear();
+        if(_mustClose)
+            close();
+        else if(isOpen())
+            _idleSince = _GetTimeUS();
+    }
+}
+
+bool HttpSocket::_ServeFromCache(Request& req)
+{
+    const std::string key = HttpCache::MakeKey(req, _accept_encoding);
+    HttpCache::Info ci;
+    if(!_cache->Lookup(key, ci))
+        return false;
+
+    _timings.clear();
+    _timings.start = _GetTimeUS();
+    _timings.fromCache = true;
+    _curRequest.swap(req);
+    _SetInProgress(true);
+    _status = HTTP_OK;
+    _contentLen = ci.size;
+    _remaining = 0;
+    _chunkedTransfer = false;
+    if(ci.etag.length())
+        _hdrs.add("etag", ci.etag);
+    if(ci.lastModified.length())
+        _hdrs.add("last-modified", ci.lastModified);
+    if(ci.contentType.length())
+        _hdrs.add("content-type", ci.contentType);
+    tracerec(2, TRACE_REQUEST_START, this, (unsigned)_requestQ.size(), 0);
+
+    if(!_cache->Replay(key, _ReplayCB, this) && !_timings.bodyBytes)
+    {
+        // Entry is gone; nothing was delivered yet, so just pretend this never happened
+        _SetInProgress(false);
+        _status = 0;
+        _hdrs.clear();
+        _curRequest.swap(req);
+        return false;
+    }
+    _FinishRequest();
+    return true;
+}
+
+void HttpSocket::_ReplayCB(void *ctx, const void *buf, unsigned size)
+{
+    ((HttpSocket*)ctx)->_OnRecvInternal((void*)buf, size);
+}
+
+// Whether a response with this Vary field can be cached under a key from MakeKey(), i.e. it only names Accept-Encoding
+static bool _VaryKeyed(const char *vary)
+{
+    for(const char *p = vary; *p; )
+    {
+        while(*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        const char *e = p;
+        while(*e && *e != ',')
+            ++e;
+        const char *t = e;
+        while(t > p && (t[-1] == ' ' || t[-1] == '\t'))
+            --t;
+        if(t > p && (t - p != 15 || STRNICMP(p, "accept-encoding", 15))) // includes "*"
+            return false;
+        p = e;
+    }
+    return true;
+}
+
+void HttpSocket::_CacheResponse()
+{
+    const std::string key = HttpCache::MakeKey(_curRequest, _accept_encoding);
+    HttpCache::Info ci;
+    bool store = true;
+    u64 maxAge = 0;
+    if(const char *cc = Hdr("cache-control"))
+    {
+        std::string c = cc;
+        strToLower(c);
+        if(c.find("no-store") != std::string::npos)
+            store = false;
+        size_t ma = c.find("max-age=");
+        if(ma != std::string::npos && c.find("no-cache") == std::string::npos)
+            maxAge = _ParseU64(c.c_str() + ma + 8, 10);
+    }
+    if(const char *v = Hdr("vary"))
+        if(!_VaryKeyed(v))
+            store = false; // depends on request fields the key doesn't have
+    ci.expires = (u64)time(NULL) + maxAge;
+    if(const char *h = Hdr("etag"))
+        ci.etag = h;
+    if(const char *h = Hdr("last-modified"))
+        ci.lastModified = h;
+    if(const char *h = Hdr("content-type"))
+        ci.contentType = h;
+    ci.size = _contentLen;
+
+    if(_status == 304)
+    {
+        HttpCache::Info old;
+        if(_curRequest.cacheState != CACHE_REVALIDATE || !_cache->Lookup(key, old))
+            return; // Not our conditional request, leave it to the user
+
+        // Unchanged. Update freshness and validators, then present the cached body as a normal response.
+        old.expires = ci.expires;
+        if(ci.etag.length())
+            old.etag = ci.etag;
+        if(ci.lastModified.length())
+            old.lastModified = ci.lastModified;
+        _cache->Refresh(key, old);
+
+        _status = HTTP_OK;
+        _contentLen = old.size;
+        if(old.etag.length())
+            _hdrs.add("etag", old.etag);
+        if(old.lastModified.length())
+            _hdrs.add("last-modified", old.lastModified);
+        if(old.contentType.length())
+            _hdrs.add("content-type", old.contentType);
+        _timings.fromCache = true;
+        if(!_cache->Replay(key, _ReplayCB, this) && !_timings.bodyBytes)
+        {
+            // The body is gone, or isn't the one the entry was made with. All there is left is the 304.
+            _cache->Remove(key);
+            _status = 304;
+            _contentLen = 0;
+            _timings.fromCache = false;
+        }
+        return;
+    }
+
+    if(!store)
+    {
+        _cache->Remove(key);
+        return;
+    }
+    if(_status != HTTP_OK || (!maxAge && ci.etag.empty() && ci.lastModified.empty()))
+        return; // could never be reused
+
+    _cacheStore = _cache->BeginStore(key, ci);
+}
+
+void HttpSocket::_EndCacheStore(bool commit)
+{
+    if(_cacheStore)
+    {
+        _cache->EndStore(_cacheStore, commit);
+        _cacheStore = NULL;
+    }
+}
+
+void HttpSocket::_AbortRequest(void)
+{
+    if(_inProgress)
+    {
+        tracerec(1, TRACE_ERROR, this, MERR_TRUNCATED, _remaining);
+        _CountError(_metrics, MERR_TRUNCATED);
+        _EndCacheStore(false);
+        if(_leading)
+            _coalescer->_Land(this, false);
+        _remaining = 0;
+        _chunkedTransfer = false;
+        _redirected = false;
+        _SetInProgress(false);
+        if(_curRequest.onDone)
+            _curRequest.onDone(this, _curRequest.user, false);
+        _hdrs.clear();
+    }
+}
+
+void HttpSocket::_DropRequest(const Request& req)
+{
+    traceprint("HttpSocket: could not send request for %s, dropping it\n", req.resource.c_str());
+    if(req.onDone)
+        req.onDone(this, req.user, false);
+}
+
+void HttpSocket::_CoalescedHeaders(const HttpSocket *leader)
+{
+    const bool mustClose = _mustClose; // our own connection is not involved
+    _status = leader->_status;
+    _hdrs = leader->_hdrs;
+    _timings.firstByte = _timings.headerDone = _GetTimeUS();
+    _HandleStatus(); // follows redirects on its own
+    _mustClose = mustClose;
+    // A 304 answered from the leader's cache has a different length than its header fields say
+    _contentLen = leader->_contentLen;
+    _remaining = leader->_remaining;
+    _chunkedTransfer = leader->_chunkedTransfer;
+}
+
+void HttpSocket::_CoalescedBody(const void *buf, unsigned size)
+{
+    _remaining -= size < _remaining ? size : _remaining;
+    _OnRecvInternal((void*)buf, size);
+}
+
+void HttpSocket::_CoalescedDone(bool complete)
+{
+    _waiting = false;
+    _remaining = 0;
+    _chunkedTransfer = false;
+    if(complete)
+    {
+        _Count(_metrics, &Metrics::coalesced);
+        _FinishRequest();
+    }
+    else
+        _AbortRequest();
+    _Wake(); // may have more queued
+}
+
+void HttpSocket::_ProcessChunk(void)
+{
+    if(!_chunkedTransfer)
+        return;
+
+    u64 chunksize = u64(-1);
+
+    while(true)
+    {
+        // less data required until chunk end than received, means the new chunk starts somewhere in the middle
+        // of the received data block. finish this chunk first.
+        if(_remaining)
+        {
+            // _remaining includes the trailing CRLF, which must not be delivered
+            const u64 payload = _remaining > 2 ? _remaining - 2 : 0;
+            if(_remaining <= _recvSize) // it contains the rest of the chunk, including CRLF
+            {
+                _OnRecvInternal(_readptr, (unsigned)payload); // implicitly skip CRLF
+                _readptr += _remaining;
+                _recvSize -= (unsigned)_remaining;
+                _remaining = 0; // done with this one.
+                if(!chunksize) // and if chunksize was 0, we are done with all chunks.
+                    break;
+            }
+            else // buffer did not yet arrive completely
+            {
+                _OnRecvInternal(_readptr, payload < _recvSize ? (unsigned)payload : _recvSize);
+                _remaining -= _recvSize;
+                _recvSize = 0; // done with the whole buffer, but not with the chunk
+                return; // nothing else to do here
+            }
+        }
+
+        // each chunk identifier ends with CRLF.
+        // if we don't find that, we hit the corner case that the chunk identifier was not fully received.
+        // in that case, adjust the buffer and wait for the rest of the data to be appended
+        char *term = strstr(_readptr, "\r\n");
+        if(!term)
+        {
+            if(_recvSize) // if there is still something queued, move it to the left of the buffer and append on next read
+                _ShiftBuffer();
+            return;
+        }
+        term += 2; // skip CRLF
+
+        // when we are here, the (next) chunk header was completely received.
+        chunksize = _ParseU64(_readptr, 16);
+        tracerec(3, TRACE_CHUNK, this, 0, chunksize);
+        _remaining = chunksize + 2; // the http protocol specifies that each chunk has a trailing CRLF
+        _recvSize -= (term - _readptr);
+        _readptr = term;
+    }
+
+    if(!chunksize) // this was the last chunk, no further data expected unless requested
+    {
+        _chunkedTransfer = false;
+        if(_recvSize)
+            traceprint("_ProcessChunk: There are %u bytes left in the buffer, huh?\n", _recvSize);
+        if(_mustClose) // same as for a plain body; closing after _DequeueMore() would kill the next request
+            close();
+        else
+            _DequeueMore();
+    }
+}
+
+void HttpSocket::_ParseHeaderFields(const char *s, size_t size)
+{
+    // Key: Value data\r\n
+
+    const char * const maxs = s + size;
+    while(s < maxs)
+    {
+        while(isspace(*s))
+        {
+            ++s;
+            if(s >= maxs)
+                return;
+        }
+        const char * const colon = strchr(s, ':');
+        if(!colon)
+            return;
+        const char *valEnd = strchr(colon, '\n'); // last char of val data
+        if(!valEnd)
+            return;
+        while(valEnd[-1] == '\n' || valEnd[-1] == '\r') // skip backwards if necessary
+            --valEnd;
+        const char *val = colon + 1; // value starts after ':' ...
+        while(isspace(*val) && val < valEnd) // skip spaces after the colon
+            ++val;
+        _hdrs.add(s, colon - s, val, valEnd - val);
+        tracerec(3, TRACE_HEADER_FIELD, this, unsigned(valEnd - val), _TraceStr(s, colon - s));
+        s = valEnd;
+    }
+}
+
+char *HeaderFields::_Alloc(size_t n)
+{
+    if(_used + n > _buf.size())
+    {
+        size_t cap = _buf.size() ? _buf.size() * 2 : 1024;
+        if(cap < _used + n)
+            cap = _used + n;
+        _buf.resize(cap);
+    }
+    char *p = &_buf[_used];
+    _used += n;
+    return p;
+}
+
+void HeaderFields::add(const char *key, size_t keylen, const char *val, size_t vallen)
+{
+    Field f;
+    f.key = _used;
+    char *p = _Alloc(keylen + vallen + 2);
+    for(size_t i = 0; i < keylen; ++i)
+        p[i] = tolower((unsigned char)key[i]);
+    p[keylen] = 0;
+    f.val = f.key + keylen + 1;
+    memcpy(p + keylen + 1, val, vallen);
+    p[keylen + 1 + vallen] = 0;
+    _fields.push_back(f);
+}
+
+void HeaderFields::swap(HeaderFields& o)
+{
+    _buf.swap(o._buf);
+    std::swap(_used, o._used);
+    _fields.swap(o._fields);
+}
+
+void HeaderFields::add(const char *key, const std::string& val)
+{
+    add(key, strlen(key), val.c_str(), val.length());
+}
+
+const char *HeaderFields::get(const char *key) const
+{
+    for(size_t i = _fields.size(); i--; ) // later fields override earlier ones
+        if(!strcmp(&_buf[_fields[i].key], key))
+            return &_buf[_fields[i].val];
+    return NULL;
+}
+
+const char *HttpSocket::Hdr(const char *h) const
+{
+    return _hdrs.get(h);
+}
+
+
+bool HttpSocket::_HandleStatus()
+{
+    _remaining = _contentLen = _ParseU64(Hdr("content-length"), 10);
+
+    const char *encoding = Hdr("transfer-encoding");
+    _chunkedTransfer = encoding && !STRNICMP(encoding, "chunked", 7);
+
+    const char *conn = Hdr("connection"); // if its not keep-alive, server will close it, so we can too
+    _mustClose = !conn || STRNICMP(conn, "keep-alive", 10);
+
+    // Every response uses up one of the requests the server allows on this connection. Most servers say
+    // how many are left each time; for those that don't, count down from what was said last.
+    const char *ka = Hdr("keep-alive"); // e.g. "timeout=5, max=100"
+    if(const char *t = ka ? strstr(ka, "timeout=") : NULL)
+        _serverIdleTimeout = _ParseU64(t + 8, 10) * 1000000;
+    if(const char *m = ka ? strstr(ka, "max=") : NULL)
+        _requestsLeft = (unsigned)_ParseU64(m + 4, 10);
+    else if(_requestsLeft && _requestsLeft != unsigned(-1))
+        --_requestsLeft;
+    if(!_requestsLeft)
+        _mustClose = true;
+
+    // These never have a body, no matter what the header fields say
+    if((_status >= 100 && _status <= 199) || _status == 204 || _status == 304)
+    {
+        _remaining = 0;
+        _chunkedTransfer = false;
+    }
+
+    // As per the spec, we also need to handle 1xx codes, but are free to ignore them
+    const bool success = IsSuccess() || (_status >= 100 && _status <= 199);
+
+    if(!(_chunkedTransfer || _contentLen) && success)
+        traceprint("_ParseHeader: Not chunked transfer and content-length==0, this will go fail\n");
+
+    tracerec(2, TRACE_STATUS, this, _status, _contentLen);
+
+    if(success)
+        return true;
+
+    bool forceGET = false;
+    switch(_status)
+    {
+        case 303:
+            forceGET = true; // As per spec, continue with a GET request
+        case 301:
+        case 302:
+        case 307:
+        case 308:
+            if(_followRedir)
+                if(const char *loc = Hdr("location"))
+                    _redirected = _Redirect(loc, forceGET);
+            return false;
+
+        default:
+            return false;
+    }
+}
+
+bool HttpSocket::IsRedirecting() const
+{
+    switch(_status)
+    {
+        case 301:
+        case 302:
+        case 303:
+        case 307:
+        case 308:
+            return true;
+    }
+    return false;
+}
+
+bool HttpSocket::IsSuccess() const
+{
+    const unsigned s = _status;
+    return s >= 200 && s <= 206;
+}
+
+
+
+void HttpSocket::_ParseHeader(void)
+{
+    const size_t prev = _tmpHdr.length();
+    _tmpHdr += _inbuf;
+    size_t skip = 0; // interim responses already dealt with
+    const char *hptr, *hdrend;
+    for(;;)
+    {
+        hptr = _tmpHdr.c_str() + skip;
+        const size_t have = _tmpHdr.length() - skip;
+
+        if(have >= 5 && memcmp("HTTP/", hptr, 5))
+        {
+            traceprint("_ParseHeader: not HTTP stream\n");
+            return;
+        }
+
+        hdrend = strstr(hptr, "\r\n\r\n");
+        if(!hdrend)
+        {
+            traceprint("_ParseHeader: could not find end-of-header marker, or incomplete buf; delaying.\n");
+            _tmpHdr.erase(0, skip);
+            return;
+        }
+
+        const char *sp = strchr(hptr + 5, ' ');
+        const unsigned status = sp ? atoi(sp + 1) : 0;
+        if(status < 100 || status > 199 || status == 101)
+            break;
+
+        // Interim response; the real one follows. 100 is the go-ahead for a held back body.
+        tracerec(3, TRACE_STATUS, this, status, 0);
+        if(status == 100 && _expectUntil)
+        {
+            traceprint("HttpSocket: 100 Continue, sending the body\n");
+            _expectUntil = 0;
+        }
+        skip = hdrend + 4 - _tmpHdr.c_str();
+    }
+
+    //traceprint(hptr);
+    // The end of the header is in this read, but the double newline may have started in the one before
+    const size_t bodyAt = hdrend + 4 - _tmpHdr.c_str() - prev;
+
+    hptr = strchr(hptr + 5, ' '); // skip "HTTP/", already known
+    if(!hptr)
+        return; // WTF?
+    ++hptr; // number behind first space is the status code
+    _status = atoi(hptr);
+    _timings.headerDone = _GetTimeUS();
+
+    // Default values
+    _chunkedTransfer = false;
+    _contentLen = 0; // yet unknown
+
+    hptr = strstr(hptr, "\r\n");
+    _ParseHeaderFields(hptr + 2, hdrend - hptr);
+
+    // FIXME: return value indicates success.
+    // Bail out on non-success, or at least make it so that _OnRecv() is not called.
+    // (Unless an override bool is given that even non-successful answers get their data delivered!)
+    _HandleStatus();
+
+    if(_uploading && _status >= 200) // answered before the body was complete, so the connection can't be reused
+    {
+        if(_expectUntil)
+            traceprint("HttpSocket: got %u instead of 100 Continue, not sending the body\n", _status);
+        _uploading = false;
+        _expectUntil = 0;
+        _mustClose = true;
+    }
+
+    if(_cache && _curRequest.cacheState != CACHE_BYPASS)
+        _CacheResponse();
+
+    if(_leading)
+        _coalescer->_Headers(this);
+
+    // get ready
+    _readptr = _inbuf + bodyAt; // skip the header part
+    _recvSize -= unsigned(bodyAt);
+    _tmpHdr.clear();
+}
+
+// generic http header parsing
+void HttpSocket::_OnData(void)
+{
+    if(_inProgress && !_timings.firstByte)
+        _timings.firstByte = _GetTimeUS();
+
+    if(!(_chunkedTransfer || (_remaining && _recvSize)))
+        _ParseHeader();
+
+    if(_chunkedTransfer)
+    {
+        _ProcessChunk(); // first, try to finish one or more chunks
+    }
+    else if(_remaining && _recvSize) // something remaining? if so, we got a header earlier, but not all data
+    {
+        unsigned n = _recvSize;
+        if(n > _remaining)
+        {
+            traceprint("_OnRecv: got %u bytes more than announced, dropping\n", unsigned(n - _remaining));
+            n = (unsigned)_remaining;
+        }
+        _remaining -= n;
+        _OnRecvInternal(_readptr, n);
+
+        if(!_remaining) // received last block?
+        {
+            if(_mustClose)
+                close();
+            else
+                _DequeueMore();
+        }
+
+        // nothing else to do here.
+    }
+
+    // otherwise, the server sent just the header, with the data following in the next packet
+}
+
+void HttpSocket::_OnClose()
+{
+    if(_waiting)
+        return; // Only an idle keep-alive connection went away, the current request doesn't use it
+    _idleSince = 0;
+    _uploading = false;
+    _expectUntil = 0;
+    // A reused connection that dies before anything came back was most likely closed by the server
+    // while idle. Safe to send an idempotent request once more; a fresh connection won't get here again.
+    if(_inProgress && !_status && _timings.reused && !_timings.wireBytes && _curRequest.post.empty() && !_curRequest.body)
+    {
+        traceprint("HttpSocket: stale keep-alive connection, retrying request\n");
+        _SetInProgress(false);
+        _retryPending = true;
+        return;
+    }
+    if(!ExpectMoreData())
+        _FinishRequest();
+    else // Connection dropped in the middle of a response. Don't wait forever for the rest.
+        _AbortRequest();
+}
+
+void HttpSocket::_OnRecvInternal(void *buf, unsigned int size)
+{
+    if(_leading)
+        _coalescer->_Body(this, buf, size);
+    if(IsSuccess() || _alwaysHandle)
+    {
+        if(_cacheStore)
+            _cache->Append(_cacheStore, buf, size);
+        _timings.bodyBytes += size;
+        if(_curRequest.onRecv)
+            _curRequest.onRecv(this, _curRequest.user, buf, size);
+        else
+            _OnRecv(buf, size);
+    }
+}
+
+#endif
+
+// ===========================
+// ===== HTTP/2 ==============
+// ===========================
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_HTTP2)
+
+// ---- HPACK (RFC 7541) -----
+
+static const char * const s_hpackStatic[61][2] =
+{
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+    { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+    { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+    { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" }, { "accept-language", "" }, { "accept-ranges", "" },
+    { "accept", "" }, { "access-control-allow-origin", "" }, { "age", "" },
+    { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" },
+    { "content-length", "" }, { "content-location", "" }, { "content-range", "" },
+    { "content-type", "" }, { "cookie", "" }, { "date", "" },
+    { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" },
+    { "if-modified-since", "" }, { "if-none-match", "" }, { "if-range", "" },
+    { "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" },
+    { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" },
+    { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+    { "set-cookie", "" }, { "strict-transport-security", "" }, { "transfer-encoding", "" },
+    { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" }
+};
+
+// Huffman code (RFC 7541 Appendix B), for encoding
+static const unsigned s_huffCode[256] =
+{
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+static const unsigned char s_huffLen[256] =
+{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+// The code is canonical, so decoding only needs the number of codes of each length,
+// and the symbols in code order (like zlib's puff.c). 256 is EOS.
+static const unsigned char s_huffCount[31] =
+{
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const unsigned short s_huffSym[257] =
+{
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256
+};
+
+static void _HpackInt(std::string& out, unsigned char flags, unsigned prefix, u64 v)
+{
+    const unsigned max = (1u << prefix) - 1;
+    if(v < max)
+    {
+        out += char(flags | v);
+        return;
+    }
+    out += char(flags | max);
+    v -= max;
+    for( ; v >= 128; v >>= 7)
+        out += char(0x80 | (v & 0x7f));
+    out += char(v);
+}
+
+static bool _HpackReadInt(const unsigned char *& p, const unsigned char *end, unsigned prefix, u64& v)
+{
+    if(p >= end)
+        return false;
+    const unsigned max = (1u << prefix) - 1;
+    v = *p++ & max;
+    if(v < max)
+        return true;
+    for(unsigned shift = 0; p < end && shift < 56; shift += 7)
+    {
+        const unsigned char b = *p++;
+        v += u64(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool _HuffDecode(const unsigned char *p, size_t n, std::string& out)
+{
+    unsigned code = 0, first = 0, index = 0, len = 0; // of the symbol being read
+    bool ones = true; // padding must be the most significant bits of EOS
+    for(size_t i = 0; i < n; ++i)
+        for(int b = 7; b >= 0; --b)
+        {
+            const unsigned bit = (p[i] >> b) & 1;
+            code |= bit;
+            ones = ones && bit;
+            const unsigned count = s_huffCount[++len];
+            if(code < first + count)
+            {
+                const unsigned sym = s_huffSym[index + code - first];
+                if(sym == 256)
+                    return false; // EOS must not appear in the string
+                out += char(sym);
+                code = first = index = len = 0;
+                ones = true;
+                continue;
+            }
+            if(len == 30)
+                return false;
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    return len <= 7 && ones;
+}
+
+static size_t _HuffSize(const char *s, size_t n)
+{
+    u64 bits = 0;
+    for(size_t i = 0; i < n; ++i)
+        bits += s_huffLen[(unsigned char)s[i]];
+    return size_t((bits + 7) / 8);
+}
+
+static void _HuffEncode(const char *s, size_t n, std::string& out)
+{
+    u64 acc = 0;
+    unsigned bits = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        const unsigned char c = s[i];
+        acc = (acc << s_huffLen[c]) | s_huffCode[c];
+        bits += s_huffLen[c];
+        for( ; bits >= 8; bits -= 8)
+            out += char(acc >> (bits - 8));
+        acc &= (1u << bits) - 1;
+    }
+    if(bits) // pad with the start of EOS
+        out += char((acc << (8 - bits)) | (0xff >> bits));
+}
+
+static bool _HpackReadString(const unsigned char *& p, const unsigned char *end, std::string& s)
+{
+    if(p >= end)
+        return false;
+    const bool huff = !!(*p & 0x80);
+    u64 n;
+    if(!_HpackReadInt(p, end, 7, n) || n > u64(end - p))
+        return false;
+    s.clear();
+    if(huff)
+    {
+        if(!_HuffDecode(p, (size_t)n, s))
+            return false;
+    }
+    else
+        s.assign((const char*)p, (size_t)n);
+    p += n;
+    return true;
+}
+
+static void _HpackString(std::string& out, const char *s, size_t n)
+{
+    const size_t h = _HuffSize(s, n);
+    if(h < n)
+    {
+        _HpackInt(out, 0x80, 7, h);
+        _HuffEncode(s, n, out);
+    }
+    else
+    {
+        _HpackInt(out, 0, 7, n);
+        out.append(s, n);
+    }
+}
+
+// Encodes one field. Names must be lower case. Uses the static table, but never adds to the dynamic table,
+// so there is no encoder state to keep in sync with the server.
+static void _HpackField(std::string& out, const char *name, size_t namelen, const char *value, size_t vallen)
+{
+    unsigned nameIdx = 0;
+    for(unsigned i = 0; i < 61; ++i)
+    {
+        const char *n = s_hpackStatic[i][0];
+        if(strncmp(n, name, namelen) || n[namelen])
+            continue;
+        if(!nameIdx)
+            nameIdx = i + 1;
+        const char *v = s_hpackStatic[i][1];
+        if(!strncmp(v, value, vallen) && !v[vallen])
+        {
+            _HpackInt(out, 0x80, 7, i + 1); // indexed
+            return;
+        }
+    }
+    const bool sensitive = nameIdx == 23 || nameIdx == 32 || nameIdx == 49; // authorization, cookie, proxy-authorization
+    _HpackInt(out, sensitive ? 0x10 : 0x00, 4, nameIdx); // literal, not indexed
+    if(!nameIdx)
+        _HpackString(out, name, namelen);
+    _HpackString(out, value, vallen);
+}
+
+static inline void _HpackField(std::string& out, const char *name, const std::string& value)
+{
+    _HpackField(out, name, strlen(name), value.c_str(), value.length());
+}
+
+// Decoding side, one per connection
+class HpackDecoder
+{
+public:
+    enum { TABLE_SIZE = 4096 }; // SETTINGS_HEADER_TABLE_SIZE, left at the default
+
+    HpackDecoder() : _size(0), _max(TABLE_SIZE) {}
+    // Adds the fields of one header block to hdrs, except pseudo fields; :status goes to status.
+    bool decode(const unsigned char *p, size_t n, HeaderFields& hdrs, unsigned& status);
+
+private:
+    typedef std::pair<std::string, std::string> Entry;
+    bool _Get(u64 idx, std::string& name, std::string *value) const;
+    void _Insert(const std::string& name, const std::string& value);
+    void _Evict(size_t max);
+
+    std::deque<Entry> _table; // newest first
+    size_t _size, _max;
+};
+
+bool HpackDecoder::_Get(u64 idx, std::string& name, std::string *value) const
+{
+    if(!idx)
+        return false;
+    if(idx <= 61)
+    {
+        name = s_hpackStatic[idx - 1][0];
+        if(value)
+            *value = s_hpackStatic[idx - 1][1];
+        return true;
+    }
+    idx -= 62;
+    if(idx >= _table.size())
+        return false;
+    const Entry& e = _table[(size_t)idx];
+    name = e.first;
+    if(value)
+        *value = e.second;
+    return true;
+}
+
+void HpackDecoder::_Evict(size_t max)
+{
+    while(_size > max)
+    {
+        const Entry& e = _table.back();
+        _size -= e.first.length() + e.second.length() + 32;
+        _table.pop_back();
+    }
+}
+
+void HpackDecoder::_Insert(const std::string& name, const std::string& value)
+{
+    const size_t sz = name.length() + value.length() + 32;
+    _Evict(sz <= _max ? _max - sz : 0);
+    if(sz > _max)
+        return; // doesn't fit at all, the table is just emptied
+    _table.push_front(Entry(name, value));
+    _size += sz;
+}
+
+bool HpackDecoder::decode(const unsigned char *p, size_t n, HeaderFields& hdrs, unsigned& status)
+{
+    const unsigned char * const end = p + n;
+    std::string name, value;
+    bool fields = false;
+    while(p < end)
+    {
+        const unsigned char b = *p;
+        u64 idx;
+        if(b & 0x80) // indexed field
+        {
+            if(!_HpackReadInt(p, end, 7, idx) || !_Get(idx, name, &value))
+                return false;
+        }
+        else if((b & 0xe0) == 0x20) // dynamic table size update, only before the first field
+        {
+            if(fields || !_HpackReadInt(p, end, 5, idx) || idx > TABLE_SIZE)
+                return false;
+            _max = (size_t)idx;
+            _Evict(_max);
+            continue;
+        }
+        else // literal, with incremental indexing if 01xxxxxx
+        {
+            const bool index = (b & 0xc0) == 0x40;
+            if(!_HpackReadInt(p, end, index ? 6 : 4, idx))
+                return false;
+            if(idx ? !_Get(idx, name, NULL) : !_HpackReadString(p, end, name))
+                return false;
+            if(!_HpackReadString(p, end, value))
+                return false;
+            if(index)
+                _Insert(name, value);
+        }
+        fields = true;
+        if(name.empty())
+            return false;
+        if(name[0] != ':')
+            hdrs.add(name.c_str(), name.length(), value.c_str(), value.length());
+        else if(name == ":status")
+            status = atoi(value.c_str());
+    }
+    return true;
+}
+
+// ---- Framing -----
+
+enum
+{
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+enum
+{
+    H2F_END_STREAM = 0x1,
+    H2F_ACK = 0x1,
+    H2F_END_HEADERS = 0x4,
+    H2F_PADDED = 0x8,
+    H2F_PRIORITY = 0x20
+};
+
+enum
+{
+    H2E_NO_ERROR = 0x0,
+    H2E_PROTOCOL = 0x1,
+    H2E_FLOW_CONTROL = 0x3,
+    H2E_FRAME_SIZE = 0x6,
+    H2E_REFUSED_STREAM = 0x7,
+    H2E_CANCEL = 0x8,
+    H2E_COMPRESSION = 0x9
+};
+
+enum
+{
+    H2S_HEADER_TABLE_SIZE = 0x1,
+    H2S_ENABLE_PUSH = 0x2,
+    H2S_MAX_CONCURRENT_STREAMS = 0x3,
+    H2S_INITIAL_WINDOW_SIZE = 0x4,
+    H2S_MAX_FRAME_SIZE = 0x5
+};
+
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_FRAME 16384 // what we accept, the default
+#define H2_STREAM_WINDOW (1 << 20) // per stream receive window we announce
+#define H2_CONN_WINDOW (16 << 20) // connection receive window
+#define H2_OUT_LIMIT (256 * 1024) // stop reading request bodies while this much is waiting to be sent
+
+static const char *s_alpnH2[] = { "h2", NULL };
+
+static inline unsigned _Get32(const unsigned char *p)
+{
+    return (unsigned(p[0]) << 24) | (unsigned(p[1]) << 16) | (unsigned(p[2]) << 8) | p[3];
+}
+
+static inline void _Put32(unsigned char *p, unsigned v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+struct Http2Socket::Stream
+{
+    Stream() : id(0), status(0), sendWindow(0), recvUnacked(0), body(NULL), bodyLeft(0), postBody(NULL, 0), headersEnd(0) {}
+
+    Request req;
+    HeaderFields hdrs;
+    RequestTimings timings;
+    unsigned id;
+    unsigned status; // 0 until the response header block arrived
+    long long sendWindow;
+    unsigned recvUnacked;
+    RequestBody *body; // still to be sent; NULL once our side of the stream is closed
+    u64 bodyLeft; // u64(-1) if unknown
+    MemoryBody postBody; // req.post
+    size_t headersEnd; // end of the header block in _out; timings.sent is set once _Flush() got past it
+};
+
+Http2Socket::Http2Socket()
+    : _originPort(0)
+    , _originSSL(false)
+    , _outOff(0)
+    , _hpack(new HpackDecoder)
+    , _hblockStream(0)
+    , _hblockFlags(0)
+    , _nextId(1)
+    , _maxStreams(100)
+    , _peerMaxStreams(100)
+    , _peerMaxFrame(H2_MAX_FRAME)
+    , _peerWindow(H2_DEFAULT_WINDOW)
+    , _sendWindow(H2_DEFAULT_WINDOW)
+    , _recvUnacked(0)
+    , _draining(false)
+{
+    SetBufsizeIn(64 * 1024); // must hold a whole frame
+}
+
+Http2Socket::~Http2Socket()
+{
+    // Too late for callbacks, just let go
+    _Count(_metrics, &Metrics::activeRequests, u64(0) - _streams.size());
+    for(size_t i = 0; i < _streams.size(); ++i)
+        delete _streams[i];
+    _streams.clear();
+    delete (HpackDecoder*)_hpack;
+}
+
+void Http2Socket::SetMetrics(Metrics *m)
+{
+    const u64 n = _streams.size();
+    _Count(_metrics, &Metrics::activeRequests, u64(0) - n);
+    _Count(m, &Metrics::activeRequests, n);
+    HttpSocket::SetMetrics(m);
+}
+
+bool Http2Socket::IsIdle() const
+{
+    if(!TcpSocket::IsIdle() || _outOff < _out.size() || (_draining && _streams.empty()))
+        return false;
+    if(_requestQ.size() && !_draining && _streams.size() < std::min(_maxStreams, _peerMaxStreams))
+        return false;
+    if(_sendWindow > 0) // bodies that may go out; the others wait for WINDOW_UPDATE, which is incoming data
+        for(size_t i = 0; i < _streams.size(); ++i)
+            if(_streams[i]->body && _streams[i]->sendWindow > 0)
+                return false;
+    return true;
+}
+
+bool Http2Socket::SendRequestSwap(Request& req, bool /* enqueue */)
+{
+    if(req.host.empty() || !req.port)
+        return false;
+    if(_origin.empty())
+    {
+        _origin = req.host;
+        _originPort = req.port;
+        _originSSL = req.useSSL;
+    }
+    else if(req.host != _origin || req.port != _originPort || req.useSSL != _originSSL)
+    {
+        traceprint("Http2Socket: %s:%d is not the origin of this connection\n", req.host.c_str(), req.port);
+        return false;
+    }
+    _requestQ.push(req);
+    tracerec(3, TRACE_REQUEST_QUEUED, this, (unsigned)_requestQ.size(), 0);
+    _Count(_metrics, &Metrics::queuedRequests);
+    if(isOpen())
+    {
+        _StartStreams();
+        _Flush();
+    }
+    _Wake();
+    return true;
+}
+
+void Http2Socket::_ResetConnection()
+{
+    delete (HpackDecoder*)_hpack;
+    _hpack = new HpackDecoder;
+    _out.clear();
+    _outOff = 0;
+    _hblock.clear();
+    _hblockStream = 0;
+    _nextId = 1;
+    _peerMaxStreams = 100; // unlimited until the server's SETTINGS arrive, but let's not go overboard
+    _peerMaxFrame = H2_MAX_FRAME;
+    _peerWindow = H2_DEFAULT_WINDOW;
+    _sendWindow = H2_DEFAULT_WINDOW;
+    _recvUnacked = 0;
+    _draining = false;
+}
+
+bool Http2Socket::_Connect()
+{
+    _ResetConnection();
+    if(_originSSL)
+    {
+        _alpn = s_alpnH2;
+        if(!initSSL(NULL))
+            return false;
+    }
+    if(!open(_origin.c_str(), _originPort))
+        return false;
+    if(_originSSL)
+    {
+        const char *proto = GetALPN();
+        if(!proto || strcmp(proto, "h2"))
+        {
+            traceprint("Http2Socket: %s doesn't speak HTTP/2 (ALPN: %s)\n", _origin.c_str(), proto ? proto : "none");
+            tracerec(1, TRACE_ERROR, this, MERR_PROTOCOL, 0);
+            _CountError(_metrics, MERR_PROTOCOL);
+            close();
+            return false;
+        }
+    }
+
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    _out.insert(_out.end(), preface, preface + sizeof(preface) - 1);
+    unsigned char settings[12];
+    settings[0] = 0; settings[1] = H2S_ENABLE_PUSH;
+    _Put32(settings + 2, 0);
+    settings[6] = 0; settings[7] = H2S_INITIAL_WINDOW_SIZE;
+    _Put32(settings + 8, H2_STREAM_WINDOW);
+    _Frame(H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    _WindowUpdate(0, H2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+    return true;
+}
+
+bool Http2Socket::_OnUpdate()
+{
+    if(!TcpSocket::_OnUpdate())
+        return false;
+
+    if(!isOpen())
+    {
+        if(!_requestQ.size())
+            return true;
+        if(!_Connect())
+        {
+            // Nothing to wait for; same as HttpSocket when it can't open a connection
+            while(_requestQ.size())
+            {
+                Request req;
+                _requestQ.pop(req);
+                _Count(_metrics, &Metrics::queuedRequests, u64(-1));
+                _DropRequest(req);
+            }
+            return true;
+        }
+    }
+
+    if(_draining && _streams.empty())
+    {
+        traceprint("Http2Socket: connection drained, closing\n");
+        close(); // queued requests go out on a new one
+        return true;
+    }
+
+    _StartStreams();
+    _PumpBodies();
+    _Flush();
+    return true;
+}
+
+void Http2Socket::_Frame(unsigned type, unsigned flags, unsigned id, const void *payload, unsigned len)
+{
+    unsigned char h[9];
+    h[0] = (unsigned char)(len >> 16);
+    h[1] = (unsigned char)(len >> 8);
+    h[2] = (unsigned char)len;
+    h[3] = (unsigned char)type;
+    h[4] = (unsigned char)flags;
+    _Put32(h + 5, id & 0x7fffffff);
+    _out.insert(_out.end(), (const char*)h, (const char*)h + 9);
+    if(len)
+        _out.insert(_out.end(), (const char*)payload, (const char*)payload + len);
+}
+
+void Http2Socket::_WindowUpdate(unsigned id, unsigned n)
+{
+    unsigned char p[4];
+    _Put32(p, n);
+    _Frame(H2_WINDOW_UPDATE, 0, id, p, 4);
+}
+
+bool Http2Socket::_Flush()
+{
+    while(_outOff < _out.size())
+    {
+        const int n = _SendSome(&_out[_outOff], unsigned(std::min(_out.size() - _outOff, size_t(1 << 20))));
+        if(n < 0)
+            return false; // closed
+        if(!n)
+            break;
+        _outOff += n;
+    }
+
+    const bool all = _outOff == _out.size();
+    const bool compact = !all && _outOff > 64 * 1024 && _outOff * 2 > _out.size(); // don't let the sent part pile up
+    u64 now = 0;
+    for(size_t i = 0; i < _streams.size(); ++i)
+    {
+        Stream *s = _streams[i];
+        if(s->timings.sent)
+            continue;
+        if(s->headersEnd <= _outOff)
+            s->timings.sent = now ? now : (now = _GetTimeUS());
+        else if(compact)
+            s->headersEnd -= _outOff;
+    }
+    if(all)
+    {
+        _out.clear(); // keeps the memory
+        _outOff = 0;
+    }
+    else if(compact)
+    {
+        _out.erase(_out.begin(), _out.begin() + _outOff);
+        _outOff = 0;
+    }
+    return true;
+}
+
+bool Http2Socket::_ConnError(unsigned code)
+{
+    traceprint("Http2Socket: connection error %u\n", code);
+    tracerec(1, TRACE_ERROR, this, MERR_PROTOCOL, code);
+    _CountError(_metrics, MERR_PROTOCOL);
+    unsigned char p[8];
+    _Put32(p, 0); // we never accept streams from the server
+    _Put32(p + 4, code);
+    _Frame(H2_GOAWAY, 0, 0, p, 8);
+    _Flush();
+    close();
+    return false;
+}
+
+Http2Socket::Stream *Http2Socket::_Find(unsigned id) const
+{
+    for(size_t i = 0; i < _streams.size(); ++i)
+        if(_streams[i]->id == id)
+            return _streams[i];
+    return NULL;
+}
+
+void Http2Socket::_Remove(Stream *s)
+{
+    std::vector<Stream*>::iterator it = std::find(_streams.begin(), _streams.end(), s);
+    if(it != _streams.end())
+        _streams.erase(it);
+}
+
+void Http2Socket::_Requeue(Stream *s)
+{
+    s->body = NULL;
+    if(s->req.body && !s->req.body->rewind())
+    {
+        _Finish(s, false); // part of it may be gone already
+        return;
+    }
+    traceprint("Http2Socket: stream %u was not processed, queueing %s again\n", s->id, s->req.resource.c_str());
+    _requestQ.push(s->req);
+    _Count(_metrics, &Metrics::queuedRequests);
+    _Count(_metrics, &Metrics::activeRequests, u64(-1));
+    delete s;
+}
+
+void Http2Socket::_Swap(Stream *s)
+{
+    _curRequest.swap(s->req);
+    std::swap(_status, s->status);
+    _hdrs.swap(s->hdrs);
+    std::swap(_timings, s->timings);
+}
+
+void Http2Socket::_Deliver(Stream *s, const void *buf, unsigned size)
+{
+    if(!(s->status >= 200 && s->status <= 206) && !_alwaysHandle)
+        return;
+    s->timings.bodyBytes += size;
+    _Swap(s);
+    if(_curRequest.onRecv)
+        _curRequest.onRecv(this, _curRequest.user, buf, size);
+    else
+        _OnRecv((void*)buf, size);
+    _Swap(s);
+}
+
+void Http2Socket::_Finish(Stream *s, bool complete)
+{
+    if(s->body && isOpen()) // response is complete, but our side is not. Don't bother sending the rest.
+    {
+        unsigned char p[4];
+        _Put32(p, H2E_CANCEL);
+        _Frame(H2_RST_STREAM, 0, s->id, p, 4);
+    }
+    RequestTimings& t = s->timings;
+    t.done = _GetTimeUS();
+    tracerec(2, TRACE_REQUEST_DONE, this, s->status, t.bodyBytes);
+    _Count(_metrics, &Metrics::activeRequests, u64(-1));
+    _Count(_metrics, &Metrics::requests);
+    if(!complete)
+    {
+        tracerec(1, TRACE_ERROR, this, MERR_TRUNCATED, s->id);
+        _CountError(_metrics, MERR_TRUNCATED);
+    }
+    else if(!(s->status >= 200 && s->status <= 206) && !(s->status >= 301 && s->status <= 308))
+        _CountError(_metrics, MERR_HTTP);
+    _Record(_metrics, &Metrics::firstByteTime, t.start, t.firstByte);
+    _Record(_metrics, &Metrics::requestTime, t.start, t.done);
+
+    _Swap(s);
+    if(_curRequest.onDone)
+        _curRequest.onDone(this, _curRequest.user, complete);
+    else
+        _OnRequestDone();
+    _Swap(s);
+    delete s;
+}
+
+bool Http2Socket::_QueuedWork(long long& key) const
+{
+    if(!_requestQ.size() || _draining || _streams.size() >= std::min(_maxStreams, _peerMaxStreams))
+        return false;
+    key = _requestQ.frontKey();
+    return true;
+}
+
+void Http2Socket::_StartStreams()
+{
+    while(_requestQ.size() && !_draining && _streams.size() < std::min(_maxStreams, _peerMaxStreams) && isOpen())
+    {
+        if(_nextId > 0x7fffffff)
+        {
+            _draining = true; // out of ids, need a new connection
+            break;
+        }
+        Stream *s = new Stream;
+        _requestQ.pop(s->req);
+        _Count(_metrics, &Metrics::queuedRequests, u64(-1));
+        _Count(_metrics, &Metrics::activeRequests);
+        s->id = _nextId;
+        _nextId += 2;
+        s->timings = _timings; // connection phases
+        s->timings.start = _GetTimeUS();
+        s->timings.reused = s->id > 1;
+        s->timings.sent = s->timings.firstByte = s->timings.headerDone = s->timings.done = 0;
+        s->timings.wireBytes = s->timings.bodyBytes = 0;
+        s->sendWindow = _peerWindow;
+        if(s->req.body)
+            s->body = s->req.body;
+        else if(!s->req.post.empty())
+        {
+            s->postBody = MemoryBody(s->req.post.c_str(), s->req.post.length());
+            s->body = &s->postBody;
+        }
+        s->bodyLeft = s->body ? s->body->size() : 0;
+        _streams.push_back(s);
+        tracerec(2, TRACE_REQUEST_START, this, (unsigned)_requestQ.size(), s->id);
+        _SendHeaders(s);
+    }
+}
+
+void Http2Socket::_SendHeaders(Stream *s)
+{
+    const Request& req = s->req;
+    const bool post = !!s->body;
+    std::string& b = _hpackOut;
+    b.clear();
+    _HpackField(b, ":method", post ? "POST" : "GET");
+    _HpackField(b, ":scheme", _originSSL ? "https" : "http");
+    std::string authority = req.host;
+    if(req.port != (_originSSL ? 443 : 80))
+    {
+        char num[16];
+        sprintf(num, ":%d", req.port);
+        authority += num;
+    }
+    _HpackField(b, ":authority", authority);
+    _HpackField(b, ":path", req.resource);
+    if(_user_agent.length())
+        _HpackField(b, "user-agent", _user_agent);
+    if(_accept_encoding.length())
+        _HpackField(b, "accept-encoding", _accept_encoding);
+    if(post)
+    {
+        _HpackField(b, "content-type", req.body ? req.body->GetContentType() : std::string("application/x-www-form-urlencoded"));
+        if(s->bodyLeft != u64(-1))
+        {
+            char num[32];
+            sprintf(num, "%llu", s->bodyLeft);
+            _HpackField(b, "content-length", num);
+        }
+        if(!s->bodyLeft)
+            s->body = NULL; // nothing to send after all
+    }
+
+    // "Name: value" lines; names go lower case, and fields that only make sense for HTTP/1.1 are dropped
+    const char *p = req.extraGetHeaders.c_str();
+    std::string name;
+    while(*p)
+    {
+        const char *eol = strstr(p, "\r\n");
+        if(!eol)
+            eol = p + strlen(p);
+        const char *colon = (const char*)memchr(p, ':', eol - p);
+        if(colon && colon > p)
+        {
+            name.assign(p, colon - p);
+            for(size_t i = 0; i < name.length(); ++i)
+                name[i] = (char)tolower((unsigned char)name[i]);
+            const char *v = colon + 1;
+            while(v < eol && (*v == ' ' || *v == '\t'))
+                ++v;
+            if(name != "connection" && name != "keep-alive" && name != "proxy-connection" && name != "transfer-encoding"
+                && name != "upgrade" && name != "host" && name != "te")
+                _HpackField(b, name.c_str(), name.length(), v, eol - v);
+        }
+        p = *eol ? eol + 2 : eol;
+    }
+
+    // HEADERS, then CONTINUATION for whatever doesn't fit into one frame
+    size_t off = 0;
+    unsigned type = H2_HEADERS;
+    do
+    {
+        const unsigned n = (unsigned)std::min(b.length() - off, size_t(_peerMaxFrame));
+        unsigned flags = off + n == b.length() ? H2F_END_HEADERS : 0;
+        if(type == H2_HEADERS && !s->body)
+            flags |= H2F_END_STREAM;
+        _Frame(type, flags, s->id, b.data() + off, n);
+        off += n;
+        type = H2_CONTINUATION;
+    }
+    while(off < b.length());
+    s->headersEnd = _out.size();
+}
+
+void Http2Socket::_PumpBodies()
+{
+    // One frame per stream and round, so that all bodies make progress
+    bool more = true;
+    while(more && _sendWindow > 0 && _out.size() - _outOff < H2_OUT_LIMIT && isOpen())
+    {
+        more = false;
+        for(size_t i = 0; i < _streams.size(); ++i)
+        {
+            Stream *s = _streams[i];
+            if(!s->body || s->sendWindow <= 0 || _sendWindow <= 0)
+                continue;
+            u64 n = std::min<long long>(std::min<long long>(s->sendWindow, _sendWindow), _peerMaxFrame);
+            if(s->bodyLeft < n)
+                n = s->bodyLeft;
+            const size_t at = _out.size();
+            _out.resize(at + 9 + (size_t)n);
+            const int r = s->body->read(&_out[at + 9], (unsigned)n);
+            if(r < 0 || u64(r) > n || (!r && s->bodyLeft != u64(-1)))
+            {
+                traceprint("Http2Socket: request body of stream %u failed\n", s->id);
+                _out.resize(at);
+                _CountError(_metrics, MERR_SEND);
+                _streams.erase(_streams.begin() + i--);
+                _Finish(s, false);
+                continue;
+            }
+            _out.resize(at + 9 + r);
+            unsigned flags = 0;
+            if(s->bodyLeft != u64(-1))
+                s->bodyLeft -= r;
+            if(!s->bodyLeft || !r)
+            {
+                flags = H2F_END_STREAM;
+                s->body = NULL;
+            }
+            else
+                more = true;
+            unsigned char *h = (unsigned char*)&_out[at];
+            h[0] = (unsigned char)(r >> 16);
+            h[1] = (unsigned char)(r >> 8);
+            h[2] = (unsigned char)r;
+            h[3] = H2_DATA;
+            h[4] = (unsigned char)flags;
+            _Put32(h + 5, s->id);
+            s->sendWindow -= r;
+            _sendWindow -= r;
+        }
+    }
+}
+
+void Http2Socket::_OnData()
+{
+    const unsigned char *p = (const unsigned char*)_readptr;
+    unsigned left = _recvSize;
+    while(left >= 9)
+    {
+        const unsigned len = (unsigned(p[0]) << 16) | (unsigned(p[1]) << 8) | p[2];
+        if(len > H2_MAX_FRAME || len + 9 >= _inbufSize)
+        {
+            _ConnError(H2E_FRAME_SIZE);
+            return;
+        }
+        if(left < 9 + len)
+            break;
+        if(!_OnFrame(p[3], p[4], _Get32(p + 5) & 0x7fffffff, p + 9, len))
+            return; // closed
+        p += 9 + len;
+        left -= 9 + len;
+    }
+    _readptr = (char*)p;
+    _recvSize = left;
+    if(left)
+        _ShiftBuffer(); // keep the partial frame
+
+    _StartStreams();
+    _PumpBodies();
+    _Flush();
+}
+
+bool Http2Socket::_OnFrame(unsigned type, unsigned flags, unsigned id, const unsigned char *p, unsigned len)
+{
+    if(_hblockStream && type != H2_CONTINUATION)
+        return _ConnError(H2E_PROTOCOL); // header blocks must not be interrupted
+
+    switch(type)
+    {
+        case H2_DATA:
+        {
+            if(!id)
+                return _ConnError(H2E_PROTOCOL);
+            const unsigned total = len; // padding counts for flow control, too
+            if(flags & H2F_PADDED)
+            {
+                if(!len || p[0] >= len)
+                    return _ConnError(H2E_PROTOCOL);
+                len -= 1 + p[0];
+                ++p;
+            }
+            _recvUnacked += total;
+            if(_recvUnacked >= H2_CONN_WINDOW / 2)
+            {
+                _WindowUpdate(0, _recvUnacked);
+                _recvUnacked = 0;
+            }
+            Stream *s = _Find(id);
+            if(!s)
+                return true; // one we gave up on
+            if(!s->status)
+            {
+                _Remove(s);
+                _Finish(s, false); // data before the header block
+                return isOpen();
+            }
+            s->timings.wireBytes += total;
+            if(len)
+            {
+                _Deliver(s, p, len);
+                if(!isOpen())
+                    return false;
+            }
+            if(flags & H2F_END_STREAM)
+            {
+                _Remove(s);
+                _Finish(s, true);
+                return isOpen();
+            }
+            s->recvUnacked += total;
+            if(s->recvUnacked >= H2_STREAM_WINDOW / 2)
+            {
+                _WindowUpdate(id, s->recvUnacked);
+                s->recvUnacked = 0;
+            }
+            return true;
+        }
+
+        case H2_HEADERS:
+        {
+            if(!id)
+                return _ConnError(H2E_PROTOCOL);
+            unsigned skip = 0, pad = 0;
+            if(flags & H2F_PADDED)
+            {
+                if(!len)
+                    return _ConnError(H2E_PROTOCOL);
+                pad = p[0];
+                skip = 1;
+            }
+            if(flags & H2F_PRIORITY)
+                skip += 5;
+            if(skip + pad > len)
+                return _ConnError(H2E_PROTOCOL);
+            _hblock.assign((const char*)p + skip, len - skip - pad);
+            _hblockStream = id;
+            _hblockFlags = flags;
+            return (flags & H2F_END_HEADERS) ? _OnHeaderBlock() : true;
+        }
+
+        case H2_CONTINUATION:
+            if(!_hblockStream || id != _hblockStream)
+                return _ConnError(H2E_PROTOCOL);
+            _hblock.append((const char*)p, len);
+            return (flags & H2F_END_HEADERS) ? _OnHeaderBlock() : true;
+
+        case H2_RST_STREAM:
+        {
+            if(len != 4)
+                return _ConnError(H2E_FRAME_SIZE);
+            Stream *s = _Find(id);
+            if(!s)
+                return true;
+            const unsigned code = _Get32(p);
+            traceprint("Http2Socket: stream %u reset by server, error %u\n", id, code);
+            _Remove(s);
+            s->body = NULL; // nothing more to send on it
+            if(code == H2E_REFUSED_STREAM)
+                _Requeue(s);
+            else
+                _Finish(s, false);
+            return isOpen();
+        }
+
+        case H2_SETTINGS:
+        {
+            if(id)
+                return _ConnError(H2E_PROTOCOL);
+            if(flags & H2F_ACK)
+                return len ? _ConnError(H2E_FRAME_SIZE) : true;
+            if(len % 6)
+                return _ConnError(H2E_FRAME_SIZE);
+            for( ; len; p += 6, len -= 6)
+            {
+                const unsigned v = _Get32(p + 2);
+                switch((p[0] << 8) | p[1])
+                {
+                    case H2S_MAX_CONCURRENT_STREAMS:
+                        _peerMaxStreams = v;
+                        break;
+                    case H2S_INITIAL_WINDOW_SIZE:
+                        if(v > 0x7fffffff)
+                            return _ConnError(H2E_FLOW_CONTROL);
+                        for(size_t i = 0; i < _streams.size(); ++i) // applies to open streams, too
+                            _streams[i]->sendWindow += (long long)v - _peerWindow;
+                        _peerWindow = v;
+                        break;
+                    case H2S_MAX_FRAME_SIZE:
+                        if(v < 16384 || v > 16777215)
+                            return _ConnError(H2E_PROTOCOL);
+                        _peerMaxFrame = v;
+                        break;
+                    // The header table size only matters to an encoder that indexes, and we don't
+                }
+            }
+            _Frame(H2_SETTINGS, H2F_ACK, 0, NULL, 0);
+            return true;
+        }
+
+        case H2_PUSH_PROMISE: // we said no
+            return _ConnError(H2E_PROTOCOL);
+
+        case H2_PING:
+            if(len != 8 || id)
+                return _ConnError(H2E_FRAME_SIZE);
+            if(!(flags & H2F_ACK))
+                _Frame(H2_PING, H2F_ACK, 0, p, 8);
+            return true;
+
+        case H2_GOAWAY:
+        {
+            if(len < 8 || id)
+                return _ConnError(H2E_FRAME_SIZE);
+            const unsigned last = _Get32(p) & 0x7fffffff;
+            traceprint("Http2Socket: GOAWAY, error %u, last stream %u\n", _Get32(p + 4), last);
+            _draining = true;
+            for(size_t i = _streams.size(); i--; )
+                if(_streams[i]->id > last)
+                {
+                    Stream *s = _streams[i];
+                    _streams.erase(_streams.begin() + i);
+                    _Requeue(s);
+                }
+            return true;
+        }
+
+        case H2_WINDOW_UPDATE:
+        {
+            if(len != 4)
+                return _ConnError(H2E_FRAME_SIZE);
+            const unsigned inc = _Get32(p) & 0x7fffffff;
+            if(!id)
+            {
+                if(!inc || _sendWindow + inc > 0x7fffffff)
+                    return _ConnError(!inc ? H2E_PROTOCOL : H2E_FLOW_CONTROL);
+                _sendWindow += inc;
+            }
+            else if(Stream *s = _Find(id))
+            {
+                if(!inc || s->sendWindow + inc > 0x7fffffff)
+                {
+                    _Remove(s);
+                    _Finish(s, false); // resets the stream
+                    return isOpen();
+                }
+                s->sendWindow += inc;
+            }
+            return true;
+        }
+    }
+    return true; // PRIORITY and unknown frame types are ignored
+}
+
+bool Http2Socket::_OnHeaderBlock()
+{
+    const unsigned id = _hblockStream;
+    _hblockStream = 0;
+    Stream *s = _Find(id);
+    HeaderFields& hdrs = s ? s->hdrs : _hscratch; // decode anyway, it changes the table
+    _hscratch.clear();
+    unsigned status = 0;
+    if(!((HpackDecoder*)_hpack)->decode((const unsigned char*)_hblock.data(), _hblock.length(), hdrs, status))
+        return _ConnError(H2E_COMPRESSION);
+    if(!s)
+        return true;
+
+    if(!s->status) // response header block; anything later are trailers
+    {
+        if(status >= 100 && status <= 199) // interim, the real one follows
+        {
+            hdrs.clear();
+            return true;
+        }
+        if(!status)
+        {
+            traceprint("Http2Socket: response without :status on stream %u\n", id);
+            _Remove(s);
+            _Finish(s, false);
+            return isOpen();
+        }
+        s->status = status;
+        s->timings.firstByte = s->timings.headerDone = _GetTimeUS();
+        tracerec(2, TRACE_STATUS, this, status, _ParseU64(hdrs.get("content-length"), 10));
+    }
+    if(_hblockFlags & H2F_END_STREAM)
+    {
+        _Remove(s);
+        _Finish(s, true);
+        return isOpen();
+    }
+    return true;
+}
+
+void Http2Socket::_OnClose()
+{
+    std::vector<Stream*> streams;
+    streams.swap(_streams);
+    for(size_t i = 0; i < streams.size(); ++i)
+    {
+        streams[i]->body = NULL;
+        _Finish(streams[i], false);
+    }
+    _out.clear();
+    _outOff = 0;
+}
+
+#endif // MINIHTTP_SUPPORT_HTTP2
+
+// ===========================
+// ===== WEBSOCKET ===========
+// ===========================
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_WEBSOCKET)
+
+enum WSOpcode
+{
+    WS_CONTINUATION = 0,
+    WS_TEXT = 1,
+    WS_BINARY = 2,
+    WS_CLOSE = 8,
+    WS_PING = 9,
+    WS_PONG = 10
+};
+
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_TOO_BIG 1009
+#define WS_CLOSE_NONE 1005 // close frame without a code
+#define WS_CLOSE_ABNORMAL 1006 // no close frame at all
+
+static const char s_wsGUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static inline unsigned _Rol(unsigned x, unsigned n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+// Only ever sees the handshake key, so no need to be fast
+static void _SHA1(const char *data, size_t len, unsigned char out[20])
+{
+    unsigned h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    std::string m(data, len);
+    m += '\x80';
+    while(m.length() % 64 != 56)
+        m += '\0';
+    const u64 bits = u64(len) * 8;
+    for(int i = 56; i >= 0; i -= 8)
+        m += char(bits >> i);
+
+    for(size_t off = 0; off < m.length(); off += 64)
+    {
+        const unsigned char *p = (const unsigned char*)m.data() + off;
+        unsigned w[80];
+        for(unsigned i = 0; i < 16; ++i)
+            w[i] = (unsigned(p[4*i]) << 24) | (unsigned(p[4*i+1]) << 16) | (unsigned(p[4*i+2]) << 8) | p[4*i+3];
+        for(unsigned i = 16; i < 80; ++i)
+            w[i] = _Rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+        unsigned a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(unsigned i = 0; i < 80; ++i)
+        {
+            unsigned f, k;
+            if(i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if(i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if(i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else            { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            const unsigned t = _Rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = _Rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for(unsigned i = 0; i < 20; ++i)
+        out[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+static void _Base64(const unsigned char *p, size_t n, std::string& out)
+{
+    static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for(size_t i = 0; i < n; i += 3)
+    {
+        const unsigned v = (unsigned(p[i]) << 16)
+            | (i + 1 < n ? unsigned(p[i + 1]) << 8 : 0)
+            | (i + 2 < n ? unsigned(p[i + 2]) : 0);
+        out += tab[v >> 18];
+        out += tab[(v >> 12) & 63];
+        out += i + 1 < n ? tab[(v >> 6) & 63] : '=';
+        out += i + 2 < n ? tab[v & 63] : '=';
+    }
+}
+
+// Whether the comma-separated list has the token, ignoring case
+static bool _HasToken(const char *list, const char *token)
+{
+    const size_t n = strlen(token);
+    for(const char *p = list; *p; )
+    {
+        while(*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        const char *e = p;
+        while(*e && *e != ',')
+            ++e;
+        const char *t = e;
+        while(t > p && (t[-1] == ' ' || t[-1] == '\t'))
+            --t;
+        if(size_t(t - p) == n && !STRNICMP(p, token, n))
+            return true;
+        p = e;
+    }
+    return false;
+}
+
+// out[i] = in[i] ^ key[i % 4], a word at a time
+static void _WSMask(char *out, const char *in, size_t len, const unsigned char key[4])
+{
+    unsigned k;
+    memcpy(&k, key, 4);
+    size_t i = 0;
+    for( ; i + 4 <= len; i += 4)
+    {
+        unsigned w;
+        memcpy(&w, in + i, 4);
+        w ^= k;
+        memcpy(out + i, &w, 4);
+    }
+    for( ; i < len; ++i)
+        out[i] = in[i] ^ key[i & 3];
+}
+
+WebSocket::WebSocket()
+    : _wsOutOff(0)
+    , _frameLeft(0)
+    , _maxMessage(16 << 20)
+    , _closeBy(0)
+    , _rng((_GetTimeUS() ^ (u64(size_t(this)) * 0x9E3779B97F4A7C15ULL)) | 1)
+    , _msgOp(0)
+    , _closeCode(0)
+    , _frameFin(false)
+    , _wsOpen(false)
+    , _closeSent(false)
+    , _closeRecv(false)
+{
+    SetBufsizeIn(64 * 1024); // frames up to this size are handed over in place
+}
+
+// Mask keys and the handshake nonce only have to be unpredictable for intermediaries, not cryptographically strong
+unsigned WebSocket::_Random()
+{
+    _rng ^= _rng >> 12;
+    _rng ^= _rng << 25;
+    _rng ^= _rng >> 27;
+    return unsigned((_rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+bool WebSocket::IsIdle() const
+{
+    if(!_wsOpen)
+        return HttpSocket::IsIdle();
+    return TcpSocket::IsIdle() && _wsOutOff == _wsOut.size() && !_closeBy && !_closeRecv;
+}
+
+bool WebSocket::Connect(const std::string& url, const char *protocols /* = NULL */, const char *extraRequest /* = NULL */)
+{
+    if(_wsOpen || _inProgress)
+        return false;
+
+    std::string u = url;
+    if(!u.compare(0, 5, "ws://"))
+        u.replace(0, 2, "http");
+    else if(!u.compare(0, 6, "wss://"))
+        u.replace(0, 3, "https");
+    Request req;
+    _MakeRequest(req, u, NULL);
+    req.onDone = _HandshakeDone;
+
+    unsigned char nonce[16];
+    for(unsigned i = 0; i < sizeof(nonce); i += 4)
+    {
+        const unsigned r = _Random();
+        memcpy(nonce + i, &r, 4);
+    }
+    _key.clear();
+    _Base64(nonce, sizeof(nonce), _key);
+    _offered = protocols ? protocols : "";
+    _protocol.clear();
+
+    std::string& h = req.extraGetHeaders;
+    h = "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: ";
+    h += _key;
+    h += "\r\n";
+    if(_offered.length())
+    {
+        h += "Sec-WebSocket-Protocol: ";
+        h += _offered;
+        h += "\r\n";
+    }
+    if(extraRequest)
+        h += extraRequest;
+    return SendRequestSwap(req, false);
+}
+
+void WebSocket::_HandshakeDone(HttpSocket *s, void * /* user */, bool /* complete */)
+{
+    WebSocket *ws = static_cast<WebSocket*>(s);
+    ws->_OnHandshake(ws->_wsOpen);
+}
+
+bool WebSocket::_CheckHandshake()
+{
+    std::string expect;
+    unsigned char digest[20];
+    const std::string k = _key + s_wsGUID;
+    _SHA1(k.c_str(), k.length(), digest);
+    _Base64(digest, sizeof(digest), expect);
+
+    const char *upgrade = Hdr("upgrade");
+    const char *conn = Hdr("connection");
+    const char *accept = Hdr("sec-websocket-accept");
+    if(!upgrade || !_HasToken(upgrade, "websocket") || !conn || !_HasToken(conn, "upgrade") || !accept || expect != accept)
+    {
+        traceprint("WebSocket: server sent 101, but not a valid WebSocket handshake\n");
+        return false;
+    }
+    if(Hdr("sec-websocket-extensions")) // none offered
+    {
+        traceprint("WebSocket: server wants an extension we didn't offer\n");
+        return false;
+    }
+    if(const char *proto = Hdr("sec-websocket-protocol"))
+    {
+        if(!_HasToken(_offered.c_str(), proto))
+        {
+            traceprint("WebSocket: server picked subprotocol '%s' that we didn't offer\n", proto);
+            return false;
+        }
+        _protocol = proto;
+    }
+    return true;
+}
+
+void WebSocket::_OnData()
+{
+    if(_wsOpen)
+    {
+        _ParseFrames();
+        return;
+    }
+
+    HttpSocket::_OnData();
+    if(!_inProgress || _status != 101)
+        return;
+
+    // Switching protocols. Finish the handshake request, but keep the connection.
+    _wsOpen = _CheckHandshake();
+    if(!_wsOpen)
+    {
+        tracerec(1, TRACE_ERROR, this, MERR_PROTOCOL, 0);
+        _CountError(_metrics, MERR_PROTOCOL);
+    }
+    _mustClose = !_wsOpen;
+    _msg.clear();
+    _msgOp = 0;
+    _frameLeft = 0;
+    _closeCode = 0;
+    _closeSent = _closeRecv = false;
+    _closeBy = 0;
+    _FinishRequest(); // _OnHandshake() comes from here
+    _idleSince = 0; // not idle in the HTTP sense
+    if(_wsOpen && isOpen() && _recvSize) // frames that came right behind the response
+        _ParseFrames();
+}
+
+bool WebSocket::_OnUpdate()
+{
+    if(!_wsOpen)
+        return HttpSocket::_OnUpdate();
+    if(!TcpSocket::_OnUpdate())
+        return false;
+
+    if(!_Flush())
+        return true;
+    if(_closeRecv && _wsOutOff == _wsOut.size()) // our answer to the close frame is out
+        close();
+    else if(_closeBy && _GetTimeUS() >= _closeBy)
+    {
+        traceprint("WebSocket: server didn't finish the closing handshake, closing anyway\n");
+        close();
+    }
+    return true;
+}
+
+void WebSocket::_ParseFrames()
+{
+    char *p = _readptr;
+    unsigned left = _recvSize;
+
+    if(_frameLeft) // more of a frame that is bigger than the buffer
+    {
+        const unsigned n = unsigned(std::min<u64>(left, _frameLeft));
+        _msg.append(p, n);
+        p += n;
+        left -= n;
+        _frameLeft -= n;
+        if(!_frameLeft && _frameFin)
+        {
+            _OnMessageDone();
+            if(!isOpen())
+                return;
+        }
+    }
+
+    while(left >= 2 && !_closeRecv)
+    {
+        const unsigned char *h = (const unsigned char*)p;
+        const unsigned op = h[0] & 0x0f;
+        const bool fin = !!(h[0] & 0x80);
+        u64 len = h[1] & 0x7f;
+        unsigned hl = 2;
+        if(len == 126)
+        {
+            if(left < 4)
+                break;
+            len = (unsigned(h[2]) << 8) | h[3];
+            hl = 4;
+        }
+        else if(len == 127)
+        {
+            if(left < 10)
+                break;
+            len = 0;
+            for(unsigned i = 2; i < 10; ++i)
+                len = (len << 8) | h[i];
+            hl = 10;
+        }
+
+        // No extensions, so no reserved bits. Servers never mask. Control frames are small and never fragmented.
+        if((h[0] & 0x70) || (h[1] & 0x80) || (op > WS_BINARY && op < WS_CLOSE) || op > WS_PONG
+            || (op >= WS_CLOSE && (!fin || len > 125))
+            || (op == WS_CONTINUATION && !_msgOp) || ((op == WS_TEXT || op == WS_BINARY) && _msgOp))
+        {
+            traceprint("WebSocket: invalid frame (%02x %02x)\n", h[0], h[1]);
+            _Fail(WS_CLOSE_PROTOCOL);
+            return;
+        }
+        if(op < WS_CLOSE && len + (op == WS_CONTINUATION ? _msg.size() : 0) > _maxMessage)
+        {
+            traceprint("WebSocket: message too big\n");
+            _Fail(WS_CLOSE_TOO_BIG);
+            return;
+        }
+
+        if(left - hl >= len)
+        {
+            if(!_OnFrame(op, fin, p + hl, size_t(len)))
+                return;
+            p += hl + unsigned(len);
+            left -= hl + unsigned(len);
+            continue;
+        }
+        if(hl + len < _inbufSize) // the rest will fit, wait for it
+            break;
+
+        // Too big for the buffer; collect the payload as it comes
+        if(op != WS_CONTINUATION)
+        {
+            _msg.clear();
+            _msgOp = op;
+        }
+        _frameFin = fin;
+        _msg.reserve(_msg.size() + size_t(len));
+        _msg.append(p + hl, left - hl);
+        _frameLeft = len - (left - hl);
+        left = 0;
+    }
+
+    _readptr = p;
+    _recvSize = left;
+    if(left)
+        _ShiftBuffer(); // keep the partial frame
+    _Flush();
+}
+
+bool WebSocket::_OnFrame(unsigned op, bool fin, const char *p, size_t len)
+{
+    switch(op)
+    {
+        case WS_CONTINUATION:
+            _msg.append(p, len);
+            if(fin)
+                _OnMessageDone();
+            break;
+
+        case WS_TEXT:
+        case WS_BINARY:
+            if(fin) // all in one piece, hand it over in place
+                _OnMessage(p, len, op == WS_TEXT);
+            else
+            {
+                _msgOp = op;
+                _msg.assign(p, len);
+            }
+            break;
+
+        case WS_CLOSE:
+            if(len == 1)
+            {
+                _Fail(WS_CLOSE_PROTOCOL);
+                return false;
+            }
+            _closeCode = len ? (unsigned((unsigned char)p[0]) << 8) | (unsigned char)p[1] : WS_CLOSE_NONE;
+            if(len > 2)
+                _closeReason.assign(p + 2, len - 2);
+            traceprint("WebSocket: server is closing (%u)\n", _closeCode);
+            _closeRecv = true;
+            if(!_closeSent) // echo the code
+            {
+                _closeSent = true;
+                _SendFrame(WS_CLOSE, p, len ? 2 : 0);
+            }
+            if(_Flush() && _wsOutOff == _wsOut.size())
+                close();
+            else if(!_closeBy)
+                _closeBy = _GetTimeUS() + 1000000;
+            return false;
+
+        case WS_PING:
+            _SendFrame(WS_PONG, p, len);
+            break;
+
+        case WS_PONG:
+            _OnPong(p, unsigned(len));
+            break;
+    }
+    return isOpen() && !_closeRecv;
+}
+
+void WebSocket::_OnMessageDone()
+{
+    const unsigned op = _msgOp;
+    _msgOp = 0;
+    _OnMessage(_msg.data(), _msg.size(), op == WS_TEXT);
+    _msg.clear(); // keeps the memory for the next one
+}
+
+bool WebSocket::_SendFrame(unsigned op, const void *buf, size_t len)
+{
+    unsigned char h[14];
+    unsigned hl = 2;
+    h[0] = (unsigned char)(0x80 | op); // we never fragment
+    if(len < 126)
+        h[1] = (unsigned char)(0x80 | len);
+    else if(len < 65536)
+    {
+        h[1] = 0x80 | 126;
+        h[2] = (unsigned char)(len >> 8);
+        h[3] = (unsigned char)len;
+        hl = 4;
+    }
+    else
+    {
+        h[1] = 0x80 | 127;
+        for(unsigned i = 0; i < 8; ++i)
+            h[2 + i] = (unsigned char)(u64(len) >> (56 - 8 * i));
+        hl = 10;
+    }
+    const unsigned key = _Random();
+    memcpy(h + hl, &key, 4);
+    hl += 4;
+
+    // Masking has to copy anyway, so the payload goes straight into the send buffer
+    const size_t at = _wsOut.size();
+    _wsOut.resize(at + hl + len);
+    memcpy(&_wsOut[at], h, hl);
+    if(len)
+        _WSMask(&_wsOut[at + hl], (const char*)buf, len, h + hl - 4);
+
+    if(!_Flush())
+        return false;
+    if(_wsOutOff < _wsOut.size())
+        _Wake();
+    return true;
+}
+
+bool WebSocket::_Flush()
+{
+    while(_wsOutOff < _wsOut.size())
+    {
+        const int n = _SendSome(&_wsOut[_wsOutOff], unsigned(std::min(_wsOut.size() - _wsOutOff, size_t(1 << 20))));
+        if(n < 0)
+            return false; // closed
+        if(!n)
+        {
+            if(_wsOutOff > 64 * 1024 && _wsOutOff * 2 > _wsOut.size()) // don't let the sent part pile up
+            {
+                _wsOut.erase(_wsOut.begin(), _wsOut.begin() + _wsOutOff);
+                _wsOutOff = 0;
+            }
+            return true;
+        }
+        _wsOutOff += n;
+    }
+    _wsOut.clear(); // keeps the memory
+    _wsOutOff = 0;
+    return true;
+}
+
+void WebSocket::_Fail(unsigned code)
+{
+    tracerec(1, TRACE_ERROR, this, MERR_PROTOCOL, code);
+    _CountError(_metrics, MERR_PROTOCOL);
+    if(!_closeSent)
+    {
+        _closeSent = true;
+        const unsigned char p[2] = { (unsigned char)(code >> 8), (unsigned char)code };
+        _SendFrame(WS_CLOSE, p, 2);
+    }
+    _Flush();
+    close();
+}
+
+bool WebSocket::SendText(const char *s, size_t len)
+{
+    return IsConnected() && _SendFrame(WS_TEXT, s, len);
+}
+
+bool WebSocket::SendBinary(const void *buf, size_t len)
+{
+    return IsConnected() && _SendFrame(WS_BINARY, buf, len);
+}
+
+bool WebSocket::Ping(const void *payload /* = NULL */, unsigned len /* = 0 */)
+{
+    return IsConnected() && len <= 125 && _SendFrame(WS_PING, payload, len);
+}
+
+bool WebSocket::Close(unsigned code /* = 1000 */, const char *reason /* = NULL */, unsigned closeWaitMs /* = 3000 */)
+{
+    if(!IsConnected())
+        return false;
+    char p[125];
+    unsigned n = 0;
+    if(code)
+    {
+        p[0] = (char)(code >> 8);
+        p[1] = (char)code;
+        n = 2;
+        if(reason)
+        {
+            const size_t r = std::min(strlen(reason), sizeof(p) - 2);
+            memcpy(p + 2, reason, r);
+            n += unsigned(r);
+        }
+    }
+    _closeSent = true;
+    _closeBy = _GetTimeUS() + u64(closeWaitMs) * 1000;
+    _Wake();
+    return _SendFrame(WS_CLOSE, p, n);
+}
+
+void WebSocket::_OnClose()
+{
+    if(_wsOpen)
+    {
+        _wsOpen = false;
+        const unsigned code = _closeRecv ? _closeCode : WS_CLOSE_ABNORMAL;
+        std::string reason;
+        reason.swap(_closeReason);
+        _msg.clear();
+        _msgOp = 0;
+        _frameLeft = 0;
+        _wsOut.clear();
+        _wsOutOff = 0;
+        _closeBy = 0;
+        _closeSent = _closeRecv = false;
+        _OnDisconnect(code, reason);
+    }
+    HttpSocket::_OnClose();
+}
+
+#endif // MINIHTTP_SUPPORT_WEBSOCKET
+
+// ===========================
+// ===== SERVER-SENT EVENTS ==
+// ===========================
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_SSE)
+
+EventSource::EventSource()
+    : _retryAt(0)
+    , _lastRecv(0)
+    , _retryMs(3000)
+    , _idleMs(0)
+    , _active(false)
+    , _checked(false)
+    , _streaming(false)
+    , _untilClose(false)
+    , _skipLF(false)
+    , _bom(false)
+{
+}
+
+bool EventSource::IsIdle() const
+{
+    // Timers need ticking
+    return HttpSocket::IsIdle() && !_retryAt && !(_idleMs && _inProgress) && (_active || !_streaming);
+}
+
+bool EventSource::Open(const std::string& url, const char *extraRequest /* = NULL */)
+{
+    _url = url;
+    _extra = extraRequest ? extraRequest : "";
+    _active = true;
+    return _Start();
+}
+
+void EventSource::Stop()
+{
+    _active = false;
+    _retryAt = 0;
+    _Wake(); // closing from inside a callback would pull the buffer away from under the parser
+}
+
+bool EventSource::_Start()
+{
+    _retryAt = 0;
+    _checked = _streaming = _untilClose = _skipLF = false;
+    _bom = true;
+    _idBuf = _lastId; // an event that was cut off doesn't count
+    _type.clear();
+    _data.clear();
+    _line.clear();
+    _lastRecv = _GetTimeUS();
+
+    Request req;
+    _MakeRequest(req, _url, NULL);
+    req.onRecv = _RecvCB;
+    req.onDone = _DoneCB;
+    std::string& h = req.extraGetHeaders;
+    h = "Accept: text/event-stream\r\nCache-Control: no-cache\r\n";
+    if(_lastId.length())
+    {
+        h += "Last-Event-ID: ";
+        h += _lastId;
+        h += "\r\n";
+    }
+    h += _extra;
+    if(SendRequestSwap(req, false))
+        return true;
+    traceprint("EventSource: could not connect, trying again in %u ms\n", _retryMs);
+    _retryAt = _GetTimeUS() + u64(_retryMs) * 1000;
+    return false;
+}
+
+bool EventSource::_CheckResponse()
+{
+    if(_checked)
+        return _streaming;
+    _checked = true;
+    const char *type = Hdr("content-type");
+    if(_status != 200 || !type || STRNICMP(type, "text/event-stream", 17))
+    {
+        traceprint("EventSource: got %u (%s) instead of an event stream\n", _status, type ? type : "no type");
+        return false;
+    }
+    _streaming = true;
+    _OnStreamStart();
+    return true;
+}
+
+void EventSource::_RecvCB(HttpSocket *s, void * /* user */, const void *buf, unsigned size)
+{
+    EventSource *es = static_cast<EventSource*>(s);
+    if(es->_CheckResponse())
+        es->_Parse((const char*)buf, size);
+}
+
+void EventSource::_DoneCB(HttpSocket *s, void * /* user */, bool /* complete */)
+{
+    EventSource *es = static_cast<EventSource*>(s);
+    const bool refused = !es->_streaming && es->_status; // no answer at all is worth another try
+    es->_streaming = false;
+    es->_untilClose = false;
+    if(refused)
+        es->_active = false;
+    if(es->_active)
+    {
+        traceprint("EventSource: stream ended, reconnecting in %u ms\n", es->_retryMs);
+        es->_retryAt = _GetTimeUS() + u64(es->_retryMs) * 1000;
+    }
+    es->_OnStreamEnd(es->_active);
+}
+
+void EventSource::_OnData()
+{
+    _lastRecv = _GetTimeUS();
+    const bool fresh = !_checked;
+    HttpSocket::_OnData();
+    if(!fresh || !_inProgress || !_status || IsRedirecting())
+        return;
+
+    // The response header arrived just now
+    if(!_CheckResponse())
+    {
+        close();
+        return;
+    }
+    if(!_chunkedTransfer && !_remaining)
+    {
+        // Let HttpSocket deliver everything until the connection ends, see _OnClose()
+        _untilClose = true;
+        _remaining = u64(-1) - _recvSize;
+        if(_recvSize)
+            _OnRecvInternal(_readptr, _recvSize);
+    }
+}
+
+void EventSource::_OnClose()
+{
+    if(_untilClose && _inProgress) // the expected end, not a truncated response
+        _remaining = 0;
+    HttpSocket::_OnClose();
+}
+
+bool EventSource::_OnUpdate()
+{
+    if(!HttpSocket::_OnUpdate())
+        return false;
+
+    const u64 now = _GetTimeUS();
+    if(!_active)
+    {
+        if(_streaming && isOpen())
+            close();
+    }
+    else if(_retryAt)
+    {
+        if(now >= _retryAt && !_inProgress)
+            _Start();
+    }
+    else if(_idleMs && _inProgress && now - _lastRecv >= u64(_idleMs) * 1000)
+    {
+        traceprint("EventSource: nothing received for %u ms\n", _idleMs);
+        close();
+    }
+    return true;
+}
+
+// Goes through a piece of the body line by line. Complete lines are handled in place;
+// only one that continues in the next piece is kept.
+void EventSource::_Parse(const char *p, size_t n)
+{
+    const char *end = p + n;
+    if(_skipLF && p < end)
+    {
+        _skipLF = false;
+        if(*p == '\n') // second half of a CRLF
+            ++p;
+    }
+    while(p < end && _active)
+    {
+        const char *e = p;
+        while(e < end && *e != '\n' && *e != '\r')
+            ++e;
+        if(e == end)
+        {
+            _line.append(p, e - p);
+            break;
+        }
+        if(_line.empty())
+            _Line(p, e - p);
+        else
+        {
+            _line.append(p, e - p);
+            _Line(_line.data(), _line.size());
+            _line.clear();
+        }
+        if(*e == '\r')
+        {
+            if(e + 1 == end)
+                _skipLF = true;
+            else if(e[1] == '\n')
+                ++e;
+        }
+        p = e + 1;
+    }
+}
+
+void EventSource::_Line(const char *p, size_t n)
+{
+    if(_bom)
+    {
+        _bom = false;
+        if(n >= 3 && !memcmp(p, "\xEF\xBB\xBF", 3))
+        {
+            p += 3;
+            n -= 3;
+        }
+    }
+
+    if(!n) // blank line: dispatch
+    {
+        _lastId = _idBuf;
+        if(_data.empty())
+        {
+            _type.clear();
+            return;
+        }
+        _data.erase(_data.length() - 1); // trailing LF
+        if(_type.empty())
+            _type = "message";
+        _OnEvent(_type, _data, _lastId);
+        _type.clear();
+        _data.clear();
+        return;
+    }
+    if(*p == ':') // comment
+        return;
+
+    const char *colon = (const char*)memchr(p, ':', n);
+    const size_t namelen = colon ? colon - p : n;
+    const char *v = colon ? colon + 1 : p + n;
+    if(v < p + n && *v == ' ')
+        ++v;
+    const size_t vlen = p + n - v;
+
+    if(namelen == 4 && !memcmp(p, "data", 4))
+    {
+        _data.append(v, vlen);
+        _data += '\n';
+    }
+    else if(namelen == 5 && !memcmp(p, "event", 5))
+        _type.assign(v, vlen);
+    else if(namelen == 2 && !memcmp(p, "id", 2))
+    {
+        if(!memchr(v, 0, vlen))
+            _idBuf.assign(v, vlen);
+    }
+    else if(namelen == 5 && !memcmp(p, "retry", 5))
+    {
+        size_t i = 0;
+        while(i < vlen && v[i] >= '0' && v[i] <= '9')
+            ++i;
+        if(i && i == vlen)
+            _retryMs = (unsigned)_ParseU64(std::string(v, vlen).c_str(), 10);
+    }
+    // anything else is ignored
+}
+
+#endif // MINIHTTP_SUPPORT_SSE
+
+
+// ===========================
+// ===== SOCKET SET ==========
+// ===========================
+#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+
+// Readiness backend of SocketSet. Knows the descriptor of every slot that has one,
+// and reports the slots that can be read from (or have failed) without blocking.
+class SocketPoller
+{
+public:
+    virtual ~SocketPoller() {}
+    // INVALID_SOCKET to forget the slot. raw: plain TCP without SSL, which the backend may read by itself.
+    virtual void set(unsigned slot, SOCKET s, bool raw) = 0;
+    virtual void poll(std::vector<unsigned>& ready) = 0; // appends to ready
+    // Reads on behalf of the socket in slot, with recv() semantics. False if the socket has to read by itself.
+    virtual bool recv(unsigned /*slot*/, SOCKET /*s*/, unsigned char * /*buf*/, size_t /*maxlen*/, int * /*result*/) { return false; }
+};
+
+class PollPoller : public SocketPoller
+{
+public:
+    virtual void set(unsigned slot, SOCKET s, bool raw);
+    virtual void poll(std::vector<unsigned>& ready);
+
+private:
+    enum { NONE = ~0u };
+#ifdef _WIN32
+    std::vector<SOCKET> _fds;
+#else
+    std::vector<pollfd> _fds;
+#endif
+    std::vector<unsigned> _slotOf; // parallel to _fds
+    std::vector<unsigned> _index; // per slot: position in _fds, or NONE
+};
+
+void PollPoller::set(unsigned slot, SOCKET s, bool /*raw*/)
+{
+    if(slot >= _index.size())
+        _index.resize(slot + 1, unsigned(NONE));
+    unsigned i = _index[slot];
+    if(!SOCKETVALID(s))
+    {
+        if(i == NONE)
+            return;
+        const unsigned last = unsigned(_fds.size() - 1); // swap-remove, keeps the array dense
+        _fds[i] = _fds[last];
+        _slotOf[i] = _slotOf[last];
+        _index[_slotOf[i]] = i;
+        _fds.pop_back();
+        _slotOf.pop_back();
+        _index[slot] = NONE;
+        return;
+    }
+    if(i == NONE)
+    {
+        i = _index[slot] = unsigned(_fds.size());
+        _fds.resize(i + 1);
+        _slotOf.push_back(slot);
+    }
+#ifdef _WIN32
+    _fds[i] = s;
+#else
+    _fds[i].fd = (int)s;
+    _fds[i].events = POLLIN;
+    _fds[i].revents = 0;
+#endif
+}
+
+void PollPoller::poll(std::vector<unsigned>& ready)
+{
+    if(_fds.empty())
+        return;
+#ifdef _WIN32
+    for(size_t base = 0; base < _fds.size(); base += FD_SETSIZE) // fd_set is a plain array on windows
+    {
+        const size_t end = _fds.size() - base < FD_SETSIZE ? _fds.size() : base + FD_SETSIZE;
+        fd_set rd;
+        FD_ZERO(&rd);
+        for(size_t i = base; i < end; ++i)
+            FD_SET(_fds[i], &rd);
+        timeval tv = { 0, 0 };
+        if(select(0, &rd, NULL, NULL, &tv) > 0)
+            for(size_t i = base; i < end; ++i)
+                if(FD_ISSET(_fds[i], &rd))
+                    ready.push_back(_slotOf[i]);
+    }
+#else
+    int n = ::poll(&_fds[0], _fds.size(), 0);
+    for(size_t i = 0; n > 0 && i < _fds.size(); ++i)
+        if(_fds[i].revents)
+        {
+            ready.push_back(_slotOf[i]);
+            --n;
+        }
+#endif
+}
+
+#ifdef __linux__
+
+// Same as PollPoller, but the kernel keeps the interest list, so a tick costs O(ready sockets).
+class EpollPoller : public SocketPoller
+{
+public:
+    EpollPoller() : _ep(epoll_create1(EPOLL_CLOEXEC)), _count(0) {}
+    virtual ~EpollPoller() { if(_ep >= 0) ::close(_ep); }
+    bool ok() const { return _ep >= 0; }
+    virtual void set(unsigned slot, SOCKET s, bool raw);
+    virtual void poll(std::vector<unsigned>& ready);
+
+private:
+    int _ep;
+    unsigned _count; // registered descriptors
+    std::vector<SOCKET> _fds; // per slot
+    std::vector<epoll_event> _events;
+};
+
+void EpollPoller::set(unsigned slot, SOCKET s, bool /*raw*/)
+{
+    if(slot >= _fds.size())
+        _fds.resize(slot + 1, INVALID_SOCKET);
+    if(_fds[slot] == s)
+        return;
+    if(SOCKETVALID(_fds[slot]))
+    {
+        // Fails if the descriptor was closed already, which removed it anyway
+        epoll_ctl(_ep, EPOLL_CTL_DEL, (int)_fds[slot], NULL);
+        --_count;
+    }
+    _fds[slot] = s;
+    if(SOCKETVALID(s))
+    {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = slot;
+        epoll_ctl(_ep, EPOLL_CTL_ADD, (int)s, &ev);
+        ++_count;
+    }
+}
+
+void EpollPoller::poll(std::vector<unsigned>& ready)
+{
+    if(!_count)
+        return;
+    if(_events.size() < _count)
+        _events.resize(_count);
+    const int n = epoll_wait(_ep, &_events[0], (int)_events.size(), 0);
+    for(int i = 0; i < n; ++i)
+        ready.push_back(unsigned(_events[i].data.u64));
+}
+
+#endif // __linux__
+
+#ifdef MINIHTTP_USE_IO_URING
+
+// Completion based backend. Plain TCP sockets always have a recv() submitted, which the kernel fills
+// into buffers taken from a registered ring; the socket copies from there instead of calling recv() itself.
+// SSL sockets read through mbedtls, so for those, the ring only waits for readability.
+// All submissions and completions of one tick go through a single io_uring_enter() call.
+class UringPoller : public SocketPoller
+{
+public:
+    UringPoller();
+    virtual ~UringPoller();
+    bool ok() const { return _bufs != NULL; }
+    virtual void set(unsigned slot, SOCKET s, bool raw);
+    virtual void poll(std::vector<unsigned>& ready);
+    virtual bool recv(unsigned slot, SOCKET s, unsigned char *buf, size_t maxlen, int *result);
+
+private:
+    enum
+    {
+        SQ_ENTRIES = 256,
+        CQ_ENTRIES = 4096,
+        NUM_BUFS = 64, // power of 2
+        BUF_SIZE = 16 * 1024,
+        BUF_GROUP = 0
+    };
+    static const u64 CANCEL_TAG = ~0ULL; // user_data of cancel requests, their results don't matter
+
+    struct Slot
+    {
+        Slot() : fd(INVALID_SOCKET), tag(0), raw(false), armed(false), data(false), done(false), res(0), bid(0), off(0), len(0) {}
+        SOCKET fd;
+        unsigned tag; // bumped whenever fd changes, so completions for the old one are recognized
+        bool raw;
+        bool armed; // a request is in flight
+        bool data; // buffer bid holds [off, len) for the socket
+        bool done; // recv finished with res (0: remote closed, < 0: -errno)
+        int res;
+        unsigned bid, off, len;
+    };
+
+    io_uring_sqe *_GetSQE();
+    void _Submit(unsigned flags);
+    void _Recycle(unsigned bid);
+    void _Arm(unsigned slot);
+
+    int _fd;
+    void *_sqMem, *_cqMem;
+    size_t _sqMemSize, _cqMemSize;
+    io_uring_sqe *_sqes;
+    size_t _sqesSize;
+    unsigned *_sqHead, *_sqTail, *_sqMask, *_sqArray, _sqEntries;
+    unsigned *_cqHead, *_cqTail, *_cqMask;
+    io_uring_cqe *_cqes;
+    unsigned _toSubmit;
+
+    io_uring_buf *_bufRing; // the ring's tail overlays bufs[0].resv
+    unsigned char *_bufs;
+    unsigned short _bufTail;
+
+    std::vector<Slot> _slots;
+    std::vector<unsigned> _leftover; // slots with unread data or results, to visit again
+};
+
+static int _UringSetup(unsigned entries, io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _UringEnter(int fd, unsigned submit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, NULL, 0);
+}
+
+static int _UringRegister(int fd, unsigned op, void *arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+UringPoller::UringPoller()
+    : _fd(-1), _sqMem(MAP_FAILED), _cqMem(MAP_FAILED), _sqMemSize(0), _cqMemSize(0)
+    , _sqes((io_uring_sqe*)MAP_FAILED), _sqesSize(0), _toSubmit(0)
+    , _bufRing((io_uring_buf*)MAP_FAILED), _bufs(NULL), _bufTail(0)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = CQ_ENTRIES;
+    _fd = _UringSetup(SQ_ENTRIES, &p);
+    if(_fd < 0)
+    {
+        traceprint("io_uring_setup() failed: %d\n", errno);
+        return;
+    }
+
+    _sqMemSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqMemSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        _sqMemSize = _cqMemSize = std::max(_sqMemSize, _cqMemSize);
+    _sqMem = mmap(NULL, _sqMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if(_sqMem == MAP_FAILED)
+        return;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        _cqMem = _sqMem;
+    else if((_cqMem = mmap(NULL, _cqMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        return;
+    _sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    _sqes = (io_uring_sqe*)mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if(_sqes == MAP_FAILED)
+        return;
+
+    char *sq = (char*)_sqMem, *cq = (char*)_cqMem;
+    _sqHead = (unsigned*)(sq + p.sq_off.head);
+    _sqTail = (unsigned*)(sq + p.sq_off.tail);
+    _sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    _sqArray = (unsigned*)(sq + p.sq_off.array);
+    _sqEntries = p.sq_entries;
+    _cqHead = (unsigned*)(cq + p.cq_off.head);
+    _cqTail = (unsigned*)(cq + p.cq_off.tail);
+    _cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Provided buffers (kernel 5.19+). Without them, this backend is of no use.
+    // Not using io_uring_buf_ring, its flexible array member is laid out differently in C++
+    _bufRing = (io_uring_buf*)mmap(NULL, NUM_BUFS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(_bufRing == MAP_FAILED)
+        return;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64)(uintptr_t)_bufRing;
+    reg.ring_entries = NUM_BUFS;
+    reg.bgid = BUF_GROUP;
+    if(_UringRegister(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        traceprint("io_uring: no provided buffer rings: %d\n", errno);
+        return;
+    }
+    unsigned char *bufs = (unsigned char*)malloc(NUM_BUFS * BUF_SIZE);
+    if(!bufs)
+        return;
+    _bufs = bufs; // ok() from here on
+    for(unsigned i = 0; i < NUM_BUFS; ++i)
+        _Recycle(i);
+}
+
+UringPoller::~UringPoller()
+{
+    if(_bufs) // no request can pick a buffer after this; closing the ring cancels the rest
+    {
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = BUF_GROUP;
+        _UringRegister(_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    if(_fd >= 0)
+        ::close(_fd);
+    if(_sqes != MAP_FAILED)
+        munmap(_sqes, _sqesSize);
+    if(_cqMem != MAP_FAILED && _cqMem != _sqMem)
+        munmap(_cqMem, _cqMemSize);
+    if(_sqMem != MAP_FAILED)
+        munmap(_sqMem, _sqMemSize);
+    if(_bufRing != MAP_FAILED)
+        munmap(_bufRing, NUM_BUFS * sizeof(io_uring_buf));
+    free(_bufs);
+}
+
+io_uring_sqe *UringPoller::_GetSQE()
+{
+    const unsigned tail = *_sqTail; // only written by us
+    if(tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+    {
+        _Submit(0); // full, make room
+        if(tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+            return NULL;
+    }
+    const unsigned idx = tail & *_sqMask;
+    io_uring_sqe *sqe = &_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    _sqArray[idx] = idx;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++_toSubmit;
+    return sqe;
+}
+
+void UringPoller::_Submit(unsigned flags)
+{
+    const int n = _UringEnter(_fd, _toSubmit, 0, flags);
+    if(n > 0)
+        _toSubmit -= std::min(_toSubmit, (unsigned)n);
+}
+
+void UringPoller::_Recycle(unsigned bid)
+{
+    io_uring_buf& b = _bufRing[_bufTail & (NUM_BUFS - 1)];
+    b.addr = (u64)(uintptr_t)(_bufs + bid * BUF_SIZE);
+    b.len = BUF_SIZE;
+    b.bid = (unsigned short)bid;
+    __atomic_store_n(&_bufRing[0].resv, ++_bufTail, __ATOMIC_RELEASE);
+}
+
+void UringPoller::_Arm(unsigned slot)
+{
+    Slot& s = _slots[slot];
+    io_uring_sqe *sqe = _GetSQE();
+    if(!sqe)
+        return; // try again after the next visit
+    sqe->fd = (int)s.fd;
+    sqe->user_data = (u64(s.tag) << 32) | slot;
+    if(s.raw)
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->len = BUF_SIZE;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+    }
+    s.armed = true;
+}
+
+void UringPoller::set(unsigned slot, SOCKET fd, bool raw)
+{
+    if(slot >= _slots.size())
+        _slots.resize(slot + 1);
+    Slot& s = _slots[slot];
+    if(s.fd != fd || s.raw != raw)
+    {
+        if(s.armed)
+        {
+            // The request keeps the old connection alive until it's gone
+            if(io_uring_sqe *sqe = _GetSQE())
             {
-                _OnRecvInternal(_readptr, _remaining - 2); // implicitly skip CRLF
-                _readptr += _remaining;
-                _recvSize -= _remaining;
-                _remaining = 0; // done with this one.
-                if(!chunksize) // and if chunksize was 0, we are done with all chunks.
-                    break;
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = (u64(s.tag) << 32) | slot;
+                sqe->user_data = CANCEL_TAG;
             }
-            else // buffer did not yet arrive completely
+        }
+        if(s.data)
+            _Recycle(s.bid);
+        ++s.tag;
+        s.fd = fd;
+        s.raw = raw;
+        s.armed = s.data = s.done = false;
+    }
+    if(!SOCKETVALID(fd))
+        return;
+    if(s.data || s.done)
+        _leftover.push_back(slot);
+    else if(!s.armed)
+        _Arm(slot);
+}
+
+void UringPoller::poll(std::vector<unsigned>& ready)
+{
+    ready.insert(ready.end(), _leftover.begin(), _leftover.end());
+    _leftover.clear();
+
+    // Submits this tick's requests and runs pending completion work, without waiting
+    _Submit(IORING_ENTER_GETEVENTS);
+
+    unsigned head = *_cqHead; // only written by us
+    const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for( ; head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = _cqes[head & *_cqMask];
+        if(cqe.user_data == CANCEL_TAG)
+            continue;
+        const unsigned slot = unsigned(cqe.user_data);
+        const bool hasBuf = !!(cqe.flags & IORING_CQE_F_BUFFER);
+        const unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if(slot >= _slots.size() || _slots[slot].tag != unsigned(cqe.user_data >> 32))
+        {
+            if(hasBuf) // for a connection that's gone
+                _Recycle(bid);
+            continue;
+        }
+        Slot& s = _slots[slot];
+        s.armed = false;
+        if(s.raw && cqe.res != -ENOBUFS) // out of buffers: re-armed after the visit
+        {
+            if(cqe.res > 0 && hasBuf)
             {
-                _OnRecvInternal(_readptr, _recvSize);
-                _remaining -= _recvSize;
-                _recvSize = 0; // done with the whole buffer, but not with the chunk
-                return; // nothing else to do here
+                s.data = true;
+                s.bid = bid;
+                s.off = 0;
+                s.len = (unsigned)cqe.res;
+            }
+            else
+            {
+                if(hasBuf)
+                    _Recycle(bid);
+                s.done = true;
+                s.res = cqe.res;
             }
         }
+        ready.push_back(slot);
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+}
 
-        // each chunk identifier ends with CRLF.
-        // if we don't find that, we hit the corner case that the chunk identifier was not fully received.
-        // in that case, adjust the buffer and wait for the rest of the data to be appended
-        char *term = strstr(_readptr, "\r\n");
-        if(!term)
+bool UringPoller::recv(unsigned slot, SOCKET fd, unsigned char *buf, size_t maxlen, int *result)
+{
+    if(slot >= _slots.size() || !_slots[slot].raw || _slots[slot].fd != fd)
+        return false; // not registered yet, nothing can be in flight
+    Slot& s = _slots[slot];
+    if(s.data)
+    {
+        const unsigned n = (unsigned)std::min(maxlen, size_t(s.len - s.off));
+        memcpy(buf, _bufs + s.bid * BUF_SIZE + s.off, n);
+        s.off += n;
+        if(s.off == s.len)
         {
-            if(_recvSize) // if there is still something queued, move it to the left of the buffer and append on next read
-                _ShiftBuffer();
-            return;
+            _Recycle(s.bid);
+            s.data = false;
         }
-        term += 2; // skip CRLF
+        *result = (int)n;
+    }
+    else if(s.done)
+    {
+        s.done = false;
+        if(s.res < 0)
+            errno = -s.res;
+        *result = s.res < 0 ? -1 : 0;
+    }
+    else
+    {
+        errno = EWOULDBLOCK;
+        *result = -1;
+    }
+    return true;
+}
 
-        // when we are here, the (next) chunk header was completely received.
-        chunksize = strtoul(_readptr, NULL, 16);
-        _remaining = chunksize + 2; // the http protocol specifies that each chunk has a trailing CRLF
-        _recvSize -= (term - _readptr);
-        _readptr = term;
+#endif // MINIHTTP_USE_IO_URING
+
+static SocketPoller *_NewPoller()
+{
+#ifdef MINIHTTP_USE_IO_URING
+    {
+        UringPoller *p = new UringPoller;
+        if(p->ok())
+            return p;
+        delete p;
+    }
+#endif
+#ifdef __linux__
+    {
+        EpollPoller *p = new EpollPoller;
+        if(p->ok())
+            return p;
+        delete p;
+    }
+#endif
+    return new PollPoller;
+}
+
+SocketSet::SocketSet()
+    : _poller(_NewPoller())
+    , _tick(0)
+    , _count(0)
+    , _limitIn(NULL)
+    , _limitOut(NULL)
+    , _options(NULL)
+{
+}
+
+SocketSet::~SocketSet()
+{
+    deleteAll();
+    delete (SocketPoller*)_poller;
+}
+
+void SocketSet::deleteAll(void)
+{
+    for(unsigned i = 0; i < _slots.size(); ++i)
+        if(TcpSocket *sock = _slots[i].sock)
+        {
+            _Free(i);
+            delete sock;
+        }
+}
+
+bool SocketSet::update(void)
+{
+    SocketPoller *poller = (SocketPoller*)_poller;
+    ++_tick;
+    _todo.clear();
+    _todo.swap(_busy);
+    for(size_t k = 0; k < _todo.size(); ++k)
+        _slots[_todo[k]].busy = false; // may come back during this tick
+    poller->poll(_todo);
+
+    bool interesting = false;
+    const size_t n = _todo.size();
+    if(n) // rotate, so no socket is always first in line for a shared rate limit
+        std::rotate(_todo.begin(), _todo.begin() + _tick % n, _todo.end());
+    _Prioritize();
+    for(size_t j = 0; j < n; ++j)
+    {
+        // Sockets may add or remove others in their callbacks, so don't hold on to slot references
+        const unsigned i = _todo[j];
+        TcpSocket *sock = _slots[i].sock;
+        if(!sock || _slots[i].tick == _tick) // gone, or readable and busy at once
+            continue;
+        _slots[i].tick = _tick;
+        const unsigned gen = _slots[i].gen;
+        interesting = sock->update() || interesting;
+        if(_slots[i].gen != gen)
+            continue; // removed itself
+        if(_slots[i].deleteWhenDone && !sock->isOpen() && !sock->HasPendingTask())
+        {
+            traceprint("Delete socket\n");
+            _Free(i);
+            delete sock;
+            continue;
+        }
+        poller->set(i, sock->isOpen() ? (SOCKET)sock->_s : INVALID_SOCKET, !sock->hasSSL()); // may have reconnected
+        if(!sock->IsIdle())
+            _Wake(i);
+    }
+    return interesting;
+}
+
+// Sockets that are about to start a queued request go first, most urgent first,
+// so that where limits are shared, the important requests get going before the rest.
+void SocketSet::_Prioritize()
+{
+    _queued.clear();
+    for(size_t k = 0; k < _todo.size(); ++k)
+    {
+        long long key;
+        const TcpSocket *s = _slots[_todo[k]].sock;
+        if(s && s->_QueuedWork(key))
+            _queued.push_back(std::make_pair(key, k));
+    }
+    if(_queued.empty())
+        return;
+    std::sort(_queued.begin(), _queued.end()); // equal keys stay in rotated order
+    _order.clear();
+    for(size_t q = 0; q < _queued.size(); ++q)
+    {
+        _order.push_back(_todo[_queued[q].second]);
+        _todo[_queued[q].second] = unsigned(-1);
+    }
+    for(size_t k = 0; k < _todo.size(); ++k)
+        if(_todo[k] != unsigned(-1))
+            _order.push_back(_todo[k]);
+    _todo.swap(_order);
+}
+
+void SocketSet::_Wake(unsigned slot)
+{
+    if(!_slots[slot].busy)
+    {
+        _slots[slot].busy = true;
+        _busy.push_back(slot);
+    }
+}
+
+void SocketSet::_Closed(unsigned slot)
+{
+    ((SocketPoller*)_poller)->set(slot, INVALID_SOCKET, false);
+    _Wake(slot);
+}
+
+bool SocketSet::_Recv(TcpSocket *s, unsigned char *buf, size_t maxlen, int *result)
+{
+    return ((SocketPoller*)_poller)->recv(s->_slot, (SOCKET)s->_s, buf, maxlen, result);
+}
+
+void SocketSet::SetHostRateLimit(const std::string& host, RateLimit *in, RateLimit *out)
+{
+    if(!in && !out)
+    {
+        _hostLimits.erase(host);
+        return;
+    }
+    HostLimits& h = _hostLimits[host];
+    h.in = in;
+    h.out = out;
+}
+
+u64 SocketSet::_Allowance(const std::string& host, bool out)
+{
+    u64 n = u64(-1);
+    if(RateLimit *r = out ? _limitOut : _limitIn)
+        n = r->Available();
+    if(n && _hostLimits.size())
+    {
+        std::map<std::string, HostLimits>::iterator it = _hostLimits.find(host);
+        if(it != _hostLimits.end())
+            if(RateLimit *r = out ? it->second.out : it->second.in)
+                n = std::min(n, r->Available());
+    }
+    return n;
+}
+
+void SocketSet::_Consume(const std::string& host, bool out, u64 n)
+{
+    if(RateLimit *r = out ? _limitOut : _limitIn)
+        r->Consume(n);
+    if(_hostLimits.size())
+    {
+        std::map<std::string, HostLimits>::iterator it = _hostLimits.find(host);
+        if(it != _hostLimits.end())
+            if(RateLimit *r = out ? it->second.out : it->second.in)
+                r->Consume(n);
+    }
+}
+
+void SocketSet::_Free(unsigned slot)
+{
+    SocketSetData& d = _slots[slot];
+    ((SocketPoller*)_poller)->set(slot, INVALID_SOCKET, false);
+    d.sock->_owner = NULL;
+    d.sock = NULL;
+    ++d.gen;
+    _free.push_back(slot);
+    --_count;
+}
+
+bool SocketSet::has(TcpSocket *s) const
+{
+    return s->_owner == this;
+}
+
+TcpSocket *SocketSet::get(Handle h) const
+{
+    const unsigned slot = unsigned(h);
+    if(slot >= _slots.size() || _slots[slot].gen != unsigned(h >> 32))
+        return NULL;
+    return _slots[slot].sock;
+}
+
+void SocketSet::remove(TcpSocket *s)
+{
+    if(!has(s))
+        return;
+    _Free(s->_slot);
+    if(s->GetMetrics() == &_metrics)
+        s->SetMetrics(NULL);
+}
+
+SocketSet::Handle SocketSet::add(TcpSocket *s, bool deleteWhenDone /* = true */)
+{
+    if(s->_owner == this)
+    {
+        _slots[s->_slot].deleteWhenDone = deleteWhenDone;
+        return (Handle(_slots[s->_slot].gen) << 32) | s->_slot;
+    }
+    if(s->_owner)
+        s->_owner->remove(s);
+    s->SetNonBlocking(true);
+
+    unsigned slot;
+    if(_free.size())
+    {
+        slot = _free.back();
+        _free.pop_back();
+    }
+    else
+    {
+        slot = unsigned(_slots.size());
+        SocketSetData fresh;
+        fresh.sock = NULL;
+        fresh.gen = 1; // so that no handle is 0
+        fresh.tick = 0;
+        fresh.busy = false;
+        _slots.push_back(fresh);
     }
+    SocketSetData& d = _slots[slot];
+    d.sock = s;
+    d.deleteWhenDone = deleteWhenDone;
+    ++_count;
+    s->_owner = this;
+    s->_slot = slot;
+    s->SetMetrics(&_metrics);
+    _Wake(slot); // first update registers the descriptor
+    return (Handle(d.gen) << 32) | slot;
+}
+
+#ifdef MINIHTTP_SUPPORT_HTTP
+
+// ---------------------------------------------------
+// Segmented download
+
+#define MIN_SEGMENT_SIZE (256 * 1024)
+
+static bool _FileSeek(FILE *f, u64 pos)
+{
+#if defined(_MSC_VER)
+    return !_fseeki64(f, (__int64)pos, SEEK_SET);
+#elif defined(_WIN32)
+    return !fseeko64(f, (off64_t)pos, SEEK_SET);
+#else
+    return !fseeko(f, (off_t)pos, SEEK_SET);
+#endif
+}
+
+static bool _FileWriteAt(void *f, u64 pos, const void *buf, size_t size)
+{
+    return _FileSeek((FILE*)f, pos) && fwrite(buf, 1, size, (FILE*)f) == size;
+}
+
+struct SegmentedDownload::Segment
+{
+    SegmentSocket *sock;
+    u64 begin;
+    u64 end; // exclusive
+    u64 done; // bytes written so far
+    unsigned retries;
+    bool checked; // Content-Range of the current response was verified
+    bool complete;
+};
+
+class SegmentSocket : public HttpSocket
+{
+public:
+    SegmentSocket(SegmentedDownload *o, int i) : owner(o), idx(i) {}
+    virtual ~SegmentSocket() {}
+
+    SegmentedDownload * const owner;
+    const int idx; // -1 for the probe
 
-    if(!chunksize) // this was the last chunk, no further data expected unless requested
+protected:
+    virtual void _OnRecv(void *buf, unsigned size)
     {
-        _chunkedTransfer = false;
-        _DequeueMore();
-        if(_recvSize)
-            traceprint("_ProcessChunk: There are %u bytes left in the buffer, huh?\n", _recvSize);
-        if(_mustClose)
-            close();
+        owner->_OnData(idx, this, buf, size);
     }
-}
+    virtual void _OnRequestDone()
+    {
+        owner->_OnSegmentDone(idx, this);
+    }
+    virtual bool _OnUpdate()
+    {
+        owner->_OnSegmentUpdate(idx, this);
+        return HttpSocket::_OnUpdate();
+    }
+};
 
-void HttpSocket::_ParseHeaderFields(const char *s, size_t size)
+SegmentedDownload::SegmentedDownload()
+    : _ss(NULL)
+    , _file(NULL)
+    , _probe(NULL)
+    , _segs(NULL)
+    , _nsegs(0)
+    , _size(0)
+    , _probeWritten(0)
+    , _maxRetries(3)
+    , _done(false)
+    , _failed(false)
 {
-    // Key: Value data\r\n
+}
 
-    const char * const maxs = s + size;
-    while(s < maxs)
+SegmentedDownload::~SegmentedDownload()
+{
+    if(_probe)
     {
-        while(isspace(*s))
-        {
-            ++s;
-            if(s >= maxs)
-                return;
-        }
-        const char * const colon = strchr(s, ':');
-        if(!colon)
-            return;
-        const char *valEnd = strchr(colon, '\n'); // last char of val data
-        if(!valEnd)
-            return;
-        while(valEnd[-1] == '\n' || valEnd[-1] == '\r') // skip backwards if necessary
-            --valEnd;
-        const char *val = colon + 1; // value starts after ':' ...
-        while(isspace(*val) && val < valEnd) // skip spaces after the colon
-            ++val;
-        std::string key(s, colon - s);
-        strToLower(key);
-        std::string valstr(val, valEnd - val);
-        _hdrs[key] = valstr;
-        traceprint("HDR: %s: %s\n", key.c_str(), valstr.c_str());
-        s = valEnd;
+        _ss->remove(_probe);
+        delete _probe;
+    }
+    if(_segs)
+    {
+        for(unsigned i = 0; i < _nsegs; ++i)
+            if(_segs[i].sock)
+            {
+                _ss->remove(_segs[i].sock);
+                delete _segs[i].sock;
+            }
+        delete [] _segs;
     }
+    if(_file)
+        fclose((FILE*)_file);
 }
 
-const char *HttpSocket::Hdr(const char *h) const
+bool SegmentedDownload::Start(SocketSet& ss, const std::string& url, const char *filename, unsigned segments /* = 4 */)
 {
-    std::map<std::string, std::string>::const_iterator it = _hdrs.find(h);
-    return it == _hdrs.end() ? NULL : it->second.c_str();
+    if(_probe)
+        return false; // already started
+    _file = fopen(filename, "wb");
+    if(!_file)
+        return false;
+    _ss = &ss;
+    _url = url;
+    _nsegs = segments ? segments : 1;
+    _probe = _NewSocket(-1);
+    if(!_probe->Download(url, "Range: bytes=0-0\r\n"))
+    {
+        _Fail();
+        return false;
+    }
+    return true;
 }
 
-static int safeatoi(const char *s)
+u64 SegmentedDownload::GetReceived() const
 {
-    return s ? atoi(s) : 0;
+    if(!_segs)
+        return _probeWritten;
+    u64 n = 0;
+    for(unsigned i = 0; i < _nsegs; ++i)
+        n += _segs[i].done;
+    return n;
 }
 
-bool HttpSocket::_HandleStatus()
+SegmentSocket *SegmentedDownload::_NewSocket(int idx)
 {
-    _remaining = _contentLen = safeatoi(Hdr("content-length"));
-
-    const char *encoding = Hdr("transfer-encoding");
-    _chunkedTransfer = encoding && !STRNICMP(encoding, "chunked", 7);
-
-    const char *conn = Hdr("connection"); // if its not keep-alive, server will close it, so we can too
-    _mustClose = !conn || STRNICMP(conn, "keep-alive", 10);
+    SegmentSocket *s = new SegmentSocket(this, idx);
+    s->SetBufsizeIn(64 * 1024);
+    s->SetFollowRedirect(true);
+    if(_user_agent.length())
+        s->SetUserAgent(_user_agent);
+    _ss->add(s, false);
+    return s;
+}
 
-    // As per the spec, we also need to handle 1xx codes, but are free to ignore them
-    const bool success = IsSuccess() || (_status >= 100 && _status <= 199);
+bool SegmentedDownload::_RequestSegment(unsigned idx)
+{
+    Segment& seg = _segs[idx];
+    if(!seg.sock)
+        seg.sock = _NewSocket(idx);
+    seg.checked = false;
+    std::ostringstream hdr;
+    hdr << "Range: bytes=" << (seg.begin + seg.done) << '-' << (seg.end - 1) << "\r\n";
+    if(_validator.length())
+        hdr << "If-Range: " << _validator << "\r\n";
+    return seg.sock->Download(_url, hdr.str().c_str());
+}
 
-    if(!(_chunkedTransfer || _contentLen) && success)
-        traceprint("_ParseHeader: Not chunked transfer and content-length==0, this will go fail\n");
+void SegmentedDownload::_OnProbeDone(SegmentSocket *s)
+{
+    const unsigned status = s->GetStatusCode();
+    if(status == 200) // Server does not support ranges and sent everything already
+    {
+        _size = _probeWritten;
+        _Finish();
+        return;
+    }
 
-    traceprint("Got HTTP Status %d\n", _status);
+    // Content-Range: bytes 0-0/<size>
+    const char *cr = s->Hdr("content-range");
+    const char *slash = cr ? strchr(cr, '/') : NULL;
+    if(status != 206 || !slash || slash[1] == '*')
+    {
+        _Fail();
+        return;
+    }
+    _size = _ParseU64(slash + 1, 10);
 
-    if(success)
-        return true;
+    // Weak ETags must not be used with If-Range
+    const char *etag = s->Hdr("etag");
+    if(etag && STRNICMP(etag, "W/", 2))
+        _validator = etag;
+    else if(const char *lm = s->Hdr("last-modified"))
+        _validator = lm;
 
-    bool forceGET = false;
-    switch(_status)
+    if(!_size)
     {
-        case 303:
-            forceGET = true; // As per spec, continue with a GET request
-        case 301:
-        case 302:
-        case 307:
-        case 308:
-            if(_followRedir)
-                if(const char *loc = Hdr("location"))
-                    _Redirect(loc, forceGET);
-            return false;
+        _Finish();
+        return;
+    }
 
-        default:
-            return false;
+    // Pre-allocate, so that each segment can write at its offset right away
+    const char zero = 0;
+    if(!_FileWriteAt(_file, _size - 1, &zero, 1))
+    {
+        _Fail();
+        return;
     }
-}
 
-bool HttpSocket::IsRedirecting() const
-{
-    switch(_status)
+    u64 n = _size / MIN_SEGMENT_SIZE;
+    if(n > _nsegs)
+        n = _nsegs;
+    if(!n)
+        n = 1;
+    _nsegs = (unsigned)n;
+    _segs = new Segment[_nsegs];
+    const u64 per = _size / _nsegs;
+    for(unsigned i = 0; i < _nsegs; ++i)
     {
-        case 301:
-        case 302:
-        case 303:
-        case 307:
-        case 308:
-            return true;
+        Segment& seg = _segs[i];
+        memset(&seg, 0, sizeof(seg));
+        seg.begin = i * per;
+        seg.end = i + 1 < _nsegs ? seg.begin + per : _size;
     }
-    return false;
+    for(unsigned i = 0; i < _nsegs; ++i)
+        _RequestSegment(i); // failures are retried in _OnSegmentUpdate()
 }
 
-bool HttpSocket::IsSuccess() const
+void SegmentedDownload::_OnData(int idx, SegmentSocket *s, const void *buf, unsigned size)
 {
-    const unsigned s = _status;
-    return s >= 200 && s <= 205;
-}
+    if(_failed || !size)
+        return;
 
+    if(idx < 0)
+    {
+        if(s->GetStatusCode() != 200)
+            return; // That's the probe byte; segment 0 fetches it again
+        if(!_FileWriteAt(_file, _probeWritten, buf, size))
+            _Fail();
+        _probeWritten += size;
+        return;
+    }
+
+    Segment& seg = _segs[idx];
+    if(!seg.checked)
+    {
+        // 200 means If-Range did not match, so the resource changed. Can't mix that with what we have.
+        const char *cr = s->Hdr("content-range");
+        if(s->GetStatusCode() != 206 || !cr || STRNICMP(cr, "bytes ", 6) || _ParseU64(cr + 6, 10) != seg.begin + seg.done)
+        {
+            _Fail();
+            return;
+        }
+        seg.checked = true;
+    }
 
+    u64 n = size;
+    if(n > seg.end - seg.begin - seg.done)
+        n = seg.end - seg.begin - seg.done;
+    if(!_FileWriteAt(_file, seg.begin + seg.done, buf, (size_t)n))
+    {
+        _Fail();
+        return;
+    }
+    seg.done += n;
+}
 
-void HttpSocket::_ParseHeader(void)
+void SegmentedDownload::_OnSegmentDone(int idx, SegmentSocket *s)
 {
-    _tmpHdr += _inbuf;
-    const char *hptr = _tmpHdr.c_str();
+    if(_failed || _done)
+        return;
 
-    if((_recvSize >= 5 || _tmpHdr.size() >= 5) && memcmp("HTTP/", hptr, 5))
+    if(idx < 0)
     {
-        traceprint("_ParseHeader: not HTTP stream\n");
+        _OnProbeDone(s);
         return;
     }
 
-    const char *hdrend = strstr(hptr, "\r\n\r\n");
-    if(!hdrend)
+    Segment& seg = _segs[idx];
+    if(seg.begin + seg.done < seg.end)
     {
-        traceprint("_ParseHeader: could not find end-of-header marker, or incomplete buf; delaying.\n");
-        return;
+        if(s->GetStatusCode() != 206)
+            _Fail();
+        return; // otherwise, resumed in _OnSegmentUpdate()
     }
 
-    //traceprint(hptr);
+    seg.complete = true;
+    for(unsigned i = 0; i < _nsegs; ++i)
+        if(!_segs[i].complete)
+            return;
+    _Finish();
+}
 
-    hptr = strchr(hptr + 5, ' '); // skip "HTTP/", already known
-    if(!hptr)
-        return; // WTF?
-    ++hptr; // number behind first space is the status code
-    _status = atoi(hptr);
+void SegmentedDownload::_OnSegmentUpdate(int idx, SegmentSocket *s)
+{
+    if(_failed || _done || s->isOpen() || s->HasPendingTask())
+        return;
 
-    // Default values
-    _chunkedTransfer = false;
-    _contentLen = 0; // yet unknown
+    // The socket is idle, but we are not done. The connection dropped, or could not be opened.
+    if(idx < 0)
+    {
+        if(!_segs)
+            _Fail();
+        return;
+    }
 
-    hptr = strstr(hptr, "\r\n");
-    _ParseHeaderFields(hptr + 2, hdrend - hptr);
+    Segment& seg = _segs[idx];
+    if(seg.complete)
+        return;
+    if(seg.retries++ >= _maxRetries)
+    {
+        _Fail();
+        return;
+    }
+    traceprint("SegmentedDownload: resuming segment %u at %u\n", idx, (unsigned)seg.done);
+    _RequestSegment(idx);
+}
 
-    // FIXME: return value indicates success.
-    // Bail out on non-success, or at least make it so that _OnRecv() is not called.
-    // (Unless an override bool is given that even non-successful answers get their data delivered!)
-    _HandleStatus();
+void SegmentedDownload::_Fail()
+{
+    _failed = true;
+    if(_file)
+    {
+        fclose((FILE*)_file);
+        _file = NULL;
+    }
+}
 
-    // get ready
-    _readptr = strstr(_inbuf, "\r\n\r\n") + 4; // skip double newline. must have been found in hptr earlier.
-    _recvSize -= (_readptr - _inbuf); // skip the header part
-    _tmpHdr.clear();
+void SegmentedDownload::_Finish()
+{
+    _done = true;
+    if(_file && fclose((FILE*)_file))
+        _failed = true;
+    _file = NULL;
 }
 
-// generic http header parsing
-void HttpSocket::_OnData(void)
+// ---------------------------------------------------
+// Request scheduler
+
+class SchedulerSocket : public HttpSocket
 {
-    if(!(_chunkedTransfer || (_remaining && _recvSize)))
-        _ParseHeader();
+public:
+    SchedulerSocket(RequestScheduler *o) : owner(o), busy(false) {}
+    virtual ~SchedulerSocket() {}
 
-    if(_chunkedTransfer)
+    virtual bool IsIdle() const
     {
-        _ProcessChunk(); // first, try to finish one or more chunks
+        return HttpSocket::IsIdle() && !(busy && IsFree()); // _OnUpdate() reports back
     }
-    else if(_remaining && _recvSize) // something remaining? if so, we got a header earlier, but not all data
-    {
-        _remaining -= _recvSize;
-        _OnRecvInternal(_readptr, _recvSize);
 
-        if(int(_remaining) < 0)
-        {
-            traceprint("_OnRecv: _remaining wrap-around, huh??\n");
-            _remaining = 0;
-        }
-        if(!_remaining) // received last block?
-        {
-            if(_mustClose)
-                close();
-            else
-                _DequeueMore();
-        }
+    bool IsFree() const { return !_inProgress && !HasPendingTask(); }
+    void Drop(const Request& req) { _DropRequest(req); }
 
-        // nothing else to do here.
+    RequestScheduler * const owner;
+    std::string key; // of the host it was last used for
+    bool busy; // counted for key
+
+protected:
+    virtual bool _OnUpdate()
+    {
+        const bool r = HttpSocket::_OnUpdate();
+        if(busy && IsFree())
+            owner->_OnSocketFree(this);
+        return r;
     }
+};
 
-    // otherwise, the server sent just the header, with the data following in the next packet
+RequestScheduler::RequestScheduler(SocketSet& ss, unsigned maxPerHost /* = 6 */, unsigned maxTotal /* = 32 */)
+    : _ss(&ss)
+    , _cache(NULL)
+    , _redirects(NULL)
+    , _keep_alive(30)
+    , _maxPerHost(maxPerHost ? maxPerHost : 1)
+    , _maxTotal(maxTotal ? maxTotal : 1)
+    , _waiting(0)
+    , _active(0)
+    , _dispatching(false)
+{
 }
 
-void HttpSocket::_OnClose()
+RequestScheduler::~RequestScheduler()
 {
-    if(!ExpectMoreData())
-        _FinishRequest();
+    for(size_t i = 0; i < _conns.size(); ++i)
+    {
+        _ss->remove(_conns[i]);
+        delete _conns[i];
+    }
 }
 
-void HttpSocket::_OnRecvInternal(void *buf, unsigned int size)
+void RequestScheduler::SetLimits(unsigned maxPerHost, unsigned maxTotal)
 {
-    if(IsSuccess() || _alwaysHandle)
-        _OnRecv(buf, size);
+    _maxPerHost = maxPerHost ? maxPerHost : 1;
+    _maxTotal = maxTotal ? maxTotal : 1;
+    _Dispatch();
 }
 
-#endif
+void RequestScheduler::SetHostWeight(const std::string& host, unsigned weight)
+{
+    if(weight > 1)
+        _weights[host] = weight;
+    else
+        _weights.erase(host);
+}
 
-// ===========================
-// ===== SOCKET SET ==========
-// ===========================
-#ifdef MINIHTTP_SUPPORT_SOCKET_SET
+unsigned RequestScheduler::_Weight(const std::string& name) const
+{
+    std::map<std::string, unsigned>::const_iterator it = _weights.find(name);
+    return it == _weights.end() ? 1 : it->second;
+}
 
-SocketSet::~SocketSet()
+bool RequestScheduler::Fetch(const std::string& url, Request::RecvFunc recv, Request::DoneFunc done, void *user /* = NULL */, const POST *post /* = NULL */)
 {
-    deleteAll();
+    Request req;
+    req.user = user;
+    req.onRecv = recv;
+    req.onDone = done;
+    if(post)
+        req.post = *post;
+    SplitURI(url, req.protocol, req.host, req.resource, req.port, req.useSSL);
+    if(req.port < 0)
+        req.port = 80;
+    return Submit(req);
 }
 
-void SocketSet::deleteAll(void)
+bool RequestScheduler::Submit(Request& req)
 {
-    for(Store::iterator it = _store.begin(); it != _store.end(); ++it)
-        delete it->first;
-    _store.clear();
+    if(req.host.empty())
+        return false;
+    std::ostringstream os;
+    os << (req.useSSL ? "https://" : "http://") << req.host << ':' << req.port;
+    const std::string key = os.str();
+    HostMap::iterator it = _hosts.find(key);
+    if(it == _hosts.end())
+    {
+        it = _hosts.insert(std::make_pair(key, Host())).first;
+        Host& h = it->second;
+        h.name = req.host;
+        h.active = h.credit = 0;
+        h.listed = false;
+    }
+    Host& h = it->second;
+    h.q.push(req);
+    ++_waiting;
+    if(!h.listed)
+    {
+        h.listed = true;
+        _turns.push_back(it);
+    }
+    _Dispatch();
+    return true;
 }
 
-bool SocketSet::update(void)
+void RequestScheduler::_Dispatch()
 {
-    bool interesting = false;
-    Store::iterator it = _store.begin();
-    for( ; it != _store.end(); )
+    if(_dispatching) // a callback during SendRequestSwap() submitted more; the loop below picks it up
+        return;
+    _dispatching = true;
+    for(size_t skipped = 0; _turns.size() && skipped < _turns.size(); )
     {
-        TcpSocket *sock =  it->first;
-        SocketSetData& sdata = it->second;
-        interesting = sock->update() || interesting;
-        if(sdata.deleteWhenDone && !sock->isOpen() && !sock->HasPendingTask())
+        HostMap::iterator it = _turns.front();
+        Host& h = it->second;
+        if(h.active >= _maxPerHost) // its turn is over, even if it has credit left
         {
-            traceprint("Delete socket\n");
-            delete sock;
-            _store.erase(it++);
+            h.credit = 0;
+            _turns.pop_front();
+            _turns.push_back(it);
+            ++skipped;
+            continue;
+        }
+        SchedulerSocket *s = _PickSocket(it->first);
+        if(!s)
+            break; // all connections busy
+        skipped = 0;
+
+        if(!h.credit)
+            h.credit = _Weight(h.name);
+        Request req;
+        h.q.pop(req);
+        --_waiting;
+        if(!h.q.size())
+        {
+            h.listed = false;
+            h.credit = 0;
+            _turns.pop_front();
+        }
+        else if(!--h.credit)
+        {
+            _turns.pop_front();
+            _turns.push_back(it);
+        }
+
+        s->key = it->first;
+        s->busy = true;
+        ++h.active;
+        ++_active;
+        if(!s->SendRequestSwap(req, false))
+        {
+            s->busy = false;
+            --h.active;
+            --_active;
+            s->Drop(req);
+            _Forget(it);
         }
+    }
+    _dispatching = false;
+}
+
+SchedulerSocket *RequestScheduler::_PickSocket(const std::string& key)
+{
+    SchedulerSocket *closed = NULL, *other = NULL;
+    for(size_t i = 0; i < _conns.size(); ++i)
+    {
+        SchedulerSocket *s = _conns[i];
+        if(s->busy)
+            continue;
+        if(!s->isOpen())
+            closed = s;
+        else if(s->key == key)
+            return s; // connection is still there, reuse it
         else
-           ++it;
+            other = s;
     }
-    return interesting;
+    if(closed)
+        return closed;
+    if(_conns.size() < _maxTotal)
+    {
+        SchedulerSocket *s = new SchedulerSocket(this);
+        s->SetNonBlocking(true);
+        s->SetBufsizeIn(64 * 1024);
+        s->SetKeepAlive(_keep_alive);
+        s->SetCache(_cache);
+        s->SetRedirectCache(_redirects);
+        if(_user_agent.length())
+            s->SetUserAgent(_user_agent);
+        _OnNewSocket(s);
+        _ss->add(s, false);
+        _conns.push_back(s);
+        return s;
+    }
+    return other; // closes the idle connection to another host
 }
 
-void SocketSet::remove(TcpSocket *s)
+void RequestScheduler::_OnSocketFree(SchedulerSocket *s)
 {
-    _store.erase(s);
+    s->busy = false;
+    --_active;
+    HostMap::iterator it = _hosts.find(s->key);
+    if(it != _hosts.end())
+    {
+        --it->second.active;
+        _Forget(it);
+    }
+    _Dispatch();
 }
 
-void SocketSet::add(TcpSocket *s, bool deleteWhenDone /* = true */)
+void RequestScheduler::_Forget(HostMap::iterator it)
 {
-    s->SetNonBlocking(true);
-    SocketSetData sdata;
-    sdata.deleteWhenDone = deleteWhenDone;
-    _store[s] = sdata;
+    if(!it->second.listed && !it->second.active)
+        _hosts.erase(it);
 }
 
+#endif // MINIHTTP_SUPPORT_HTTP
+
 #endif
 
 
@@ -1404,6 +7171,19 @@ protected:
     }
 };
 
+static HttpCache *s_dlCache = NULL;
+static RedirectCache *s_dlRedirects = NULL;
+
+void SetDownloadCache(HttpCache *c)
+{
+    s_dlCache = c;
+}
+
+void SetDownloadRedirectCache(RedirectCache *c)
+{
+    s_dlRedirects = c;
+}
+
 char *Download(const char *url, size_t *sz, const POST *post /* = NULL */)
 {
     if(!_networkInitDone)
@@ -1411,6 +7191,8 @@ char *Download(const char *url, size_t *sz, const POST *post /* = NULL */)
             return NULL;
 
     DLSocket dl;
+    dl.SetCache(s_dlCache);
+    dl.SetRedirectCache(s_dlRedirects);
     dl.SetBufsizeIn(64 * 1024);
     dl.SetNonBlocking(false);
     dl.SetFollowRedirect(true);
@@ -1435,6 +7217,25 @@ char *Download(const char *url, size_t *sz, const POST *post /* = NULL */)
     return dl.buf;
 }
 
+SharedBody *DownloadShared(const char *url, const POST *post /* = NULL */)
+{
+    if(s_dlCache && !post)
+    {
+        Request req;
+        SplitURI(url, req.protocol, req.host, req.resource, req.port, req.useSSL);
+        if(req.port < 0)
+            req.port = 80;
+        if(s_dlRedirects)
+            s_dlRedirects->Resolve(req);
+        if(SharedBody *b = s_dlCache->GetShared(HttpCache::MakeKey(req)))
+            return b;
+    }
+
+    size_t sz = 0;
+    char *buf = Download(url, &sz, post);
+    return buf ? SharedBody::Adopt(buf, sz) : NULL;
+}
+
 
 
 } // namespace minihttp
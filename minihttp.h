@@ -10,6 +10,13 @@
 // ---- Compile config -----
 #define MINIHTTP_SUPPORT_HTTP
 #define MINIHTTP_SUPPORT_SOCKET_SET
+#define MINIHTTP_SUPPORT_HTTP2 // Http2Socket. Needs MINIHTTP_SUPPORT_HTTP; https needs MINIHTTP_USE_MBEDTLS built with ALPN.
+#define MINIHTTP_SUPPORT_WEBSOCKET // WebSocket. Needs MINIHTTP_SUPPORT_HTTP.
+#define MINIHTTP_SUPPORT_SSE // EventSource. Needs MINIHTTP_SUPPORT_HTTP.
+//#define MINIHTTP_SUPPORT_FUTURE // FetchFuture(), needs C++11 and pulls in <future>. Can also be defined before including.
+#ifndef MINIHTTP_TRACE_LEVEL
+#  define MINIHTTP_TRACE_LEVEL 2 // Binary trace ring. 0 = off, 1 = errors, 2 = +connection/request lifecycle, 3 = +parser details
+#endif
 // -------------------------
 
 #include <stdlib.h>
@@ -20,6 +27,13 @@ namespace minihttp
 {
 
 class POST;
+struct Metrics;
+class SharedBody;
+class HttpCache;
+class RedirectCache;
+class SocketSet;
+
+typedef unsigned long long u64;
 
 bool InitNetwork();
 void StopNetwork();
@@ -36,6 +50,17 @@ bool HasSSL();
 //       is perfectly capable of stalling the caller for a VERY LONG TIME.
 char *Download(const char *url, size_t *sz = NULL, const POST *post = NULL);
 
+// Same as above, but returns a reference-counted body that must be Release()'d after use.
+// If the cache set with SetDownloadCache() keeps bodies in memory (MemCache), a fresh hit
+// returns the cached buffer itself, without copying.
+SharedBody *DownloadShared(const char *url, const POST *post = NULL);
+
+// Cache used by Download() and DownloadShared(). Not owned. Default NULL (no caching).
+void SetDownloadCache(HttpCache *c);
+
+// Permanent redirect cache used by Download() and DownloadShared(). Not owned. Default NULL.
+void SetDownloadRedirectCache(RedirectCache *c);
+
 // append to enc
 void URLEncode(const std::string& s, std::string& enc);
 
@@ -55,6 +80,73 @@ enum SSLResult
     _SSLR_FORCE32BIT = 0x7fffffff
 };
 
+// Timestamps are monotonic, in microseconds. Only differences between them are meaningful.
+// A timestamp is 0 if the phase did not happen (yet).
+struct RequestTimings
+{
+    RequestTimings() { clear(); }
+    void clear();
+
+    u64 start; // request was opened (left the queue)
+    u64 connecting; // connection attempt started. 0 if an already open connection was reused.
+    u64 resolved; // host name resolved. Same as connected when using mbedtls, which does both in one go.
+    u64 connected; // TCP connection established
+    u64 handshaked; // SSL handshake done
+    u64 sent; // request was sent, including its body. 0 if the server answered before the body was complete.
+    u64 firstByte; // first byte of the response arrived
+    u64 headerDone; // status line and header fields parsed
+    u64 done; // request finished
+
+    u64 wireBytes; // bytes received on the socket, including headers and chunk framing
+    u64 bodyBytes; // bytes delivered to _OnRecv()
+    bool reused; // true if no new connection had to be opened
+    bool fromCache; // body was served from an HttpCache, either directly or after a 304 response
+    bool coalesced; // response was shared from another socket's identical request (see Coalescer)
+};
+
+// Token bucket: caps throughput at a number of bytes per second. Refilled from the clock whenever a socket asks
+// for it during update(), so nothing sleeps; a socket that has to wait just skips reading or sending for now.
+// Not owned by the sockets. Any number of them may share one, and then they share the rate.
+// Not thread-safe, so only share it among sockets that are updated by the same thread.
+class RateLimit
+{
+public:
+    RateLimit(u64 bytesPerSec = 0, u64 burst = 0);
+    // 0 bytesPerSec: unlimited. burst is how much may go at once after a quiet phase.
+    // Default (0) is 1/10 s worth, but at least 16 KB. Smaller than 4 KB is raised to 4 KB,
+    // the least a socket waits for before it reads or sends under a limit.
+    void Set(u64 bytesPerSec, u64 burst = 0);
+    u64 GetRate() const { return _rate; }
+
+    u64 Available(); // bytes that may go right now, u64(-1) if unlimited
+    void Consume(u64 n); // may go into debt, which has to be paid off before anything else goes
+
+private:
+    u64 _rate;
+    u64 _burst;
+    u64 _last; // time the tokens were last brought up to date
+    u64 _frac; // refill of less than a byte, carried over; in byte-microseconds
+    long long _tokens;
+};
+
+// Transport tuning, applied to each new connection. Members left at 0 / false keep the system default.
+// Options that don't exist on the platform are skipped. With MINIHTTP_USE_MBEDTLS, mbedtls connects the socket
+// itself, so fastOpen has no effect and the buffer sizes are set only after connecting.
+struct SocketOptions
+{
+    SocketOptions() : noDelay(false), fastOpen(false), quickAck(false), rcvBuf(0), sndBuf(0), keepIdle(0), keepInterval(0), keepCount(0) {}
+
+    bool noDelay; // TCP_NODELAY: send small writes at once instead of collecting them (Nagle)
+    bool fastOpen; // TCP_FASTOPEN_CONNECT (linux): if the server gave us a cookie before, the request goes out with the SYN.
+                   // connect() then returns before the handshake, so RequestTimings::connected is early.
+    bool quickAck; // TCP_QUICKACK (linux): don't delay ACKs. The kernel may go back to delaying them later.
+    unsigned rcvBuf; // SO_RCVBUF, in bytes. Set before connecting, since it decides the window scale.
+    unsigned sndBuf; // SO_SNDBUF, in bytes
+    unsigned keepIdle; // enables TCP keepalive: seconds without traffic until the first probe
+    unsigned keepInterval; // seconds between probes. 0: system default.
+    unsigned keepCount; // unanswered probes until the connection is dropped. 0: system default.
+};
+
 class TcpSocket
 {
 public:
@@ -67,7 +159,11 @@ public:
     void close();
     bool update(); // returns true if something interesting happened (incoming data, closed connection, etc)
 
-    bool isOpen(void);
+    bool isOpen(void) const;
+
+    // True if update() has nothing to do until data arrive, so a SocketSet can skip it until then.
+    // Closed sockets are never idle. Override and return false if _OnUpdate() must run on every tick.
+    virtual bool IsIdle() const;
 
     void SetBufsizeIn(unsigned int s);
     bool SetNonBlocking(bool nonblock);
@@ -75,11 +171,26 @@ public:
     const char *GetHost(void) { return _host.c_str(); }
     bool SendBytes(const void *buf, unsigned int len);
 
+    // For HttpSocket, these describe the current (or last finished) request. Valid in _OnRequestDone().
+    // For a plain TcpSocket, only the connection phases and wireBytes are tracked.
+    const RequestTimings& GetTimings() const { return _timings; }
+
+    // Report counters to m (may be NULL). SocketSet::add() does this automatically.
+    virtual void SetMetrics(Metrics *m);
+    Metrics *GetMetrics() const { return _metrics; }
+
     // SSL related
     bool initSSL(const char *certs);
     bool hasSSL() const { return !!_sslctx; }
     void shutdownSSL();
     SSLResult verifySSL(char *buf = 0, unsigned buflen = 0); // optionally put info string into buf
+    const char *GetALPN() const; // protocol the server picked during the SSL handshake, NULL if none
+
+    // Limits for this socket, in addition to those of the SocketSet it is in. Not owned, may be shared. NULL for none.
+    void SetRateLimit(RateLimit *in, RateLimit *out) { _limitIn = in; _limitOut = out; }
+
+    // Applied when connecting. Not owned, may be shared. NULL (default) uses the SocketSet's, if any.
+    void SetSocketOptions(const SocketOptions *o) { _options = o; }
 
 protected:
     virtual void _OnCloseInternal();
@@ -89,8 +200,14 @@ protected:
     virtual void _OnClose() {}; // close callback
     virtual void _OnOpen() {} // called when opened
     virtual bool _OnUpdate() { return true; } // called before reading from the socket
+    // True if a queued request is waiting to be started; key as in RequestQueue. A SocketSet updates lower keys first.
+    virtual bool _QueuedWork(long long& key) const { return false; }
 
     void _ShiftBuffer();
+    int _SendSome(const void *buf, unsigned len); // sent bytes, 0 if it would block, < 0 on error (closes)
+    void _Wake(); // have the owning SocketSet update this socket on its next tick, idle or not
+    u64 _Allowance(bool out); // bytes the rate limits let through right now, u64(-1) if unlimited
+    void _Consume(bool out, u64 n);
 
     char *_inbuf;
     char *_readptr; // part of inbuf, optionally skipped header
@@ -112,12 +229,144 @@ protected:
 
     std::string _host;
 
+    RequestTimings _timings;
+    Metrics *_metrics;
+
+    const char **_alpn; // NULL-terminated protocol list offered via ALPN, taken by initSSL(). Must stay valid. Default NULL.
+
+    RateLimit *_limitIn;
+    RateLimit *_limitOut;
+    bool _throttled; // skipped reading because of a rate limit; try again on the next tick
+
+    const SocketOptions *_options;
+
 private:
     int _writeBytes(const unsigned char *buf, size_t len);
     int _readBytes(unsigned char *buf, size_t maxlen);
     void *_sslctx;
+
+    friend class SocketSet;
+    SocketSet *_owner; // set while in a SocketSet
+    unsigned _slot; // index in _owner
 };
 
+// Log-linear latency histogram, values in microseconds.
+// Each power of 2 is split into 4 sub-buckets, so a bucket's bounds are at most 25% apart.
+struct Histogram
+{
+    enum
+    {
+        SUB_BITS = 2,
+        SUB = 1 << SUB_BITS,
+        BUCKETS = 40 * SUB // enough for ~25 days
+    };
+
+    Histogram() { clear(); }
+    void clear();
+    void add(u64 v);
+    u64 percentile(double p) const; // p in [0..100]. Returns the upper bound of the bucket the percentile is in.
+    static unsigned bucketOf(u64 v);
+    static u64 bucketUpper(unsigned i); // exclusive
+
+    u64 count;
+    u64 sum;
+    u64 buckets[BUCKETS];
+};
+
+enum MetricsError
+{
+    MERR_RESOLVE,
+    MERR_CONNECT,
+    MERR_SSL,
+    MERR_SEND,
+    MERR_RECV,
+    MERR_HTTP, // finished with a non-success, non-redirect status code
+    MERR_TRUNCATED, // connection closed in the middle of a response
+    MERR_PROTOCOL, // HTTP/2 or WebSocket framing error, failed HPACK decoding, or the server doesn't speak the protocol
+
+    MERR_MAX
+};
+
+const char *MetricsErrorName(unsigned e); // "resolve", "connect", ... as in the exported metrics. "?" if out of range.
+
+// Aggregate counters, usually owned by a SocketSet.
+// Written by the thread that updates the sockets; any other thread may read
+// without locking (each value is consistent, but not necessarily all of them together).
+struct Metrics
+{
+    Metrics() { clear(); }
+    void clear();
+
+    // Gauges
+    u64 openSockets;
+    u64 activeRequests;
+    u64 queuedRequests; // summed over all HttpSocket request queues
+
+    // Counters
+    u64 bytesIn;
+    u64 bytesOut;
+    u64 bufferShifts; // _ShiftBuffer() calls
+    u64 requests; // finished requests
+    u64 redirects; // redirects followed
+    u64 coalesced; // requests answered by another socket's identical in-flight request
+    u64 errors[MERR_MAX];
+
+    Histogram connectTime; // connection attempt until TCP connection is up
+    Histogram handshakeTime; // SSL handshake only
+    Histogram firstByteTime; // request opened until first response byte
+    Histogram requestTime; // request opened until finished
+
+    // Append in Prometheus text exposition format / as a JSON object
+    void toPrometheus(std::string& out, const char *prefix = "minihttp") const;
+    void toJSON(std::string& out) const;
+};
+
+// ---- Trace ring ----
+// Each thread writes fixed-size binary records into its own ring buffer; nothing is formatted
+// or locked on the hot path. Records above MINIHTTP_TRACE_LEVEL are compiled out.
+// TraceSave() may be called from any thread at any time to dump what is currently in all rings;
+// decode the file with the tracedump tool.
+
+enum TraceEvent
+{
+    TRACE_NONE,
+    TRACE_SOCKET_OPEN, // a = port
+    TRACE_SOCKET_CLOSE, // b = bytes received on the connection
+    TRACE_REQUEST_START, // a = requests left in the queue
+    TRACE_REQUEST_DONE, // a = HTTP status, b = body bytes
+    TRACE_REQUEST_QUEUED, // a = queue length
+    TRACE_STATUS, // a = HTTP status, b = content length
+    TRACE_HEADER_FIELD, // a = value length, b = first 8 chars of the key
+    TRACE_CHUNK, // b = chunk size
+    TRACE_REDIRECT, // a = HTTP status
+    TRACE_ERROR, // a = MetricsError, b = system or mbedtls error code
+
+    TRACE_MAX
+};
+
+struct TraceRecord
+{
+    u64 time; // monotonic, microseconds
+    u64 obj; // address of the socket that emitted it
+    u64 b;
+    unsigned int a;
+    unsigned short event; // TraceEvent
+    unsigned short thread; // ring number, in order of first use
+};
+
+const char *TraceEventName(unsigned e);
+
+// A trace file starts with three unsigned ints: TRACE_FILE_MAGIC, TRACE_FILE_VERSION and sizeof(TraceRecord).
+// The records follow in native byte order.
+enum
+{
+    TRACE_FILE_MAGIC = 0x5254484d, // "MHTR"
+    TRACE_FILE_VERSION = 1
+};
+
+// Write all records of the last lastSeconds seconds (0: everything that is still in the rings) to a file.
+bool TraceSave(const char *filename, unsigned lastSeconds = 0);
+
 } // end namespace minihttp
 
 
@@ -127,6 +376,7 @@ private:
 
 #include <map>
 #include <queue>
+#include <vector>
 
 namespace minihttp
 {
@@ -146,15 +396,132 @@ public:
     const std::string& str() const { return data; }
     bool empty() const { return data.empty(); }
     size_t length() const { return data.length(); }
+    void swap(POST& o) { data.swap(o.data); }
 private:
     std::string data;
 };
 
+// Request body that is produced piece by piece while it is sent, so it never has to be in memory as a whole.
+// Sent as a POST with Content-Length if the size is known, otherwise with Transfer-Encoding: chunked.
+// Not owned by the socket; must stay alive until the request is done.
+class RequestBody
+{
+public:
+    RequestBody() : _contentType("application/octet-stream") {}
+    virtual ~RequestBody() {}
+
+    virtual u64 size() const { return u64(-1); } // u64(-1) if unknown
+    // Copy the next up to maxlen bytes to buf. Returns how many; 0 at the end, < 0 on error (fails the request).
+    virtual int read(void *buf, unsigned maxlen) = 0;
+    // Start over, so that the body can be sent again after a 307/308 redirect. False if that's not possible.
+    virtual bool rewind() { return false; }
+
+    // File backed bodies may be sent with sendfile() on plain TCP connections:
+    // descriptor (-1 if none), the position read() would continue from, and advancing that position.
+    virtual int fd() const { return -1; }
+    virtual u64 tell() const { return 0; }
+    virtual void skip(u64 /*n*/) {}
+
+    void SetContentType(const std::string& s) { _contentType = s; }
+    const std::string& GetContentType() const { return _contentType; }
+
+protected:
+    std::string _contentType;
+};
+
+// Memory span. Not copied, must stay valid until the request is done.
+class MemoryBody : public RequestBody
+{
+public:
+    MemoryBody(const void *data, size_t len) : _data((const char*)data), _len(len), _pos(0) {}
+    virtual u64 size() const { return _len; }
+    virtual int read(void *buf, unsigned maxlen);
+    virtual bool rewind() { _pos = 0; return true; }
+private:
+    const char *_data;
+    size_t _len, _pos;
+};
+
+// Part of an open file, by default from offset to the end. The descriptor is not closed.
+class FileBody : public RequestBody
+{
+public:
+    FileBody(int fd, u64 offset = 0, u64 len = u64(-1));
+    virtual u64 size() const { return _end == u64(-1) ? _end : _end - _start; }
+    virtual int read(void *buf, unsigned maxlen);
+    virtual bool rewind() { _pos = _start; return true; }
+    virtual int fd() const { return _fd; }
+    virtual u64 tell() const { return _pos; }
+    virtual void skip(u64 n) { _pos += n; }
+private:
+    int _fd;
+    u64 _start, _end, _pos; // _end is u64(-1) if the file size is unknown
+};
+
+// Pulls the body from a function with the same contract as RequestBody::read(). Size is optional.
+class CallbackBody : public RequestBody
+{
+public:
+    typedef int (*ReadFunc)(void *user, void *buf, unsigned maxlen);
+    CallbackBody(ReadFunc f, void *user, u64 size = u64(-1)) : _f(f), _user(user), _size(size) {}
+    virtual u64 size() const { return _size; }
+    virtual int read(void *buf, unsigned maxlen) { return _f(_user, buf, maxlen); }
+private:
+    ReadFunc _f;
+    void *_user;
+    u64 _size;
+};
+
+// multipart/form-data, streamed. File parts are read from their own bodies (not owned) while sending.
+class MultipartBody : public RequestBody
+{
+public:
+    MultipartBody();
+    MultipartBody& add(const char *name, const char *value);
+    MultipartBody& add(const char *name, const char *filename, const char *contentType, RequestBody *body);
+
+    virtual u64 size() const; // unknown if any part's size is
+    virtual int read(void *buf, unsigned maxlen);
+    virtual bool rewind();
+
+private:
+    struct Part
+    {
+        std::string head; // delimiter, part header fields, and for plain fields the value
+        RequestBody *body;
+    };
+    void _AddHead(const char *name, const char *filename, const char *contentType, std::string& head) const;
+
+    std::string _boundary;
+    std::vector<Part> _parts;
+    std::string _tail; // closing delimiter
+    size_t _cur; // part being read; _parts.size() for _tail
+    size_t _off; // in head or _tail
+    bool _inBody;
+};
+
+enum CacheState
+{
+    CACHE_BYPASS, // no cache, or request not cacheable
+    CACHE_MISS, // not cached; response will be stored if possible
+    CACHE_HIT, // fresh entry, served without touching the network
+    CACHE_REVALIDATE // stale entry, sent as conditional request
+};
+
+class HttpSocket;
+
 struct Request
 {
-    Request() : port(80), user(NULL) {}
+    Request() : port(80), user(NULL), useSSL(false), cacheState(CACHE_BYPASS), onRecv(NULL), onDone(NULL), body(NULL), priority(0), queuedAt(0), expectContinue(false) {}
     Request(const std::string& h, const std::string& res, int p = 80, void *u = NULL)
-        : host(h), resource(res), port(80), user(u), useSSL(false) {}
+        : host(h), resource(res), port(p), user(u), useSSL(false), cacheState(CACHE_BYPASS), onRecv(NULL), onDone(NULL), body(NULL), priority(0), queuedAt(0), expectContinue(false) {}
+
+    // Per-request callbacks, used instead of the socket's _OnRecv() / _OnRequestDone() if set.
+    // onDone is called exactly once for every request the socket accepted, even if it failed;
+    // complete is false if no full response arrived. A request that was turned down (false returned)
+    // never gets onDone, so the caller still owns whatever user points to. Use the socket for status, header fields and timings.
+    typedef void (*RecvFunc)(HttpSocket *s, void *user, const void *buf, unsigned size);
+    typedef void (*DoneFunc)(HttpSocket *s, void *user, bool complete);
 
     std::string protocol;
     std::string host;
@@ -164,7 +531,275 @@ struct Request
     int port;
     void *user;
     bool useSSL;
+    CacheState cacheState; // set by socket
+    RecvFunc onRecv;
+    DoneFunc onDone;
     POST post; // if this is empty, it's a GET request, otherwise a POST request
+    RequestBody *body; // if set, sent as POST instead of post. Not owned.
+    int priority; // higher goes first among queued requests; may be negative. Default 0.
+    u64 queuedAt; // set by socket: when the request was first queued, in us
+    bool expectContinue; // set by socket: body is held back until the server answers 100 Continue
+
+    // Exchanges contents without copying strings. Requests are handed around this way
+    // inside the socket, so one passed to SendRequestSwap() comes back empty.
+    void swap(Request& o);
+};
+
+// Requests waiting to be sent, highest priority first; equal priorities in order of arrival.
+// Waiting time counts as priority too, so that low priorities are not starved: after waiting
+// for the aging time, a request goes ahead of one that arrives now with one level more.
+// Moves requests in and out by swapping, so nothing gets copied on the way through the queue,
+// and slots are reused once the queue has grown to its working size.
+class RequestQueue
+{
+public:
+    RequestQueue() : _aging(1000000), _seq(0) {}
+    size_t size() const { return _heap.size(); }
+    const Request& front() const { return _slots[_heap[0].slot]; }
+    long long frontKey() const { return _heap[0].key; } // lower is more urgent; comparable across queues with the same aging
+    void push(Request& r); // takes over r's contents. Sets r.queuedAt if not yet set.
+    void pop(Request& r); // hands the most urgent request over to r
+    void SetAging(unsigned ms) { _aging = u64(ms) * 1000; } // waiting time worth one priority level. 0 ignores priorities. Default 1000.
+private:
+    struct Entry { long long key; u64 seq; size_t slot; };
+    static bool _Later(const Entry& a, const Entry& b);
+    std::vector<Request> _slots;
+    std::vector<size_t> _free; // unused slots
+    std::vector<Entry> _heap; // binary heap, most urgent at the top
+    u64 _aging, _seq;
+};
+
+// Header fields of one response. Names (lower case) and values are packed into one buffer
+// that is reset, not freed, for the next response, so parsing allocates nothing once it has grown.
+// Fields are kept in the order they arrived; if a name repeats, get() returns the last one.
+class HeaderFields
+{
+public:
+    HeaderFields() : _used(0) {}
+    void clear() { _used = 0; _fields.clear(); } // keeps the memory
+    void add(const char *key, size_t keylen, const char *val, size_t vallen); // key is lowercased
+    void add(const char *key, const std::string& val);
+    const char *get(const char *key) const; // key must be lower case. NULL if not present.
+    size_t size() const { return _fields.size(); }
+    const char *key(size_t i) const { return &_buf[_fields[i].key]; }
+    const char *value(size_t i) const { return &_buf[_fields[i].val]; }
+    void swap(HeaderFields& o);
+private:
+    struct Field { size_t key, val; }; // offsets, they stay valid when the buffer grows
+    char *_Alloc(size_t n);
+    std::vector<char> _buf;
+    size_t _used;
+    std::vector<Field> _fields;
+};
+
+// Immutable, reference-counted, zero-terminated memory block. References may be passed between threads.
+class SharedBody
+{
+public:
+    static SharedBody *Adopt(char *buf, size_t size); // takes ownership of a malloc()'d buffer with size+1 bytes
+    void AddRef() const;
+    void Release() const; // deletes when the last reference is gone
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+    // Only while building a new body that nobody else references yet
+    static SharedBody *Create(size_t reserve);
+    bool append(const void *buf, size_t size);
+
+private:
+    SharedBody();
+    ~SharedBody();
+    char *_data;
+    size_t _size;
+    size_t _cap;
+    mutable long _refs;
+};
+
+// Response cache interface for HttpSocket::SetCache().
+// Only GET requests without extra headers and their 200 responses are cached,
+// since the cache can't know whether extra headers would change the response.
+// Responses with a Vary field are only cached if it names nothing but Accept-Encoding;
+// the socket's Accept-Encoding is part of the key.
+// Freshness is controlled by the response's Cache-Control: max-age / no-cache / no-store.
+// Stale entries are revalidated with If-None-Match / If-Modified-Since.
+class HttpCache
+{
+public:
+    struct Info
+    {
+        Info() : expires(0), size(0) {}
+        std::string etag;
+        std::string lastModified;
+        std::string contentType;
+        u64 expires; // wall clock time (seconds since the epoch) after which the entry is stale
+        u64 size;
+    };
+
+    // Receives the body of a cached response, in one or more pieces
+    typedef void (*ReplayFunc)(void *ctx, const void *buf, unsigned size);
+
+    virtual ~HttpCache() {}
+
+    virtual bool Lookup(const std::string& url, Info& info) = 0;
+    virtual bool Replay(const std::string& url, ReplayFunc f, void *ctx) = 0;
+
+    // Returns a handle for Append() and EndStore(), or NULL if the response should not be stored
+    virtual void *BeginStore(const std::string& url, const Info& info) = 0;
+    virtual void Append(void *handle, const void *buf, unsigned size) = 0;
+    virtual void EndStore(void *handle, bool commit) = 0; // commit is false if the response was incomplete
+
+    virtual void Refresh(const std::string& url, const Info& info) = 0; // a 304 response updated freshness
+    virtual void Remove(const std::string& url) = 0;
+
+    // Returns a new reference to the body of a fresh entry, for caches that keep bodies in memory
+    virtual SharedBody *GetShared(const std::string& url) { (void)url; return NULL; }
+
+    static std::string MakeKey(const Request& req, const std::string& acceptEncoding = std::string());
+};
+
+// Keeps cached responses as files in a directory, so they survive restarts.
+// Each entry is a small header file plus the body, which starts with the URL and size so that it is checked
+// against the header file before it is used; bodies are streamed from and to disk and never held in memory as a whole.
+class DiskCache : public HttpCache
+{
+public:
+    DiskCache(const std::string& dir); // directory must exist
+    virtual ~DiskCache();
+
+    virtual bool Lookup(const std::string& url, Info& info);
+    virtual bool Replay(const std::string& url, ReplayFunc f, void *ctx);
+    virtual void *BeginStore(const std::string& url, const Info& info);
+    virtual void Append(void *handle, const void *buf, unsigned size);
+    virtual void EndStore(void *handle, bool commit);
+    virtual void Refresh(const std::string& url, const Info& info);
+    virtual void Remove(const std::string& url);
+
+protected:
+    std::string _Path(const std::string& url, const char *ext) const;
+    bool _WriteInfo(const std::string& url, const Info& info, const char *ext);
+
+    std::string _dir;
+};
+
+// Keeps responses in memory, up to a byte budget; the least recently used entries are evicted first.
+// Bodies are shared, so hits are delivered without copying.
+// All methods are thread-safe, so one instance can serve the whole process.
+class MemCache : public HttpCache
+{
+public:
+    MemCache(size_t budget = 16 * 1024 * 1024);
+    virtual ~MemCache();
+
+    static MemCache& Global(); // process-wide instance
+
+    virtual bool Lookup(const std::string& url, Info& info);
+    virtual bool Replay(const std::string& url, ReplayFunc f, void *ctx);
+    virtual void *BeginStore(const std::string& url, const Info& info);
+    virtual void Append(void *handle, const void *buf, unsigned size);
+    virtual void EndStore(void *handle, bool commit);
+    virtual void Refresh(const std::string& url, const Info& info);
+    virtual void Remove(const std::string& url);
+    virtual SharedBody *GetShared(const std::string& url);
+
+    void SetBudget(size_t bytes);
+    size_t GetBytes() const;
+    void Clear();
+
+protected:
+    struct Entry
+    {
+        Info info;
+        SharedBody *body;
+        Entry *prev; // LRU list, most recently used first
+        Entry *next;
+        const std::string *key;
+    };
+    typedef std::map<std::string, Entry> Store;
+
+    Entry *_Find(const std::string& url); // and mark as used
+    void _Unlink(Entry *e);
+    void _Erase(Store::iterator it);
+    void _Evict();
+
+    Store _store;
+    Entry *_head;
+    Entry *_tail;
+    size_t _bytes;
+    size_t _budget;
+    void *_mutex;
+};
+
+// Single-flight layer for GET requests. Attach one Coalescer to a group of HttpSockets;
+// when a socket is about to send a GET that another socket of the group is already waiting for,
+// it sends nothing and gets the other socket's status, header fields, body and completion instead.
+// Requests are identical if method, URL, extra header fields and Accept-Encoding match.
+// Not owned by the sockets and not thread-safe: all attached sockets must be updated by the same thread.
+class Coalescer
+{
+public:
+    Coalescer() {}
+    ~Coalescer();
+
+    size_t GetInFlight() const { return _flights.size(); } // unique requests currently on the wire
+
+protected:
+    friend class HttpSocket;
+
+    struct Flight
+    {
+        Flight() : leader(NULL), delivering(false) {}
+        HttpSocket *leader;
+        std::vector<HttpSocket*> waiters;
+        bool delivering; // leader has started passing on the response. Too late to join.
+    };
+    typedef std::map<std::string, Flight> Store;
+
+    static std::string _MakeKey(const HttpSocket *s, const Request& req);
+    bool _Join(const std::string& key, HttpSocket *s); // true if s now waits for someone else's response
+    void _Lead(const std::string& key, HttpSocket *s);
+    void _Leave(HttpSocket *s); // waiter gone
+    void _Headers(HttpSocket *leader);
+    void _Body(HttpSocket *leader, const void *buf, unsigned size);
+    void _Land(HttpSocket *leader, bool complete);
+
+    Flight *_Find(HttpSocket *leader);
+
+    Store _flights;
+};
+
+// Remembers permanent redirects (301, 308), so that later requests for the same
+// scheme, host, port and resource go to the final location right away.
+// Holds up to maxEntries redirects and forgets the oldest when full.
+// Not owned by the sockets. Thread-safe, one instance can be shared by all sockets.
+class RedirectCache
+{
+public:
+    RedirectCache(size_t maxEntries = 256);
+    ~RedirectCache();
+
+    // Rewrites req to its final known location. Returns true if anything was changed.
+    bool Resolve(Request& req) const;
+    void Add(const Request& from, const Request& to);
+
+    // Forget a redirect, e.g. if the target went away. url as passed to Download().
+    void Invalidate(const std::string& url);
+    void Clear();
+    size_t size() const;
+
+protected:
+    struct Entry
+    {
+        std::string location;
+        unsigned long gen;
+    };
+    typedef std::map<std::string, Entry> Store;
+
+    Store _store;
+    std::queue<std::pair<std::string, unsigned long> > _order; // oldest first
+    unsigned long _gen;
+    size_t _maxEntries;
+    void *_mutex;
 };
 
 class HttpSocket : public TcpSocket
@@ -176,40 +811,70 @@ public:
 
     virtual bool HasPendingTask() const
     {
-        return ExpectMoreData() || _requestQ.size();
+        return ExpectMoreData() || _requestQ.size() || _waiting || _retryPending;
     }
+    virtual bool IsIdle() const;
 
     void SetKeepAlive(unsigned int secs) { _keep_alive = secs; }
     void SetUserAgent(const std::string &s) { _user_agent = s; }
     void SetAcceptEncoding(const std::string& s) { _accept_encoding = s; }
     void SetFollowRedirect(bool follow) { _followRedir = follow; }
     void SetAlwaysHandle(bool h) { _alwaysHandle = h; }
+    void SetCache(HttpCache *c) { _cache = c; } // not owned. NULL to disable.
+    void SetCoalescer(Coalescer *c) { _coalescer = c; } // not owned. NULL to disable. Change only while idle.
+    void SetRedirectCache(RedirectCache *c) { _redirects = c; } // not owned. NULL to disable.
+    // Announce POST bodies of at least minSize bytes (or of unknown size) with "Expect: 100-continue",
+    // and send the body only once the server answered 100, or after waitMs without an answer.
+    // A final response that comes first (401, 413, a redirect, ...) saves the upload. 0 to disable (default).
+    void SetExpectContinue(u64 minSize, unsigned waitMs = 1000) { _expectMin = minSize; _expectWaitMs = waitMs; }
+    // Queued requests go by Request::priority, see RequestQueue. Sockets in one SocketSet should use the same aging,
+    // so that their queues can be compared.
+    void SetPriorityAging(unsigned ms) { _requestQ.SetAging(ms); }
 
     bool Download(const std::string& url, const char *extraRequest = NULL, void *user = NULL, const POST *post = NULL);
-    bool SendRequest(Request& what, bool enqueue);
+    // Same, but the response goes to the given callbacks. Either may be NULL.
+    // False only if the request was not accepted; done has not been called then and won't be.
+    // Once accepted, even a connection that breaks right away is reported through done.
+    bool Fetch(const std::string& url, Request::RecvFunc recv, Request::DoneFunc done, void *user = NULL, const POST *post = NULL);
+    // POST of a streamed body, see RequestBody. Upload memory use doesn't depend on the body size.
+    bool Upload(const std::string& url, RequestBody *body, const char *extraRequest = NULL, void *user = NULL);
+    // Sends a copy of what. False if it was not accepted, in which case its onDone was not called.
+    bool SendRequest(const Request& what, bool enqueue);
+    // Same, without the copy: takes over the contents of what (swapped out, like a move).
+    // what is left intact only if false is returned.
+    virtual bool SendRequestSwap(Request& what, bool enqueue);
     bool SendRequest(const std::string& what, const char *extraRequest = NULL, void *user = NULL);
     bool QueueRequest(const std::string& what, const char *extraRequest = NULL, void *user = NULL);
 
-    unsigned int GetRemaining() const { return _remaining; }
+    u64 GetRemaining() const { return _remaining; }
+
+    // What the server announced in its Keep-Alive header field for the current connection.
+    u64 GetServerIdleTimeout() const { return _serverIdleTimeout; } // in microseconds, 0 if unknown
+    // Requests the connection may still be used for; the connection is closed at 0. unsigned(-1) if unknown.
+    unsigned GetRequestsLeft() const { return _requestsLeft; }
 
     unsigned int GetStatusCode() const { return _status; }
-    unsigned int GetContentLen() const { return _contentLen; }
+    u64 GetContentLen() const { return _contentLen; }
     bool ChunkedTransfer() const { return _chunkedTransfer; }
     bool ExpectMoreData() const { return _remaining || _chunkedTransfer; }
 
     const Request &GetCurrentRequest() const { return _curRequest; }
     const char *Hdr(const char *h) const;
+    const HeaderFields& GetHeaders() const { return _hdrs; }
 
     bool IsRedirecting() const;
     bool IsSuccess() const;
 
+    virtual void SetMetrics(Metrics *m);
+
 protected:
     virtual void _OnCloseInternal();
     virtual void _OnClose();
     virtual void _OnData(); // data received callback. Internal, should only be overloaded to call _OnRecv()
-    virtual void _OnRecv(void *buf, unsigned int size) = 0;
+    virtual void _OnRecv(void *buf, unsigned int size) {} // not needed if all requests have callbacks
     virtual void _OnOpen(); // called when opene
     virtual bool _OnUpdate(); // called before reading from the socket
+    virtual bool _QueuedWork(long long& key) const;
 
     // new ones:
     virtual void _OnRequestDone() {}
@@ -217,27 +882,41 @@ protected:
     bool _Redirect(const std::string& loc, bool forceGET);
 
     void _ProcessChunk();
-    bool _EnqueueOrSend(const Request& req, bool forceQueue = false);
+    bool _EnqueueOrSend(Request& req, bool forceQueue = false);
     void _DequeueMore();
-    bool _OpenRequest(const Request& req);
+    bool _OpenRequest(Request& req);
     void _ParseHeader();
     void _ParseHeaderFields(const char *s, size_t size);
     bool _HandleStatus(); // Returns whether the processed request was successful, or not
     void _FinishRequest();
+    void _AbortRequest(); // drop the current request without finishing it
+    bool _ServeFromCache(Request& req);
+    void _CacheResponse();
+    void _EndCacheStore(bool commit);
+    static void _ReplayCB(void *ctx, const void *buf, unsigned size);
     void _OnRecvInternal(void *buf, unsigned int size);
+    void _SetInProgress(bool p);
+    bool _IdleExpired() const;
+    void _MakeRequest(Request& req, const std::string& url, const POST *post) const;
+    void _DropRequest(const Request& req);
+    void _CoalescedHeaders(const HttpSocket *leader);
+    void _CoalescedBody(const void *buf, unsigned size);
+    void _CoalescedDone(bool complete);
+
+    friend class Coalescer;
 
     std::string _user_agent;
     std::string _accept_encoding; // Default empty.
     std::string _tmpHdr; // used to save the http header if the incoming buffer was not large enough
 
     unsigned int _keep_alive; // http related
-    unsigned int _remaining; // http "Content-Length: X" - already recvd. 0 if ready for next packet.
-                             // For chunked transfer encoding, this holds the remaining size of the current chunk
-    unsigned int _contentLen; // as reported by server
+    u64 _remaining; // http "Content-Length: X" - already recvd. 0 if ready for next packet.
+                    // For chunked transfer encoding, this holds the remaining size of the current chunk
+    u64 _contentLen; // as reported by server
     unsigned int _status; // http status code, HTTP_OK if things are good
 
-    std::queue<Request> _requestQ;
-    std::map<std::string, std::string> _hdrs; // Maps HTTP header fields to their values
+    RequestQueue _requestQ;
+    HeaderFields _hdrs; // of the current response
 
     Request _curRequest;
 
@@ -246,8 +925,256 @@ protected:
     bool _mustClose; // keep-alive specified, or not
     bool _followRedir; // Default true. Follow 3xx redirects if this is set.
     bool _alwaysHandle; // Also deliver to _OnRecv() if a non-success code was received.
+    bool _redirected; // the current response is a redirect that is being followed
+
+    HttpCache *_cache;
+    void *_cacheStore; // HttpCache handle while storing the current response
+
+    Coalescer *_coalescer;
+    bool _leading; // others wait for the current request's response
+    bool _waiting; // the current request is answered by another socket
+
+    RedirectCache *_redirects;
+
+    u64 _idleSince; // when the connection last became idle, 0 if busy or closed
+    u64 _serverIdleTimeout;
+    unsigned _requestsLeft;
+    bool _retryPending; // _curRequest hit a stale connection and is re-sent on the next update
+
+    // Streaming _curRequest.body
+    bool _PumpUpload(); // false if the upload failed and the socket was closed
+    RequestBody *_upBody; // _curRequest.body, or _postBody
+    MemoryBody _postBody; // _curRequest.post, if it wasn't sent with the header
+    u64 _expectMin;
+    unsigned _expectWaitMs;
+    u64 _expectUntil; // while waiting for 100 Continue: when to send the body anyway. 0 if not waiting.
+    bool _uploading;
+    bool _upChunked;
+    bool _upLast; // _upBuf holds the end of the body
+    u64 _upLeft; // if not chunked
+    std::vector<char> _upBuf; // staging buffer, allocated once
+    unsigned _upOff, _upLen; // unsent part of _upBuf
+};
+
+#ifdef MINIHTTP_SUPPORT_HTTP2
+
+// HTTP/2 client connection to one origin (RFC 9113). All requests run over the same connection at once, each as a stream,
+// with as many in flight as the server allows. https agrees on h2 via ALPN; plain http uses h2c with prior knowledge,
+// i.e. the server is assumed to speak HTTP/2 right away. If it doesn't, or the request goes to another origin, it fails.
+// Everything else works like HttpSocket: per-request callbacks, or _OnRecv() / _OnRequestDone(), during which
+// GetCurrentRequest(), GetStatusCode(), Hdr() and GetTimings() describe the stream that is being delivered.
+// _OnRequestDone() is called for every request that was sent, failed ones included.
+// Redirects are not followed, and caching, coalescing, keep-alive and Expect: 100-continue don't apply.
+// Requests are always queued; SendRequest() returns false only for a request to a different origin.
+class Http2Socket : public HttpSocket
+{
+public:
+    Http2Socket();
+    virtual ~Http2Socket();
+
+    virtual bool HasPendingTask() const { return _requestQ.size() || _streams.size(); }
+    virtual bool IsIdle() const;
+    virtual void SetMetrics(Metrics *m);
+
+    virtual bool SendRequestSwap(Request& what, bool enqueue);
+
+    void SetMaxStreams(unsigned n) { _maxStreams = n ? n : 1; } // our own limit of concurrent streams. Default 100.
+    size_t GetOpenStreams() const { return _streams.size(); }
+
+protected:
+    struct Stream;
+
+    virtual void _OnCloseInternal() { _OnClose(); }
+    virtual void _OnClose();
+    virtual void _OnData();
+    virtual bool _OnUpdate();
+    virtual bool _QueuedWork(long long& key) const;
+
+    bool _Connect();
+    void _ResetConnection();
+    bool _OnFrame(unsigned type, unsigned flags, unsigned id, const unsigned char *p, unsigned len); // false if the connection was closed
+    bool _OnHeaderBlock();
+    bool _ConnError(unsigned code); // sends GOAWAY and closes. Always false.
+    void _StartStreams();
+    void _SendHeaders(Stream *s);
+    void _PumpBodies();
+    bool _Flush(); // false if the connection was closed
+    void _Frame(unsigned type, unsigned flags, unsigned id, const void *payload, unsigned len);
+    void _WindowUpdate(unsigned id, unsigned n);
+    Stream *_Find(unsigned id) const;
+    void _Remove(Stream *s); // from _streams
+    void _Requeue(Stream *s); // the server didn't process it, so it's safe to send again
+    void _Deliver(Stream *s, const void *buf, unsigned size);
+    void _Finish(Stream *s, bool complete); // s must be removed already; deletes it
+    void _Swap(Stream *s); // exchange the stream's state with the socket's current request
+
+    std::string _origin; // host all requests go to
+    int _originPort;
+    bool _originSSL;
+
+    std::vector<Stream*> _streams; // open ones, oldest first
+    std::vector<char> _out; // frames not sent yet
+    size_t _outOff; // start of the unsent part of _out
+    std::string _hblock; // header block being put together from HEADERS and CONTINUATION frames
+    std::string _hpackOut; // scratch for encoding
+    HeaderFields _hscratch; // decodes header blocks of streams that are gone
+    void *_hpack; // header compression state (decoding side; we never index when encoding)
+    unsigned _hblockStream; // stream of _hblock, 0 if none
+    unsigned _hblockFlags;
+    unsigned _nextId;
+    unsigned _maxStreams;
+    unsigned _peerMaxStreams;
+    unsigned _peerMaxFrame;
+    unsigned _peerWindow; // initial stream window the server gave us
+    long long _sendWindow; // connection level
+    unsigned _recvUnacked; // connection level: received, not yet handed back with WINDOW_UPDATE
+    bool _draining; // GOAWAY received, or out of stream ids: no new streams, close when the open ones are done
 };
 
+#endif // MINIHTTP_SUPPORT_HTTP2
+
+#ifdef MINIHTTP_SUPPORT_WEBSOCKET
+
+// WebSocket client connection (RFC 6455). Connect() sends the Upgrade request through the normal request path;
+// once the server answered 101 and the handshake checks out, the connection carries messages instead.
+// Incoming frames are parsed in the input buffer. An unfragmented message that fits is handed to _OnMessage()
+// in place; only fragmented messages and frames bigger than the buffer are put together in a separate one.
+// Pings are answered on their own. Outgoing frames are masked into a send buffer that is flushed without blocking.
+// Text messages are not checked for valid UTF-8. No extensions (e.g. compression) are offered.
+// Don't send other requests on this socket while a WebSocket connection is up.
+class WebSocket : public HttpSocket
+{
+public:
+    WebSocket();
+
+    virtual bool HasPendingTask() const { return _wsOpen || HttpSocket::HasPendingTask(); }
+    virtual bool IsIdle() const;
+
+    // ws://, wss://, http:// or https:// URL. protocols is an optional comma-separated list of subprotocols.
+    // False if the connection could not be made; otherwise, _OnHandshake() is called once the server answered.
+    bool Connect(const std::string& url, const char *protocols = NULL, const char *extraRequest = NULL);
+    bool IsConnected() const { return _wsOpen && !_closeSent && !_closeRecv; }
+    const std::string& GetProtocol() const { return _protocol; } // subprotocol the server picked, empty if none
+
+    // Queued and sent as soon as the socket allows. False if not connected.
+    bool SendText(const char *s, size_t len);
+    bool SendText(const std::string& s) { return SendText(s.c_str(), s.length()); }
+    bool SendBinary(const void *buf, size_t len);
+    bool Ping(const void *payload = NULL, unsigned len = 0); // up to 125 bytes of payload
+    // Starts the closing handshake. The connection goes down when the server answered, or after closeWaitMs.
+    bool Close(unsigned code = 1000, const char *reason = NULL, unsigned closeWaitMs = 3000);
+
+    void SetMaxMessageSize(size_t n) { _maxMessage = n; } // bigger incoming messages fail the connection. Default 16 MB.
+    size_t GetSendQueueSize() const { return _wsOut.size() - _wsOutOff; } // bytes not sent yet
+
+protected:
+    virtual void _OnHandshake(bool ok) {} // ok is false if the server refused; GetStatusCode() and Hdr() tell more
+    virtual void _OnMessage(const char *data, size_t size, bool text) {} // data is only valid during the call
+    virtual void _OnPong(const char *data, unsigned size) {}
+    virtual void _OnDisconnect(unsigned code, const std::string& reason) {} // code 1006 if there was no close frame
+
+    virtual void _OnClose();
+    virtual void _OnData();
+    virtual bool _OnUpdate();
+
+    static void _HandshakeDone(HttpSocket *s, void *user, bool complete);
+    bool _CheckHandshake();
+    void _ParseFrames();
+    bool _OnFrame(unsigned op, bool fin, const char *p, size_t len); // false if the connection is going down
+    void _OnMessageDone(); // _msg is complete
+    bool _SendFrame(unsigned op, const void *p, size_t len);
+    bool _Flush(); // false if the connection was closed
+    void _Fail(unsigned code); // protocol violation: close frame, then close
+    unsigned _Random();
+
+    std::string _key; // Sec-WebSocket-Key of the handshake
+    std::string _offered; // subprotocols we asked for
+    std::string _protocol;
+    std::string _msg; // message being put together
+    std::string _closeReason;
+    std::vector<char> _wsOut; // frames not sent yet
+    size_t _wsOutOff; // start of the unsent part of _wsOut
+    u64 _frameLeft; // payload of a frame bigger than the input buffer that is still to come; it goes to _msg
+    size_t _maxMessage;
+    u64 _closeBy; // give up on the closing handshake at this time, 0 if not closing
+    u64 _rng;
+    unsigned _msgOp; // opcode of the message in _msg, 0 if none
+    unsigned _closeCode; // from the server's close frame
+    bool _frameFin; // of the frame that goes to _msg
+    bool _wsOpen; // handshake done, frames are flowing
+    bool _closeSent;
+    bool _closeRecv;
+};
+
+#endif // MINIHTTP_SUPPORT_WEBSOCKET
+
+#ifdef MINIHTTP_SUPPORT_SSE
+
+// Server-sent events client (text/event-stream). Open() keeps a GET request running and hands each complete event
+// to _OnEvent(). Lines are parsed as the body comes in, across chunk and packet boundaries; only an unfinished line
+// and the data of the event that is being read are kept around.
+// When the stream ends or breaks off, or nothing arrived within the idle timeout, the request goes out again after
+// the reconnect delay, with Last-Event-ID so that the server can resume where it left off.
+// A response other than 200 with text/event-stream ends it for good, and so does Stop(). Redirects are followed.
+class EventSource : public HttpSocket
+{
+public:
+    EventSource();
+
+    virtual bool HasPendingTask() const { return _active || HttpSocket::HasPendingTask(); }
+    virtual bool IsIdle() const;
+
+    // False if the first attempt failed to connect; until Stop(), it is tried again anyway.
+    bool Open(const std::string& url, const char *extraRequest = NULL);
+    void Stop(); // no more reconnects. The connection is closed on the next update.
+    bool IsActive() const { return _active; } // streaming, or about to reconnect
+    bool IsStreaming() const { return _streaming; } // the server accepted the request
+
+    void SetReconnectDelay(unsigned ms) { _retryMs = ms; } // Default 3000. The server may change it with "retry:".
+    // Reconnect if nothing arrived for this long. Servers send comments to keep a quiet stream up. 0 to disable (default).
+    void SetIdleTimeout(unsigned ms) { _idleMs = ms; }
+    // Sent as Last-Event-ID. Updated with every event that has an id; set it before Open() to resume from a known point.
+    void SetLastEventId(const std::string& id) { _lastId = id; }
+    const std::string& GetLastEventId() const { return _lastId; }
+
+protected:
+    // type is "message" unless the server sent an event field. id is the last event id, which may be empty.
+    virtual void _OnEvent(const std::string& type, const std::string& data, const std::string& id) {}
+    virtual void _OnStreamStart() {}
+    virtual void _OnStreamEnd(bool reconnect) {} // reconnect is false after Stop(), or if the server refused (GetStatusCode())
+
+    virtual void _OnClose();
+    virtual void _OnData();
+    virtual bool _OnUpdate();
+
+    static void _RecvCB(HttpSocket *s, void *user, const void *buf, unsigned size);
+    static void _DoneCB(HttpSocket *s, void *user, bool complete);
+    bool _Start();
+    bool _CheckResponse(); // false if the server refused
+    void _Parse(const char *p, size_t n);
+    void _Line(const char *p, size_t n);
+
+    std::string _url;
+    std::string _extra; // extra request header fields
+    std::string _lastId;
+    std::string _idBuf; // id of the event being read; becomes _lastId once it is complete
+    std::string _type;
+    std::string _data;
+    std::string _line; // unfinished line at the end of the last piece
+    u64 _retryAt; // when to reconnect, 0 if not waiting
+    u64 _lastRecv;
+    unsigned _retryMs;
+    unsigned _idleMs;
+    bool _active;
+    bool _checked; // response of the current request was looked at
+    bool _streaming;
+    bool _untilClose; // neither length nor chunked; the stream ends with the connection
+    bool _skipLF; // last piece ended with CR
+    bool _bom; // at the start of the stream, where a BOM may be
+};
+
+#endif // MINIHTTP_SUPPORT_SSE
+
 } // end namespace minihttp
 
 #endif
@@ -256,39 +1183,275 @@ protected:
 
 #ifdef MINIHTTP_SUPPORT_SOCKET_SET
 
+#include <deque>
 #include <map>
+#include <vector>
 
 namespace minihttp
 {
 
+// Sockets live in a slot array. Each tick, update() visits only the sockets that are readable,
+// as reported by the backend, and those that have work to do besides reading (see TcpSocket::IsIdle()).
+// With MINIHTTP_USE_IO_URING on linux, the backend also receives for plain TCP sockets, in one syscall per tick.
 class SocketSet
 {
 public:
+    // Refers to a socket in this set. Never matches another socket, even after the slot is reused.
+    typedef u64 Handle;
+
+    SocketSet();
     virtual ~SocketSet();
     void deleteAll();
     bool update();
-    void add(TcpSocket *s, bool deleteWhenDone = true);
-    bool has(TcpSocket *s);
+    Handle add(TcpSocket *s, bool deleteWhenDone = true);
+    bool has(TcpSocket *s) const;
+    TcpSocket *get(Handle h) const; // NULL if the socket was removed or deleted
     void remove(TcpSocket *s);
-    inline size_t size() { return _store.size(); }
+    inline size_t size() { return _count; }
+
+    // Aggregated over all sockets in this set. Safe to read from another thread.
+    const Metrics& GetMetrics() const { return _metrics; }
+
+    // Limits shared by all sockets in this set, and by all sockets connected to host (as passed to open()).
+    // They apply on top of each socket's own. Not owned. NULL for none; both NULL removes a host.
+    void SetRateLimit(RateLimit *in, RateLimit *out) { _limitIn = in; _limitOut = out; }
+    void SetHostRateLimit(const std::string& host, RateLimit *in, RateLimit *out);
+
+    // For sockets in this set that have none of their own, when they connect; add sockets before their first request.
+    // Not owned. NULL for none.
+    void SetSocketOptions(const SocketOptions *o) { _options = o; }
 
 //protected:
 
     struct SocketSetData
     {
+        TcpSocket *sock; // NULL if the slot is free
+        unsigned gen; // bumped when the slot is freed, so old handles stop matching
+        unsigned tick; // last update() that visited this socket
         bool deleteWhenDone;
-        // To be extended
+        bool busy; // in _busy
     };
 
-    typedef std::map<TcpSocket*, SocketSetData> Store;
+    friend class TcpSocket;
+    void _Wake(unsigned slot);
+    void _Closed(unsigned slot);
+    bool _Recv(TcpSocket *s, unsigned char *buf, size_t maxlen, int *result);
+    void _Free(unsigned slot);
+    u64 _Allowance(const std::string& host, bool out);
+    void _Consume(const std::string& host, bool out, u64 n);
+    void _Prioritize();
+
+    std::vector<SocketSetData> _slots;
+    std::vector<unsigned> _free; // unused slots
+    std::vector<unsigned> _busy; // to visit on the next tick, whether readable or not
+    std::vector<unsigned> _todo; // this tick's visits
+    std::vector<std::pair<long long, size_t> > _queued; // scratch for _Prioritize(): key, index in _todo
+    std::vector<unsigned> _order; // scratch for _Prioritize()
+    void *_poller; // backend: io_uring if enabled and available, else epoll on linux, poll() or select() elsewhere
+    unsigned _tick;
+    size_t _count;
+    Metrics _metrics;
+
+    struct HostLimits
+    {
+        RateLimit *in;
+        RateLimit *out;
+    };
+    RateLimit *_limitIn;
+    RateLimit *_limitOut;
+    std::map<std::string, HostLimits> _hostLimits;
+    const SocketOptions *_options;
 
-    Store _store;
+private:
+    SocketSet(const SocketSet&); // not copyable
+    SocketSet& operator=(const SocketSet&);
+};
+
+#ifdef MINIHTTP_SUPPORT_HTTP
+
+class SegmentSocket;
+
+// Downloads one resource into a file, over several connections in parallel.
+// The size is probed with a 1-byte Range request first. If the server supports ranges,
+// the file is pre-allocated and split into segments that are fetched on their own sockets
+// and written at their offsets. A segment whose connection drops is resumed where it stopped;
+// If-Range makes sure that a resource that changed in the meantime is not mixed with the old one.
+// Servers that ignore Range get a normal single-connection download.
+class SegmentedDownload
+{
+    friend class SegmentSocket;
+public:
+    SegmentedDownload();
+    ~SegmentedDownload(); // removes the sockets from the SocketSet
+
+    // The sockets are added to ss, which must be updated until IsDone() or HasFailed().
+    bool Start(SocketSet& ss, const std::string& url, const char *filename, unsigned segments = 4);
+
+    void SetMaxRetries(unsigned n) { _maxRetries = n; } // per segment. Default 3.
+    void SetUserAgent(const std::string& s) { _user_agent = s; }
+
+    bool IsDone() const { return _done; }
+    bool HasFailed() const { return _failed; }
+    u64 GetSize() const { return _size; } // 0 while unknown
+    u64 GetReceived() const;
+
+private:
+    struct Segment;
+
+    SegmentSocket *_NewSocket(int idx);
+    bool _RequestSegment(unsigned idx);
+    void _OnProbeDone(SegmentSocket *s);
+    void _OnData(int idx, SegmentSocket *s, const void *buf, unsigned size);
+    void _OnSegmentDone(int idx, SegmentSocket *s);
+    void _OnSegmentUpdate(int idx, SegmentSocket *s);
+    void _Fail();
+    void _Finish();
+
+    SocketSet *_ss;
+    std::string _url;
+    std::string _user_agent;
+    std::string _validator; // ETag or Last-Modified of the probed resource, for If-Range
+    void *_file; // FILE*
+    SegmentSocket *_probe;
+    Segment *_segs;
+    unsigned _nsegs;
+    u64 _size;
+    u64 _probeWritten; // if the server ignored the Range request
+    unsigned _maxRetries;
+    bool _done;
+    bool _failed;
 };
 
+class SchedulerSocket;
+
+// Spreads requests over a bounded number of connections: at most maxPerHost to each host (scheme, name and port),
+// and at most maxTotal in all. Requests wait in a queue per host, ordered by Request::priority, until a connection
+// is free for them. Hosts with waiting requests take turns, sending as many requests per turn as their weight
+// (default 1), so a host with a long queue doesn't hold up the others.
+// Idle connections stay open for the next request to the same host; when all are in use, the scheduler opens
+// new ones up to maxTotal, and only then takes over idle connections to other hosts.
+// Responses go to the per-request callbacks (Request::onRecv, onDone), which get the connection that carried them.
+// A redirect is followed on the same connection and counts for the host it started with.
+class RequestScheduler
+{
+    friend class SchedulerSocket;
+public:
+    // The connections are added to ss, which must be updated.
+    RequestScheduler(SocketSet& ss, unsigned maxPerHost = 6, unsigned maxTotal = 32);
+    virtual ~RequestScheduler(); // removes the connections from the SocketSet. Waiting requests are dropped without callback.
+
+    void SetLimits(unsigned maxPerHost, unsigned maxTotal); // busy connections above the new limits are left alone
+    void SetHostWeight(const std::string& host, unsigned weight); // host name as in URLs. 0 resets to 1.
+    void SetUserAgent(const std::string& s) { _user_agent = s; }
+    // For new connections. Default 30. 0 sends "Connection: close", so that no connection is reused.
+    void SetKeepAlive(unsigned secs) { _keep_alive = secs; }
+    void SetCache(HttpCache *c) { _cache = c; } // for new connections. Not owned.
+    void SetRedirectCache(RedirectCache *c) { _redirects = c; } // for new connections. Not owned.
+
+    bool Fetch(const std::string& url, Request::RecvFunc recv, Request::DoneFunc done, void *user = NULL, const POST *post = NULL);
+    // Takes over the contents of req (swapped out), like HttpSocket::SendRequestSwap(). False if it has no host.
+    bool Submit(Request& req);
+
+    size_t GetWaiting() const { return _waiting; } // requests queued for a connection
+    size_t GetActive() const { return _active; } // requests on a connection
+    size_t GetConnections() const { return _conns.size(); }
+    bool IsDone() const { return !_waiting && !_active; }
+
+protected:
+    virtual void _OnNewSocket(HttpSocket *s) {} // called for each new connection before it is used, for further setup
+
+private:
+    struct Host
+    {
+        std::string name;
+        RequestQueue q;
+        unsigned active; // connections busy with requests of this host
+        unsigned credit; // requests left in this turn
+        bool listed; // in _turns
+    };
+    typedef std::map<std::string, Host> HostMap;
+
+    void _Dispatch();
+    SchedulerSocket *_PickSocket(const std::string& key);
+    void _OnSocketFree(SchedulerSocket *s);
+    void _Forget(HostMap::iterator it); // if nothing refers to it anymore
+    unsigned _Weight(const std::string& name) const;
+
+    SocketSet *_ss;
+    std::vector<SchedulerSocket*> _conns;
+    HostMap _hosts; // key: scheme://name:port
+    std::deque<HostMap::iterator> _turns; // hosts with waiting requests; the front one is sending
+    std::map<std::string, unsigned> _weights;
+    std::string _user_agent;
+    HttpCache *_cache;
+    RedirectCache *_redirects;
+    unsigned _keep_alive;
+    unsigned _maxPerHost;
+    unsigned _maxTotal;
+    size_t _waiting;
+    size_t _active;
+    bool _dispatching;
+};
+
+#endif
+
 #endif
 
 
 } // end namespace minihttp
 
+// ------------------------------------------------------------------------
+
+#if defined(MINIHTTP_SUPPORT_FUTURE) && defined(MINIHTTP_SUPPORT_HTTP) && (__cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L))
+
+#include <future>
+
+namespace minihttp
+{
+
+struct FetchResult
+{
+    FetchResult() : status(0), complete(false) {}
+    unsigned status;
+    bool complete; // false if no full response arrived
+    std::string body;
+};
+
+// Sends a request on s and returns its outcome as a future. The socket must keep being updated
+// by someone, so don't wait for the future on the thread that does that.
+inline std::future<FetchResult> FetchFuture(HttpSocket& s, const std::string& url, const POST *post = NULL)
+{
+    struct State
+    {
+        std::promise<FetchResult> promise;
+        FetchResult result;
+
+        static void Recv(HttpSocket *, void *user, const void *buf, unsigned size)
+        {
+            ((State*)user)->result.body.append((const char*)buf, size);
+        }
+        static void Done(HttpSocket *s, void *user, bool complete)
+        {
+            State *st = (State*)user;
+            st->result.status = s->GetStatusCode();
+            st->result.complete = complete;
+            st->promise.set_value(std::move(st->result));
+            delete st;
+        }
+    };
+
+    State *st = new State;
+    std::future<FetchResult> f = st->promise.get_future();
+    if(!s.Fetch(url, State::Recv, State::Done, st, post)) // Done was not called, st is still ours
+    {
+        st->promise.set_value(std::move(st->result));
+        delete st;
+    }
+    return f;
+}
+
+} // end namespace minihttp
+
+#endif
 
 #endif
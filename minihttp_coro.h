@@ -0,0 +1,393 @@
+/* This program is free software. It comes without any warranty, to
+* the extent permitted by applicable law. You can redistribute it
+* and/or modify it under the terms of the Do What The Fuck You Want
+* To Public License, Version 2, as published by Sam Hocevar.
+* See http://sam.zoy.org/wtfpl/COPYING for more details. */
+
+// Optional C++20 coroutine interface. Header-only, include after (or instead of) minihttp.h.
+// Every request runs on its own HttpSocket inside a SocketSet; whoever calls SocketSet::update()
+// drives all coroutines, no threads involved. Empty if the compiler has no coroutine support.
+//
+//   minihttp::coro::Task<> fetch(minihttp::coro::Client& c)
+//   {
+//       minihttp::coro::Response r = co_await c.get("http://example.com");
+//       ...
+//   }
+//
+//   minihttp::SocketSet ss;
+//   minihttp::coro::Client client(ss);
+//   minihttp::coro::Spawn(fetch(client));
+//   while(ss.size())
+//       ss.update();
+
+#ifndef MINIHTTP_CORO_H
+#define MINIHTTP_CORO_H
+
+#include "minihttp.h"
+
+#if defined(__cpp_impl_coroutine) && defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_SOCKET_SET)
+
+#define MINIHTTP_CORO_H_AVAILABLE
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdlib>
+#include <exception>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace minihttp {
+namespace coro {
+
+// ---- Task -----
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; } // started when awaited
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template<typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template<typename T> struct Promise : PromiseBase
+{
+    std::optional<T> value;
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result()
+    {
+        if(error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<> struct Promise<void> : PromiseBase
+{
+    void return_void() {}
+    void result()
+    {
+        if(error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // end namespace detail
+
+// Lazy coroutine result; runs when co_await'ed, or when handed to Spawn().
+template<typename T> class Task
+{
+public:
+    struct promise_type : detail::Promise<T>
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task&& o) noexcept : _h(std::exchange(o._h, {})) {}
+    Task& operator=(Task&& o) noexcept { std::swap(_h, o._h); return *this; }
+    ~Task() { if(_h) _h.destroy(); }
+
+    bool done() const { return !_h || _h.done(); }
+
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> h;
+            bool await_ready() noexcept { return !h || h.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+            {
+                h.promise().continuation = cont;
+                return h;
+            }
+            T await_resume() { return h.promise().result(); }
+        };
+        return Awaiter{_h};
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : _h(h) {}
+    std::coroutine_handle<promise_type> _h;
+};
+
+namespace detail {
+
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+} // end namespace detail
+
+// Starts a task that owns itself and goes away when finished. Exceptions escaping it terminate.
+inline detail::Detached Spawn(Task<> t)
+{
+    co_await std::move(t);
+}
+
+// ---- HTTP -----
+
+struct Response
+{
+    unsigned status = 0; // 0 if there was no response at all
+    std::map<std::string, std::string> headers; // field names in lower case
+    std::string body; // everything read() returned. Empty for statuses other than 2xx, whose bodies the socket skips.
+    bool complete = false; // false if the connection failed or broke off
+
+    bool ok() const { return complete && status >= 200 && status <= 206; }
+    const char *header(const char *name) const
+    {
+        std::map<std::string, std::string>::const_iterator it = headers.find(name);
+        return it == headers.end() ? NULL : it->second.c_str();
+    }
+};
+
+class Stream;
+class Client;
+
+namespace detail {
+
+// Bridges the callbacks of one request to whoever co_awaits its Stream.
+// Owned by the SocketSet; the Stream only borrows it.
+class CoroSocket : public HttpSocket
+{
+public:
+    CoroSocket() : _owned(true), _haveHeaders(false), _finished(false), _wantData(false) {}
+
+    virtual bool HasPendingTask() const
+    {
+        return HttpSocket::HasPendingTask() || _owned; // the Stream still looks at us
+    }
+
+    virtual bool IsIdle() const
+    {
+        // _OnUpdate() closes abandoned requests and reports vanished ones
+        return HttpSocket::IsIdle() && _owned && (_finished || _inProgress);
+    }
+
+protected:
+    friend class minihttp::coro::Stream;
+    friend class minihttp::coro::Client;
+
+    virtual bool _OnUpdate()
+    {
+        const bool r = HttpSocket::_OnUpdate();
+        if(!_owned)
+        {
+            if(!_finished && isOpen()) // nobody cares anymore
+                close();
+        }
+        else if(!_finished && !_inProgress && !_retryPending && !_requestQ.size())
+        {
+            // Request went away without being done; connection failed or broke off
+            _finished = true;
+            _Wake();
+        }
+        return r;
+    }
+
+    virtual void _OnData()
+    {
+        HttpSocket::_OnData();
+        if(_inProgress && _status && !_haveHeaders && !IsRedirecting())
+            _CaptureHeaders();
+    }
+
+    virtual void _OnRecv(void *buf, unsigned int size)
+    {
+        _CaptureHeaders();
+        if(!_owned)
+            return;
+        if(_waiter && _wantData && _pending.empty())
+        {
+            _chunk = std::string_view((const char*)buf, size); // handed over in place
+            _Wake();
+            _chunk = std::string_view();
+        }
+        else
+            _pending.append((const char*)buf, size);
+    }
+
+    virtual void _OnRequestDone()
+    {
+        _CaptureHeaders();
+        _resp.complete = true;
+        _finished = true;
+        _Wake();
+    }
+
+    void _CaptureHeaders()
+    {
+        if(_haveHeaders)
+            return;
+        _haveHeaders = true;
+        _resp.status = GetStatusCode();
+        for(size_t i = 0; i < _hdrs.size(); ++i)
+            _resp.headers[_hdrs.key(i)] = _hdrs.value(i);
+        if(!_wantData)
+            _Wake();
+    }
+
+    void _Wake()
+    {
+        if(std::coroutine_handle<> h = std::exchange(_waiter, {}))
+            h.resume();
+    }
+
+    std::string_view _Take()
+    {
+        if(!_chunk.empty())
+            return _chunk;
+        _current.clear();
+        _current.swap(_pending);
+        return _current;
+    }
+
+    void _Release()
+    {
+        _owned = false;
+        _waiter = {};
+        _Wake();
+    }
+
+    std::coroutine_handle<> _waiter;
+    Response _resp; // status and header fields; body goes through _pending
+    std::string _pending; // arrived while nobody was reading
+    std::string _current; // what the last read() returned, unless it was _chunk
+    std::string_view _chunk;
+    bool _owned;
+    bool _haveHeaders;
+    bool _finished;
+    bool _wantData;
+};
+
+} // end namespace detail
+
+// One request in flight. Await headers() first, then read() until it returns an empty chunk.
+class Stream
+{
+public:
+    Stream(Stream&& o) noexcept : _s(std::exchange(o._s, nullptr)) {}
+    Stream& operator=(Stream&& o) noexcept { std::swap(_s, o._s); return *this; }
+    ~Stream() { if(_s) _s->_Release(); }
+
+    // Resumes once status and header fields are known, or the request failed (status 0).
+    auto headers() noexcept
+    {
+        struct Awaiter
+        {
+            detail::CoroSocket *s;
+            bool await_ready() noexcept { return !s || s->_haveHeaders || s->_finished; }
+            void await_suspend(std::coroutine_handle<> h) noexcept { s->_waiter = h; s->_wantData = false; }
+            Response await_resume() { return s ? s->_resp : Response(); }
+        };
+        return Awaiter{_s};
+    }
+
+    // Resumes with the next piece of the body, valid until the next read().
+    // Empty once the response is complete or the request failed.
+    auto read() noexcept
+    {
+        struct Awaiter
+        {
+            detail::CoroSocket *s;
+            bool await_ready() noexcept { return !s || !s->_pending.empty() || s->_finished; }
+            void await_suspend(std::coroutine_handle<> h) noexcept { s->_waiter = h; s->_wantData = true; }
+            std::string_view await_resume() noexcept { return s ? s->_Take() : std::string_view(); }
+        };
+        return Awaiter{_s};
+    }
+
+    bool failed() const { return !_s || (_s->_finished && !_s->_resp.complete); }
+
+private:
+    friend class Client;
+    explicit Stream(detail::CoroSocket *s) : _s(s) {}
+    detail::CoroSocket *_s;
+};
+
+// Creates requests on a SocketSet. Not owned; the SocketSet must outlive all requests.
+class Client
+{
+public:
+    explicit Client(SocketSet& ss) : _ss(ss), _cache(NULL), _redirects(NULL) {}
+
+    void SetUserAgent(const std::string& s) { _user_agent = s; }
+    void SetCache(HttpCache *c) { _cache = c; }
+    void SetRedirectCache(RedirectCache *c) { _redirects = c; }
+
+    // Starts a request right away. The returned stream fails at once if no connection could be made.
+    Stream open(const std::string& url, const POST *post = NULL)
+    {
+        detail::CoroSocket *s = new detail::CoroSocket;
+        s->SetUserAgent(_user_agent);
+        s->SetCache(_cache);
+        s->SetRedirectCache(_redirects);
+        s->SetNonBlocking(true);
+        s->SetBufsizeIn(64 * 1024);
+        if(!s->Download(url, NULL, NULL, post))
+            s->_finished = true;
+        _ss.add(s, true);
+        return Stream(s);
+    }
+
+    // Whole response in one piece.
+    Task<Response> get(std::string url) { return _Fetch(std::move(url), std::nullopt); }
+    Task<Response> post(std::string url, POST data) { return _Fetch(std::move(url), std::move(data)); }
+
+private:
+    Task<Response> _Fetch(std::string url, std::optional<POST> post)
+    {
+        Stream s = open(url, post ? &*post : NULL);
+        Response r = co_await s.headers();
+        if(const char *len = r.header("content-length")) // a hint only; the server may send something else, or a lot
+            r.body.reserve((size_t)std::min<unsigned long long>(strtoull(len, NULL, 10), 1 << 20));
+        for(;;)
+        {
+            std::string_view chunk = co_await s.read();
+            if(chunk.empty())
+                break;
+            r.body.append(chunk);
+        }
+        r.complete = !s.failed();
+        co_return r;
+    }
+
+    SocketSet& _ss;
+    std::string _user_agent;
+    HttpCache *_cache;
+    RedirectCache *_redirects;
+};
+
+} // end namespace coro
+} // end namespace minihttp
+
+#endif
+
+#endif
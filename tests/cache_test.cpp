@@ -0,0 +1,438 @@
+// Tests for the response caches: DiskCache entries and their checks, MemCache eviction and body lifetime,
+// and HttpSocket's use of either (fresh hits, expiry, revalidation, Vary) against a scripted peer on a local socket.
+// Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && !defined(_WIN32)
+
+#include "testutil.h"
+#include <dirent.h>
+
+using namespace minihttp;
+
+class TestDiskCache : public DiskCache
+{
+public:
+    TestDiskCache(const std::string& dir) : DiskCache(dir) {}
+    std::string path(const std::string& url, const char *ext) const { return _Path(url, ext); }
+};
+
+static void store(HttpCache& c, const std::string& url, const std::string& body, u64 expires = u64(-1), const char *etag = "")
+{
+    HttpCache::Info info;
+    info.expires = expires;
+    info.etag = etag;
+    info.size = body.length();
+    void *h = c.BeginStore(url, info);
+    CHECK(h);
+    if(!h)
+        return;
+    c.Append(h, body.data(), unsigned(body.length() / 2));
+    c.Append(h, body.data() + body.length() / 2, unsigned(body.length() - body.length() / 2));
+    c.EndStore(h, true);
+}
+
+static void append(void *ctx, const void *buf, unsigned size)
+{
+    ((std::string*)ctx)->append((const char*)buf, size);
+}
+
+// The body, or "-" if there is none
+static std::string replay(HttpCache& c, const std::string& url)
+{
+    std::string s;
+    return c.Replay(url, append, &s) ? s : "-";
+}
+
+static std::string readFile(const std::string& path)
+{
+    std::string s;
+    if(FILE *f = fopen(path.c_str(), "rb"))
+    {
+        char buf[4096];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), f)))
+            s.append(buf, n);
+        fclose(f);
+    }
+    return s;
+}
+
+static void writeFile(const std::string& path, const std::string& s)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    CHECK(f && fwrite(s.data(), 1, s.length(), f) == s.length());
+    if(f)
+        fclose(f);
+}
+
+static std::string s_dir;
+
+static void clearDir()
+{
+    if(DIR *d = opendir(s_dir.c_str()))
+    {
+        while(dirent *e = readdir(d))
+            if(e->d_name[0] != '.')
+                remove((s_dir + "/" + e->d_name).c_str());
+        closedir(d);
+    }
+}
+
+static void testDiskEntries()
+{
+    clearDir();
+    TestDiskCache c(s_dir);
+    const std::string a = "http://a:80/", b = "http://b:80/";
+    HttpCache::Info info;
+    CHECK(!c.Lookup(a, info) && replay(c, a) == "-");
+
+    store(c, a, "body of a", 1234, "\"ea\"");
+    store(c, b, "body of b!");
+    CHECK(c.Lookup(a, info) && info.size == 9 && info.expires == 1234 && info.etag == "\"ea\"");
+    CHECK(replay(c, a) == "body of a");
+    CHECK(replay(c, b) == "body of b!");
+
+    // Survives the instance
+    TestDiskCache c2(s_dir + "/");
+    CHECK(replay(c2, a) == "body of a");
+
+    // Empty body
+    store(c, "http://e:80/", "");
+    CHECK(c.Lookup("http://e:80/", info) && !info.size && replay(c, "http://e:80/") == "");
+
+    // Another URL's body, e.g. after a hash collision, is not used even if it has the right size
+    const std::string bodyA = readFile(c.path(a, ".body"));
+    store(c, b, "body of b");
+    CHECK(replay(c, b) == "body of b");
+    writeFile(c.path(b, ".body"), bodyA);
+    CHECK(c.Lookup(b, info) && replay(c, b) == "-");
+
+    // Neither is a body that doesn't go with the header file, a cut off one, or one with something behind it
+    store(c, b, "body of b");
+    info.size = 10;
+    c.Refresh(b, info);
+    CHECK(replay(c, b) == "-");
+    writeFile(c.path(a, ".body"), bodyA.substr(0, bodyA.length() - 1));
+    CHECK(replay(c, a) == "-");
+    writeFile(c.path(a, ".body"), bodyA + "x");
+    CHECK(replay(c, a) == "-");
+    writeFile(c.path(a, ".body"), "body of a"); // no head at all
+    CHECK(replay(c, a) == "-");
+    writeFile(c.path(a, ".body"), bodyA);
+    CHECK(replay(c, a) == "body of a");
+
+    // Incomplete or not matching the announced size: not stored, and the old entry is gone too
+    info.size = 5;
+    void *h = c.BeginStore(a, info);
+    c.Append(h, "abc", 3);
+    c.EndStore(h, true);
+    CHECK(!c.Lookup(a, info) && replay(c, a) == "-");
+    store(c, a, "body of a");
+    h = c.BeginStore(a, HttpCache::Info());
+    c.Append(h, "abc", 3);
+    c.EndStore(h, false);
+    CHECK(!c.Lookup(a, info));
+
+    c.Remove(b);
+    CHECK(!c.Lookup(b, info) && replay(c, b) == "-");
+}
+
+// While a replay is running, the entry goes away
+struct EvictingReplay
+{
+    MemCache *cache;
+    std::string url, got;
+};
+
+static void appendEvicting(void *ctx, const void *buf, unsigned size)
+{
+    EvictingReplay& r = *(EvictingReplay*)ctx;
+    r.cache->Remove(r.url);
+    r.cache->Clear();
+    r.got.append((const char*)buf, size);
+}
+
+static void testMemEntries()
+{
+    MemCache c(100);
+    const std::string a = "http://a:80/", b = "http://b:80/", d = "http://d:80/";
+    const std::string forty(40, '4');
+    HttpCache::Info info;
+
+    // Least recently used goes first. Lookups and replays count as use.
+    store(c, a, forty);
+    store(c, b, forty);
+    CHECK(c.GetBytes() == 80);
+    CHECK(c.Lookup(a, info));
+    store(c, d, forty);
+    CHECK(c.GetBytes() == 80);
+    CHECK(!c.Lookup(b, info) && replay(c, b) == "-");
+    CHECK(replay(c, a) == forty && replay(c, d) == forty);
+    CHECK(replay(c, a) == forty);
+    c.SetBudget(50);
+    CHECK(c.GetBytes() == 40 && c.Lookup(a, info) && !c.Lookup(d, info));
+
+    // Replacing an entry doesn't count its old body
+    store(c, a, "short");
+    CHECK(c.GetBytes() == 5 && replay(c, a) == "short");
+
+    // Bigger than the whole budget: not stored, whether the size is known up front or not
+    const std::string big(51, 'b');
+    info = HttpCache::Info();
+    info.size = big.length();
+    CHECK(!c.BeginStore(b, info));
+    void *h = c.BeginStore(b, HttpCache::Info());
+    CHECK(h);
+    c.Append(h, big.data(), 30);
+    c.Append(h, big.data(), 30);
+    c.EndStore(h, true);
+    CHECK(!c.Lookup(b, info) && c.GetBytes() == 5);
+
+    // A body handed out stays valid after its entry is evicted, until the last reference is released
+    store(c, b, forty, u64(time(NULL)) + 60);
+    SharedBody *body = c.GetShared(b);
+    CHECK(body && body->size() == 40);
+    store(c, d, std::string(50, 'd'));
+    CHECK(!c.Lookup(b, info) && c.GetBytes() == 50);
+    if(body)
+    {
+        CHECK(std::string(body->data(), body->size()) == forty && !body->data()[40]);
+        body->AddRef();
+        body->Release();
+        CHECK(std::string(body->data(), body->size()) == forty);
+        body->Release();
+    }
+    c.Clear();
+    CHECK(!c.GetBytes() && !c.Lookup(d, info));
+
+    // Only fresh entries are shared
+    store(c, a, "stale", u64(time(NULL)) - 1);
+    store(c, b, "fresh", u64(time(NULL)) + 60);
+    CHECK(c.Lookup(a, info) && !c.GetShared(a));
+    body = c.GetShared(b);
+    CHECK(body && std::string(body->data()) == "fresh");
+    if(body)
+        body->Release();
+
+    // The entry may go away while it is replayed
+    EvictingReplay r;
+    r.cache = &c;
+    r.url = b;
+    CHECK(c.Replay(b, appendEvicting, &r) && r.got == "fresh");
+    CHECK(!c.Lookup(b, info) && !c.GetBytes());
+}
+
+static bool request(HttpSocket& c, LoopbackPeer& p, const char *resource, Result& r)
+{
+    r = Result();
+    return c.SendRequest(testRequest(p.port, resource, r), false);
+}
+
+static bool expectRequest(LoopbackPeer& p, const char *resource, std::string& head)
+{
+    if(!p.accept() || !p.readUntil("\r\n\r\n", head))
+        return false;
+    return !head.compare(0, strlen(resource) + 5, std::string("GET ") + resource + " ");
+}
+
+static std::string field(const std::string& head, const char *name)
+{
+    const size_t at = head.find(std::string("\r\n") + name + ": ");
+    if(at == std::string::npos)
+        return std::string();
+    const size_t from = at + strlen(name) + 4;
+    return head.substr(from, head.find("\r\n", from) - from);
+}
+
+static void respond(LoopbackPeer& p, const char *fields, const char *body)
+{
+    char len[64];
+    sprintf(len, "Content-Length: %u\r\n\r\n", unsigned(strlen(body)));
+    p.write(std::string("HTTP/1.1 200 OK\r\n") + fields + len + body);
+    p.flush();
+}
+
+// A request that the cache answers: done right away, nothing goes out
+static bool cached(HttpSocket& c, LoopbackPeer& p, const char *resource, const char *body)
+{
+    Result r;
+    CHECK(request(c, p, resource, r));
+    return r.done && r.complete && r.status == 200 && r.body == body && c.GetTimings().fromCache && !p.pending(30);
+}
+
+static void testSocket(HttpCache& cache)
+{
+    HttpSocket c;
+    c.SetCache(&cache);
+    LoopbackPeer p(c);
+    Result r;
+    std::string head;
+
+    // Fresh: served from the cache until it expires
+    CHECK(request(c, p, "/fresh", r));
+    CHECK(expectRequest(p, "/fresh", head));
+    respond(p, "Cache-Control: max-age=60\r\nContent-Type: text/plain\r\n", "hello");
+    CHECK(r.done && r.complete && r.body == "hello" && !c.GetTimings().fromCache);
+    CHECK(cached(c, p, "/fresh", "hello"));
+    CHECK(cached(c, p, "/fresh", "hello"));
+
+    // Not cacheable: no-store, or no way to reuse it
+    CHECK(request(c, p, "/nostore", r));
+    CHECK(expectRequest(p, "/nostore", head));
+    respond(p, "Cache-Control: no-store, max-age=60\r\n", "x");
+    CHECK(request(c, p, "/nostore", r));
+    CHECK(expectRequest(p, "/nostore", head));
+    respond(p, "", "x");
+    CHECK(r.done && r.complete && !c.GetTimings().fromCache);
+
+    // Stale with validators: revalidated, and a 304 brings back the stored body as a 200
+    CHECK(request(c, p, "/stale", r));
+    CHECK(expectRequest(p, "/stale", head));
+    CHECK(field(head, "If-None-Match").empty());
+    respond(p, "Cache-Control: max-age=0\r\nETag: \"v1\"\r\nLast-Modified: Mon, 01 Jan 2024 00:00:00 GMT\r\n", "stale body");
+    CHECK(request(c, p, "/stale", r));
+    CHECK(expectRequest(p, "/stale", head));
+    CHECK(field(head, "If-None-Match") == "\"v1\"");
+    CHECK(field(head, "If-Modified-Since") == "Mon, 01 Jan 2024 00:00:00 GMT");
+    p.write("HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=60\r\nETag: \"v2\"\r\n\r\n");
+    p.flush();
+    CHECK(r.done && r.complete && r.status == 200 && r.body == "stale body" && c.GetTimings().fromCache);
+    HttpCache::Info info;
+    CHECK(cache.Lookup(HttpCache::MakeKey(testRequest(p.port, "/stale", r)), info) && info.etag == "\"v2\"");
+    CHECK(cached(c, p, "/stale", "stale body")); // fresh again
+
+    // Changed: the new response replaces the entry
+    CHECK(request(c, p, "/changed", r));
+    CHECK(expectRequest(p, "/changed", head));
+    respond(p, "ETag: \"a\"\r\n", "old");
+    CHECK(request(c, p, "/changed", r));
+    CHECK(expectRequest(p, "/changed", head));
+    CHECK(field(head, "If-None-Match") == "\"a\"");
+    respond(p, "ETag: \"b\"\r\nCache-Control: max-age=60\r\n", "new!");
+    CHECK(r.done && r.status == 200 && r.body == "new!" && !c.GetTimings().fromCache);
+    CHECK(cached(c, p, "/changed", "new!"));
+
+    // Vary: Accept-Encoding is part of the key, so another encoding is a miss, and both are kept
+    c.SetAcceptEncoding("gzip");
+    CHECK(request(c, p, "/vary", r));
+    CHECK(expectRequest(p, "/vary", head));
+    respond(p, "Cache-Control: max-age=60\r\nVary: accept-encoding\r\n", "gzipped");
+    CHECK(cached(c, p, "/vary", "gzipped"));
+    c.SetAcceptEncoding("");
+    CHECK(request(c, p, "/vary", r));
+    CHECK(expectRequest(p, "/vary", head));
+    CHECK(field(head, "Accept-Encoding").empty());
+    respond(p, "Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n", "plain");
+    CHECK(r.body == "plain" && !c.GetTimings().fromCache);
+    CHECK(cached(c, p, "/vary", "plain"));
+    c.SetAcceptEncoding("gzip");
+    CHECK(cached(c, p, "/vary", "gzipped"));
+    c.SetAcceptEncoding("");
+
+    // Vary on anything else: not stored
+    CHECK(request(c, p, "/ua", r));
+    CHECK(expectRequest(p, "/ua", head));
+    respond(p, "Cache-Control: max-age=60\r\nVary: Accept-Encoding, User-Agent\r\n", "ua");
+    CHECK(request(c, p, "/ua", r));
+    CHECK(expectRequest(p, "/ua", head));
+    respond(p, "Cache-Control: max-age=60\r\nVary: *\r\n", "ua");
+    CHECK(r.done && !c.GetTimings().fromCache);
+    CHECK(request(c, p, "/ua", r));
+    CHECK(expectRequest(p, "/ua", head));
+    respond(p, "", "ua");
+}
+
+// The socket only takes fresh entries, by their expiry time
+static void testExpiry(HttpCache& cache)
+{
+    HttpSocket c;
+    c.SetCache(&cache);
+    LoopbackPeer p(c);
+    Result r;
+    std::string head;
+    const std::string key = HttpCache::MakeKey(testRequest(p.port, "/exp", r));
+    HttpCache::Info info;
+
+    CHECK(request(c, p, "/exp", r));
+    CHECK(expectRequest(p, "/exp", head));
+    respond(p, "Cache-Control: max-age=60\r\n", "sixty");
+    const u64 now = u64(time(NULL));
+    CHECK(cache.Lookup(key, info) && info.expires >= now + 59 && info.expires <= now + 60);
+    CHECK(cached(c, p, "/exp", "sixty"));
+
+    // Expired, and without validators: fetched again as if it wasn't there
+    info.expires = now - 1;
+    cache.Refresh(key, info);
+    CHECK(request(c, p, "/exp", r));
+    CHECK(expectRequest(p, "/exp", head));
+    CHECK(field(head, "If-None-Match").empty() && field(head, "If-Modified-Since").empty());
+    respond(p, "Cache-Control: max-age=0\r\n", "zero");
+    CHECK(r.done && r.body == "zero" && !c.GetTimings().fromCache);
+    CHECK(request(c, p, "/exp", r));
+    CHECK(expectRequest(p, "/exp", head));
+    respond(p, "Cache-Control: no-cache, max-age=60\r\n", "nocache");
+    CHECK(cache.Lookup(key, info) && info.expires <= u64(time(NULL)));
+    CHECK(request(c, p, "/exp", r));
+    CHECK(expectRequest(p, "/exp", head));
+    respond(p, "", "done");
+}
+
+// A 304 for an entry whose body doesn't check out: the 304 is passed on, and the entry is dropped
+static void testLostBody()
+{
+    clearDir();
+    TestDiskCache cache(s_dir);
+    HttpSocket c;
+    c.SetCache(&cache);
+    LoopbackPeer p(c);
+    Result r;
+    std::string head;
+    CHECK(request(c, p, "/lost", r));
+    CHECK(expectRequest(p, "/lost", head));
+    respond(p, "ETag: \"x\"\r\n", "lost body");
+    const std::string key = HttpCache::MakeKey(testRequest(p.port, "/lost", r));
+    writeFile(cache.path(key, ".body"), readFile(cache.path(key, ".body")).substr(0, 20));
+    CHECK(request(c, p, "/lost", r));
+    CHECK(expectRequest(p, "/lost", head));
+    CHECK(field(head, "If-None-Match") == "\"x\"");
+    p.write("HTTP/1.1 304 Not Modified\r\n\r\n");
+    p.flush();
+    CHECK(r.done && r.complete && r.status == 304 && r.body.empty() && !c.GetTimings().fromCache);
+    HttpCache::Info info;
+    CHECK(!cache.Lookup(key, info));
+}
+
+int main()
+{
+    InitNetwork();
+    char dir[] = "/tmp/minihttp-cache-XXXXXX";
+    CHECK(mkdtemp(dir));
+    s_dir = dir;
+
+    testDiskEntries();
+    clearDir();
+    TestDiskCache disk(s_dir);
+    testSocket(disk);
+    testExpiry(disk);
+    testLostBody();
+
+    testMemEntries();
+    MemCache mem(1 << 20);
+    testSocket(mem);
+    testExpiry(mem);
+
+    clearDir();
+    rmdir(dir);
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,308 @@
+// Tests for Coalescer: one request on the wire for a group of sockets, the response fanned out to all of them,
+// waiters going away in the middle of it, and the leader failing. Against a scripted peer on a local socket.
+// Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+class TestCoalescer : public Coalescer
+{
+public:
+    std::string key(const HttpSocket& s, const Request& req) const { return _MakeKey(&s, req); }
+};
+
+// Sockets attached to one coalescer and updated by one set. Not deleted by the set.
+struct Group
+{
+    Group(unsigned n) : peer(set)
+    {
+        for(unsigned i = 0; i < n; ++i)
+        {
+            HttpSocket *s = new HttpSocket;
+            s->SetCoalescer(&co);
+            set.add(s, false);
+            socks.push_back(s);
+        }
+    }
+    ~Group()
+    {
+        for(size_t i = 0; i < socks.size(); ++i)
+            delete socks[i];
+    }
+
+    TestCoalescer co;
+    SocketSet set;
+    LoopbackPeer peer;
+    std::vector<HttpSocket*> socks; // NULL once deleted
+    std::vector<Result> results;
+};
+
+static std::string pattern(size_t n, unsigned seed)
+{
+    std::string s(n, 0);
+    for(size_t i = 0; i < n; ++i)
+        s[i] = char((unsigned(i) * 2654435761u + seed * 40503u) >> 13);
+    return s;
+}
+
+static bool expectRequest(LoopbackPeer& p, const char *resource)
+{
+    std::string head;
+    if(!p.accept() || !p.readUntil("\r\n\r\n", head))
+        return false;
+    return !head.compare(0, strlen(resource) + 5, std::string("GET ") + resource + " ");
+}
+
+static std::string header(size_t len, const char *extra = "")
+{
+    char buf[256];
+    sprintf(buf, "HTTP/1.1 200 OK\r\nContent-Length: %u\r\nX-Test: shared\r\n%s\r\n", unsigned(len), extra);
+    return buf;
+}
+
+static void testKeys()
+{
+    TestCoalescer co;
+    HttpSocket s, t;
+    Result r;
+    const Request a = testRequest(80, "/a", r);
+    Request b = a;
+    CHECK(co.key(s, a) == co.key(t, b));
+    b.resource = "/b";
+    CHECK(co.key(s, a) != co.key(s, b));
+    b = a;
+    b.port = 81;
+    CHECK(co.key(s, a) != co.key(s, b));
+    b = a;
+    b.extraGetHeaders = "Authorization: x\r\n";
+    CHECK(co.key(s, a) != co.key(s, b));
+    t.SetAcceptEncoding("gzip");
+    CHECK(co.key(s, a) != co.key(t, a));
+}
+
+static void testFanOut()
+{
+    Group g(4);
+    g.results.resize(4);
+    HttpSocket& l = *g.socks[0];
+    LoopbackPeer& p = g.peer;
+
+    // One goes out, the others wait for it
+    CHECK(l.SendRequest(testRequest(p.port, "/a", g.results[0]), false));
+    CHECK(g.co.GetInFlight() == 1);
+    CHECK(g.socks[1]->SendRequest(testRequest(p.port, "/a", g.results[1]), false));
+    CHECK(g.socks[2]->SendRequest(testRequest(p.port, "/a", g.results[2]), false));
+    CHECK(g.co.GetInFlight() == 1 && g.socks[1]->HasPendingTask() && g.socks[2]->HasPendingTask());
+    CHECK(expectRequest(p, "/a"));
+    CHECK(!p.pending(50));
+
+    // In pieces, so that every piece is passed on separately
+    const std::string body = pattern(300000, 1);
+    p.write(header(body.length()) + body.substr(0, 1000));
+    p.flush();
+    CHECK(g.results[1].body == body.substr(0, 1000) && g.results[2].body == g.results[1].body);
+
+    // Too late to join once the response is being passed on: this one goes alone
+    CHECK(g.socks[3]->SendRequest(testRequest(p.port, "/a", g.results[3]), false));
+    CHECK(g.co.GetInFlight() == 1);
+    CHECK(p.pending(500));
+
+    p.write(body.substr(1000));
+    p.flush(4096);
+    for(unsigned i = 0; i < 3; ++i)
+    {
+        const Result& r = g.results[i];
+        CHECK(r.done && r.complete && r.status == 200 && r.header == "shared" && r.resource == "/a" && r.body == body);
+        CHECK(g.socks[i]->GetTimings().coalesced == (i > 0));
+    }
+    CHECK(!g.co.GetInFlight() && !l.HasPendingTask() && !g.socks[1]->HasPendingTask());
+    CHECK(!g.results[3].done);
+
+    CHECK(expectRequest(p, "/a"));
+    p.write(header(2) + "ok");
+    p.flush();
+    CHECK(g.results[3].done && g.results[3].complete && g.results[3].body == "ok");
+    CHECK(!g.socks[3]->GetTimings().coalesced);
+
+    // The next round starts a new flight
+    Result r;
+    CHECK(g.socks[2]->SendRequest(testRequest(p.port, "/a", r), false));
+    CHECK(g.co.GetInFlight() == 1);
+    CHECK(expectRequest(p, "/a"));
+    p.write(header(3) + "new");
+    p.flush();
+    CHECK(r.done && r.complete && r.body == "new" && !g.socks[2]->GetTimings().coalesced);
+}
+
+// A waiter whose onRecv deletes another waiter
+static Group *s_group;
+static size_t s_victim;
+
+static void onRecvDelete(HttpSocket *s, void *user, const void *buf, unsigned size)
+{
+    if(HttpSocket *v = s_group->socks[s_victim])
+    {
+        delete v;
+        s_group->socks[s_victim] = NULL;
+    }
+    onRecv(s, user, buf, size);
+}
+
+static void testLeave()
+{
+    Group g(5);
+    g.results.resize(5);
+    LoopbackPeer& p = g.peer;
+    for(unsigned i = 0; i < 5; ++i)
+    {
+        Request req = testRequest(p.port, "/a", g.results[i]);
+        if(i == 3)
+            req.onRecv = onRecvDelete;
+        CHECK(g.socks[i]->SendRequest(req, false));
+    }
+    CHECK(g.co.GetInFlight() == 1);
+    CHECK(expectRequest(p, "/a"));
+
+    // Before anything arrived
+    delete g.socks[1];
+    g.socks[1] = NULL;
+
+    // While the first piece of the body is passed on: #3 takes out #2, which already has it
+    s_group = &g;
+    s_victim = 2;
+    const std::string body = pattern(50000, 2);
+    p.write(header(body.length()) + body);
+    p.flush(1000);
+    CHECK(!g.results[1].done && g.results[1].body.empty());
+    CHECK(!g.results[2].done && g.results[2].body.length() < body.length());
+    const unsigned left[] = { 0, 3, 4 };
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.results[left[i]].done && g.results[left[i]].complete && g.results[left[i]].body == body);
+    CHECK(!g.co.GetInFlight());
+
+    // ...and #4, which comes after it and already saw some of the body
+    Result r0, r3, r4;
+    CHECK(g.socks[0]->SendRequest(testRequest(p.port, "/b", r0), false));
+    Request req = testRequest(p.port, "/b", r3);
+    req.onRecv = onRecvDelete;
+    CHECK(g.socks[3]->SendRequest(req, false));
+    CHECK(g.socks[4]->SendRequest(testRequest(p.port, "/b", r4), false));
+    CHECK(expectRequest(p, "/b"));
+    p.write(header(body.length()) + body.substr(0, 100));
+    p.flush();
+    CHECK(r4.body == body.substr(0, 100));
+    s_victim = 4;
+    p.write(body.substr(100));
+    p.flush(1000);
+    CHECK(!r4.done);
+    CHECK(r0.done && r0.complete && r0.body == body);
+    CHECK(r3.done && r3.complete && r3.body == body);
+}
+
+static void testLeaderFails()
+{
+    Group g(3);
+    g.results.resize(3);
+    LoopbackPeer& p = g.peer;
+
+    // The connection breaks in the middle of the body: everyone gets what there was, and a failure
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.socks[i]->SendRequest(testRequest(p.port, "/a", g.results[i]), false));
+    CHECK(expectRequest(p, "/a"));
+    p.write(header(100) + "partial");
+    p.flush();
+    p.hangup();
+    p.pump();
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.results[i].done && !g.results[i].complete && g.results[i].body == "partial");
+    CHECK(!g.co.GetInFlight());
+
+    // Before the response: the same
+    std::vector<Result> r(3);
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.socks[i]->SendRequest(testRequest(p.port, "/b", r[i]), false));
+    CHECK(expectRequest(p, "/b"));
+    p.hangup();
+    p.pump();
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(r[i].done && !r[i].complete && r[i].body.empty());
+    CHECK(!g.co.GetInFlight() && !p.pending(50));
+
+    // The leader is deleted
+    r.assign(3, Result());
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.socks[i]->SendRequest(testRequest(p.port, "/c", r[i]), false));
+    CHECK(expectRequest(p, "/c"));
+    delete g.socks[0];
+    g.socks[0] = NULL;
+    CHECK(!r[0].done);
+    CHECK(r[1].done && !r[1].complete && r[2].done && !r[2].complete);
+    CHECK(!g.co.GetInFlight());
+
+    // A waiter that failed can lead the next flight
+    r.assign(3, Result());
+    CHECK(g.socks[2]->SendRequest(testRequest(p.port, "/c", r[2]), false));
+    CHECK(g.socks[1]->SendRequest(testRequest(p.port, "/c", r[1]), false));
+    CHECK(g.co.GetInFlight() == 1);
+    CHECK(expectRequest(p, "/c"));
+    p.write(header(2) + "ok");
+    p.flush();
+    CHECK(r[1].done && r[1].complete && r[1].body == "ok" && g.socks[1]->GetTimings().coalesced);
+    CHECK(r[2].done && r[2].complete && r[2].body == "ok" && !g.socks[2]->GetTimings().coalesced);
+}
+
+// A leader whose idle connection turns out to be closed sends again, and keeps its waiters
+static void testLeaderRetries()
+{
+    Group g(3);
+    g.results.resize(3);
+    LoopbackPeer& p = g.peer;
+    HttpSocket& l = *g.socks[0];
+    l.SetKeepAlive(30);
+
+    Result first;
+    CHECK(l.SendRequest(testRequest(p.port, "/first", first), false));
+    CHECK(expectRequest(p, "/first"));
+    p.write(header(2, "Connection: keep-alive\r\n") + "ok");
+    p.flush();
+    CHECK(first.done && first.complete && l.isOpen());
+
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.socks[i]->SendRequest(testRequest(p.port, "/a", g.results[i]), false));
+    std::string head;
+    CHECK(p.readUntil("\r\n\r\n", head) && !head.compare(0, 7, "GET /a "));
+    p.hangup();
+    p.pump();
+    CHECK(!g.results[0].done && !g.results[1].done && g.co.GetInFlight() == 1);
+    CHECK(expectRequest(p, "/a"));
+    p.write(header(5) + "again");
+    p.flush();
+    for(unsigned i = 0; i < 3; ++i)
+        CHECK(g.results[i].done && g.results[i].complete && g.results[i].body == "again");
+    CHECK(!g.co.GetInFlight() && !p.pending(50));
+}
+
+int main()
+{
+    InitNetwork();
+    testKeys();
+    testFanOut();
+    testLeave();
+    testLeaderFails();
+    testLeaderRetries();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
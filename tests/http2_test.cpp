@@ -0,0 +1,466 @@
+// Tests for Http2Socket: HPACK decoding (RFC 7541 appendix C), Huffman coding,
+// and the connection logic against a scripted peer on a local socket.
+// Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_HTTP2) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+static std::string unhex(const char *h)
+{
+    std::string s;
+    for( ; *h; )
+    {
+        if(*h == ' ')
+        {
+            ++h;
+            continue;
+        }
+        s += char(strtoul(std::string(h, 2).c_str(), NULL, 16));
+        h += 2;
+    }
+    return s;
+}
+
+static bool decode(HpackDecoder& d, const std::string& block, HeaderFields& hdrs, unsigned& status)
+{
+    hdrs.clear();
+    status = 0;
+    return d.decode((const unsigned char*)block.data(), block.length(), hdrs, status);
+}
+
+// ---- HPACK -----
+
+static void testHuffman()
+{
+    // C.4.1
+    std::string enc;
+    _HuffEncode("www.example.com", 15, enc);
+    CHECK(enc == unhex("f1e3 c2e5 f23a 6ba0 ab90 f4ff"));
+    CHECK(_HuffSize("www.example.com", 15) == enc.length());
+
+    // Every byte value, and strings that end on every bit offset
+    std::string all;
+    for(unsigned i = 0; i < 256; ++i)
+        all += char(i);
+    for(size_t n = 0; n <= all.length(); n += 7)
+    {
+        std::string e, d;
+        _HuffEncode(all.data(), n, e);
+        CHECK(e.length() == _HuffSize(all.data(), n));
+        CHECK(_HuffDecode((const unsigned char*)e.data(), e.length(), d));
+        CHECK(d == all.substr(0, n));
+    }
+    unsigned r = 12345;
+    for(unsigned k = 0; k < 200; ++k)
+    {
+        std::string s, e, d;
+        for(unsigned i = k % 40; i--; )
+        {
+            r = r * 1103515245 + 12345;
+            s += char(r >> 16);
+        }
+        _HuffEncode(s.data(), s.length(), e);
+        CHECK(_HuffDecode((const unsigned char*)e.data(), e.length(), d) && d == s);
+    }
+
+    // Padding longer than 7 bits, padding that isn't EOS, and EOS itself are errors
+    std::string d;
+    CHECK(!_HuffDecode((const unsigned char*)"\xff", 1, d));
+    CHECK(!_HuffDecode((const unsigned char*)"\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xfe", 12, d));
+    CHECK(!_HuffDecode((const unsigned char*)"\xff\xff\xff\xff", 4, d));
+}
+
+// C.3 and C.4: requests. Pseudo fields are not passed on, so only the regular ones can be compared.
+static void testHpackRequests(bool huffman)
+{
+    const char *blocks[2][3] =
+    {
+        {
+            "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+            "8286 84be 5808 6e6f 2d63 6163 6865",
+            "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"
+        },
+        {
+            "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+            "8286 84be 5886 a8eb 1064 9cbf",
+            "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"
+        }
+    };
+    HpackDecoder d;
+    HeaderFields h;
+    unsigned status;
+    CHECK(decode(d, unhex(blocks[huffman][0]), h, status) && !h.size());
+    CHECK(decode(d, unhex(blocks[huffman][1]), h, status) && h.size() == 1);
+    CHECK(h.get("cache-control") && !strcmp(h.get("cache-control"), "no-cache"));
+    CHECK(decode(d, unhex(blocks[huffman][2]), h, status) && h.size() == 1);
+    CHECK(h.get("custom-key") && !strcmp(h.get("custom-key"), "custom-value"));
+    // Table is [62] custom-key, [63] cache-control, [64] :authority; nothing beyond
+    CHECK(decode(d, unhex("be"), h, status) && h.size() == 1 && !strcmp(h.get("custom-key"), "custom-value"));
+    CHECK(!decode(d, unhex("c1"), h, status));
+}
+
+// C.5 and C.6: responses with a 256 byte table, which evicts. Set by a size update in front of the first block.
+static void testHpackResponses(bool huffman)
+{
+    const char *blocks[2][3] =
+    {
+        {
+            "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768"
+            "7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+            "4803 3330 37c1 c0bf",
+            "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153"
+            "444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e"
+            "3d31"
+        },
+        {
+            "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8"
+            "e9ae 82ae 43d3",
+            "4883 640e ffc1 c0bf",
+            "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b"
+            "3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07"
+        }
+    };
+    HpackDecoder d;
+    HeaderFields h;
+    unsigned status;
+    CHECK(decode(d, unhex("3fe1 01") + unhex(blocks[huffman][0]), h, status) && status == 302 && h.size() == 3);
+    CHECK(h.get("cache-control") && !strcmp(h.get("cache-control"), "private"));
+    CHECK(h.get("date") && !strcmp(h.get("date"), "Mon, 21 Oct 2013 20:13:21 GMT"));
+    CHECK(h.get("location") && !strcmp(h.get("location"), "https://www.example.com"));
+
+    CHECK(decode(d, unhex(blocks[huffman][1]), h, status) && status == 307 && h.size() == 3);
+    CHECK(h.get("cache-control") && !strcmp(h.get("cache-control"), "private"));
+    CHECK(h.get("location") && !strcmp(h.get("location"), "https://www.example.com"));
+
+    CHECK(decode(d, unhex(blocks[huffman][2]), h, status) && status == 200 && h.size() == 5);
+    CHECK(h.get("date") && !strcmp(h.get("date"), "Mon, 21 Oct 2013 20:13:22 GMT"));
+    CHECK(h.get("content-encoding") && !strcmp(h.get("content-encoding"), "gzip"));
+    CHECK(h.get("set-cookie") && !strcmp(h.get("set-cookie"), "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"));
+
+    // Table is down to [62] set-cookie, [63] content-encoding, [64] date; the rest was evicted
+    CHECK(decode(d, unhex("c0"), h, status) && h.get("date"));
+    CHECK(!decode(d, unhex("c1"), h, status));
+}
+
+static void testHpackErrors()
+{
+    HpackDecoder d;
+    HeaderFields h;
+    unsigned status;
+    CHECK(!decode(d, unhex("80"), h, status)); // index 0
+    CHECK(!decode(d, unhex("be"), h, status)); // empty dynamic table
+    CHECK(!decode(d, unhex("3fe2 1f"), h, status)); // table size above what we allow
+    CHECK(!decode(d, unhex("82 3f00"), h, status)); // size update after a field
+    CHECK(!decode(d, unhex("400a 6375"), h, status)); // string runs past the end
+    CHECK(!decode(d, unhex("ff"), h, status)); // integer runs past the end
+}
+
+// ---- Scripted peer -----
+
+struct Frame
+{
+    unsigned type, flags, id;
+    std::string payload;
+};
+
+// Speaks HTTP/2 frames on the peer's side of the connection
+class Peer : public LoopbackPeer
+{
+public:
+    Peer(Http2Socket& c) : LoopbackPeer(c), _c(c) {}
+
+    void request(const char *resource, Result& r, RequestBody *body = NULL)
+    {
+        CHECK(_c.SendRequest(testRequest(port, resource, r, body), false));
+    }
+
+    // Takes the next connection and checks the preface and the client's SETTINGS
+    virtual bool accept(unsigned timeoutMs = 2000)
+    {
+        if(!LoopbackPeer::accept(timeoutMs))
+            return false;
+        static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        if(!fill(24) || in.compare(0, 24, preface))
+            return false;
+        in.erase(0, 24);
+        Frame f;
+        if(!next(f) || f.type != H2_SETTINGS || f.flags || f.payload.length() % 6)
+            return false;
+        send(H2_SETTINGS, 0, 0, _settings);
+        return true;
+    }
+
+    void settings(unsigned id, unsigned v) // for the next accept()
+    {
+        unsigned char p[6] = { 0, (unsigned char)id };
+        _Put32(p + 2, v);
+        _settings.append((const char*)p, 6);
+    }
+
+    void send(unsigned type, unsigned flags, unsigned id, const std::string& payload)
+    {
+        unsigned char h[9] = { (unsigned char)(payload.length() >> 16), (unsigned char)(payload.length() >> 8), (unsigned char)payload.length(),
+            (unsigned char)type, (unsigned char)flags };
+        _Put32(h + 5, id);
+        write(std::string((const char*)h, 9));
+        write(payload);
+    }
+
+    void send32(unsigned type, unsigned id, unsigned v)
+    {
+        unsigned char p[4];
+        _Put32(p, v);
+        send(type, 0, id, std::string((const char*)p, 4));
+    }
+
+    void headers(unsigned id, unsigned status, bool end, const char *xtest = NULL)
+    {
+        std::string b;
+        char num[16];
+        sprintf(num, "%u", status);
+        _HpackField(b, ":status", num);
+        if(xtest)
+            _HpackField(b, "x-test", xtest);
+        send(H2_HEADERS, H2F_END_HEADERS | (end ? H2F_END_STREAM : 0), id, b);
+    }
+
+    // Next frame from the client, skipping SETTINGS ACKs. WINDOW_UPDATEs are skipped, too, but remembered.
+    bool next(Frame& f, unsigned timeoutMs = 2000)
+    {
+        for(;;)
+        {
+            if(!fill(9, timeoutMs))
+                return false;
+            const unsigned len = (unsigned((unsigned char)in[0]) << 16) | (unsigned((unsigned char)in[1]) << 8) | (unsigned char)in[2];
+            if(!fill(9 + len, timeoutMs))
+                return false;
+            f.type = (unsigned char)in[3];
+            f.flags = (unsigned char)in[4];
+            f.id = _Get32((const unsigned char*)in.data() + 5) & 0x7fffffff;
+            f.payload.assign(in, 9, len);
+            in.erase(0, 9 + len);
+            if(f.type == H2_SETTINGS && (f.flags & H2F_ACK))
+                continue;
+            if(f.type == H2_WINDOW_UPDATE)
+            {
+                windowUpdates.push_back(std::make_pair(f.id, _Get32((const unsigned char*)f.payload.data())));
+                continue;
+            }
+            return true;
+        }
+    }
+
+    void drain()
+    {
+        Frame f;
+        while(next(f, 100)) {}
+    }
+
+    bool expect(unsigned type, Frame& f)
+    {
+        return next(f) && f.type == type;
+    }
+
+    // True if the client closed the connection
+    bool closed()
+    {
+        drain();
+        return LoopbackPeer::closed(0);
+    }
+
+    std::vector<std::pair<unsigned, unsigned> > windowUpdates;
+
+private:
+    Http2Socket& _c;
+    std::string _settings;
+};
+
+// Request and response, with the response split into frames of all kinds and delivered a byte at a time
+static void testExchange()
+{
+    Http2Socket c;
+    c.SetUserAgent("h2test");
+    Peer p(c);
+    Result r;
+    p.request("/a", r);
+    CHECK(p.accept());
+    Frame f;
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 1 && f.flags == (H2F_END_HEADERS | H2F_END_STREAM));
+    HpackDecoder d;
+    HeaderFields h;
+    unsigned status;
+    CHECK(decode(d, f.payload, h, status) && h.get("user-agent") && !strcmp(h.get("user-agent"), "h2test"));
+
+    std::string b;
+    _HpackField(b, ":status", "200");
+    _HpackField(b, "x-test", "split");
+    p.send(H2_HEADERS, 0, 1, b.substr(0, 3));
+    p.send(H2_CONTINUATION, H2F_END_HEADERS, 1, b.substr(3));
+    p.send(H2_PING, 0, 0, "12345678");
+    p.send(H2_DATA, H2F_PADDED, 1, std::string("\x04hel\0\0\0\0", 8));
+    p.send(H2_PRIORITY, 0, 1, std::string(5, '\0')); // ignored
+    p.send(H2_DATA, H2F_END_STREAM, 1, "lo");
+    p.flush(1);
+    CHECK(r.done && r.complete && r.status == 200 && r.body == "hello" && r.header == "split" && r.resource == "/a");
+    CHECK(r.sent && r.sent <= r.firstByte);
+    CHECK(p.expect(H2_PING, f) && f.flags == H2F_ACK && f.payload == "12345678");
+    CHECK(!c.GetOpenStreams());
+
+    // Frame bigger than we allow: connection error, the open request fails
+    Result r2;
+    p.request("/b", r2);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 3);
+    p.send(H2_DATA, 0, 3, std::string(H2_MAX_FRAME + 1, 'x'));
+    p.flush();
+    CHECK(p.expect(H2_GOAWAY, f) && _Get32((const unsigned char*)f.payload.data() + 4) == H2E_FRAME_SIZE);
+    CHECK(r2.done && !r2.complete);
+    CHECK(p.closed());
+}
+
+// Flow control in both directions
+static void testFlowControl()
+{
+    Http2Socket c;
+    Peer p(c);
+    p.settings(H2S_INITIAL_WINDOW_SIZE, 10);
+    Result r;
+    p.request("/get", r);
+    CHECK(p.accept());
+    Frame f;
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 1);
+
+    // Receiving: a stream's window is handed back once half of it is used up
+    p.headers(1, 200, false);
+    const unsigned total = H2_STREAM_WINDOW / 2 + H2_MAX_FRAME;
+    for(unsigned sent = 0; sent < total; sent += H2_MAX_FRAME)
+        p.send(H2_DATA, 0, 1, std::string(H2_MAX_FRAME, 'd'));
+    p.flush();
+    p.drain();
+    unsigned streamInc = 0;
+    for(size_t i = 0; i < p.windowUpdates.size(); ++i)
+        if(p.windowUpdates[i].first == 1)
+            streamInc += p.windowUpdates[i].second;
+    CHECK(streamInc >= H2_STREAM_WINDOW / 2);
+    CHECK(p.windowUpdates.size() && p.windowUpdates[0].first == 0 && p.windowUpdates[0].second == H2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+    p.send(H2_DATA, H2F_END_STREAM, 1, "");
+    p.flush();
+    CHECK(r.done && r.complete && r.body.length() == total);
+
+    // Sending: the body goes out as far as the stream window lets it
+    std::string data(100, 'u');
+    MemoryBody body(data.data(), data.length());
+    Result r2;
+    p.request("/post", r2, &body);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 3 && f.flags == H2F_END_HEADERS);
+    std::string got;
+    CHECK(p.expect(H2_DATA, f) && f.id == 3 && !f.flags);
+    got += f.payload;
+    CHECK(got.length() == 10 && !p.next(f, 100));
+    p.send32(H2_WINDOW_UPDATE, 3, 30);
+    p.flush();
+    CHECK(p.expect(H2_DATA, f) && !f.flags);
+    got += f.payload;
+    CHECK(got.length() == 40 && !p.next(f, 100));
+    p.send32(H2_WINDOW_UPDATE, 3, 1000);
+    p.flush();
+    CHECK(p.expect(H2_DATA, f) && f.flags == H2F_END_STREAM);
+    got += f.payload;
+    CHECK(got == data);
+    p.headers(3, 201, true);
+    p.flush();
+    CHECK(r2.done && r2.complete && r2.status == 201);
+
+    // A window pushed past 2^31-1 resets the stream
+    Result r3;
+    p.request("/get", r3);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 5);
+    p.send32(H2_WINDOW_UPDATE, 5, 0x7fffffff);
+    p.flush();
+    CHECK(r3.done && !r3.complete);
+}
+
+// Streams the server refused, or will not process after GOAWAY, go out again
+static void testRequeue()
+{
+    Http2Socket c;
+    Peer p(c);
+    Result a, b, x;
+    p.request("/a", a);
+    p.request("/b", b);
+    CHECK(p.accept());
+    Frame f;
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 1);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 3);
+    p.send32(H2_RST_STREAM, 3, H2E_REFUSED_STREAM);
+    p.flush();
+    CHECK(!b.done);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 5); // /b again
+    p.headers(1, 200, true);
+    p.headers(5, 200, true);
+    p.flush();
+    CHECK(a.done && a.complete && a.resource == "/a");
+    CHECK(b.done && b.complete && b.resource == "/b");
+
+    // Any other error is final
+    p.request("/x", x);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 7);
+    p.send32(H2_RST_STREAM, 7, H2E_CANCEL);
+    p.flush();
+    CHECK(x.done && !x.complete);
+
+    // GOAWAY: streams above the last one are sent again on a new connection, after the others are done
+    Result c1, c2, c3;
+    p.request("/c1", c1);
+    p.request("/c2", c2);
+    p.request("/c3", c3);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 9);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 11);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 13);
+    unsigned char ga[8];
+    _Put32(ga, 9);
+    _Put32(ga + 4, H2E_NO_ERROR);
+    p.send(H2_GOAWAY, 0, 0, std::string((const char*)ga, 8));
+    p.flush();
+    CHECK(!c2.done && !c3.done);
+    p.headers(9, 200, true);
+    p.flush();
+    CHECK(c1.done && c1.complete);
+    CHECK(p.closed());
+    CHECK(p.accept());
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 1);
+    CHECK(p.expect(H2_HEADERS, f) && f.id == 3);
+    p.headers(1, 200, true);
+    p.headers(3, 200, true);
+    p.flush();
+    CHECK(c2.done && c2.complete && c2.resource == "/c2");
+    CHECK(c3.done && c3.complete && c3.resource == "/c3");
+}
+
+int main()
+{
+    InitNetwork();
+    testHuffman();
+    testHpackRequests(false);
+    testHpackRequests(true);
+    testHpackResponses(false);
+    testHpackResponses(true);
+    testHpackErrors();
+    testExchange();
+    testFlowControl();
+    testRequeue();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,184 @@
+// Tests for keep-alive connections: reuse, the Keep-Alive header field, and retrying a request on a
+// connection the server closed while it was idle. Against a scripted peer on a local socket.
+// Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+// Expects the request for resource on the current connection, or on a new one if accept is set
+static bool expectRequest(LoopbackPeer& p, const char *resource, bool accept)
+{
+    std::string head;
+    if(accept && !p.accept())
+        return false;
+    if(!p.readUntil("\r\n\r\n", head))
+        return false;
+    const std::string line = std::string(" ") + resource + " HTTP/1.1\r\n";
+    const size_t at = head.find(' ');
+    return at != std::string::npos && !head.compare(at, line.length(), line);
+}
+
+static void respond(LoopbackPeer& p, const char *extra = "Connection: keep-alive\r\n")
+{
+    p.write(std::string("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n") + extra + "\r\nok");
+    p.flush();
+}
+
+static void testReuse()
+{
+    HttpSocket c;
+    LoopbackPeer p(c);
+
+    Result r1;
+    CHECK(c.SendRequest(testRequest(p.port, "/1", r1), false));
+    CHECK(expectRequest(p, "/1", true));
+    respond(p, "Connection: keep-alive\r\nKeep-Alive: timeout=5, max=2\r\n");
+    CHECK(r1.done && r1.complete && !r1.reused);
+    CHECK(c.GetServerIdleTimeout() == 5000000 && c.GetRequestsLeft() == 2);
+
+    // Not said again: counted down. At 0 the connection is closed after the response.
+    Result r2;
+    CHECK(c.SendRequest(testRequest(p.port, "/2", r2), false));
+    CHECK(expectRequest(p, "/2", false));
+    respond(p);
+    CHECK(r2.done && r2.complete && r2.reused && c.GetRequestsLeft() == 1);
+    CHECK(c.isOpen());
+
+    Result r3;
+    CHECK(c.SendRequest(testRequest(p.port, "/3", r3), false));
+    CHECK(expectRequest(p, "/3", false));
+    respond(p);
+    CHECK(r3.done && r3.complete && r3.reused);
+    CHECK(p.closed());
+    CHECK(!c.isOpen());
+
+    // A new connection knows nothing yet. max=0 ends it right away.
+    Result r4;
+    CHECK(c.SendRequest(testRequest(p.port, "/4", r4), false));
+    CHECK(expectRequest(p, "/4", true));
+    CHECK(c.GetRequestsLeft() == unsigned(-1) && !c.GetServerIdleTimeout());
+    respond(p, "Connection: keep-alive\r\nKeep-Alive: max=0\r\n");
+    CHECK(r4.done && r4.complete && !r4.reused);
+    CHECK(p.closed());
+
+    // Without "Connection: keep-alive" the connection isn't kept
+    Result r5;
+    CHECK(c.SendRequest(testRequest(p.port, "/5", r5), false));
+    CHECK(expectRequest(p, "/5", true));
+    respond(p, "");
+    CHECK(r5.done && r5.complete);
+    CHECK(p.closed());
+
+    // Not reused when the server is about to drop it: with timeout=1, half a second is the safety margin
+    Result r6, r7;
+    CHECK(c.SendRequest(testRequest(p.port, "/6", r6), false));
+    CHECK(expectRequest(p, "/6", true));
+    respond(p, "Connection: keep-alive\r\nKeep-Alive: timeout=1\r\n");
+    CHECK(r6.done && r6.complete && c.isOpen());
+    p.pump(600);
+    CHECK(c.SendRequest(testRequest(p.port, "/7", r7), false));
+    CHECK(expectRequest(p, "/7", true));
+    respond(p);
+    CHECK(r7.done && r7.complete && !r7.reused);
+}
+
+// The server closes a connection that was idle just as the next request goes out
+static void testStaleRetry()
+{
+    HttpSocket c;
+    c.SetKeepAlive(30);
+    LoopbackPeer p(c);
+
+    Result r1;
+    CHECK(c.SendRequest(testRequest(p.port, "/1", r1), false));
+    CHECK(expectRequest(p, "/1", true));
+    respond(p);
+    CHECK(r1.done && r1.complete);
+
+    // A GET goes out again on a new connection, once
+    Result r2;
+    CHECK(c.SendRequest(testRequest(p.port, "/2", r2), false));
+    CHECK(expectRequest(p, "/2", false));
+    p.hangup();
+    p.pump();
+    CHECK(!r2.done);
+    CHECK(expectRequest(p, "/2", true));
+    respond(p);
+    CHECK(r2.done && r2.complete && r2.status == 200 && !r2.reused && r2.body == "ok");
+
+    // The retry is on a fresh connection; if that one breaks too, the request fails
+    Result r3;
+    CHECK(c.SendRequest(testRequest(p.port, "/3", r3), false));
+    CHECK(expectRequest(p, "/3", false));
+    p.hangup();
+    p.pump();
+    CHECK(!r3.done);
+    CHECK(expectRequest(p, "/3", true));
+    p.hangup();
+    p.pump();
+    CHECK(r3.done && !r3.complete);
+    CHECK(!p.pending(100));
+
+    // A POST is never sent twice, whether it has a body or form data
+    const char *data = "payload";
+    MemoryBody body(data, strlen(data));
+    Result r4, r5, r6;
+    CHECK(c.SendRequest(testRequest(p.port, "/4", r4), false));
+    CHECK(expectRequest(p, "/4", true));
+    respond(p);
+    CHECK(c.SendRequest(testRequest(p.port, "/5", r5, &body), false));
+    CHECK(expectRequest(p, "/5", false));
+    p.hangup();
+    p.pump();
+    CHECK(r5.done && !r5.complete);
+    CHECK(!p.pending(100));
+
+    Result r7;
+    CHECK(c.SendRequest(testRequest(p.port, "/6", r6), false));
+    CHECK(expectRequest(p, "/6", true));
+    respond(p);
+    Request form = testRequest(p.port, "/7", r7);
+    form.post.add("k", "v");
+    CHECK(c.SendRequest(form, false));
+    CHECK(expectRequest(p, "/7", false));
+    p.hangup();
+    p.pump();
+    CHECK(r7.done && !r7.complete);
+    CHECK(!p.pending(100));
+
+    // Once the response has begun, a broken connection fails the GET, too
+    Result r8, r9;
+    CHECK(c.SendRequest(testRequest(p.port, "/8", r8), false));
+    CHECK(expectRequest(p, "/8", true));
+    respond(p);
+    CHECK(c.SendRequest(testRequest(p.port, "/9", r9), false));
+    CHECK(expectRequest(p, "/9", false));
+    p.write("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nok");
+    p.flush();
+    p.hangup();
+    p.pump();
+    CHECK(r9.done && !r9.complete);
+    CHECK(!p.pending(100));
+}
+
+int main()
+{
+    InitNetwork();
+    testReuse();
+    testStaleRetry();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
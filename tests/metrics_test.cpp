@@ -0,0 +1,205 @@
+// Tests for Metrics: the histogram's bucket bounds and percentiles, and the Prometheus and JSON exports,
+// compared with the exact expected text at bucket boundaries. Built together with minihttp.cpp to get at its
+// internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+static void testBuckets()
+{
+    // Below SUB, one bucket per value
+    for(unsigned v = 0; v < Histogram::SUB; ++v)
+        CHECK(Histogram::bucketOf(v) == v && Histogram::bucketUpper(v) == v + 1);
+
+    // Then each power of 2 in 4
+    const u64 lower[] = { 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, 28, 32, 40 };
+    for(unsigned i = 0; i + 1 < sizeof(lower) / sizeof(lower[0]); ++i)
+    {
+        CHECK(Histogram::bucketOf(lower[i]) == i + 4);
+        CHECK(Histogram::bucketOf(lower[i + 1] - 1) == i + 4);
+        CHECK(Histogram::bucketUpper(i + 4) == lower[i + 1]);
+    }
+    CHECK(Histogram::bucketOf(1234567) == 76);
+    CHECK(Histogram::bucketUpper(75) == 1048576 && Histogram::bucketUpper(76) == 1310720);
+
+    // Contiguous all the way up, and no wider than a quarter of the lower bound
+    for(unsigned i = 1; i < Histogram::BUCKETS; ++i)
+    {
+        const u64 lo = Histogram::bucketUpper(i - 1), hi = Histogram::bucketUpper(i);
+        CHECK(hi > lo);
+        CHECK(Histogram::bucketOf(lo) == i && Histogram::bucketOf(hi - 1) == i && Histogram::bucketOf(lo - 1) == i - 1);
+        if(i >= Histogram::SUB)
+            CHECK((hi - lo) * 4 <= lo);
+    }
+
+    // The last one takes everything above, about 25 days
+    const u64 top = Histogram::bucketUpper(Histogram::BUCKETS - 1);
+    CHECK(top == u64(1) << 41);
+    CHECK(Histogram::bucketOf(top) == Histogram::BUCKETS - 1);
+    CHECK(Histogram::bucketOf(u64(1) << 50) == Histogram::BUCKETS - 1);
+    CHECK(Histogram::bucketOf(u64(-1)) == Histogram::BUCKETS - 1);
+}
+
+static void testPercentile()
+{
+    Histogram h;
+    CHECK(h.percentile(50) == 0 && h.percentile(100) == 0);
+    for(u64 v = 0; v < 100; ++v)
+        h.add(v);
+    CHECK(h.count == 100 && h.sum == 4950);
+    CHECK(h.percentile(0) == 1); // at least the first value
+    CHECK(h.percentile(4) == 4); // the 4th value is 3
+    CHECK(h.percentile(5) == 5);
+    CHECK(h.percentile(50) == 56); // 49 is in [48, 56)
+    CHECK(h.percentile(48) == 48); // 47 is in [40, 48)
+    CHECK(h.percentile(100) == 112); // 99 is in [96, 112)
+    h.add(u64(1) << 45);
+    CHECK(h.percentile(100) == u64(1) << 41);
+    h.clear();
+    CHECK(!h.count && !h.sum && h.percentile(50) == 0);
+}
+
+static void fill(Metrics& m)
+{
+    m.openSockets = 2;
+    m.activeRequests = 1;
+    m.queuedRequests = 3;
+    m.bytesIn = 12345678901ULL;
+    m.bytesOut = 42;
+    m.bufferShifts = 7;
+    m.requests = 10;
+    m.redirects = 1;
+    m.coalesced = 4;
+    for(unsigned i = 0; i < MERR_MAX; ++i)
+        m.errors[i] = i * 2;
+    const u64 v[] = { 0, 3, 4, 13, 14, 1234567, u64(1) << 45 };
+    for(unsigned i = 0; i < sizeof(v) / sizeof(v[0]); ++i)
+        m.connectTime.add(v[i]);
+    m.requestTime.add(999999);
+    m.requestTime.add(1000000);
+}
+
+static bool hasLine(const std::string& s, const std::string& line)
+{
+    return ("\n" + s).find("\n" + line + "\n") != std::string::npos;
+}
+
+static void testPrometheus()
+{
+    Metrics m;
+    fill(m);
+    std::string s = "before\n";
+    m.toPrometheus(s, "app");
+    const char *head =
+        "before\n"
+        "# TYPE app_open_sockets gauge\n"
+        "app_open_sockets 2\n"
+        "# TYPE app_active_requests gauge\n"
+        "app_active_requests 1\n"
+        "# TYPE app_queued_requests gauge\n"
+        "app_queued_requests 3\n"
+        "# TYPE app_received_bytes_total counter\n"
+        "app_received_bytes_total 12345678901\n"
+        "# TYPE app_sent_bytes_total counter\n"
+        "app_sent_bytes_total 42\n"
+        "# TYPE app_buffer_shifts_total counter\n"
+        "app_buffer_shifts_total 7\n"
+        "# TYPE app_requests_total counter\n"
+        "app_requests_total 10\n"
+        "# TYPE app_redirects_total counter\n"
+        "app_redirects_total 1\n"
+        "# TYPE app_coalesced_requests_total counter\n"
+        "app_coalesced_requests_total 4\n"
+        "# TYPE app_errors_total counter\n"
+        "app_errors_total{kind=\"resolve\"} 0\n"
+        "app_errors_total{kind=\"connect\"} 2\n"
+        "app_errors_total{kind=\"ssl\"} 4\n"
+        "app_errors_total{kind=\"send\"} 6\n"
+        "app_errors_total{kind=\"recv\"} 8\n"
+        "app_errors_total{kind=\"http\"} 10\n"
+        "app_errors_total{kind=\"truncated\"} 12\n"
+        "app_errors_total{kind=\"protocol\"} 14\n"
+        "# TYPE app_connect_seconds histogram\n"
+        "app_connect_seconds_bucket{le=\"0.000000\"} 1\n"
+        "app_connect_seconds_bucket{le=\"0.000001\"} 1\n"
+        "app_connect_seconds_bucket{le=\"0.000002\"} 1\n"
+        "app_connect_seconds_bucket{le=\"0.000003\"} 2\n"
+        "app_connect_seconds_bucket{le=\"0.000004\"} 3\n"
+        "app_connect_seconds_bucket{le=\"0.000005\"} 3\n";
+    CHECK(!s.compare(0, strlen(head), head));
+
+    // Each bucket's largest value; a value on the exclusive upper bound is in the next one
+    CHECK(hasLine(s, "app_connect_seconds_bucket{le=\"0.000011\"} 3"));
+    CHECK(hasLine(s, "app_connect_seconds_bucket{le=\"0.000013\"} 4"));
+    CHECK(hasLine(s, "app_connect_seconds_bucket{le=\"0.000015\"} 5"));
+    CHECK(hasLine(s, "app_connect_seconds_bucket{le=\"1.048575\"} 5"));
+    CHECK(hasLine(s, "app_connect_seconds_bucket{le=\"1.310719\"} 6"));
+    CHECK(hasLine(s, "app_connect_seconds_bucket{le=\"1924145.348607\"} 6\napp_connect_seconds_bucket{le=\"+Inf\"} 7"));
+    CHECK(hasLine(s, "app_connect_seconds_sum 35184373.323433"));
+    CHECK(hasLine(s, "app_connect_seconds_count 7"));
+    CHECK(hasLine(s, "app_request_seconds_bucket{le=\"0.917503\"} 0"));
+    CHECK(hasLine(s, "app_request_seconds_bucket{le=\"1.048575\"} 2"));
+    CHECK(hasLine(s, "app_request_seconds_sum 1.999999"));
+    CHECK(hasLine(s, "# TYPE app_handshake_seconds histogram"));
+    CHECK(hasLine(s, "app_handshake_seconds_bucket{le=\"+Inf\"} 0"));
+    CHECK(hasLine(s, "app_handshake_seconds_sum 0.000000"));
+    CHECK(hasLine(s, "app_first_byte_seconds_count 0"));
+
+    // Every bucket of every histogram, always
+    unsigned lines = 0, buckets = 0;
+    for(size_t at = 0; (at = s.find('\n', at)) != std::string::npos; ++at)
+        ++lines;
+    for(size_t at = 0; (at = s.find("_bucket{le=", at)) != std::string::npos; ++at)
+        ++buckets;
+    CHECK(buckets == 4 * Histogram::BUCKETS);
+    CHECK(lines == 1 + 9 * 2 + 1 + MERR_MAX + 4 * (1 + Histogram::BUCKETS + 2));
+    CHECK(s[s.length() - 1] == '\n');
+
+    std::string d;
+    m.toPrometheus(d);
+    CHECK(!d.compare(0, 36, "# TYPE minihttp_open_sockets gauge\nm"));
+}
+
+static void testJSON()
+{
+    Metrics m;
+    fill(m);
+    std::string s = "x";
+    m.toJSON(s);
+    CHECK(s == "x{\"open_sockets\":2,\"active_requests\":1,\"queued_requests\":3,\"bytes_in\":12345678901,\"bytes_out\":42,"
+        "\"buffer_shifts\":7,\"requests\":10,\"redirects\":1,\"coalesced\":4,"
+        "\"errors\":{\"resolve\":0,\"connect\":2,\"ssl\":4,\"send\":6,\"recv\":8,\"http\":10,\"truncated\":12,\"protocol\":14},"
+        "\"connect_us\":{\"count\":7,\"sum\":35184373323433,\"p50\":14,\"p90\":1310720,\"p99\":2199023255552,\"p999\":2199023255552},"
+        "\"handshake_us\":{\"count\":0,\"sum\":0,\"p50\":0,\"p90\":0,\"p99\":0,\"p999\":0},"
+        "\"first_byte_us\":{\"count\":0,\"sum\":0,\"p50\":0,\"p90\":0,\"p99\":0,\"p999\":0},"
+        "\"request_us\":{\"count\":2,\"sum\":1999999,\"p50\":1048576,\"p90\":1048576,\"p99\":1048576,\"p999\":1048576}}");
+
+    m.clear();
+    s.clear();
+    m.toJSON(s);
+    CHECK(s.find("\"bytes_in\":0,") != std::string::npos && s.find("\"connect_us\":{\"count\":0,") != std::string::npos);
+    CHECK(!strcmp(MetricsErrorName(MERR_PROTOCOL), "protocol") && !strcmp(MetricsErrorName(MERR_MAX), "?"));
+}
+
+int main()
+{
+    testBuckets();
+    testPercentile();
+    testPrometheus();
+    testJSON();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,227 @@
+// Tests for RequestQueue: priority order, arrival order among equal priorities, aging, and the order in which an
+// HttpSocket sends what it queued. Times are given to the queue explicitly, so nothing depends on the clock.
+// Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && !defined(_WIN32)
+
+#include "testutil.h"
+#include <algorithm>
+
+using namespace minihttp;
+
+static void push(RequestQueue& q, const std::string& name, int priority, u64 queuedAt)
+{
+    Request r;
+    r.resource = name;
+    r.priority = priority;
+    r.queuedAt = queuedAt;
+    q.push(r);
+    CHECK(r.resource.empty());
+}
+
+static std::string pop(RequestQueue& q)
+{
+    if(!q.size())
+        return "-";
+    Request r;
+    const std::string front = q.front().resource;
+    q.pop(r);
+    CHECK(r.resource == front);
+    return r.resource;
+}
+
+static std::string popAll(RequestQueue& q)
+{
+    std::string s;
+    while(q.size())
+        s += pop(q);
+    return s;
+}
+
+static void testOrder()
+{
+    RequestQueue q;
+    const u64 t = 1000000000;
+
+    // Highest first, negative priorities too
+    push(q, "b", 1, t);
+    push(q, "d", -1, t);
+    push(q, "a", 7, t);
+    push(q, "c", 0, t);
+    CHECK(q.size() == 4 && q.front().resource == "a");
+    CHECK(popAll(q) == "abcd" && pop(q) == "-");
+
+    // Equal priorities in order of arrival, also when they arrive in the same microsecond
+    const char *names = "abcdefghijklmnopqrstuvwxyz";
+    for(unsigned i = 0; i < 26; ++i)
+        push(q, std::string(1, names[i]), 3, t);
+    CHECK(popAll(q) == names);
+    for(unsigned i = 0; i < 26; ++i)
+        push(q, std::string(1, names[i]), i % 2, t + i);
+    CHECK(popAll(q) == "bdfhjlnprtvxzacegikmoqsuwy");
+
+    // Left unset, the time of queueing is filled in, which keeps the order
+    for(unsigned i = 0; i < 5; ++i)
+    {
+        Request r;
+        r.resource = std::string(1, names[i]);
+        q.push(r);
+    }
+    CHECK(q.front().queuedAt && popAll(q) == "abcde");
+
+    // A request that comes back keeps its place: it goes ahead of one that arrived after it first did
+    push(q, "x", 0, t);
+    push(q, "y", 0, t + 10);
+    Request r;
+    q.pop(r);
+    CHECK(r.resource == "x" && r.queuedAt == t);
+    q.push(r);
+    CHECK(popAll(q) == "xy");
+}
+
+static void testAging()
+{
+    RequestQueue q;
+    const u64 t = 1000000000;
+
+    // One level is worth a second of waiting by default
+    push(q, "low", 0, t);
+    push(q, "high", 1, t + 999999);
+    CHECK(popAll(q) == "highlow");
+    push(q, "low", 0, t);
+    push(q, "high", 1, t + 1000001);
+    CHECK(popAll(q) == "lowhigh");
+    push(q, "low", 0, t);
+    push(q, "high", 1, t + 1000000); // a tie: the one that was queued first
+    CHECK(popAll(q) == "lowhigh");
+    push(q, "high", 1, t + 1000000);
+    push(q, "low", 0, t);
+    CHECK(popAll(q) == "highlow");
+
+    q.SetAging(10);
+    push(q, "low", 0, t);
+    push(q, "high", 3, t + 29999);
+    CHECK(popAll(q) == "highlow");
+    push(q, "low", 0, t);
+    push(q, "high", 3, t + 30001);
+    CHECK(popAll(q) == "lowhigh");
+    CHECK(q.size() == 0);
+
+    // 0: by time of queueing only
+    q.SetAging(0);
+    push(q, "a", 0, t);
+    push(q, "b", 100, t + 1);
+    push(q, "c", -100, t + 1);
+    CHECK(popAll(q) == "abc");
+
+    // No starvation: a steady stream of requests 5 levels up, one every 100 ms, each as soon as the last one
+    // went out. After 5 s, the old one is as urgent as a new one, and goes first.
+    q.SetAging(1000);
+    push(q, "old", 0, t);
+    unsigned k = 0;
+    for( ; k < 100; ++k)
+    {
+        push(q, "new", 5, t + k * 100000);
+        if(pop(q) == "old")
+            break;
+    }
+    CHECK(k == 50);
+    CHECK(q.size() == 1 && q.frontKey() == (long long)(t + 50 * 100000) - 5 * 1000000);
+}
+
+struct Ref
+{
+    long long key;
+    unsigned seq;
+    std::string name;
+    bool operator<(const Ref& o) const { return key != o.key ? key < o.key : seq < o.seq; }
+};
+
+// Against a plain sort by (key, arrival), with pushes and pops mixed, so that slots are reused
+static void testMixed()
+{
+    RequestQueue q;
+    q.SetAging(2);
+    std::vector<Ref> ref;
+    unsigned seed = 1, seq = 0;
+    for(unsigned i = 0; i < 2000; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        if((seed >> 16) % 3 || ref.empty())
+        {
+            Ref e;
+            const int prio = int((seed >> 8) % 7) - 3;
+            const u64 at = 1000000 + i * 500;
+            e.key = (long long)at - prio * 2000;
+            e.seq = seq++;
+            char name[16];
+            sprintf(name, "%u", e.seq);
+            e.name = name;
+            ref.push_back(e);
+            push(q, name, prio, at);
+        }
+        else
+        {
+            std::vector<Ref>::iterator m = std::min_element(ref.begin(), ref.end());
+            CHECK(q.frontKey() == m->key);
+            CHECK(pop(q) == m->name);
+            ref.erase(m);
+        }
+        CHECK(q.size() == ref.size());
+    }
+    std::stable_sort(ref.begin(), ref.end());
+    for(size_t i = 0; i < ref.size(); ++i)
+        CHECK(pop(q) == ref[i].name);
+}
+
+// Requests queued while one is in progress go out by priority
+static void testSocket()
+{
+    HttpSocket c;
+    c.SetKeepAlive(30);
+    LoopbackPeer p(c);
+    std::vector<Result> r(5);
+    const int prio[] = { 0, -2, 0, 4, 4 };
+    for(unsigned i = 0; i < 5; ++i)
+    {
+        char res[8];
+        sprintf(res, "/%u", i);
+        Request req = testRequest(p.port, res, r[i]);
+        req.priority = prio[i];
+        CHECK(c.SendRequest(req, false));
+    }
+    CHECK(p.accept());
+    const char *order[] = { "/0", "/3", "/4", "/2", "/1" };
+    for(unsigned i = 0; i < 5; ++i)
+    {
+        std::string head;
+        CHECK(p.readUntil("\r\n\r\n", head));
+        CHECK(!head.compare(0, strlen(order[i]) + 5, std::string("GET ") + order[i] + " "));
+        p.write("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Length: 2\r\n\r\nok");
+        p.flush();
+    }
+    for(unsigned i = 0; i < 5; ++i)
+        CHECK(r[i].done && r[i].complete);
+    CHECK(!p.pending(50));
+}
+
+int main()
+{
+    InitNetwork();
+    testOrder();
+    testAging();
+    testMixed();
+    testSocket();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
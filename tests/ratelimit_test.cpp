@@ -0,0 +1,238 @@
+// Tests for RateLimit: the token bucket itself, how a socket combines its own limit with those of its SocketSet,
+// and that transfers over a local socket stay within the rate. Every bound is checked against the clock as measured
+// around the call, so a slow machine can't make them fail. Built together with minihttp.cpp to get at its internals.
+// POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_SOCKET_SET) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+// Most bytes a limit can let through in the time between from and to, starting with a full bucket
+static u64 most(u64 rate, u64 burst, u64 from, u64 to)
+{
+    return burst + rate * (to - from) / 1000000;
+}
+
+static void sleepUntil(u64 t)
+{
+    for(u64 now; (now = _GetTimeUS()) < t; )
+        usleep(useconds_t(t - now));
+}
+
+static void testBucket()
+{
+    // Unlimited
+    RateLimit r;
+    CHECK(r.Available() == u64(-1));
+    r.Consume(12345);
+    CHECK(r.Available() == u64(-1) && !r.GetRate());
+
+    // Starts full. The burst defaults to 1/10 s, at least 16 KB, and is never below the 4 KB sockets wait for.
+    r.Set(1000000);
+    CHECK(r.Available() == 100000 && r.GetRate() == 1000000);
+    r.Set(1);
+    CHECK(r.Available() == 16 * 1024);
+    r.Set(1, 1000);
+    CHECK(r.Available() == RATE_QUANTUM);
+    r.Set(1, RATE_QUANTUM + 1);
+    CHECK(r.Available() == RATE_QUANTUM + 1);
+    r.Set(0);
+    CHECK(r.Available() == u64(-1));
+
+    // Refill: what the elapsed time is worth, never more than the burst
+    u64 t0 = _GetTimeUS();
+    r.Set(1000000, 100000);
+    u64 t1 = _GetTimeUS();
+    r.Consume(100000);
+    sleepUntil(t1 + 20000);
+    u64 a = r.Available();
+    u64 t2 = _GetTimeUS();
+    CHECK(a >= 20000 && a <= most(1000000, 0, t0, t2));
+    sleepUntil(t2 + 150000);
+    CHECK(r.Available() == 100000);
+
+    // Debt is paid off before anything goes
+    t0 = _GetTimeUS();
+    r.Set(1000000, 100000);
+    t1 = _GetTimeUS();
+    r.Consume(150000);
+    a = r.Available();
+    t2 = _GetTimeUS();
+    if(t2 - t0 < 50000)
+        CHECK(!a);
+    sleepUntil(t1 + 40000);
+    a = r.Available();
+    if(_GetTimeUS() - t0 < 50000)
+        CHECK(!a);
+    sleepUntil(t1 + 60000);
+    a = r.Available();
+    t2 = _GetTimeUS();
+    CHECK(a >= 10000 && a <= most(1000000, 0, t0, t2) - 50000);
+
+    // Less than a byte per call adds up
+    t0 = _GetTimeUS();
+    r.Set(1000, RATE_QUANTUM);
+    t1 = _GetTimeUS();
+    r.Consume(RATE_QUANTUM);
+    unsigned calls = 0;
+    while(_GetTimeUS() < t1 + 50000)
+    {
+        r.Available();
+        ++calls;
+        usleep(50);
+    }
+    a = r.Available();
+    t2 = _GetTimeUS();
+    CHECK(calls > 50);
+    CHECK(a >= 50 && a <= most(1000, 0, t0, t2));
+}
+
+class TestSocket : public TcpSocket
+{
+public:
+    void setHost(const char *h) { _host = h; }
+    u64 allowance(bool out) { return _Allowance(out); }
+    void consume(bool out, u64 n) { _Consume(out, n); }
+protected:
+    virtual void _OnRecv(void *, unsigned) {}
+};
+
+// At 1 byte per second nothing refills while the test runs
+static void testCombined()
+{
+    SocketSet set;
+    TestSocket s, t;
+    s.setHost("a");
+    t.setHost("b");
+    RateLimit own(1, 50000), all(1, 40000), hostA(1, 30000), hostB(1, 20000), out(1, 10000);
+
+    CHECK(s.allowance(false) == u64(-1) && s.allowance(true) == u64(-1));
+    s.SetRateLimit(&own, &out);
+    CHECK(s.allowance(false) == 50000 && s.allowance(true) == 10000);
+
+    // The smallest of the socket's, the set's, and the host's
+    set.add(&s, false);
+    set.add(&t, false);
+    set.SetRateLimit(&all, NULL);
+    CHECK(s.allowance(false) == 40000 && s.allowance(true) == 10000 && t.allowance(false) == 40000);
+    set.SetHostRateLimit("a", &hostA, NULL);
+    set.SetHostRateLimit("b", &hostB, NULL);
+    CHECK(s.allowance(false) == 30000 && t.allowance(false) == 20000 && t.allowance(true) == u64(-1));
+
+    // Using some takes it from every limit that applies
+    s.consume(false, 5000);
+    CHECK(own.Available() == 45000 && all.Available() == 35000 && hostA.Available() == 25000);
+    CHECK(hostB.Available() == 20000 && out.Available() == 10000);
+    CHECK(s.allowance(false) == 25000);
+    t.consume(false, 30000);
+    CHECK(all.Available() == 5000 && hostB.Available() == 0 && hostA.Available() == 25000);
+    CHECK(s.allowance(false) == 5000 && t.allowance(false) == 0);
+    s.consume(true, 4000);
+    CHECK(out.Available() == 6000 && own.Available() == 45000 && all.Available() == 5000);
+
+    // Outside the set, or with the host's limit gone, only what is left applies
+    set.SetHostRateLimit("b", NULL, NULL);
+    CHECK(t.allowance(false) == 5000);
+    set.remove(&s);
+    CHECK(s.allowance(false) == 45000 && s.allowance(true) == 6000);
+    s.consume(false, 45000);
+    CHECK(s.allowance(false) == 0 && all.Available() == 5000);
+}
+
+static std::string pattern(size_t n)
+{
+    std::string s(n, 0);
+    for(size_t i = 0; i < n; ++i)
+        s[i] = char((unsigned(i) * 2654435761u) >> 13);
+    return s;
+}
+
+// Downloads body through a host limit of the set, and checks what was read against the clock all along
+static void download(u64 rate, u64 burst, size_t len)
+{
+    SocketSet set;
+    HttpSocket c;
+    set.add(&c, false);
+    RateLimit lim(rate, burst);
+    set.SetHostRateLimit("127.0.0.1", &lim, NULL);
+    const u64 full = lim.Available(); // the burst it was given, raised to a quantum
+    LoopbackPeer p(set);
+
+    Result r;
+    CHECK(c.SendRequest(testRequest(p.port, "/", r), false));
+    std::string head;
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    const u64 t0 = _GetTimeUS();
+    const u64 in0 = set.GetMetrics().bytesIn;
+    const std::string body = pattern(len);
+    char h[64];
+    sprintf(h, "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n", unsigned(len));
+    const u64 total = strlen(h) + len;
+    p.write(h + body);
+    p.flush(size_t(-1), 0);
+    while(!r.done && _GetTimeUS() < t0 + 10000000)
+    {
+        p.update();
+        const u64 in = set.GetMetrics().bytesIn - in0;
+        CHECK(in <= most(rate, full, t0, _GetTimeUS()));
+        usleep(500);
+    }
+    const u64 t1 = _GetTimeUS();
+    CHECK(r.done && r.complete && r.body == body);
+    CHECK(t1 - t0 >= (total - full) * 1000000 / rate);
+}
+
+// Uploads a body through the socket's own limit; the request header isn't held back, but counts
+static void upload(u64 rate, u64 burst, size_t len)
+{
+    HttpSocket c;
+    RateLimit lim(rate, burst);
+    c.SetRateLimit(NULL, &lim);
+    const u64 full = lim.Available(); // the burst it was given, raised to a quantum
+    LoopbackPeer p(c);
+
+    const std::string data = pattern(len);
+    MemoryBody body(data.data(), data.length());
+    Result r;
+    const u64 t0 = _GetTimeUS();
+    CHECK(c.SendRequest(testRequest(p.port, "/", r, &body), false));
+    std::string head;
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    const u64 total = head.length() + len;
+    while(head.length() + p.in.length() < total && _GetTimeUS() < t0 + 10000000)
+    {
+        p.fill(p.in.length() + 1, 1);
+        CHECK(p.in.length() <= most(rate, full, t0, _GetTimeUS()));
+    }
+    const u64 t1 = _GetTimeUS();
+    CHECK(p.in == data);
+    CHECK(t1 - t0 >= (len - full) * 1000000 / rate);
+    p.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    p.flush();
+    CHECK(r.done && r.complete);
+}
+
+int main()
+{
+    InitNetwork();
+    testBucket();
+    testCombined();
+    download(200000, 0, 100000);
+    download(20000, 1000, 16000); // burst raised to a whole quantum
+    upload(100000, 0, 50000);
+    upload(20000, 100, 16000);
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
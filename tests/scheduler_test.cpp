@@ -0,0 +1,400 @@
+// Tests for RequestScheduler: the per-host and total connection limits, hosts taking turns by weight, which
+// connection a request goes on, and requests submitted from inside callbacks. Against a scripted server on a
+// local socket that takes any number of connections; the host names 127.0.0.1, 127.1 and 127.0.1 all reach it,
+// but are different hosts to the scheduler. Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_SOCKET_SET) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+// Collects requests as they arrive, and answers them when told to
+class Server
+{
+public:
+    Server(SocketSet& set) : accepted(0), _set(set)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        _lfd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in a;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(a);
+        if(bind(_lfd, (sockaddr*)&a, sizeof(a)) || listen(_lfd, 64) || getsockname(_lfd, (sockaddr*)&a, &len))
+            perror("listen");
+        fcntl(_lfd, F_SETFL, O_NONBLOCK);
+        port = ntohs(a.sin_port);
+    }
+    ~Server()
+    {
+        for(size_t i = 0; i < _conns.size(); ++i)
+            ::close(_conns[i].fd);
+        ::close(_lfd);
+    }
+
+    struct Pending
+    {
+        std::string resource;
+        int fd;
+    };
+
+    unsigned port;
+    unsigned accepted; // connections so far
+    std::vector<Pending> pending; // in order of arrival, not answered yet
+    std::string order; // resources in order of arrival, space separated
+
+    void pump(unsigned ms = 30)
+    {
+        for(unsigned i = 0; i < ms; ++i)
+        {
+            _set.update();
+            _Poll();
+            usleep(1000);
+        }
+    }
+
+    // Until n requests are pending, or timeoutMs passed
+    bool wait(size_t n, unsigned timeoutMs = 2000)
+    {
+        for(unsigned i = 0; pending.size() < n && i < timeoutMs; ++i)
+            pump(1);
+        return pending.size() >= n;
+    }
+
+    // Answers the i-th pending request, and lets the client see it
+    void answer(size_t i = 0, bool close = false)
+    {
+        const char *r = close ? "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok"
+            : "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Length: 2\r\n\r\nok";
+        if(::write(pending[i].fd, r, strlen(r)) != ssize_t(strlen(r)))
+            perror("write");
+        pending.erase(pending.begin() + i);
+        pump();
+    }
+
+    size_t open() const { return _conns.size(); }
+
+private:
+    struct Conn
+    {
+        int fd;
+        std::string in;
+    };
+
+    void _Poll()
+    {
+        for(int fd; (fd = ::accept(_lfd, NULL, NULL)) >= 0; )
+        {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            Conn c;
+            c.fd = fd;
+            _conns.push_back(c);
+            ++accepted;
+        }
+        for(size_t i = 0; i < _conns.size(); )
+        {
+            Conn& c = _conns[i];
+            char buf[4096];
+            ssize_t r;
+            while((r = ::read(c.fd, buf, sizeof(buf))) > 0)
+                c.in.append(buf, r);
+            for(size_t end; (end = c.in.find("\r\n\r\n")) != std::string::npos; c.in.erase(0, end + 4))
+            {
+                const size_t from = c.in.find(' ') + 1;
+                Pending p;
+                p.resource = c.in.substr(from, c.in.find(' ', from) - from);
+                p.fd = c.fd;
+                pending.push_back(p);
+                order += (order.length() ? " " : "") + p.resource.substr(1);
+            }
+            if(!r)
+            {
+                ::close(c.fd);
+                _conns.erase(_conns.begin() + i);
+            }
+            else
+                ++i;
+        }
+    }
+
+    SocketSet& _set;
+    int _lfd;
+    std::vector<Conn> _conns;
+};
+
+static Request request(const char *host, unsigned port, const std::string& resource, Result& r)
+{
+    Request req(host, resource, port, &r);
+    req.onRecv = onRecv;
+    req.onDone = onDone;
+    return req;
+}
+
+// How many pending requests are for resources starting with c
+static unsigned count(const Server& srv, char c)
+{
+    unsigned n = 0;
+    for(size_t i = 0; i < srv.pending.size(); ++i)
+        n += srv.pending[i].resource[1] == c;
+    return n;
+}
+
+static void testLimits()
+{
+    SocketSet set;
+    Server srv(set);
+    RequestScheduler sched(set, 2, 3);
+    std::vector<Result> r(12);
+    for(unsigned i = 0; i < 12; ++i)
+    {
+        char res[8];
+        sprintf(res, "/%c%u", i % 2 ? 'b' : 'a', i / 2);
+        Request req = request(i % 2 ? "127.1" : "127.0.0.1", srv.port, res, r[i]);
+        CHECK(sched.Submit(req));
+    }
+    CHECK(sched.GetActive() == 3 && sched.GetWaiting() == 9 && sched.GetConnections() == 3);
+
+    // Never more than 2 to a host, 3 in all, however the answers come
+    CHECK(srv.wait(3));
+    srv.pump(50);
+    for(unsigned step = 0; step < 12; ++step)
+    {
+        CHECK(srv.pending.size() == std::min(3u, 12 - step));
+        CHECK(count(srv, 'a') <= 2 && count(srv, 'b') <= 2);
+        CHECK(sched.GetActive() == srv.pending.size() && sched.GetConnections() <= 3);
+        if(srv.pending.empty())
+            break;
+        srv.answer(step % 3 ? 0 : srv.pending.size() - 1);
+        srv.wait(std::min(3u, 11 - step));
+    }
+    for(unsigned i = 0; i < 12; ++i)
+        CHECK(r[i].done && r[i].complete && r[i].body == "ok");
+    CHECK(sched.IsDone() && sched.GetConnections() == 3);
+
+    // Raised limits let the waiting ones through right away; lowered ones leave busy connections alone
+    for(unsigned i = 0; i < 6; ++i)
+    {
+        r[i] = Result();
+        char res[8];
+        sprintf(res, "/a%u", i);
+        Request req = request("127.0.0.1", srv.port, res, r[i]);
+        CHECK(sched.Submit(req));
+    }
+    CHECK(sched.GetActive() == 2 && sched.GetWaiting() == 4);
+    sched.SetLimits(4, 4);
+    CHECK(sched.GetActive() == 4 && sched.GetConnections() == 4);
+    CHECK(srv.wait(4));
+    sched.SetLimits(1, 1);
+    CHECK(sched.GetActive() == 4);
+    srv.answer();
+    srv.answer();
+    srv.answer();
+    CHECK(sched.GetActive() == 1 && sched.GetWaiting() == 2);
+    srv.answer();
+    CHECK(srv.wait(1));
+    srv.answer();
+    CHECK(srv.wait(1));
+    CHECK(sched.GetActive() == 1);
+    srv.answer();
+    CHECK(sched.IsDone());
+    for(unsigned i = 0; i < 6; ++i)
+        CHECK(r[i].done && r[i].complete);
+}
+
+// With one connection, the order in which requests arrive is the order in which the scheduler sends them
+static std::string turns(unsigned weightB, const char *names, unsigned perHost, unsigned maxPerHost = 4)
+{
+    SocketSet set;
+    Server srv(set);
+    RequestScheduler sched(set, maxPerHost, 1);
+    sched.SetHostWeight("127.1", weightB);
+    const char *hosts[] = { "127.0.0.1", "127.1", "127.0.1" };
+    std::vector<Result> r(strlen(names) * perHost);
+    size_t k = 0;
+    for(const char *n = names; *n; ++n)
+        for(unsigned i = 0; i < perHost; ++i, ++k)
+        {
+            char res[8];
+            sprintf(res, "/%c%u", *n, i);
+            Request req = request(hosts[*n - 'a'], srv.port, res, r[k]);
+            CHECK(sched.Submit(req));
+        }
+    while(srv.wait(1))
+        srv.answer();
+    CHECK(sched.IsDone());
+    for(size_t i = 0; i < r.size(); ++i)
+        CHECK(r[i].done && r[i].complete);
+    return srv.order;
+}
+
+static void testTurns()
+{
+    // a0 goes out as soon as it is submitted; then the hosts take turns
+    CHECK(turns(1, "ab", 4) == "a0 a1 b0 a2 b1 a3 b2 b3");
+    CHECK(turns(3, "ab", 6) == "a0 a1 b0 b1 b2 a2 b3 b4 b5 a3 a4 a5");
+    CHECK(turns(2, "abc", 3) == "a0 a1 b0 b1 c0 a2 b2 c1 c2");
+    CHECK(turns(3, "ba", 4) == "b0 b1 b2 b3 a0 a1 a2 a3");
+
+    // A host at its own limit gives up the rest of its turn
+    CHECK(turns(3, "ab", 4, 1) == "a0 b0 a1 b1 a2 b2 a3 b3");
+}
+
+// Reuses an idle connection to the same host, then opens new ones, and only then takes over other hosts' idle ones
+static void testPickSocket()
+{
+    SocketSet set;
+    Server srv(set);
+    RequestScheduler sched(set, 2, 2);
+    Result r[6];
+    Request req = request("127.0.0.1", srv.port, "/a0", r[0]);
+    CHECK(sched.Submit(req));
+    CHECK(srv.wait(1));
+    srv.answer();
+    CHECK(r[0].done && !r[0].reused);
+
+    req = request("127.1", srv.port, "/b0", r[1]);
+    CHECK(sched.Submit(req));
+    CHECK(srv.wait(1));
+    srv.answer();
+    CHECK(r[1].done && !r[1].reused && sched.GetConnections() == 2 && srv.accepted == 2);
+
+    req = request("127.0.0.1", srv.port, "/a1", r[2]);
+    CHECK(sched.Submit(req));
+    CHECK(srv.wait(1));
+    srv.answer();
+    CHECK(r[2].done && r[2].reused && srv.accepted == 2);
+
+    // No more connections allowed: one of the idle ones goes to the new host
+    req = request("127.0.1", srv.port, "/c0", r[3]);
+    CHECK(sched.Submit(req));
+    CHECK(srv.wait(1));
+    srv.answer();
+    CHECK(r[3].done && !r[3].reused && sched.GetConnections() == 2 && srv.accepted == 3 && srv.open() == 2);
+
+    // A closed connection is used before a new one is opened, whatever host it was for
+    RequestScheduler s2(set, 2, 3);
+    req = request("127.0.0.1", srv.port, "/a2", r[4]);
+    CHECK(s2.Submit(req));
+    CHECK(srv.wait(1));
+    srv.answer(0, true);
+    CHECK(r[4].done && r[4].complete);
+    req = request("127.1", srv.port, "/b1", r[5]);
+    CHECK(s2.Submit(req));
+    CHECK(srv.wait(1));
+    srv.answer();
+    CHECK(r[5].done && r[5].complete && s2.GetConnections() == 1 && srv.accepted == 5);
+}
+
+// Submitting from onDone, while the scheduler is busy handing out requests: answers from the cache arrive
+// before SendRequestSwap() returns
+static RequestScheduler *s_sched;
+static unsigned s_port;
+static std::vector<Result> s_chain;
+
+static void onDoneSubmit(HttpSocket *s, void *user, bool complete)
+{
+    onDone(s, user, complete);
+    const size_t i = (Result*)user - &s_chain[0];
+    if(2 * i + 2 >= s_chain.size())
+        return;
+    for(size_t k = 2 * i + 1; k <= 2 * i + 2; ++k)
+    {
+        char res[8];
+        sprintf(res, "/c%u", unsigned(k % 4));
+        Request req = request(k % 3 ? "127.0.0.1" : "127.1", s_port, res, s_chain[k]);
+        req.onDone = onDoneSubmit;
+        CHECK(s_sched->Submit(req));
+    }
+}
+
+static void testReentrant(unsigned maxTotal)
+{
+    SocketSet set;
+    Server srv(set);
+    MemCache cache(1 << 20);
+    RequestScheduler sched(set, 2, maxTotal);
+    sched.SetCache(&cache);
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        char url[64];
+        sprintf(url, "/c%u", i);
+        const char *hosts[] = { "127.0.0.1", "127.1" };
+        for(unsigned h = 0; h < 2; ++h)
+        {
+            Result r;
+            HttpCache::Info info;
+            info.expires = u64(time(NULL)) + 60;
+            info.size = 6;
+            void *st = cache.BeginStore(HttpCache::MakeKey(request(hosts[h], srv.port, url, r)), info);
+            cache.Append(st, "cached", 6);
+            cache.EndStore(st, true);
+        }
+    }
+
+    // A binary tree of 31 requests, each one's onDone submitting the next two
+    s_sched = &sched;
+    s_port = srv.port;
+    s_chain.assign(31, Result());
+    Request req = request("127.0.0.1", srv.port, "/c0", s_chain[0]);
+    req.onDone = onDoneSubmit;
+    CHECK(sched.Submit(req));
+    for(unsigned i = 0; i < 200 && !sched.IsDone(); ++i)
+        srv.pump(1);
+    CHECK(sched.IsDone() && !sched.GetWaiting() && !sched.GetActive());
+    CHECK(sched.GetConnections() <= maxTotal);
+    for(size_t i = 0; i < s_chain.size(); ++i)
+        CHECK(s_chain[i].done && s_chain[i].complete && s_chain[i].body == "cached");
+    CHECK(srv.order.empty() && !srv.accepted);
+}
+
+// The same for requests that the connection turns down (no port): each one's onDone, called from inside the
+// dispatch loop, submits the next to the same host
+static void onDoneResubmit(HttpSocket *s, void *user, bool complete)
+{
+    onDone(s, user, complete);
+    const size_t i = (Result*)user - &s_chain[0];
+    if(i + 1 >= s_chain.size())
+        return;
+    Request req = request("127.0.0.1", 0, "/x", s_chain[i + 1]);
+    req.onDone = onDoneResubmit;
+    CHECK(s_sched->Submit(req));
+}
+
+static void testReentrantDrop()
+{
+    SocketSet set;
+    RequestScheduler sched(set, 2, 2);
+    s_sched = &sched;
+    s_chain.assign(20, Result());
+    Request req = request("127.0.0.1", 0, "/x", s_chain[0]);
+    req.onDone = onDoneResubmit;
+    CHECK(sched.Submit(req));
+    CHECK(sched.IsDone() && !sched.GetWaiting() && !sched.GetActive());
+    for(size_t i = 0; i < s_chain.size(); ++i)
+        CHECK(s_chain[i].done && !s_chain[i].complete);
+}
+
+int main()
+{
+    InitNetwork();
+    testLimits();
+    testTurns();
+    testPickSocket();
+    testReentrant(1);
+    testReentrant(4);
+    testReentrantDrop();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
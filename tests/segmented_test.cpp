@@ -0,0 +1,311 @@
+// Tests for 64-bit lengths and SegmentedDownload: _ParseU64() and body lengths above 4 GB, the probe and the Range
+// requests of each segment, a server that ignores Range, answers that don't fit the request, and a segment that
+// resumes where its connection dropped. Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_SOCKET_SET) && !defined(_WIN32)
+
+#include "testutil.h"
+#include <algorithm>
+#include <sys/stat.h>
+
+using namespace minihttp;
+
+static const char *s_file = "/tmp/minihttp-segmented-test";
+
+static void testParse()
+{
+    CHECK(_ParseU64(NULL, 10) == 0 && _ParseU64("", 10) == 0 && _ParseU64("x1", 10) == 0);
+    CHECK(_ParseU64("4294967295", 10) == 4294967295u);
+    CHECK(_ParseU64("4294967296", 10) == u64(1) << 32);
+    CHECK(_ParseU64("5000000000", 10) == 5000000000ULL);
+    CHECK(_ParseU64("18446744073709551615", 10) == u64(-1));
+    CHECK(_ParseU64(" \t123-456/789", 10) == 123);
+    CHECK(_ParseU64("12a05f200\r\n", 16) == 5000000000ULL);
+    CHECK(_ParseU64("FFFFFFFFFFFFFFFF", 16) == u64(-1));
+    CHECK(_ParseU64("1fg", 16) == 31 && _ParseU64("1f", 10) == 1);
+}
+
+// Bodies longer than 4 GB: what is left is counted in 64 bits
+static void testLength()
+{
+    HttpSocket c;
+    LoopbackPeer p(c);
+    Result r;
+    std::string head;
+    CHECK(c.SendRequest(testRequest(p.port, "/", r), false));
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    p.write("HTTP/1.1 200 OK\r\nContent-Length: 5000000000\r\n\r\nabc");
+    p.flush();
+    CHECK(c.GetContentLen() == 5000000000ULL && c.GetRemaining() == 5000000000ULL - 3 && r.body == "abc");
+    p.hangup();
+    p.pump();
+    CHECK(r.done && !r.complete);
+
+    Result r2;
+    CHECK(c.SendRequest(testRequest(p.port, "/", r2), false));
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    p.write("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n12a05f200\r\nabc");
+    p.flush();
+    CHECK(c.GetRemaining() == 5000000000ULL + 2 - 3 && r2.body == "abc"); // with the chunk's CRLF
+    p.hangup();
+    p.pump();
+    CHECK(r2.done && !r2.complete);
+}
+
+static std::string pattern(size_t n)
+{
+    std::string s(n, 0);
+    for(size_t i = 0; i < n; ++i)
+        s[i] = char((unsigned(i) * 2654435761u) >> 13);
+    return s;
+}
+
+static std::string readFile()
+{
+    std::string s;
+    FILE *f = fopen(s_file, "rb");
+    if(!f)
+        return s;
+    char buf[65536];
+    for(size_t n; (n = fread(buf, 1, sizeof(buf), f)); )
+        s.append(buf, n);
+    fclose(f);
+    return s;
+}
+
+// Takes the next request and returns its Range ("a-b"), checking If-Range
+static std::string takeRequest(LoopbackPeer& p, const char *validator, unsigned timeoutMs = 2000)
+{
+    std::string head;
+    if(!p.accept(timeoutMs) || !p.readUntil("\r\n\r\n", head))
+        return "";
+    const size_t at = head.find("\r\nRange: bytes=");
+    CHECK(at != std::string::npos);
+    if(at == std::string::npos)
+        return "";
+    const size_t end = head.find("\r\n", at + 2);
+    const std::string range = head.substr(at + 15, end - at - 15);
+    if(range != "0-0")
+        CHECK(head.find(std::string("\r\nIf-Range: ") + validator + "\r\n") != std::string::npos);
+    return range;
+}
+
+static void answer(LoopbackPeer& p, const std::string& data, const std::string& range, u64 cut = u64(-1))
+{
+    unsigned long long a = 0, b = 0;
+    CHECK(sscanf(range.c_str(), "%llu-%llu", &a, &b) == 2);
+    char h[256];
+    sprintf(h, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%u\r\nContent-Length: %llu\r\n\r\n",
+        a, b, unsigned(data.length()), b - a + 1);
+    p.write(h + data.substr(size_t(a), size_t(std::min<u64>(b - a + 1, cut))));
+    p.flush();
+}
+
+// The probe's answer for data, with validator as the ETag
+static bool probe(LoopbackPeer& p, const std::string& data, const char *validator)
+{
+    if(takeRequest(p, validator) != "0-0")
+        return false;
+    char h[256];
+    sprintf(h, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-0/%u\r\nETag: %s\r\nContent-Length: 1\r\n\r\n",
+        unsigned(data.length()), validator);
+    p.write(h + data.substr(0, 1));
+    p.flush();
+    return true;
+}
+
+// Connections a download left behind, so that the next one starts clean
+static void drain(LoopbackPeer& p)
+{
+    while(p.pending(50))
+        p.accept();
+    p.hangup();
+}
+
+// Answers segments until the download ends. The first request from cutAt on gets 1000 bytes, then the connection drops.
+static std::string serve(LoopbackPeer& p, SegmentedDownload& d, const std::string& data, u64 cutAt = u64(-1))
+{
+    std::vector<std::string> ranges;
+    const u64 t0 = _GetTimeUS();
+    while(!d.IsDone() && !d.HasFailed() && _GetTimeUS() < t0 + 10000000)
+    {
+        const std::string range = takeRequest(p, "\"v1\"", 100);
+        if(range.empty())
+            continue;
+        ranges.push_back(range);
+        const bool cut = strtoull(range.c_str(), NULL, 10) == cutAt;
+        answer(p, data, range, cut ? 1000 : u64(-1));
+        if(cut)
+        {
+            cutAt = u64(-1);
+            p.hangup();
+        }
+    }
+    std::sort(ranges.begin(), ranges.end());
+    std::string s;
+    for(size_t i = 0; i < ranges.size(); ++i)
+        s += ranges[i] + " ";
+    return s;
+}
+
+static void testSegments()
+{
+    // 4 segments of at least MIN_SEGMENT_SIZE
+    const std::string data = pattern(4 * MIN_SEGMENT_SIZE + 1000);
+    SocketSet set;
+    LoopbackPeer p(set);
+    char url[64];
+    sprintf(url, "http://127.0.0.1:%u/file", p.port);
+    {
+        SegmentedDownload d;
+        CHECK(d.Start(set, url, s_file, 8));
+        CHECK(!d.Start(set, url, s_file, 8));
+        CHECK(probe(p, data, "\"v1\""));
+        CHECK(d.GetSize() == data.length());
+        CHECK(serve(p, d, data) == "0-262393 262394-524787 524788-787181 787182-1049575 ");
+        CHECK(d.IsDone() && !d.HasFailed() && d.GetReceived() == data.length());
+        CHECK(readFile() == data);
+    }
+
+    // Cut off in the third segment: resumed with the rest of it
+    {
+        SegmentedDownload d;
+        CHECK(d.Start(set, url, s_file, 4));
+        CHECK(probe(p, data, "\"v1\""));
+        CHECK(serve(p, d, data, 524788) == "0-262393 262394-524787 524788-787181 525788-787181 787182-1049575 ");
+        CHECK(d.IsDone() && !d.HasFailed() && d.GetReceived() == data.length());
+        CHECK(readFile() == data);
+    }
+
+    // Unless it ran out of retries
+    {
+        SegmentedDownload d;
+        d.SetMaxRetries(0);
+        CHECK(d.Start(set, url, s_file, 4));
+        CHECK(probe(p, data, "\"v1\""));
+        serve(p, d, data, 262394);
+        CHECK(d.HasFailed() && !d.IsDone());
+    }
+    drain(p);
+
+    // Less than two segments' worth: one
+    {
+        const std::string small = data.substr(0, MIN_SEGMENT_SIZE + 5);
+        SegmentedDownload d;
+        CHECK(d.Start(set, url, s_file, 4));
+        CHECK(probe(p, small, "\"v1\""));
+        CHECK(serve(p, d, small) == "0-262148 ");
+        CHECK(d.IsDone() && readFile() == small);
+    }
+}
+
+// A server that ignores Range sends everything to the probe
+static void testNoRanges()
+{
+    const std::string data = pattern(100000);
+    SocketSet set;
+    LoopbackPeer p(set);
+    char url[64];
+    sprintf(url, "http://127.0.0.1:%u/file", p.port);
+    SegmentedDownload d;
+    CHECK(d.Start(set, url, s_file));
+    CHECK(takeRequest(p, "") == "0-0");
+    p.write("HTTP/1.1 200 OK\r\nContent-Length: 100000\r\n\r\n" + data);
+    p.flush(10000);
+    for(unsigned i = 0; i < 2000 && !d.IsDone(); ++i)
+        p.pump(1);
+    CHECK(d.IsDone() && !d.HasFailed());
+    CHECK(d.GetSize() == data.length() && d.GetReceived() == data.length());
+    CHECK(readFile() == data);
+    CHECK(!p.pending(50));
+}
+
+// Answers that don't match what was asked for
+static void testMismatch()
+{
+    const std::string data = pattern(2 * MIN_SEGMENT_SIZE);
+    SocketSet set;
+    LoopbackPeer p(set);
+    char url[64];
+    sprintf(url, "http://127.0.0.1:%u/file", p.port);
+    for(unsigned k = 0; k < 3; ++k)
+    {
+        {
+            SegmentedDownload d;
+            CHECK(d.Start(set, url, s_file, 2));
+            CHECK(probe(p, data, "\"v1\""));
+            const std::string range = takeRequest(p, "\"v1\"");
+            CHECK(range == "0-262143" || range == "262144-524287");
+            if(k == 0) // another start
+                answer(p, data, range == "0-262143" ? "1-262143" : "262145-524287");
+            else if(k == 1) // If-Range didn't match: the whole new version
+                p.write("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nnewer");
+            else // not a byte range
+                p.write("HTTP/1.1 206 Partial Content\r\nContent-Range: items 0-9/10\r\nContent-Length: 5\r\n\r\nitems");
+            p.flush();
+            CHECK(d.HasFailed() && !d.IsDone());
+        }
+        drain(p);
+    }
+
+    // The probe must say how big it is
+    SegmentedDownload d;
+    CHECK(d.Start(set, url, s_file, 2));
+    CHECK(takeRequest(p, "") == "0-0");
+    p.write("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-0/*\r\nContent-Length: 1\r\n\r\nx");
+    p.flush();
+    CHECK(d.HasFailed() && !d.GetSize());
+}
+
+// Above 4 GB, with a weak ETag that If-Range can't use
+static void testLarge()
+{
+    SocketSet set;
+    LoopbackPeer p(set);
+    char url[64];
+    sprintf(url, "http://127.0.0.1:%u/file", p.port);
+    const char *lm = "Sat, 17 Oct 2026 10:00:00 GMT";
+    {
+        SegmentedDownload d;
+        CHECK(d.Start(set, url, s_file, 4));
+        CHECK(takeRequest(p, "") == "0-0");
+        p.write(std::string("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-0/5000000000\r\nETag: W/\"v1\"\r\n")
+            + "Last-Modified: " + lm + "\r\nContent-Length: 1\r\n\r\nx");
+        p.flush();
+        CHECK(d.GetSize() == 5000000000ULL && !d.HasFailed());
+        std::vector<std::string> ranges;
+        for(unsigned i = 0; i < 4; ++i)
+            ranges.push_back(takeRequest(p, lm));
+        std::sort(ranges.begin(), ranges.end());
+        CHECK(ranges[0] == "0-1249999999" && ranges[1] == "1250000000-2499999999");
+        CHECK(ranges[2] == "2500000000-3749999999" && ranges[3] == "3750000000-4999999999");
+    }
+
+    // Pre-allocated at full size
+    struct stat st;
+    CHECK(!stat(s_file, &st) && u64(st.st_size) == 5000000000ULL);
+}
+
+int main()
+{
+    InitNetwork();
+    testParse();
+    testLength();
+    testSegments();
+    testNoRanges();
+    testMismatch();
+    testLarge();
+    remove(s_file);
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,274 @@
+// Tests for EventSource: the event stream parser, fed in every possible split and with every kind of line end,
+// and reconnecting against a scripted peer on a local socket. Built together with minihttp.cpp to get at its
+// internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_SSE) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+class TestSource : public EventSource
+{
+public:
+    TestSource() : starts(0), ends(0), lastReconnect(false) {}
+
+    struct Event
+    {
+        std::string type, data, id;
+        bool operator==(const Event& e) const { return type == e.type && data == e.data && id == e.id; }
+    };
+    std::vector<Event> events;
+    unsigned starts, ends;
+    bool lastReconnect;
+
+    // Parser only, as if a stream had just started
+    void begin()
+    {
+        events.clear();
+        _lastId.clear();
+        _idBuf.clear();
+        _type.clear();
+        _data.clear();
+        _line.clear();
+        _retryMs = 3000;
+        _active = true;
+        _skipLF = false;
+        _bom = true;
+    }
+    void feed(const std::string& s) { _Parse(s.data(), s.length()); }
+    unsigned retryMs() const { return _retryMs; }
+
+protected:
+    virtual void _OnEvent(const std::string& type, const std::string& data, const std::string& id)
+    {
+        Event e;
+        e.type = type;
+        e.data = data;
+        e.id = id;
+        events.push_back(e);
+    }
+    virtual void _OnStreamStart() { ++starts; }
+    virtual void _OnStreamEnd(bool reconnect)
+    {
+        ++ends;
+        lastReconnect = reconnect;
+    }
+};
+
+static TestSource::Event event(const char *type, const char *data, const char *id)
+{
+    TestSource::Event e;
+    e.type = type;
+    e.data = data;
+    e.id = id;
+    return e;
+}
+
+static std::string replaceLF(const std::string& s, const char *eol)
+{
+    std::string r;
+    for(size_t i = 0; i < s.length(); ++i)
+    {
+        if(s[i] == '\n')
+            r += eol;
+        else
+            r += s[i];
+    }
+    return r;
+}
+
+static const char s_stream[] =
+    "\xEF\xBB\xBF" ": a comment, and the BOM in front of it is skipped\n"
+    "data: first\n"
+    "data:second\n"
+    "id: 7\n"
+    "unknown: field\n"
+    "\n"
+    "event: update\n"
+    "data\n"
+    "\n"
+    "\n" // nothing to dispatch
+    "retry: 1500\n"
+    "retry: 15x\n" // ignored
+    "id\n" // empty id resets
+    "data:  leading space\n"
+    ":\n"
+    "\n"
+    "id: 9\n"
+    "event: cut\n"
+    "data: never finished";
+
+static void checkStream(TestSource& s)
+{
+    CHECK(s.events.size() == 3);
+    if(s.events.size() == 3)
+    {
+        CHECK(s.events[0] == event("message", "first\nsecond", "7"));
+        CHECK(s.events[1] == event("update", "", "7"));
+        CHECK(s.events[2] == event("message", " leading space", ""));
+    }
+    CHECK(s.retryMs() == 1500);
+    CHECK(s.GetLastEventId() == ""); // the id of the unfinished event doesn't count
+}
+
+static void testParse()
+{
+    const char *eols[] = { "\n", "\r\n", "\r" };
+    TestSource s;
+    for(unsigned k = 0; k < 3; ++k)
+    {
+        const std::string in = replaceLF(s_stream, eols[k]);
+
+        // In one piece, in two pieces split everywhere, and a byte at a time
+        s.begin();
+        s.feed(in);
+        checkStream(s);
+        for(size_t i = 0; i <= in.length(); ++i)
+        {
+            s.begin();
+            s.feed(in.substr(0, i));
+            s.feed(in.substr(i));
+            checkStream(s);
+        }
+        s.begin();
+        for(size_t i = 0; i < in.length(); ++i)
+            s.feed(in.substr(i, 1));
+        checkStream(s);
+    }
+
+    // Line ends mixed in one stream; a CR right at the end of a piece followed by a new line, not an LF
+    s.begin();
+    s.feed("data: a\r");
+    s.feed("data: b\n");
+    s.feed("data: c\r\n\r");
+    s.feed("\r");
+    CHECK(s.events.size() == 1 && s.events[0] == event("message", "a\nb\nc", ""));
+    CHECK(s.events.size() == 1); // the CR CR was a blank line, then nothing
+}
+
+// Sends the response header, for a stream that ends with the connection unless chunked
+class Peer : public LoopbackPeer
+{
+public:
+    Peer(TestSource& c) : LoopbackPeer(c), _c(c) {}
+
+    bool request(std::string& req)
+    {
+        return accept() && readUntil("\r\n\r\n", req);
+    }
+
+    void respond(bool chunked)
+    {
+        write(std::string("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n")
+            + (chunked ? "Transfer-Encoding: chunked\r\n" : "") + "\r\n");
+    }
+
+    void chunk(const std::string& s)
+    {
+        char h[16];
+        sprintf(h, "%x\r\n", unsigned(s.length()));
+        write(h + s + "\r\n");
+    }
+
+private:
+    TestSource& _c;
+};
+
+static void testReconnect()
+{
+    TestSource c;
+    Peer p(c);
+    char url[64];
+    sprintf(url, "http://127.0.0.1:%u/events", p.port);
+    CHECK(c.Open(url));
+
+    std::string req;
+    CHECK(p.request(req));
+    CHECK(req.find("GET /events HTTP/1.1\r\n") == 0);
+    CHECK(req.find("\r\nAccept: text/event-stream\r\n") != std::string::npos);
+    CHECK(req.find("Last-Event-ID") == std::string::npos);
+
+    // Until the connection ends, in small pieces so that lines are cut up
+    p.respond(false);
+    p.write("retry: 10\r\ndata: one\r\nid: 41\r\n\r\ndata: two\r\nid: 42\r\n\r\ndata: cut off\r\nid: 43\r\n");
+    p.flush(3);
+    CHECK(c.IsStreaming() && c.starts == 1);
+    CHECK(c.events.size() == 2);
+    if(c.events.size() == 2)
+    {
+        CHECK(c.events[0] == event("message", "one", "41"));
+        CHECK(c.events[1] == event("message", "two", "42"));
+    }
+    p.hangup();
+    p.pump();
+    CHECK(c.ends == 1 && c.lastReconnect && c.IsActive() && !c.IsStreaming());
+
+    // Again after the delay the server asked for, resuming after the last complete event. Now chunked,
+    // with chunk borders inside lines and between the CR and LF.
+    CHECK(p.request(req));
+    CHECK(req.find("\r\nLast-Event-ID: 42\r\n") != std::string::npos);
+    p.respond(true);
+    p.chunk("event: x\r");
+    p.chunk("\ndata: thr");
+    p.chunk("ee\r");
+    p.chunk("\n\r");
+    p.chunk("\n");
+    p.flush();
+    CHECK(c.events.size() == 3 && c.events[2] == event("x", "three", "42"));
+    CHECK(c.starts == 2 && c.ends == 1);
+
+    // The end of the chunked stream is an end like any other
+    p.write("0\r\n\r\n");
+    p.flush();
+    CHECK(c.ends == 2 && c.lastReconnect);
+
+    // Anything but an event stream ends it for good
+    CHECK(p.request(req));
+    CHECK(req.find("\r\nLast-Event-ID: 42\r\n") != std::string::npos);
+    p.write("HTTP/1.1 204 No Content\r\n\r\n");
+    p.flush();
+    CHECK(c.ends == 3 && !c.lastReconnect && !c.IsActive() && c.GetStatusCode() == 204);
+    CHECK(!p.pending(100));
+    CHECK(c.starts == 2 && c.events.size() == 3);
+}
+
+static void testStop()
+{
+    TestSource c;
+    Peer p(c);
+    char url[64];
+    sprintf(url, "http://127.0.0.1:%u/", p.port);
+    c.SetLastEventId("start");
+    CHECK(c.Open(url));
+    std::string req;
+    CHECK(p.request(req));
+    CHECK(req.find("\r\nLast-Event-ID: start\r\n") != std::string::npos);
+    p.respond(false);
+    p.flush();
+    CHECK(c.IsStreaming());
+    c.Stop();
+    p.pump();
+    CHECK(p.closed());
+    CHECK(!c.IsActive() && !p.pending(100));
+}
+
+int main()
+{
+    InitNetwork();
+    testParse();
+    testReconnect();
+    testStop();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
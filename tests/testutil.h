@@ -0,0 +1,233 @@
+// Shared by the tests: CHECK(), and a scripted server on a local socket.
+// Include after minihttp.cpp. POSIX only.
+
+#ifndef MINIHTTP_TESTUTIL_H
+#define MINIHTTP_TESTUTIL_H
+
+#include <arpa/inet.h>
+#include <signal.h>
+
+static int s_failed = 0;
+
+#define CHECK(c) do { if(!(c)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); ++s_failed; } } while(0)
+
+static int testResult()
+{
+    printf("%s\n", s_failed ? "FAILED" : "ok");
+    return s_failed ? 1 : 0;
+}
+
+#ifdef MINIHTTP_SUPPORT_HTTP
+
+// What a request's callbacks saw
+struct Result
+{
+    Result() : done(false), complete(false), reused(false), status(0), sent(0), firstByte(0) {}
+    std::string body, resource, header;
+    bool done, complete, reused;
+    unsigned status;
+    minihttp::u64 sent, firstByte;
+};
+
+static void onRecv(minihttp::HttpSocket *, void *user, const void *buf, unsigned size)
+{
+    ((Result*)user)->body.append((const char*)buf, size);
+}
+
+static void onDone(minihttp::HttpSocket *s, void *user, bool complete)
+{
+    Result& r = *(Result*)user;
+    CHECK(!r.done); // exactly once
+    r.done = true;
+    r.complete = complete;
+    r.status = s->GetStatusCode();
+    r.resource = s->GetCurrentRequest().resource;
+    if(const char *h = s->Hdr("x-test"))
+        r.header = h;
+    r.reused = s->GetTimings().reused;
+    r.sent = s->GetTimings().sent;
+    r.firstByte = s->GetTimings().firstByte;
+}
+
+// A request to the local peer with the callbacks above
+static minihttp::Request testRequest(unsigned port, const char *resource, Result& r, minihttp::RequestBody *body = NULL)
+{
+    minihttp::Request req("127.0.0.1", resource, port, &r);
+    req.onRecv = onRecv;
+    req.onDone = onDone;
+    req.body = body;
+    return req;
+}
+
+#endif
+
+// The server side of one connection at a time, driven from the same thread as the client:
+// everything that waits for the peer keeps updating the client socket (or set) meanwhile.
+class LoopbackPeer
+{
+public:
+    LoopbackPeer(minihttp::TcpSocket& c) : _c(&c), _set(NULL), _fd(-1), _eof(false) { _Listen(); }
+    LoopbackPeer(minihttp::SocketSet& s) : _c(NULL), _set(&s), _fd(-1), _eof(false) { _Listen(); }
+    virtual ~LoopbackPeer()
+    {
+        if(_fd >= 0)
+            ::close(_fd);
+        ::close(_lfd);
+    }
+
+    unsigned port;
+    std::string in; // received, not consumed yet
+
+    // Takes the next connection. The previous one, if any, is closed.
+    virtual bool accept(unsigned timeoutMs = 2000)
+    {
+        hangup();
+        in.clear();
+        _eof = false;
+        for(unsigned i = 0; i < timeoutMs && _fd < 0; ++i)
+        {
+            update();
+            pollfd p = { _lfd, POLLIN, 0 };
+            if(poll(&p, 1, 1) > 0)
+                _fd = ::accept(_lfd, NULL, NULL);
+        }
+        if(_fd < 0)
+            return false;
+        fcntl(_fd, F_SETFL, O_NONBLOCK);
+        const int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // small writes must not wait for ACKs
+        return true;
+    }
+
+    // Whether a new connection came in within timeoutMs, without taking it
+    bool pending(unsigned timeoutMs)
+    {
+        for(unsigned i = 0; i < timeoutMs; ++i)
+        {
+            update();
+            pollfd p = { _lfd, POLLIN, 0 };
+            if(poll(&p, 1, 1) > 0)
+                return true;
+        }
+        return false;
+    }
+
+    void hangup()
+    {
+        if(_fd >= 0)
+            ::close(_fd);
+        _fd = -1;
+    }
+
+    void write(const std::string& s) { _out += s; }
+
+    // Writes what was queued, in pieces of at most chunk bytes with client updates in between
+    void flush(size_t chunk = size_t(-1), unsigned pumpMs = 20)
+    {
+        for(size_t off = 0; off < _out.length(); )
+        {
+            const size_t n = std::min(chunk, _out.length() - off);
+            const ssize_t w = ::write(_fd, _out.data() + off, n);
+            if(w > 0)
+                off += w;
+            else if(w < 0 && errno != EAGAIN)
+                break;
+            update();
+        }
+        _out.clear();
+        pump(pumpMs);
+    }
+
+    void pump(unsigned ms = 20)
+    {
+        for(unsigned i = 0; i < ms; ++i)
+        {
+            update();
+            usleep(1000);
+        }
+    }
+
+    // Until at least n bytes are in. False on timeout or EOF.
+    bool fill(size_t n, unsigned timeoutMs = 2000)
+    {
+        for(unsigned i = 0; in.length() < n && i < timeoutMs; ++i)
+        {
+            update();
+            char buf[65536];
+            const ssize_t r = ::read(_fd, buf, sizeof(buf));
+            if(r > 0)
+            {
+                in.append(buf, r);
+                continue;
+            }
+            if(!r)
+            {
+                _eof = true;
+                return false;
+            }
+            usleep(1000);
+        }
+        return in.length() >= n;
+    }
+
+    // Takes everything up to and including delim
+    bool readUntil(const char *delim, std::string& out, unsigned timeoutMs = 2000)
+    {
+        size_t at;
+        for(unsigned i = 0; (at = in.find(delim)) == std::string::npos; ++i)
+            if(i >= timeoutMs || (!fill(in.length() + 1, 1) && _eof))
+                return false;
+        at += strlen(delim);
+        out.assign(in, 0, at);
+        in.erase(0, at);
+        return true;
+    }
+
+    // Takes the next n bytes
+    bool read(size_t n, std::string& out, unsigned timeoutMs = 2000)
+    {
+        if(!fill(n, timeoutMs))
+            return false;
+        out.assign(in, 0, n);
+        in.erase(0, n);
+        return true;
+    }
+
+    // True if the client closed the connection. Whatever else arrives until then is kept in 'in'.
+    bool closed(unsigned timeoutMs = 100)
+    {
+        fill(size_t(-1), timeoutMs);
+        return _eof;
+    }
+
+    void update()
+    {
+        if(_c)
+            _c->update();
+        if(_set)
+            _set->update();
+    }
+
+private:
+    void _Listen()
+    {
+        signal(SIGPIPE, SIG_IGN); // writes to a client that hung up just fail
+        _lfd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in a;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(a);
+        if(bind(_lfd, (sockaddr*)&a, sizeof(a)) || listen(_lfd, 8) || getsockname(_lfd, (sockaddr*)&a, &len))
+            perror("listen");
+        port = ntohs(a.sin_port);
+    }
+
+    minihttp::TcpSocket *_c;
+    minihttp::SocketSet *_set;
+    int _lfd, _fd;
+    std::string _out;
+    bool _eof;
+};
+
+#endif
@@ -0,0 +1,220 @@
+// Tests for the trace ring: records written by two threads and by a real request, saved with TraceSave(),
+// read back from the file, and decoded by the tracedump tool, whose path is the first argument (that part is
+// skipped without it). Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && MINIHTTP_TRACE_LEVEL > 0 && !defined(_WIN32)
+
+#include "testutil.h"
+#include <pthread.h>
+#include <sys/wait.h>
+
+using namespace minihttp;
+
+static std::string s_file;
+static const char *s_tracedump;
+
+static std::vector<TraceRecord> load()
+{
+    std::vector<TraceRecord> recs;
+    FILE *f = fopen(s_file.c_str(), "rb");
+    CHECK(f);
+    if(!f)
+        return recs;
+    unsigned hdr[3];
+    CHECK(fread(hdr, sizeof(hdr), 1, f) == 1);
+    CHECK(hdr[0] == TRACE_FILE_MAGIC && hdr[1] == TRACE_FILE_VERSION && hdr[2] == sizeof(TraceRecord));
+    TraceRecord t;
+    while(fread(&t, sizeof(t), 1, f) == 1)
+        recs.push_back(t);
+    fclose(f);
+    return recs;
+}
+
+// tracedump's output for the file, without the time column
+static std::string dump(int& status)
+{
+    std::string out;
+    FILE *p = popen((std::string(s_tracedump) + " " + s_file).c_str(), "r");
+    CHECK(p);
+    if(!p)
+        return out;
+    char line[512];
+    while(fgets(line, sizeof(line), p))
+        out += strstr(line, " ms  ") ? strstr(line, " ms  ") + 5 : line;
+    status = pclose(p);
+    status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return out;
+}
+
+static bool is(const TraceRecord& t, unsigned event, u64 obj, unsigned a, u64 b, unsigned thread)
+{
+    return t.event == event && t.obj == obj && t.a == a && t.b == b && t.thread == thread;
+}
+
+static void *other(void *)
+{
+    _Trace(TRACE_CHUNK, (void*)0x5678, 0, 1);
+    return NULL;
+}
+
+static void testRecords()
+{
+    void * const obj = (void*)0x1234;
+    const u64 o = 0x1234;
+    _Trace(TRACE_SOCKET_OPEN, obj, 8080, 0);
+    _Trace(TRACE_REQUEST_QUEUED, obj, 3, 0);
+    _Trace(TRACE_REQUEST_START, obj, 2, 0);
+    _Trace(TRACE_STATUS, obj, 200, 12345678901ULL);
+    _Trace(TRACE_HEADER_FIELD, obj, 5, _TraceStr("content-type", 12));
+    _Trace(TRACE_HEADER_FIELD, obj, 3, _TraceStr("etag", 4));
+
+    // From another thread, in between: a ring of its own
+    usleep(1000);
+    pthread_t th;
+    CHECK(!pthread_create(&th, NULL, other, NULL) && !pthread_join(th, NULL));
+    usleep(1000);
+
+    _Trace(TRACE_CHUNK, obj, 0, 4096);
+    _Trace(TRACE_REDIRECT, obj, 301, 0);
+    _Trace(TRACE_ERROR, obj, MERR_RECV, u64(-104));
+    _Trace(TRACE_REQUEST_DONE, obj, 200, 5);
+    _Trace(TRACE_SOCKET_CLOSE, obj, 0, 777);
+    _Trace(TRACE_NONE, obj, 1, 2);
+    CHECK(TraceSave(s_file.c_str()));
+
+    // Each ring in order; the newest ring comes first
+    const std::vector<TraceRecord> r = load();
+    CHECK(r.size() == 13);
+    if(r.size() == 13)
+    {
+        CHECK(is(r[0], TRACE_CHUNK, 0x5678, 0, 1, 1));
+        CHECK(is(r[1], TRACE_SOCKET_OPEN, o, 8080, 0, 0));
+        CHECK(is(r[5], TRACE_HEADER_FIELD, o, 5, _TraceStr("content-", 8), 0));
+        CHECK(is(r[10], TRACE_REQUEST_DONE, o, 200, 5, 0));
+        CHECK(is(r[12], TRACE_NONE, o, 1, 2, 0));
+        for(size_t i = 2; i < r.size(); ++i)
+            CHECK(r[i].time >= r[i - 1].time);
+        CHECK(r[0].time > r[6].time && r[0].time < r[7].time);
+    }
+
+    if(!s_tracedump)
+        return;
+    int status;
+    CHECK(dump(status) ==
+        "T0   0000000000001234  socket_open    port=8080\n"
+        "T0   0000000000001234  request_queued queue=3\n"
+        "T0   0000000000001234  request_start  queue=2\n"
+        "T0   0000000000001234  status         status=200 length=12345678901\n"
+        "T0   0000000000001234  header_field   key=content-... vallen=5\n"
+        "T0   0000000000001234  header_field   key=etag vallen=3\n"
+        "T1   0000000000005678  chunk          size=1\n"
+        "T0   0000000000001234  chunk          size=4096\n"
+        "T0   0000000000001234  redirect       status=301\n"
+        "T0   0000000000001234  error          kind=recv code=-104\n"
+        "T0   0000000000001234  request_done   status=200 body=5\n"
+        "T0   0000000000001234  socket_close   recvd=777\n"
+        "T0   0000000000001234  none           a=1 b=2\n"
+        "13 records\n");
+    CHECK(status == 0);
+}
+
+// What a request leaves in the ring, in order
+static void testRequestRecords()
+{
+    HttpSocket *c = new HttpSocket;
+    const u64 obj = (u64)(size_t)c;
+    unsigned port;
+    {
+        LoopbackPeer p(*c);
+        port = p.port;
+        Result r;
+        CHECK(c->SendRequest(testRequest(p.port, "/", r), false));
+        std::string head;
+        CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+        p.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+        p.flush();
+        CHECK(r.done && r.complete);
+    }
+    delete c;
+    CHECK(TraceSave(s_file.c_str()));
+
+    std::vector<TraceRecord> mine;
+    const std::vector<TraceRecord> r = load();
+    for(size_t i = 0; i < r.size(); ++i)
+        if(r[i].obj == obj && r[i].thread == 0)
+            mine.push_back(r[i]);
+    CHECK(mine.size() == 5);
+    if(mine.size() == 5)
+    {
+        CHECK(is(mine[0], TRACE_SOCKET_OPEN, obj, port, 0, 0));
+        CHECK(is(mine[1], TRACE_REQUEST_START, obj, 0, 0, 0));
+        CHECK(is(mine[2], TRACE_STATUS, obj, 200, 2, 0));
+        CHECK(is(mine[3], TRACE_REQUEST_DONE, obj, 200, 2, 0));
+        CHECK(mine[4].event == TRACE_SOCKET_CLOSE && mine[4].b > 2); // once, though it closes from the callback
+    }
+}
+
+// A full ring keeps the newest records but one, whose slot the thread may be writing; lastSeconds keeps the recent
+// ones
+static void testWrap()
+{
+    for(unsigned i = 0; i < TRACE_RING_SIZE + 1000; ++i)
+        _Trace(TRACE_CHUNK, (void*)0x9999, 0, i);
+    CHECK(TraceSave(s_file.c_str()));
+    std::vector<TraceRecord> r = load();
+    CHECK(r.size() == TRACE_RING_SIZE);
+    if(r.size() == TRACE_RING_SIZE)
+    {
+        CHECK(is(r[0], TRACE_CHUNK, 0x5678, 0, 1, 1));
+        for(unsigned i = 1; i < TRACE_RING_SIZE; ++i)
+            CHECK(is(r[i], TRACE_CHUNK, 0x9999, 0, i + 1000, 0));
+    }
+
+    usleep(1100000);
+    _Trace(TRACE_REDIRECT, (void*)0x9999, 302, 0);
+    CHECK(TraceSave(s_file.c_str(), 1));
+    r = load();
+    CHECK(r.size() == 1 && is(r[0], TRACE_REDIRECT, 0x9999, 302, 0, 0));
+
+    if(!s_tracedump)
+        return;
+    int status;
+    CHECK(dump(status) == "T0   0000000000009999  redirect       status=302\n1 records\n" && status == 0);
+
+    // Not a trace file
+    FILE *f = fopen(s_file.c_str(), "wb");
+    fputs("MHTR, but not really", f);
+    fclose(f);
+    CHECK(dump(status).find("Not a minihttp trace file") != std::string::npos && status == 1);
+}
+
+int main(int argc, char *argv[])
+{
+    InitNetwork();
+    s_tracedump = argc > 1 ? argv[1] : NULL;
+    if(!s_tracedump)
+        printf("No tracedump given, only checking the file\n");
+    char file[] = "/tmp/minihttp-trace-XXXXXX";
+    const int fd = mkstemp(file);
+    CHECK(fd >= 0);
+    close(fd);
+    s_file = file;
+
+    testRecords();
+    testRequestRecords();
+    testWrap();
+
+    remove(file);
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,396 @@
+// Tests for request bodies: the exact bytes on the wire for each kind of RequestBody, chunked and not,
+// both ways _PumpUpload() sends a file, and Expect: 100-continue. Against a scripted peer on a local socket.
+// Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+// A payload whose bytes depend on where they are (repeating only every 2 MB), so that shifted or repeated pieces show
+static std::string pattern(size_t n, unsigned seed)
+{
+    std::string s(n, '\0');
+    for(size_t i = 0; i < n; ++i)
+        s[i] = char((unsigned(i) * 2654435761u + seed * 40503u) >> 13);
+    return s;
+}
+
+// For CallbackBody: hands out the pieces one per call, then -1 if fail is set, else 0
+struct Pieces
+{
+    Pieces() : next(0), fail(false) {}
+    std::vector<std::string> pieces;
+    size_t next;
+    bool fail;
+};
+
+static int readPieces(void *user, void *buf, unsigned maxlen)
+{
+    Pieces& p = *(Pieces*)user;
+    if(p.next == p.pieces.size())
+        return p.fail ? -1 : 0;
+    const std::string& s = p.pieces[p.next++];
+    CHECK(s.length() <= maxlen);
+    memcpy(buf, s.data(), s.length());
+    return (int)s.length();
+}
+
+// For CallbackBody: as much of the string as fits
+struct Stream
+{
+    Stream(const std::string& s) : data(s), off(0) {}
+    std::string data;
+    size_t off;
+};
+
+static int readStream(void *user, void *buf, unsigned maxlen)
+{
+    Stream& s = *(Stream*)user;
+    const size_t n = std::min(size_t(maxlen), s.data.length() - s.off);
+    memcpy(buf, s.data.data() + s.off, n);
+    s.off += n;
+    return (int)n;
+}
+
+// Has a descriptor that sendfile() refuses, so the body goes the read() way
+class NoSendfileBody : public MemoryBody
+{
+public:
+    NoSendfileBody(const void *data, size_t len, int fd) : MemoryBody(data, len), _fd(fd) {}
+    virtual int fd() const { return _fd; }
+private:
+    int _fd;
+};
+
+// A chunked body as it comes, and what it decodes to
+static bool readChunked(LoopbackPeer& p, std::string& raw, std::string& data)
+{
+    for(;;)
+    {
+        std::string line, d;
+        if(!p.readUntil("\r\n", line))
+            return false;
+        raw += line;
+        const size_t n = strtoul(line.c_str(), NULL, 16);
+        if(!n)
+        {
+            if(!p.readUntil("\r\n", line)) // no trailer fields
+                return false;
+            raw += line;
+            return line == "\r\n";
+        }
+        if(!p.read(n + 2, d) || d.compare(n, 2, "\r\n"))
+            return false;
+        raw += d;
+        data += d.substr(0, n);
+    }
+}
+
+static std::string field(const std::string& head, const char *name)
+{
+    const size_t at = head.find(std::string("\r\n") + name + ": ");
+    if(at == std::string::npos)
+        return std::string();
+    const size_t from = at + strlen(name) + 4;
+    return head.substr(from, head.find("\r\n", from) - from);
+}
+
+// Sends a POST with the body, takes the request apart and answers it
+struct Upload
+{
+    std::string head, raw, data;
+    Result r;
+
+    bool run(HttpSocket& c, LoopbackPeer& p, RequestBody *body)
+    {
+        CHECK(c.SendRequest(testRequest(p.port, "/up", r, body), false));
+        if(!p.accept() || !p.readUntil("\r\n\r\n", head))
+            return false;
+        CHECK(head.find("POST /up HTTP/1.1\r\n") == 0);
+        if(field(head, "Transfer-Encoding") == "chunked")
+        {
+            CHECK(field(head, "Content-Length").empty());
+            if(!readChunked(p, raw, data))
+                return false;
+        }
+        else if(!p.read(strtoul(field(head, "Content-Length").c_str(), NULL, 10), raw))
+            return false;
+        else
+            data = raw;
+        p.fill(p.in.length() + 1, 20);
+        CHECK(p.in.empty()); // nothing behind the body
+        p.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+        p.flush();
+        CHECK(r.done && r.complete && r.status == 200 && r.body == "ok");
+        CHECK(r.sent && r.sent <= r.firstByte);
+        return true;
+    }
+};
+
+static void testCallbackBody()
+{
+    HttpSocket c;
+    LoopbackPeer p(c);
+
+    Pieces hello;
+    hello.pieces.push_back("hello");
+    hello.pieces.push_back(" world");
+    CallbackBody b1(readPieces, &hello);
+    Upload u1;
+    CHECK(u1.run(c, p, &b1));
+    CHECK(field(u1.head, "Content-Type") == "application/octet-stream");
+    CHECK(u1.raw == "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n");
+
+    // Nothing at all is still a chunked body, made of the last chunk only
+    Pieces none;
+    CallbackBody b2(readPieces, &none);
+    Upload u2;
+    CHECK(u2.run(c, p, &b2));
+    CHECK(u2.raw == "0\r\n\r\n");
+
+    // Known size: as is
+    Pieces sized = hello;
+    sized.next = 0;
+    CallbackBody b3(readPieces, &sized, 11);
+    Upload u3;
+    CHECK(u3.run(c, p, &b3));
+    CHECK(field(u3.head, "Content-Length") == "11" && u3.raw == "hello world");
+
+    // Bigger than the upload buffer: chunks as big as the buffer allows
+    Stream big(pattern(40000, 1));
+    CallbackBody b4(readStream, &big);
+    Upload u4;
+    CHECK(u4.run(c, p, &b4));
+    const unsigned most = UPLOAD_BUFSIZE - UPLOAD_CHUNK_HDR - 2;
+    char h[16];
+    sprintf(h, "%x\r\n", most);
+    std::string expect = h + big.data.substr(0, most) + "\r\n" + h + big.data.substr(most, most) + "\r\n";
+    sprintf(h, "%x\r\n", 40000 - 2 * most);
+    expect += h + big.data.substr(2 * most) + "\r\n0\r\n\r\n";
+    CHECK(u4.raw == expect);
+
+    // A read error ends the request, and the connection, in the middle of the body
+    Pieces broken;
+    broken.pieces.push_back("hello");
+    broken.fail = true;
+    CallbackBody b5(readPieces, &broken);
+    Result r;
+    CHECK(c.SendRequest(testRequest(p.port, "/up", r, &b5), false));
+    std::string head, chunk;
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    CHECK(p.read(10, chunk) && chunk == "5\r\nhello\r\n");
+    CHECK(p.closed());
+    CHECK(p.in.empty());
+    CHECK(r.done && !r.complete);
+}
+
+static void testMultipart()
+{
+    HttpSocket c;
+    LoopbackPeer p(c);
+
+    const std::string text = "file\r\ncontents";
+    MemoryBody file(text.data(), text.length());
+    MultipartBody m;
+    m.add("field", "value").add("we\"ird\r\n", "a \"b\".txt", "text/plain", &file);
+    Upload u;
+    CHECK(u.run(c, p, &m));
+    const std::string type = field(u.head, "Content-Type");
+    CHECK(!type.compare(0, 30, "multipart/form-data; boundary="));
+    const std::string b = type.substr(30);
+    CHECK(b.length() >= 10);
+    const std::string expect = "--" + b + "\r\n"
+        "Content-Disposition: form-data; name=\"field\"\r\n"
+        "\r\n"
+        "value\r\n"
+        "--" + b + "\r\n"
+        "Content-Disposition: form-data; name=\"we%22ird%0D%0A\"; filename=\"a %22b%22.txt\"\r\n"
+        "Content-Type: text/plain\r\n"
+        "\r\n"
+        "file\r\ncontents\r\n"
+        "--" + b + "--\r\n";
+    CHECK(u.raw == expect);
+    CHECK(strtoul(field(u.head, "Content-Length").c_str(), NULL, 10) == expect.length());
+
+    // A part of unknown size makes the whole body chunked, and the parts come out the same
+    Stream s(pattern(20000, 2));
+    CallbackBody cb(readStream, &s);
+    MultipartBody m2;
+    m2.add("blob", "blob.bin", NULL, &cb).add("after", "");
+    Upload u2;
+    CHECK(u2.run(c, p, &m2));
+    const std::string b2 = field(u2.head, "Content-Type").substr(30);
+    CHECK(b2 != b);
+    CHECK(u2.data == "--" + b2 + "\r\n"
+        "Content-Disposition: form-data; name=\"blob\"; filename=\"blob.bin\"\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "\r\n"
+        + s.data + "\r\n"
+        "--" + b2 + "\r\n"
+        "Content-Disposition: form-data; name=\"after\"\r\n"
+        "\r\n"
+        "\r\n"
+        "--" + b2 + "--\r\n");
+
+    // No parts at all
+    MultipartBody m3;
+    Upload u3;
+    CHECK(u3.run(c, p, &m3));
+    CHECK(u3.raw == "--" + field(u3.head, "Content-Type").substr(30) + "--\r\n");
+}
+
+static void testFileBody()
+{
+    HttpSocket c;
+    LoopbackPeer p(c);
+
+    // Part of a file, more than one update's worth: sendfile() on linux
+    const std::string contents = pattern(700000, 3);
+    FILE *f = tmpfile();
+    CHECK(f && fwrite(contents.data(), 1, contents.length(), f) == contents.length() && !fflush(f));
+    const int fd = fileno(f);
+    FileBody part(fd, 1000, 600000);
+    Upload u;
+    CHECK(u.run(c, p, &part));
+    CHECK(field(u.head, "Content-Length") == "600000");
+    CHECK(u.raw == contents.substr(1000, 600000));
+    CHECK(part.tell() == 601000);
+
+    // To the end of the file
+    FileBody rest(fd, 650000);
+    Upload u2;
+    CHECK(u2.run(c, p, &rest));
+    CHECK(u2.raw == contents.substr(650000));
+
+    // A descriptor sendfile() can't read from (EINVAL): read() instead, same bytes
+    const int dir = open(".", O_RDONLY);
+    CHECK(dir >= 0);
+    NoSendfileBody nosf(contents.data(), 300000, dir);
+    Upload u3;
+    CHECK(u3.run(c, p, &nosf));
+    CHECK(field(u3.head, "Content-Length") == "300000");
+    CHECK(u3.raw == contents.substr(0, 300000));
+
+    // The file is shorter than promised: the request fails instead of waiting for the rest
+    FileBody toolong(fd, 690000, 20000);
+    Result r;
+    CHECK(c.SendRequest(testRequest(p.port, "/up", r, &toolong), false));
+    std::string head, data;
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    CHECK(field(head, "Content-Length") == "20000");
+    CHECK(p.closed());
+    CHECK(p.in == contents.substr(690000));
+    CHECK(r.done && !r.complete);
+
+    ::close(dir);
+    fclose(f);
+}
+
+// Sends a POST whose body is held back, and reads up to the end of the request header
+static bool expectRequest(HttpSocket& c, LoopbackPeer& p, Result& r, RequestBody *body, std::string& head)
+{
+    CHECK(c.SendRequest(testRequest(p.port, "/up", r, body), false));
+    if(!p.accept() || !p.readUntil("\r\n\r\n", head))
+        return false;
+    CHECK(field(head, "Expect") == "100-continue");
+    return !p.fill(1, 50); // nothing behind the header yet
+}
+
+static void testExpectContinue()
+{
+    HttpSocket c;
+    c.SetExpectContinue(100, 5000);
+    LoopbackPeer p(c);
+    const std::string data = pattern(1000, 5);
+    std::string head, got;
+
+    // The body goes out once the server says so
+    MemoryBody b1(data.data(), data.length());
+    Result r1;
+    CHECK(expectRequest(c, p, r1, &b1, head));
+    p.write("HTTP/1.1 100 Continue\r\n\r\n");
+    p.flush();
+    CHECK(p.read(data.length(), got) && got == data);
+    p.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    p.flush();
+    CHECK(r1.done && r1.complete && r1.status == 200 && r1.body == "ok");
+
+    // Interim responses in front of the final one are skipped: one in the same packet as the 100,
+    // and more that come a byte at a time
+    MemoryBody b2(data.data(), data.length());
+    Result r2;
+    CHECK(expectRequest(c, p, r2, &b2, head));
+    p.write("HTTP/1.1 100 Continue\r\nX-Test: 100\r\n\r\nHTTP/1.1 102 Processing\r\n\r\n");
+    p.flush();
+    CHECK(p.read(data.length(), got) && got == data);
+    CHECK(!r2.done);
+    p.write("HTTP/1.1 103 Early Hints\r\nX-Test: 103\r\nLink: </a>\r\n\r\n"
+        "HTTP/1.1 201 Created\r\nX-Test: final\r\nContent-Length: 2\r\n\r\nok");
+    p.flush(1);
+    CHECK(r2.done && r2.complete && r2.status == 201 && r2.header == "final" && r2.body == "ok");
+
+    // A final status instead of 100: the body is never sent, and the connection can't be used again
+    MemoryBody b3(data.data(), data.length());
+    Result r3;
+    CHECK(expectRequest(c, p, r3, &b3, head));
+    p.write("HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n");
+    p.flush();
+    CHECK(r3.done && r3.complete && r3.status == 413);
+    CHECK(p.closed());
+    CHECK(p.in.empty());
+
+    // No answer at all: sent anyway after the wait
+    c.SetExpectContinue(100, 100);
+    MemoryBody b4(data.data(), data.length());
+    Result r4;
+    CHECK(expectRequest(c, p, r4, &b4, head));
+    CHECK(p.read(data.length(), got, 500) && got == data);
+    p.write("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    p.flush();
+    CHECK(r4.done && r4.complete && r4.status == 200);
+
+    // Form data is held back the same way; a small body isn't
+    c.SetExpectContinue(100, 5000);
+    Result r5;
+    Request req = testRequest(p.port, "/form", r5);
+    req.post.add("k", data.c_str());
+    const std::string form = req.post.str();
+    CHECK(c.SendRequest(req, false));
+    CHECK(p.accept() && p.readUntil("\r\n\r\n", head));
+    CHECK(field(head, "Expect") == "100-continue");
+    CHECK(!p.fill(1, 50));
+    p.write("HTTP/1.1 100 Continue\r\n\r\n");
+    p.flush();
+    CHECK(p.read(form.length(), got) && got == form);
+    p.write("HTTP/1.1 204 No Content\r\n\r\n");
+    p.flush();
+    CHECK(r5.done && r5.complete && r5.status == 204);
+
+    MemoryBody small(data.data(), 99);
+    Upload u;
+    CHECK(u.run(c, p, &small));
+    CHECK(field(u.head, "Expect").empty() && u.raw == data.substr(0, 99));
+}
+
+int main()
+{
+    InitNetwork();
+    testCallbackBody();
+    testMultipart();
+    testFileBody();
+    testExpectContinue();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
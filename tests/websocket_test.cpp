@@ -0,0 +1,386 @@
+// Tests for WebSocket: the handshake key (RFC 6455 section 1.3), and framing against a scripted peer
+// on a local socket. Built together with minihttp.cpp to get at its internals. POSIX only.
+
+#include "../minihttp.cpp"
+
+#if defined(MINIHTTP_SUPPORT_HTTP) && defined(MINIHTTP_SUPPORT_WEBSOCKET) && !defined(_WIN32)
+
+#include "testutil.h"
+
+using namespace minihttp;
+
+static std::string hex(const unsigned char *p, size_t n)
+{
+    std::string s;
+    char b[3];
+    for(size_t i = 0; i < n; ++i)
+    {
+        sprintf(b, "%02x", p[i]);
+        s += b;
+    }
+    return s;
+}
+
+static std::string acceptKey(const std::string& key)
+{
+    const std::string k = key + s_wsGUID;
+    unsigned char d[20];
+    _SHA1(k.data(), k.length(), d);
+    std::string a;
+    _Base64(d, sizeof(d), a);
+    return a;
+}
+
+// A payload whose bytes depend on where they are (repeating only every 2 MB), so that shifted or repeated pieces show
+static std::string pattern(size_t n, unsigned seed)
+{
+    std::string s(n, '\0');
+    for(size_t i = 0; i < n; ++i)
+        s[i] = char((unsigned(i) * 2654435761u + seed * 40503u) >> 13);
+    return s;
+}
+
+// A frame as a server sends it; unmasked unless a key is given
+static std::string frame(unsigned op, bool fin, const std::string& payload, const unsigned char *mask = NULL)
+{
+    std::string f;
+    f += char((fin ? 0x80 : 0) | op);
+    const unsigned m = mask ? 0x80 : 0;
+    const u64 n = payload.length();
+    if(n < 126)
+        f += char(m | n);
+    else if(n < 65536)
+    {
+        f += char(m | 126);
+        f += char(n >> 8);
+        f += char(n);
+    }
+    else
+    {
+        f += char(m | 127);
+        for(int i = 56; i >= 0; i -= 8)
+            f += char(n >> i);
+    }
+    if(!mask)
+        return f + payload;
+    f.append((const char*)mask, 4);
+    for(size_t i = 0; i < n; ++i)
+        f += char(payload[i] ^ mask[i & 3]);
+    return f;
+}
+
+static std::string closePayload(unsigned code, const char *reason = "")
+{
+    return std::string(1, char(code >> 8)) + char(code) + reason;
+}
+
+class TestSocket : public WebSocket
+{
+public:
+    TestSocket() : handshakes(0), handshakeOk(false), disconnects(0), closeCode(0) {}
+
+    struct Message
+    {
+        std::string data;
+        bool text;
+    };
+    std::vector<Message> messages;
+    std::vector<std::string> pongs;
+    unsigned handshakes;
+    bool handshakeOk;
+    unsigned disconnects;
+    unsigned closeCode;
+    std::string closeReason;
+
+    const std::string& key() const { return _key; }
+
+protected:
+    virtual void _OnHandshake(bool ok)
+    {
+        ++handshakes;
+        handshakeOk = ok;
+    }
+    virtual void _OnMessage(const char *data, size_t size, bool text)
+    {
+        Message m;
+        m.data.assign(data, size);
+        m.text = text;
+        messages.push_back(m);
+    }
+    virtual void _OnPong(const char *data, unsigned size)
+    {
+        pongs.push_back(std::string(data, size));
+    }
+    virtual void _OnDisconnect(unsigned code, const std::string& reason)
+    {
+        ++disconnects;
+        closeCode = code;
+        closeReason = reason;
+    }
+};
+
+// Answers the handshake and reads the client's frames
+class Peer : public LoopbackPeer
+{
+public:
+    Peer(TestSocket& c) : LoopbackPeer(c), _c(c) {}
+
+    // Connects the client and answers with a valid 101, or with the accept value given. 'after' goes out in the same write.
+    bool handshake(const char *accept = NULL, const std::string& after = std::string())
+    {
+        char url[64];
+        sprintf(url, "ws://127.0.0.1:%u/chat", port);
+        std::string req;
+        const unsigned before = _c.handshakes;
+        if(!_c.Connect(url) || !this->accept() || !readUntil("\r\n\r\n", req))
+            return false;
+        CHECK(req.find("GET /chat HTTP/1.1\r\n") == 0);
+        CHECK(req.find("\r\nSec-WebSocket-Version: 13\r\n") != std::string::npos);
+        CHECK(req.find("\r\nSec-WebSocket-Key: " + _c.key() + "\r\n") != std::string::npos);
+        write(std::string("HTTP/1.1 101 Switching Protocols\r\nUpgrade: WebSocket\r\nConnection: keep-alive, Upgrade\r\n")
+            + "Sec-WebSocket-Accept: " + (accept ? std::string(accept) : acceptKey(_c.key())) + "\r\n\r\n" + after);
+        flush();
+        return _c.handshakes == before + 1 && _c.handshakeOk;
+    }
+
+    // Next frame from the client, which must be masked and unfragmented
+    bool next(unsigned& op, std::string& payload)
+    {
+        std::string h;
+        if(!read(2, h))
+            return false;
+        const unsigned char b0 = h[0], b1 = h[1];
+        CHECK(b0 & 0x80);
+        CHECK(b1 & 0x80);
+        op = b0 & 0x0f;
+        u64 n = b1 & 0x7f;
+        if(n >= 126)
+        {
+            if(!read(n == 126 ? 2 : 8, h))
+                return false;
+            n = 0;
+            for(size_t i = 0; i < h.length(); ++i)
+                n = (n << 8) | (unsigned char)h[i];
+            CHECK(n >= (h.length() == 2 ? 126u : 65536u)); // shortest encoding
+        }
+        std::string mask;
+        if(!read(4, mask) || !read(size_t(n), payload))
+            return false;
+        for(size_t i = 0; i < payload.length(); ++i)
+            payload[i] ^= mask[i & 3];
+        return true;
+    }
+
+    bool expect(unsigned op, const std::string& payload)
+    {
+        unsigned o;
+        std::string p;
+        return next(o, p) && o == op && p == payload;
+    }
+
+private:
+    TestSocket& _c;
+};
+
+static void testAcceptKey()
+{
+    // RFC 6455 section 1.3
+    CHECK(acceptKey("dGhlIHNhbXBsZSBub25jZQ==") == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+
+    // FIPS 180 examples; the second one needs a block of its own for the padding
+    unsigned char d[20];
+    _SHA1("abc", 3, d);
+    CHECK(hex(d, 20) == "a9993e364706816aba3e25717850c26c9cd0d89d");
+    const char *two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    _SHA1(two, strlen(two), d);
+    CHECK(hex(d, 20) == "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+    std::string b;
+    _Base64((const unsigned char*)"foob", 4, b);
+    CHECK(b == "Zm9vYg==");
+    b.clear();
+    _Base64((const unsigned char*)"fooba", 5, b);
+    CHECK(b == "Zm9vYmE=");
+}
+
+static void testHandshake()
+{
+    TestSocket c;
+    Peer p(c);
+    CHECK(!p.handshake("s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+    CHECK(c.handshakes == 1 && !c.handshakeOk && !c.IsConnected());
+    CHECK(p.closed());
+    CHECK(!c.disconnects);
+
+    TestSocket c2;
+    Peer p2(c2);
+    CHECK(p2.handshake());
+    CHECK(c2.handshakeOk && c2.IsConnected());
+}
+
+// Everything the server may send, in one connection
+static void testFrames()
+{
+    TestSocket c;
+    c.SetMaxMessageSize(70000);
+    Peer p(c);
+
+    // A frame right behind the 101 in the same packet
+    CHECK(p.handshake(NULL, frame(WS_TEXT, true, "hello")));
+    CHECK(c.messages.size() == 1 && c.messages[0].data == "hello" && c.messages[0].text);
+    c.messages.clear();
+
+    // Fragmented, with a ping in between, a byte at a time
+    p.write(frame(WS_TEXT, false, "Hel") + frame(WS_PING, true, "p") + frame(WS_CONTINUATION, false, "lo ")
+        + frame(WS_CONTINUATION, true, "world"));
+    p.flush(1);
+    CHECK(c.messages.size() == 1 && c.messages[0].data == "Hello world" && c.messages[0].text);
+    CHECK(p.expect(WS_PONG, "p"));
+    c.messages.clear();
+
+    // 16 and 64 bit lengths. The last message is exactly as big as allowed and bigger than the input buffer,
+    // so it is put together as it comes in, with the next frame right behind it.
+    const std::string m300 = pattern(300, 1), m70k = pattern(70000, 2);
+    p.write(frame(WS_BINARY, true, m300) + frame(WS_BINARY, true, m70k) + frame(WS_TEXT, true, "after"));
+    p.flush(1000);
+    CHECK(c.messages.size() == 3);
+    if(c.messages.size() == 3)
+    {
+        CHECK(c.messages[0].data == m300 && !c.messages[0].text);
+        CHECK(c.messages[1].data == m70k && !c.messages[1].text);
+        CHECK(c.messages[2].data == "after");
+    }
+    c.messages.clear();
+
+    // Frames that end up cut off at the end of the buffer, so that the start of the next read has to be shifted down
+    std::string all;
+    for(unsigned i = 0; i < 8; ++i)
+        all += frame(WS_BINARY, true, pattern(20000 + i, i));
+    p.write(all);
+    p.flush(7001);
+    CHECK(c.messages.size() == 8);
+    for(unsigned i = 0; i < c.messages.size(); ++i)
+        CHECK(c.messages[i].data == pattern(20000 + i, i));
+    c.messages.clear();
+
+    // A big fragmented message, whose second frame also doesn't fit the buffer
+    const std::string big = pattern(69000, 3);
+    p.write(frame(WS_BINARY, false, big.substr(0, 1000)) + frame(WS_CONTINUATION, true, big.substr(1000)));
+    p.flush(4096);
+    CHECK(c.messages.size() == 1 && c.messages[0].data == big);
+    c.messages.clear();
+
+    // What the client sends is masked, with the shortest length encoding
+    CHECK(c.SendText("hi"));
+    CHECK(p.expect(WS_TEXT, "hi"));
+    const std::string out = pattern(70001, 4);
+    CHECK(c.SendBinary(out.data(), out.length()));
+    CHECK(p.expect(WS_BINARY, out));
+    CHECK(c.SendBinary(m300.data(), m300.length()));
+    CHECK(p.expect(WS_BINARY, m300));
+
+    // Ping and pong both ways
+    CHECK(c.Ping("xy", 2));
+    CHECK(p.expect(WS_PING, "xy"));
+    p.write(frame(WS_PONG, true, "xy") + frame(WS_PING, true, ""));
+    p.flush();
+    CHECK(c.pongs.size() == 1 && c.pongs[0] == "xy");
+    CHECK(p.expect(WS_PONG, ""));
+
+    // The server closes: the client echoes the code and goes down
+    p.write(frame(WS_CLOSE, true, closePayload(1001, "going")));
+    p.flush();
+    CHECK(p.expect(WS_CLOSE, closePayload(1001)));
+    CHECK(p.closed());
+    CHECK(c.disconnects == 1 && c.closeCode == 1001 && c.closeReason == "going");
+    CHECK(!c.IsConnected() && !c.messages.size());
+}
+
+static void testClientClose()
+{
+    TestSocket c;
+    Peer p(c);
+    CHECK(p.handshake());
+    CHECK(c.Close(1000, "bye"));
+    CHECK(!c.IsConnected() && !c.SendText("late"));
+    CHECK(p.expect(WS_CLOSE, closePayload(1000, "bye")));
+    p.pump();
+    CHECK(!c.disconnects); // waits for the answer
+    p.write(frame(WS_CLOSE, true, closePayload(1000, "ok")));
+    p.flush();
+    CHECK(p.closed());
+    CHECK(c.disconnects == 1 && c.closeCode == 1000 && c.closeReason == "ok");
+
+    // No answer: closed after the wait, as if there had been no close frame
+    CHECK(p.handshake());
+    CHECK(c.Close(1000, NULL, 50));
+    CHECK(p.expect(WS_CLOSE, closePayload(1000)));
+    p.pump(20);
+    CHECK(c.disconnects == 1);
+    p.pump(100);
+    CHECK(p.closed());
+    CHECK(c.disconnects == 2 && c.closeCode == 1006);
+
+    // Connection lost without a close frame
+    CHECK(p.handshake());
+    p.hangup();
+    p.pump();
+    CHECK(c.disconnects == 3 && c.closeCode == 1006 && !c.IsConnected());
+}
+
+// Sends the frames, and returns the code of the close frame the client answered with, 0 if none
+static unsigned failWith(const std::string& frames, size_t maxMessage = 16 << 20)
+{
+    TestSocket c;
+    c.SetMaxMessageSize(maxMessage);
+    Peer p(c);
+    if(!p.handshake())
+        return 0;
+    p.write(frames);
+    p.flush();
+    unsigned op;
+    std::string payload;
+    if(!p.next(op, payload) || op != WS_CLOSE || payload.length() != 2)
+        return 0;
+    CHECK(p.closed());
+    CHECK(c.disconnects == 1 && c.closeCode == 1006 && !c.messages.size());
+    return (unsigned((unsigned char)payload[0]) << 8) | (unsigned char)payload[1];
+}
+
+static void testProtocolErrors()
+{
+    const unsigned char key[4] = { 1, 2, 3, 4 };
+    CHECK(failWith(frame(WS_TEXT, true, "masked", key)) == 1002);
+    CHECK(failWith("\xc1\x01x") == 1002); // reserved bit
+    CHECK(failWith(frame(3, true, "")) == 1002); // reserved opcode
+    CHECK(failWith(frame(WS_CONTINUATION, true, "x")) == 1002); // nothing to continue
+    CHECK(failWith(frame(WS_TEXT, false, "x") + frame(WS_BINARY, true, "y")) == 1002); // new message inside a fragmented one
+    CHECK(failWith(frame(WS_PING, false, "")) == 1002); // fragmented control frame
+    CHECK(failWith(frame(WS_PING, true, std::string(126, 'p'))) == 1002); // control frame too big
+    CHECK(failWith(frame(WS_CLOSE, true, "x")) == 1002); // close frame with half a code
+
+    // Too big: a frame, a message made of frames, and a frame bigger than the buffer before its payload is in
+    CHECK(failWith(frame(WS_BINARY, true, std::string(101, 'b')), 100) == 1009);
+    CHECK(failWith(frame(WS_TEXT, false, std::string(60, 't')) + frame(WS_CONTINUATION, true, std::string(60, 't')), 100) == 1009);
+    CHECK(failWith(frame(WS_BINARY, true, std::string(200000, 'b')).substr(0, 10), 100000) == 1009);
+}
+
+int main()
+{
+    InitNetwork();
+    testAcceptKey();
+    testHandshake();
+    testFrames();
+    testClientClose();
+    testProtocolErrors();
+    return testResult();
+}
+
+#else
+
+int main()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,99 @@
+// tracedump: Offline decoder for files written by minihttp::TraceSave()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "minihttp.h"
+
+using minihttp::TraceRecord;
+
+static bool byTime(const TraceRecord& a, const TraceRecord& b)
+{
+    return a.time < b.time;
+}
+
+static void printRecord(const TraceRecord& t, minihttp::u64 t0)
+{
+    printf("%12.3f ms  T%-3u %016llx  %-15s", (t.time - t0) / 1000.0, t.thread, t.obj, minihttp::TraceEventName(t.event));
+    switch(t.event)
+    {
+        case minihttp::TRACE_SOCKET_OPEN:
+            printf("port=%u", t.a);
+            break;
+        case minihttp::TRACE_SOCKET_CLOSE:
+            printf("recvd=%llu", t.b);
+            break;
+        case minihttp::TRACE_REQUEST_START:
+        case minihttp::TRACE_REQUEST_QUEUED:
+            printf("queue=%u", t.a);
+            break;
+        case minihttp::TRACE_REQUEST_DONE:
+            printf("status=%u body=%llu", t.a, t.b);
+            break;
+        case minihttp::TRACE_STATUS:
+            printf("status=%u length=%llu", t.a, t.b);
+            break;
+        case minihttp::TRACE_HEADER_FIELD:
+        {
+            char key[sizeof(t.b) + 1] = { 0 };
+            memcpy(key, &t.b, sizeof(t.b));
+            printf("key=%s%s vallen=%u", key, strlen(key) == sizeof(t.b) ? "..." : "", t.a);
+            break;
+        }
+        case minihttp::TRACE_CHUNK:
+            printf("size=%llu", t.b);
+            break;
+        case minihttp::TRACE_REDIRECT:
+            printf("status=%u", t.a);
+            break;
+        case minihttp::TRACE_ERROR:
+            printf("kind=%s code=%lld", minihttp::MetricsErrorName(t.a), (long long)t.b);
+            break;
+        default:
+            printf("a=%u b=%llu", t.a, t.b);
+    }
+    putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        printf("Usage: %s tracefile\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if(!f)
+    {
+        printf("Failed to open %s\n", argv[1]);
+        return 1;
+    }
+
+    unsigned hdr[3];
+    if(fread(&hdr[0], sizeof(hdr), 1, f) != 1 || hdr[0] != minihttp::TRACE_FILE_MAGIC
+        || hdr[1] != minihttp::TRACE_FILE_VERSION || hdr[2] != sizeof(TraceRecord))
+    {
+        printf("%s: Not a minihttp trace file, or from a different version or platform\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    std::vector<TraceRecord> recs;
+    TraceRecord t;
+    while(fread(&t, sizeof(t), 1, f) == 1)
+        recs.push_back(t);
+    fclose(f);
+
+    // Rings of different threads are stored one after another
+    std::stable_sort(recs.begin(), recs.end(), byTime);
+
+    for(size_t i = 0; i < recs.size(); ++i)
+        printRecord(recs[i], recs[0].time);
+
+    printf("%u records\n", (unsigned)recs.size());
+    return 0;
+}